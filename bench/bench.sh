@@ -0,0 +1,229 @@
+#!/bin/sh
+# Benchmark oclc itself over a generated corpus of kernels and write the
+# wall time, peak RSS and per-phase breakdown of every run as CSV.
+#
+# Usage: bench/bench.sh OCLC [CSV_FILE]
+#
+# Environment variables:
+#   BENCH_RUNS    Number of measured runs of each scenario (default: 3)
+#   BENCH_JOBS    Number of builds in flight in batch mode (default: number of CPUs)
+#   BENCH_FILES   Number of kernel files of the many-file corpus (default: 100)
+#   BENCH_UNROLL  Number of unrolled statements of the huge kernel (default: 8192)
+#   BENCH_DEPTH   Number of nested headers of the include-heavy kernel (default: 64)
+#   BENCH_WORK    Working directory, which is removed first (default: bench/work)
+#   OCLC_FLAGS    Flags passed to every run, such as "-t gpu"
+
+set -eu
+
+if [ $# -lt 1 ]; then
+  echo "Usage: $0 OCLC [CSV_FILE]" >&2
+  exit 1
+fi
+OCLC=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+CSV=${2:-bench.csv}
+RUNS=${BENCH_RUNS:-3}
+JOBS=${BENCH_JOBS:-$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 8)}
+FILES=${BENCH_FILES:-100}
+UNROLL=${BENCH_UNROLL:-8192}
+DEPTH=${BENCH_DEPTH:-64}
+WORK=${BENCH_WORK:-$(dirname "$0")/work}
+OCLC_FLAGS=${OCLC_FLAGS:-}
+
+rm -rf "$WORK"
+mkdir -p "$WORK"
+WORK=$(cd "$WORK" && pwd)
+CORPUS=$WORK/corpus
+OUT=$WORK/out
+CACHE=$WORK/cache
+SOCK=$WORK/oclc.sock
+mkdir -p "$CORPUS/include" "$CORPUS/many" "$OUT"
+
+
+# ---------------------------------------------------------------------------
+# Corpus
+# ---------------------------------------------------------------------------
+cat > "$CORPUS/small.cl" << 'EOF'
+__kernel void
+vecAdd(__global const float* a, __global const float* b, __global float* c)
+{
+  const size_t i = get_global_id(0);
+  c[i] = a[i] + b[i];
+}
+EOF
+
+awk -v n="$UNROLL" 'BEGIN {
+  print "__kernel void"
+  print "unrolled(__global const float* x, __global float* y, const uint mask)"
+  print "{"
+  print "  const uint gid = (uint) get_global_id(0);"
+  print "  float acc = 0.0f;"
+  for (i = 0; i < n; i++) {
+    printf "  acc = mad(acc, x[(gid + %du) & mask], %d.0f);\n", i, i % 97
+  }
+  print "  y[gid] = acc;"
+  print "}"
+}' > "$CORPUS/unrolled.cl"
+
+awk -v n="$DEPTH" -v dir="$CORPUS/include" 'BEGIN {
+  for (i = 0; i < n; i++) {
+    file = sprintf("%s/h%03d.h", dir, i)
+    printf "#ifndef H%03d_H\n#define H%03d_H\n", i, i > file
+    if (i > 0) {
+      printf "#include \"h%03d.h\"\n", i - 1 > file
+      printf "inline float f%03d(float x) { return f%03d(x) * 0.5f + %d.0f; }\n", i, i - 1, i > file
+    } else {
+      printf "inline float f%03d(float x) { return x; }\n", i > file
+    }
+    printf "#endif\n" > file
+    close(file)
+  }
+}'
+{
+  printf '#include "h%03d.h"\n' $((DEPTH - 1))
+  printf '__kernel void\nincluded(__global float* x)\n{\n  const size_t i = get_global_id(0);\n'
+  printf '  x[i] = f%03d(x[i]);\n}\n' $((DEPTH - 1))
+} > "$CORPUS/include.cl"
+
+i=0
+while [ "$i" -lt "$FILES" ]; do
+  name=$(printf 'k%03d' "$i")
+  cat > "$CORPUS/many/$name.cl" << EOF
+__kernel void
+$name(__global const float* a, __global float* b)
+{
+  const size_t i = get_global_id(0);
+  b[i] = a[i] * $i.0f + 1.0f;
+}
+EOF
+  i=$((i + 1))
+done
+MANY=$(ls "$CORPUS"/many/*.cl)
+
+
+# ---------------------------------------------------------------------------
+# Measurement
+# ---------------------------------------------------------------------------
+SERVER_PID=
+cleanup() {
+  if [ -n "$SERVER_PID" ]; then
+    kill "$SERVER_PID" 2>/dev/null || :
+  fi
+}
+trap cleanup EXIT INT TERM
+
+# Convert one JSON line of --time-report into CSV rows
+# $1: Scenario name, $2: Run index
+emit_csv() {
+  awk -v scenario="$1" -v run="$2" '
+  function field(str, key,    value) {
+    if (index(str, "\"" key "\": ") == 0) {
+      return ""
+    }
+    value = str
+    sub(".*\"" key "\": ", "", value)
+    sub(/[,}].*/, "", value)
+    return value
+  }
+  {
+    prefix = scenario "," run "," field($0, "total_ms") "," field($0, "peak_rss_kib")
+    phases = $0
+    sub(/^[^[]*\[/, "", phases)
+    sub(/\].*$/, "", phases)
+    if (phases == "") {
+      print prefix ",,,"
+      next
+    }
+    n = split(phases, items, /\}, \{/)
+    for (i = 1; i <= n; i++) {
+      name = items[i]
+      sub(/.*"name": "/, "", name)
+      sub(/".*/, "", name)
+      print prefix ",\"" name "\"," field(items[i], "count") "," field(items[i], "ms")
+    }
+  }' >> "$CSV"
+}
+
+# Run oclc several times and record each time report
+# $1: Cache mode (cold: empty cache each run, warm: populated cache, none)
+# $2: Scenario name
+# $@: Arguments of oclc
+run_case() {
+  mode=$1
+  name=$2
+  shift 2
+  if [ "$mode" != none ]; then
+    rm -rf "$CACHE"
+  fi
+  if [ "$mode" = warm ]; then
+    # shellcheck disable=SC2086
+    "$OCLC" $OCLC_FLAGS "$@" > /dev/null 2>&1
+  fi
+  run=1
+  while [ "$run" -le "$RUNS" ]; do
+    if [ "$mode" = cold ]; then
+      rm -rf "$CACHE"
+    fi
+    # shellcheck disable=SC2086
+    if ! "$OCLC" $OCLC_FLAGS --time-report --time-report-format=json "$@" > "$WORK/stdout" 2> "$WORK/stderr"; then
+      cat "$WORK/stderr" >&2
+      echo "Scenario $name failed" >&2
+      exit 1
+    fi
+    grep '^{"phases"' "$WORK/stderr" | tail -n 1 | emit_csv "$name" "$run"
+    run=$((run + 1))
+  done
+  echo "$name" >&2
+}
+
+echo "scenario,run,wall_ms,peak_rss_kib,phase,count,phase_ms" > "$CSV"
+INVENTORY=--inventory=$WORK/devices
+INCLUDE_OPTION="-I $CORPUS/include"
+
+for kernel in small unrolled include; do
+  option=
+  if [ "$kernel" = include ]; then
+    option=$INCLUDE_OPTION
+  fi
+  run_case cold "cold-$kernel" "$INVENTORY" --cache-dir="$CACHE" -O "$option" -o "$OUT/$kernel.bin" "$CORPUS/$kernel.cl"
+  run_case warm "warm-$kernel" "$INVENTORY" --cache-dir="$CACHE" -O "$option" -o "$OUT/$kernel.bin" "$CORPUS/$kernel.cl"
+done
+
+# shellcheck disable=SC2086
+run_case none batch-j1 "$INVENTORY" -b -j 1 $MANY
+if [ "$JOBS" -gt 1 ]; then
+  # shellcheck disable=SC2086
+  run_case none "batch-j$JOBS" "$INVENTORY" -b -j "$JOBS" $MANY
+fi
+# shellcheck disable=SC2086
+run_case cold "batch-cold-j$JOBS" "$INVENTORY" --cache-dir="$CACHE" -b -j "$JOBS" $MANY
+# shellcheck disable=SC2086
+run_case warm "batch-warm-j$JOBS" "$INVENTORY" --cache-dir="$CACHE" -b -j "$JOBS" $MANY
+
+# Requests to a compile server, which keeps its context warm across the runs
+# shellcheck disable=SC2086
+"$OCLC" $OCLC_FLAGS --serve="$SOCK" > /dev/null 2> "$WORK/server.log" &
+SERVER_PID=$!
+i=0
+while [ ! -S "$SOCK" ] && [ "$i" -lt 100 ]; do
+  sleep 0.1
+  i=$((i + 1))
+done
+if [ ! -S "$SOCK" ]; then
+  cat "$WORK/server.log" >&2
+  echo "Compile server did not start" >&2
+  exit 1
+fi
+for kernel in small unrolled include; do
+  option=
+  if [ "$kernel" = include ]; then
+    option=$INCLUDE_OPTION
+  fi
+  run_case none "daemon-$kernel" --socket="$SOCK" -O "$option" -o "$OUT/$kernel.bin" "$CORPUS/$kernel.cl"
+done
+kill "$SERVER_PID"
+wait "$SERVER_PID" 2>/dev/null || :
+SERVER_PID=
+
+run_case none all-small --all -o "$OUT/all.bin" "$CORPUS/small.cl"
+
+echo "Wrote $CSV" >&2
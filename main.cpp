@@ -1,4 +1,6 @@
 #include <iostream>
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
@@ -6,6 +8,14 @@
 #include <fstream>
 #include <memory>
 #include <array>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
 
 #ifdef __APPLE__
 #  include <OpenCL/opencl.h>
@@ -15,166 +25,2773 @@
 
 #include <kotlib/macro.h>
 #include <kotlib/OptionParser.hpp>
+#include "oclBinaryCache.h"
+#include "oclBuildLog.h"
+#include "oclDeviceInventory.h"
+#include "oclDiagnostics.h"
+#include "oclEmbed.h"
 #include "oclErrorCode.h"
+#include "oclFatBinary.h"
+#include "oclFileUtil.h"
+#include "oclFileWatcher.h"
+#include "oclHandle.h"
+#include "oclKernelReport.h"
+#include "oclPhaseTimer.h"
+#include "oclPipe.h"
+#include "oclSocket.h"
+#include "oclSourceFile.h"
+#include "oclSourceIndex.h"
+#include "oclTargetSelector.h"
 
 
-static constexpr cl_uint kNDefaultPlatformEntry = 16;
-static constexpr cl_uint kNDefaultDeviceEntry = 16;
+static constexpr std::size_t kDefaultCacheSizeMiB = 1024;
+//! Magic number of SPIR-V module
+static constexpr std::uint32_t kSpirvMagic = 0x07230203;
+//! Maximum number of connections which the compile server handles at once
+static constexpr std::size_t kMaxServerConnections = 64;
 static const std::unordered_map<std::string, cl_int> kDeviceTypeMap{
   {"all", CL_DEVICE_TYPE_ALL},
   {"default", CL_DEVICE_TYPE_DEFAULT},
   {"cpu", CL_DEVICE_TYPE_CPU},
   {"gpu", CL_DEVICE_TYPE_GPU}
 };
+//! Output formats of binaries
+enum class EmitFormat
+{
+  //! Raw binary for each device, or fat binary with --bundle
+  kBinary,
+  //! C++ header which defines fat binary image as constexpr array
+  kCArray,
+  //! Linkable object which defines fat binary image
+  kObject
+};
+static const std::unordered_map<std::string, EmitFormat> kEmitFormatMap{
+  {"binary", EmitFormat::kBinary},
+  {"c-array", EmitFormat::kCArray},
+  {"obj", EmitFormat::kObject}
+};
+static const std::unordered_map<std::string, PhaseTimer::Format> kTimeReportFormatMap{
+  {"table", PhaseTimer::Format::kTable},
+  {"json", PhaseTimer::Format::kJson}
+};
+
+//! Timer of each phase, which is enabled with --time-report
+static PhaseTimer phaseTimer;
+//! Writer of build logs to stderr or --log-file
+static BuildLogWriter buildLogWriter;
+//! Collector of kernel metadata and resource usage, which is enabled with --kernel-report
+static KernelReportWriter kernelReportWriter;
+//! Collector of build status of all programs, which is enabled with --diagnostics=json
+static DiagnosticsWriter diagnosticsWriter;
+//! Contexts for each set of target devices, which are reused by all builds of this process
+static ContextPool contextPool(&phaseTimer);
+
+
+#define OCLC_CHECK_ERROR(errCode) \
+  KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, std::string("[OpenCL] [") + std::to_string(errCode) + "] " + kErrorMessageMap.at(errCode))
+
+#define OCLC_CHECK_ERROR_WITH_MSG(errCode, msg) \
+  KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, std::string("[OpenCL] [") + std::to_string(errCode) + "] " + kErrorMessageMap.at(errCode) + "\n" + msg)
+
+
+/*!
+ * @brief Read specified file as a text file
+ * @param [in] filename  File name to read
+ * @return  SourceFile which maps or holds the specified file content
+ */
+static inline SourceFile
+readSource(const std::string& filename)
+{
+  PhaseTimer::Scope scope = phaseTimer.measure("Source read");
+  return SourceFile::read(filename);
+}
+
+
+/*!
+ * @brief Read specified files and return std::vector of SourceFile of the files
+ * @param [in] filenames  Vector of file names to read
+ * @return  std::vector which contains SourceFile of the files
+ */
+static inline std::vector<SourceFile>
+readSource(const std::vector<std::string>& filenames)
+{
+  std::vector<SourceFile> srcs(filenames.size());
+  for (decltype(srcs)::size_type i = 0; i < srcs.size(); i++) {
+    srcs[i] = readSource(filenames[i]);
+  }
+  return srcs;
+}
+
+
+/*!
+ * @brief Check whether specified content is a SPIR-V module or not
+ * @param [in] source  Content of input file
+ * @return  true if the content starts with the magic number of SPIR-V in either byte order
+ */
+static inline bool
+isSpirv(const SourceFile& source) noexcept
+{
+  if (source.size() < sizeof(kSpirvMagic)) {
+    return false;
+  }
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(source.data());
+  std::uint32_t le = static_cast<std::uint32_t>(p[0]) | static_cast<std::uint32_t>(p[1]) << 8
+    | static_cast<std::uint32_t>(p[2]) << 16 | static_cast<std::uint32_t>(p[3]) << 24;
+  std::uint32_t be = static_cast<std::uint32_t>(p[3]) | static_cast<std::uint32_t>(p[2]) << 8
+    | static_cast<std::uint32_t>(p[1]) << 16 | static_cast<std::uint32_t>(p[0]) << 24;
+  return le == kSpirvMagic || be == kSpirvMagic;
+}
+
+
+/*!
+ * @brief Split specified string with specified delimiter, dropping empty fields
+ * @param [in] str        String to split
+ * @param [in] delimiter  Delimiter
+ * @return  Non-empty fields
+ */
+static inline std::vector<std::string>
+splitString(const std::string& str, char delimiter)
+{
+  std::vector<std::string> fields;
+  for (std::string::size_type first = 0, last; first <= str.length(); first = last + 1) {
+    last = std::min(str.find(delimiter, first), str.length());
+    if (last > first) {
+      fields.emplace_back(str.substr(first, last - first));
+    }
+  }
+  return fields;
+}
+
+
+/*!
+ * @brief Remove suffix of specified file name
+ * @param [in] filename  FIle name which you want to remove suffix
+ * @return  File name which removed suffix
+ */
+static inline std::string
+removeSuffix(const std::string& filename) noexcept
+{
+  return filename.substr(0, filename.find_last_of("."));
+}
+
+
+/*!
+ * @brief Get output file name of the binary for the specified device
+ * @param [in] outputBase  Output file name for a single device
+ * @param [in] index       Index of the device in the program
+ * @param [in] nDevice     Number of devices in the program
+ * @return  Output file name
+ */
+static inline std::string
+getOutputFileName(const std::string& outputBase, std::size_t index, std::size_t nDevice)
+{
+  return nDevice > 1 ? (outputBase + "." + std::to_string(index)) : outputBase;
+}
+
+
+/*!
+ * @brief Write binary to the specified file
+ *
+ * The binary is written atomically, so that parallel builds never see
+ * half-written binary files.
+ * @param [in] filename  Output file name, or "-" for standard output
+ * @param [in] data      Pointer to the binary
+ * @param [in] size      Size of the binary
+ */
+static inline void
+writeBinary(const std::string& filename, const char* data, std::size_t size)
+{
+  PhaseTimer::Scope scope = phaseTimer.measure("File write");
+  if (filename == kStdioFileName) {
+    PipeChannel::getStandardStreams().sendBytes(data, size);
+    return;
+  }
+  if (!writeFileAtomically(filename, data, size)) {
+    std::cerr << "Failed to write: " << filename << std::endl;
+  }
+}
+
+
+/*!
+ * @brief Get specified platform information as a string
+ * @param [in] platformId  Platform ID
+ * @param [in] paramName   Parameter name such as CL_PLATFORM_NAME
+ * @return  Obtained information
+ */
+static inline std::string
+getPlatformInfoString(cl_platform_id platformId, cl_platform_info paramName)
+{
+  std::size_t size;
+  cl_int errCode = clGetPlatformInfo(platformId, paramName, 0, nullptr, &size);
+  OCLC_CHECK_ERROR(errCode);
+  std::string info(size, '\0');
+  errCode = clGetPlatformInfo(platformId, paramName, info.size(), &info[0], nullptr);
+  OCLC_CHECK_ERROR(errCode);
+  info.resize(std::min(info.find('\0'), info.size()));
+  return info;
+}
+
+
+/*!
+ * @brief Get specified device information as a string
+ * @param [in] deviceId   Device ID
+ * @param [in] paramName  Parameter name such as CL_DEVICE_NAME
+ * @return  Obtained information
+ */
+static inline std::string
+getDeviceInfoString(cl_device_id deviceId, cl_device_info paramName)
+{
+  std::size_t size;
+  cl_int errCode = clGetDeviceInfo(deviceId, paramName, 0, nullptr, &size);
+  OCLC_CHECK_ERROR(errCode);
+  std::string info(size, '\0');
+  errCode = clGetDeviceInfo(deviceId, paramName, info.size(), &info[0], nullptr);
+  OCLC_CHECK_ERROR(errCode);
+  info.resize(std::min(info.find('\0'), info.size()));
+  return info;
+}
+
+
+/*!
+ * @brief Get specified device information as a scalar value
+ * @tparam T  Type of the information, such as cl_uint
+ * @param [in] deviceId   Device ID
+ * @param [in] paramName  Parameter name such as CL_DEVICE_MAX_COMPUTE_UNITS
+ * @return  Obtained information
+ */
+template<typename T>
+static inline T
+getDeviceInfo(cl_device_id deviceId, cl_device_info paramName)
+{
+  T info;
+  cl_int errCode = clGetDeviceInfo(deviceId, paramName, sizeof(info), &info, nullptr);
+  OCLC_CHECK_ERROR(errCode);
+  return info;
+}
+
+
+/*!
+ * @brief Get the string which identifies the compiler for specified device
+ * @param [in] platformId  Platform ID
+ * @param [in] deviceId    Device ID
+ * @return  Identity string which consists of platform, device and driver names and versions
+ */
+static inline std::string
+getDeviceIdentity(cl_platform_id platformId, cl_device_id deviceId)
+{
+  return DeviceInventory::makeIdentity(
+      getPlatformInfoString(platformId, CL_PLATFORM_NAME),
+      getPlatformInfoString(platformId, CL_PLATFORM_VERSION),
+      getDeviceInfoString(deviceId, CL_DEVICE_NAME),
+      getDeviceInfoString(deviceId, CL_DEVICE_VERSION),
+      getDeviceInfoString(deviceId, CL_DRIVER_VERSION));
+}
+
+
+/*!
+ * @brief Get the strings which identify the compiler for each device
+ * @param [in] platformId  Platform ID of the devices
+ * @param [in] deviceIds   Device IDs
+ * @return  Identity strings for each device
+ */
+static inline std::vector<std::string>
+getDeviceIdentities(cl_platform_id platformId, const std::vector<cl_device_id>& deviceIds)
+{
+  std::vector<std::string> identities;
+  identities.reserve(deviceIds.size());
+  for (const auto& deviceId : deviceIds) {
+    identities.emplace_back(getDeviceIdentity(platformId, deviceId));
+  }
+  return identities;
+}
+
+
+/*!
+ * @brief Get device IDs of a device type, allowing a platform which has no such device
+ * @param [in] platformId  Platform ID
+ * @param [in] deviceType  Device type
+ * @return  Device IDs, which are empty if the platform has no device of the type
+ */
+static inline std::vector<cl_device_id>
+findDeviceIds(cl_platform_id platformId, cl_device_type deviceType)
+{
+  cl_uint nDevice;
+  cl_int errCode = clGetDeviceIDs(platformId, deviceType, 0, nullptr, &nDevice);
+  if (errCode == CL_DEVICE_NOT_FOUND) {
+    return {};
+  }
+  OCLC_CHECK_ERROR(errCode);
+  std::vector<cl_device_id> deviceIds(nDevice);
+  errCode = clGetDeviceIDs(platformId, deviceType, nDevice, deviceIds.data(), nullptr);
+  OCLC_CHECK_ERROR(errCode);
+  return deviceIds;
+}
+
+
+/*!
+ * @brief Probe all platforms and devices, which loads all OpenCL drivers
+ * @param [in] fingerprint  Fingerprint of the drivers
+ * @return  Probed inventory
+ */
+static inline DeviceInventory
+probeDeviceInventory(const std::string& fingerprint)
+{
+  PhaseTimer::Scope scope = phaseTimer.measure("Device probe");
+  DeviceInventory inventory(fingerprint);
+  for (const auto& platformId : getPlatformIds(kNDefaultPlatformEntry, &phaseTimer)) {
+    PlatformRecord platform{
+        getPlatformInfoString(platformId, CL_PLATFORM_NAME),
+        getPlatformInfoString(platformId, CL_PLATFORM_VENDOR),
+        getPlatformInfoString(platformId, CL_PLATFORM_VERSION),
+        {},
+        {}};
+    std::vector<cl_device_id> deviceIds = findDeviceIds(platformId, CL_DEVICE_TYPE_ALL);
+    for (const auto& deviceId : deviceIds) {
+      platform.devices.emplace_back(DeviceRecord{
+          getDeviceInfoString(deviceId, CL_DEVICE_NAME),
+          getDeviceInfoString(deviceId, CL_DEVICE_VENDOR),
+          getDeviceInfoString(deviceId, CL_DEVICE_VERSION),
+          getDeviceInfoString(deviceId, CL_DRIVER_VERSION),
+          getDeviceInfoString(deviceId, CL_DEVICE_EXTENSIONS),
+          static_cast<std::uint64_t>(getDeviceInfo<cl_device_type>(deviceId, CL_DEVICE_TYPE)),
+          getDeviceInfo<cl_uint>(deviceId, CL_DEVICE_MAX_COMPUTE_UNITS),
+          getDeviceInfo<std::size_t>(deviceId, CL_DEVICE_MAX_WORK_GROUP_SIZE)});
+    }
+    // Record the devices which each device type selects, which cannot be derived from CL_DEVICE_TYPE for the default type
+    for (const auto& deviceType : kDeviceTypeMap) {
+      std::vector<std::size_t> indices;
+      for (const auto& deviceId : findDeviceIds(platformId, static_cast<cl_device_type>(deviceType.second))) {
+        auto it = std::find(deviceIds.begin(), deviceIds.end(), deviceId);
+        if (it != deviceIds.end()) {
+          indices.emplace_back(static_cast<std::size_t>(it - deviceIds.begin()));
+        }
+      }
+      platform.typeDevices.emplace_back(deviceType.first, std::move(indices));
+    }
+    inventory.addPlatform(std::move(platform));
+  }
+  return inventory;
+}
+
+
+/*!
+ * @brief Probe the devices and save the inventory file
+ * @param [in] path         Path of the inventory file, or empty not to save
+ * @param [in] fingerprint  Fingerprint of the drivers
+ * @return  Probed inventory
+ */
+static inline DeviceInventory
+refreshDeviceInventory(const std::string& path, const std::string& fingerprint)
+{
+  DeviceInventory inventory = probeDeviceInventory(fingerprint);
+  // The inventory is only an accelerator, so a read-only cache directory is not an error
+  if (path != "") {
+    inventory.save(path);
+  }
+  return inventory;
+}
+
+
+/*!
+ * @brief Load the device inventory, probing the devices if it is missing or stale
+ * @param [in]  path       Path of the inventory file, or empty to always probe
+ * @param [in]  isRefresh  Always probe the devices
+ * @param [out] isProbed   Whether the devices are probed or not
+ * @return  Device inventory
+ */
+static inline DeviceInventory
+openDeviceInventory(const std::string& path, bool isRefresh, bool& isProbed)
+{
+  std::string fingerprint;
+  DeviceInventory inventory;
+  {
+    PhaseTimer::Scope scope = phaseTimer.measure("Device inventory load");
+    fingerprint = DeviceInventory::getDriverFingerprint();
+    isProbed = isRefresh || path == "" || !inventory.load(path) || inventory.getFingerprint() != fingerprint;
+  }
+  return isProbed ? refreshDeviceInventory(path, fingerprint) : inventory;
+}
+
+
+/*!
+ * @brief Show all information of platforms and devices in the inventory
+ * @param [in] inventory   Device inventory
+ * @param [in] deviceType  Device type name which you want to know the information
+ */
+static inline void
+showInfo(const DeviceInventory& inventory, const std::string& deviceType)
+{
+  std::cout << "============================= Platform Information =============================";
+  for (std::size_t i = 0; i < inventory.getPlatforms().size(); i++) {
+    const PlatformRecord& platform = inventory.getPlatforms()[i];
+    std::cout << "\nPlatform: " << i << "\n"
+              << "  CL_PLATFORM_NAME: " << platform.name << "\n"
+              << "  CL_PLATFORM_VENDOR: " << platform.vendor << "\n"
+              << "  CL_PLATFORM_VERSION: " << platform.version << "\n";
+    std::vector<const DeviceRecord*> devices = inventory.getDevices(i, deviceType);
+    for (decltype(devices)::size_type j = 0; j < devices.size(); j++) {
+      std::cout << "  Device: " << j << "\n"
+                << "    CL_DEVICE_NAME: " << devices[j]->name << "\n"
+                << "    CL_DEVICE_VENDOR: " << devices[j]->vendor << "\n"
+                << "    CL_DEVICE_VERSION: " << devices[j]->version << "\n"
+                << "    CL_DRIVER_VERSION: " << devices[j]->driverVersion << "\n"
+                << "    CL_DEVICE_MAX_COMPUTE_UNITS: " << devices[j]->maxComputeUnits << "\n"
+                << "    CL_DEVICE_MAX_WORK_GROUP_SIZE: " << devices[j]->maxWorkGroupSize << "\n"
+                << "    CL_DEVICE_EXTENSIONS: " << devices[j]->extensions << "\n";
+    }
+  }
+  std::cout << "================================================================================" << std::endl;
+}
+
+
+/*!
+ * @brief Select target devices from the devices of a platform
+ * @param [in] deviceIds    Device IDs of the platform
+ * @param [in] deviceIndex  Index of the first target device
+ * @return  Target device IDs
+ */
+static inline std::vector<cl_device_id>
+selectTargetDevices(const std::vector<cl_device_id>& deviceIds, std::size_t deviceIndex)
+{
+  KOTLIB_THROW_IF(deviceIndex >= deviceIds.size(), std::out_of_range, "Invalid device index: " + std::to_string(deviceIndex));
+  return std::vector<cl_device_id>(deviceIds.begin() + static_cast<std::ptrdiff_t>(deviceIndex), deviceIds.end());
+}
+
+
+/*!
+ * @brief Target devices of one platform, which are built in one context
+ */
+struct TargetDevices
+{
+  //! Platform ID
+  cl_platform_id platformId;
+  //! Target device IDs
+  std::vector<cl_device_id> deviceIds;
+};
+
+
+/*!
+ * @brief Get the identities of the selected devices from the device inventory
+ * @param [in] inventory     Device inventory
+ * @param [in] targetGroups  Selected devices of each platform
+ * @return  Identities of the selected devices in the order of the groups
+ */
+static inline std::vector<std::string>
+getTargetIdentities(const DeviceInventory& inventory, const std::vector<TargetGroup>& targetGroups)
+{
+  std::vector<std::string> identities;
+  for (const auto& targetGroup : targetGroups) {
+    const PlatformRecord& platform = inventory.getPlatforms().at(targetGroup.platformIndex);
+    for (const auto& deviceIndex : targetGroup.deviceIndices) {
+      const DeviceRecord& device = platform.devices.at(deviceIndex);
+      identities.emplace_back(DeviceInventory::makeIdentity(platform.name, platform.version, device.name, device.version, device.driverVersion));
+    }
+  }
+  return identities;
+}
+
+
+/*!
+ * @brief Get device IDs of the selected devices
+ * @param [in] platformIds   Platform IDs
+ * @param [in] targetGroups  Selected devices of each platform
+ * @return  Target devices of each platform, or empty if the platforms and devices differ from the inventory
+ */
+static inline std::vector<TargetDevices>
+getTargetDevices(const std::vector<cl_platform_id>& platformIds, const std::vector<TargetGroup>& targetGroups)
+{
+  std::vector<TargetDevices> targets;
+  for (const auto& targetGroup : targetGroups) {
+    if (targetGroup.platformIndex >= platformIds.size()) {
+      return {};
+    }
+    cl_platform_id platformId = platformIds[targetGroup.platformIndex];
+    std::vector<cl_device_id> deviceIds = findDeviceIds(platformId, CL_DEVICE_TYPE_ALL);
+    targets.emplace_back(TargetDevices{platformId, {}});
+    for (const auto& deviceIndex : targetGroup.deviceIndices) {
+      if (deviceIndex >= deviceIds.size()) {
+        return {};
+      }
+      targets.back().deviceIds.emplace_back(deviceIds[deviceIndex]);
+    }
+  }
+  return targets;
+}
+
+
+/*!
+ * @brief Make binary cache keys of a digest of kernel sources for each device
+ * @param [in] deviceIdentities  Identities of the target devices
+ * @param [in] contentDigest     Digest of the kernel sources and the headers which they include
+ * @param [in] options           Compile options
+ * @return  Cache keys for each device
+ */
+static inline std::vector<std::string>
+makeCacheKeys(
+    const std::vector<std::string>& deviceIdentities,
+    const std::string& contentDigest,
+    const std::string& options)
+{
+  PhaseTimer::Scope scope = phaseTimer.measure("Cache key computation");
+  std::vector<std::string> cacheKeys;
+  cacheKeys.reserve(deviceIdentities.size());
+  for (const auto& deviceIdentity : deviceIdentities) {
+    cacheKeys.emplace_back(BinaryCache::makeKey(contentDigest.data(), contentDigest.size(), options, deviceIdentity));
+  }
+  return cacheKeys;
+}
+
+
+/*!
+ * @brief Make binary cache keys of kernel sources for each device
+ *
+ * The sources are hashed once, not for each device.
+ * @param [in] deviceIdentities  Identities of the target devices
+ * @param [in] kernelSources     Kernel source codes
+ * @param [in] options           Compile options
+ * @return  Cache keys for each device
+ */
+static inline std::vector<std::string>
+makeCacheKeys(
+    const std::vector<std::string>& deviceIdentities,
+    const std::vector<SourceFile>& kernelSources,
+    const std::string& options)
+{
+  std::string contentDigest;
+  {
+    PhaseTimer::Scope scope = phaseTimer.measure("Cache key computation");
+    contentDigest = BinaryCache::makeKey(kernelSources, "", "");
+  }
+  return makeCacheKeys(deviceIdentities, contentDigest, options);
+}
+
+
+/*!
+ * @brief Load binaries from binary cache if all of them are cached
+ * @param [in]  cache         Binary cache
+ * @param [in]  cacheKeys     Cache keys for each device
+ * @param [out] bins          Loaded binaries for each device
+ * @param [in]  isRecordMiss  Record a miss, which is false if the lookup is repeated by the build on a miss
+ * @return  true if all binaries are cached, otherwise false
+ */
+static inline bool
+loadCachedBinaries(const BinaryCache& cache, const std::vector<std::string>& cacheKeys, std::vector<std::vector<char> >& bins, bool isRecordMiss = true)
+{
+  PhaseTimer::Scope scope = phaseTimer.measure("Cache lookup");
+  bins.resize(cacheKeys.size());
+  bool isHit = !cacheKeys.empty();
+  for (std::remove_reference<decltype(cacheKeys)>::type::size_type i = 0; i < cacheKeys.size() && isHit; i++) {
+    isHit = cache.load(cacheKeys[i], bins[i]);
+  }
+  if (isHit) {
+    cache.recordHit();
+  } else if (isRecordMiss) {
+    cache.recordMiss();
+  }
+  return isHit;
+}
+
+
+/*!
+ * @brief Write binaries from binary cache if all of them are cached
+ * @param [in] cache         Binary cache
+ * @param [in] cacheKeys     Cache keys for each device
+ * @param [in] filenames     Output file names for each device
+ * @param [in] isRecordMiss  Record a miss, which is false if the lookup is repeated by the build on a miss
+ * @return  true if all binaries are cached and written, otherwise false
+ */
+static inline bool
+writeCachedBinaries(const BinaryCache& cache, const std::vector<std::string>& cacheKeys, const std::vector<std::string>& filenames, bool isRecordMiss = true)
+{
+  // Kernel reports are cached along with the binaries, and both of them are required
+  std::vector<DeviceKernelReport> reports(cacheKeys.size(), DeviceKernelReport{"", "", {}});
+  if (kernelReportWriter.isEnabled()) {
+    PhaseTimer::Scope scope = phaseTimer.measure("Cache lookup");
+    std::vector<char> data;
+    for (std::remove_reference<decltype(cacheKeys)>::type::size_type i = 0; i < cacheKeys.size(); i++) {
+      if (!cache.load(kernelReportWriter.makeCacheKey(cacheKeys[i]), data) || !DeviceKernelReport::parse(data, reports[i])) {
+        if (isRecordMiss) {
+          cache.recordMiss();
+        }
+        return false;
+      }
+    }
+  }
+  std::vector<std::vector<char> > cachedBins;
+  if (!loadCachedBinaries(cache, cacheKeys, cachedBins, isRecordMiss)) {
+    return false;
+  }
+  for (decltype(cachedBins)::size_type i = 0; i < cachedBins.size(); i++) {
+    writeBinary(filenames[i], cachedBins[i].data(), cachedBins[i].size());
+    if (kernelReportWriter.isEnabled()) {
+      kernelReportWriter.add(filenames[i], reports[i]);
+    }
+  }
+  return true;
+}
+
+
+/*!
+ * @brief Binaries of a program for each target device
+ *
+ * All binaries are carved out of one arena which is sized to the sum of
+ * CL_PROGRAM_BINARY_SIZES, so that extraction needs only one allocation.
+ */
+struct ProgramBinaries
+{
+  //! Arena which holds all binaries of the program
+  std::unique_ptr<char[]> arena;
+  //! Pointers to the binary of each target device in the arena, nullptr if not built
+  std::vector<const char*> data;
+  //! Sizes of the binary of each target device
+  std::vector<std::size_t> sizes;
+};
+
+
+/*!
+ * @brief Store binaries to binary cache
+ * @param [in] cache      Binary cache
+ * @param [in] cacheKeys  Cache keys for each device
+ * @param [in] bins       Binaries for each device
+ */
+static inline void
+storeCachedBinaries(const BinaryCache& cache, const std::vector<std::string>& cacheKeys, const ProgramBinaries& bins)
+{
+  if (cacheKeys.size() != bins.data.size()) {
+    return;
+  }
+  PhaseTimer::Scope scope = phaseTimer.measure("Cache store");
+  for (decltype(bins.data)::size_type i = 0; i < bins.data.size(); i++) {
+    if (bins.data[i] != nullptr) {
+      cache.store(cacheKeys[i], bins.data[i], bins.sizes[i]);
+    }
+  }
+  cache.evict();
+}
+
+
+/*!
+ * @brief Completion flag which is signaled from the pfn_notify callback of clBuildProgram()
+ */
+struct BuildNotification
+{
+  /*!
+   * @brief Initialize as not completed
+   */
+  BuildNotification() :
+    mtx(),
+    cv(),
+    isDone(false)
+  {}
+
+  //! Mutex for isDone
+  std::mutex mtx;
+  //! Condition variable which is notified when the build is completed
+  std::condition_variable cv;
+  //! Flag which indicates whether the build is completed or not
+  bool isDone;
+};
+
+
+/*!
+ * @brief Callback function for clBuildProgram() which signals BuildNotification
+ *
+ * The condition variable is notified under the mutex, since the waiter may
+ * wake spuriously, see isDone and destroy the notification as soon as the
+ * mutex is released.
+ * @param [in]     program   Built program (unused)
+ * @param [in,out] userData  Pointer to BuildNotification
+ */
+static void CL_CALLBACK
+onBuildCompleted(cl_program program, void* userData)
+{
+  static_cast<void>(program);
+  BuildNotification* notification = static_cast<BuildNotification*>(userData);
+  std::lock_guard<std::mutex> lock(notification->mtx);
+  notification->isDone = true;
+  notification->cv.notify_all();
+}
+
+
+/*!
+ * @brief Build program and wait for its completion
+ *
+ * The completion is notified via pfn_notify callback, so that the build runs
+ * asynchronously on the drivers which support it, and the calling thread
+ * sleeps until the build is completed.
+ * @param [in] program    Program to build
+ * @param [in] deviceIds  Target device IDs
+ * @param [in] options    Compile options
+ * @return  Error code of OpenCL
+ */
+static inline cl_int
+buildProgramAndWait(cl_program program, const std::vector<cl_device_id>& deviceIds, const std::string& options)
+{
+  PhaseTimer::Scope scope = phaseTimer.measure("clBuildProgram");
+  BuildNotification notification;
+  cl_int errCode = clBuildProgram(program, static_cast<cl_uint>(deviceIds.size()), deviceIds.data(), options.c_str(), onBuildCompleted, &notification);
+  if (errCode != CL_SUCCESS) {
+    return errCode;
+  }
+  {
+    std::unique_lock<std::mutex> lock(notification.mtx);
+    notification.cv.wait(lock, [&notification] {
+      return notification.isDone;
+    });
+  }
+
+  // An asynchronous build reports its failure via the build status
+  for (const auto& deviceId : deviceIds) {
+    cl_build_status buildStatus;
+    errCode = clGetProgramBuildInfo(program, deviceId, CL_PROGRAM_BUILD_STATUS, sizeof(buildStatus), &buildStatus, nullptr);
+    if (errCode != CL_SUCCESS) {
+      return errCode;
+    }
+    if (buildStatus != CL_BUILD_SUCCESS) {
+      return CL_BUILD_PROGRAM_FAILURE;
+    }
+  }
+  return CL_SUCCESS;
+}
+
+
+/*!
+ * @brief Create program from kernel sources
+ * @param [in] context        Context which contains the target devices
+ * @param [in] kernelSources  Kernel source codes
+ * @return  Created program, which is not built yet
+ */
+static inline ProgramHandle
+createProgramWithSource(cl_context context, const std::vector<SourceFile>& kernelSources)
+{
+  cl_int errCode;
+  std::pair<std::vector<const char*>, std::vector<std::size_t> > kernelSourcePairs;
+  kernelSourcePairs.first.reserve(kernelSources.size());
+  kernelSourcePairs.second.reserve(kernelSources.size());
+  for (const auto& kernelSource : kernelSources) {
+    kernelSourcePairs.first.emplace_back(kernelSource.data());
+    kernelSourcePairs.second.emplace_back(kernelSource.size());
+  }
+  ProgramHandle program;
+  {
+    PhaseTimer::Scope scope = phaseTimer.measure("clCreateProgramWithSource");
+    program.reset(
+        clCreateProgramWithSource(
+          context,
+          static_cast<cl_uint>(kernelSourcePairs.first.size()),
+          kernelSourcePairs.first.data(),
+          kernelSourcePairs.second.data(),
+          &errCode));
+  }
+  OCLC_CHECK_ERROR(errCode);
+  return program;
+}
+
+
+/*!
+ * @brief Create program from one kernel source
+ * @param [in] context       Context which contains the target devices
+ * @param [in] kernelSource  Kernel source code
+ * @return  Created program, which is not compiled yet
+ */
+static inline ProgramHandle
+createProgramWithSource(cl_context context, const SourceFile& kernelSource)
+{
+  cl_int errCode;
+  const char* data = kernelSource.data();
+  std::size_t size = kernelSource.size();
+  ProgramHandle program;
+  {
+    PhaseTimer::Scope scope = phaseTimer.measure("clCreateProgramWithSource");
+    program.reset(clCreateProgramWithSource(context, 1, &data, &size, &errCode));
+  }
+  OCLC_CHECK_ERROR(errCode);
+  return program;
+}
+
+
+/*!
+ * @brief Create program from binaries for each device
+ * @param [in] context    Context which contains the target devices
+ * @param [in] deviceIds  Target device IDs
+ * @param [in] bins       Binaries for each device
+ * @return  Created program
+ */
+static inline ProgramHandle
+createProgramWithBinary(cl_context context, const std::vector<cl_device_id>& deviceIds, const std::vector<std::vector<char> >& bins)
+{
+  std::vector<const unsigned char*> binPtrs;
+  std::vector<std::size_t> binSizes;
+  binPtrs.reserve(bins.size());
+  binSizes.reserve(bins.size());
+  for (const auto& bin : bins) {
+    binPtrs.emplace_back(reinterpret_cast<const unsigned char*>(bin.data()));
+    binSizes.emplace_back(bin.size());
+  }
+  cl_int errCode;
+  std::vector<cl_int> binStatuses(deviceIds.size());
+  ProgramHandle program(
+      clCreateProgramWithBinary(context, static_cast<cl_uint>(deviceIds.size()), deviceIds.data(), binSizes.data(), binPtrs.data(), binStatuses.data(), &errCode));
+  for (std::remove_reference<decltype(deviceIds)>::type::size_type i = 0; i < deviceIds.size(); i++) {
+    KOTLIB_THROW_IF(binStatuses[i] != CL_SUCCESS, std::runtime_error,
+        "Binary is rejected by device (" + getClErrorMessage(binStatuses[i]) + "): " + getDeviceInfoString(deviceIds[i], CL_DEVICE_NAME));
+  }
+  OCLC_CHECK_ERROR(errCode);
+  return program;
+}
+
+
+/*!
+ * @brief Create program from one SPIR-V module
+ *
+ * Every target device must report SPIR-V in CL_DEVICE_IL_VERSION.
+ * @param [in] context    Context which contains the target devices
+ * @param [in] deviceIds  Target device IDs
+ * @param [in] module     SPIR-V module
+ * @return  Created program, which is not built yet
+ */
+static inline ProgramHandle
+createProgramWithIl(cl_context context, const std::vector<cl_device_id>& deviceIds, const SourceFile& module)
+{
+  ProgramHandle program;
+#ifdef CL_VERSION_2_1
+  for (const auto& deviceId : deviceIds) {
+    KOTLIB_THROW_IF(getDeviceInfoString(deviceId, CL_DEVICE_IL_VERSION).find("SPIR-V") == std::string::npos,
+        std::runtime_error, "SPIR-V is not supported by device: " + getDeviceInfoString(deviceId, CL_DEVICE_NAME));
+  }
+  cl_int errCode;
+  {
+    PhaseTimer::Scope scope = phaseTimer.measure("clCreateProgramWithIL");
+    program.reset(clCreateProgramWithIL(context, module.data(), module.size(), &errCode));
+  }
+  OCLC_CHECK_ERROR(errCode);
+#else
+  static_cast<void>(context);
+  static_cast<void>(deviceIds);
+  static_cast<void>(module);
+  KOTLIB_THROW_IF(true, std::runtime_error, "SPIR-V input requires OpenCL 2.1 headers");
+#endif  // CL_VERSION_2_1
+  return program;
+}
+
+
+/*!
+ * @brief Get build log of specified program for specified device
+ * @param [in] program   Program which is built, compiled or linked
+ * @param [in] deviceId  Device ID
+ * @return  Build log
+ */
+static inline std::string
+getBuildLog(cl_program program, cl_device_id deviceId)
+{
+  std::size_t logSize;
+  if (clGetProgramBuildInfo(program, deviceId, CL_PROGRAM_BUILD_LOG, 0, nullptr, &logSize) != CL_SUCCESS || logSize == 0) {
+    return "";
+  }
+  std::string buildLog(logSize, '\0');
+  if (clGetProgramBuildInfo(program, deviceId, CL_PROGRAM_BUILD_LOG, logSize, &buildLog[0], nullptr) != CL_SUCCESS) {
+    return "";
+  }
+  // Drop the terminating NUL character without copying the log
+  buildLog.resize(std::min(buildLog.find('\0'), buildLog.size()));
+  return buildLog;
+}
+
+
+/*!
+ * @brief Report build logs of a program for all devices
+ *
+ * Non-empty logs are written to the build log writer one by one, so that
+ * only one log is held in memory at a time.
+ * When the writer is disabled, the logs are concatenated and returned
+ * instead, which is done only on failure.
+ * @param [in] program    Program which was built
+ * @param [in] deviceIds  Target device IDs
+ * @param [in] name       Name of the program which is shown in the log titles, or empty
+ * @param [in] isFailed   Whether the build failed or not
+ * @return  Message to add to the build error
+ */
+static inline std::string
+reportBuildLogs(cl_program program, const std::vector<cl_device_id>& deviceIds, const std::string& name, bool isFailed)
+{
+  if (!buildLogWriter.isEnabled() && !isFailed) {
+    return "";
+  }
+  std::string logs;
+  for (std::remove_reference<decltype(deviceIds)>::type::size_type i = 0; i < deviceIds.size(); i++) {
+    std::string buildLog = getBuildLog(program, deviceIds[i]);
+    if (buildLog.find_first_not_of(" \t\r\n") == std::string::npos) {
+      continue;
+    }
+    std::string title = "Build log" + (name.empty() ? "" : " of " + name) + " for device " + std::to_string(i)
+      + " (" + getDeviceInfoString(deviceIds[i], CL_DEVICE_NAME) + ")";
+    if (buildLogWriter.isEnabled()) {
+      buildLogWriter.write(title, buildLog);
+    } else {
+      logs += "=== " + title + " ===\n" + buildLog + "\n";
+    }
+  }
+  if (buildLogWriter.isEnabled()) {
+    return buildLogWriter.getFilename().empty() ? "See build log above" : "See build log in " + buildLogWriter.getFilename();
+  }
+  return logs;
+}
+
+
+/*!
+ * @brief Report kernel metadata and resource usage of a built program for all
+ *        devices if --kernel-report is specified
+ *
+ * The reports are stored in the binary cache before the binaries, so that a
+ * cache hit reports the kernels without building the program.
+ * @param [in] program    Built program
+ * @param [in] deviceIds  Target device IDs
+ * @param [in] filenames  Output file names for each device
+ * @param [in] cache      Binary cache, or nullptr if disabled
+ * @param [in] cacheKeys  Cache keys for each device
+ */
+static inline void
+reportKernels(cl_program program, const std::vector<cl_device_id>& deviceIds, const std::vector<std::string>& filenames, const BinaryCache* cache, const std::vector<std::string>& cacheKeys)
+{
+  if (!kernelReportWriter.isEnabled()) {
+    return;
+  }
+  PhaseTimer::Scope scope = phaseTimer.measure("Kernel report");
+  for (std::remove_reference<decltype(deviceIds)>::type::size_type i = 0; i < deviceIds.size(); i++) {
+    DeviceKernelReport report = queryKernelReport(program, deviceIds[i], getBuildLog(program, deviceIds[i]), kernelReportWriter.getPrivateMemLimit());
+    kernelReportWriter.add(filenames[i], report);
+    if (cache != nullptr && i < cacheKeys.size()) {
+      std::string text = report.serialize();
+      cache->store(kernelReportWriter.makeCacheKey(cacheKeys[i]), text.data(), text.size());
+    }
+  }
+}
+
+
+/*!
+ * @brief Create program from kernel sources or one SPIR-V module and build it
+ *        without throwing on build errors
+ * @param [in]  context        Context which contains the target devices
+ * @param [in]  deviceIds      Target device IDs
+ * @param [in]  kernelSources  Kernel source codes, or one SPIR-V module
+ * @param [in]  options        Compile options
+ * @param [out] errCode        Error code of the build
+ * @return  Created program, which is built if errCode is CL_SUCCESS
+ */
+static inline ProgramHandle
+createAndBuildProgram(
+    cl_context context,
+    const std::vector<cl_device_id>& deviceIds,
+    const std::vector<SourceFile>& kernelSources,
+    const std::string& options,
+    cl_int& errCode)
+{
+  bool hasSpirv = std::any_of(kernelSources.begin(), kernelSources.end(), isSpirv);
+  KOTLIB_THROW_IF(hasSpirv && kernelSources.size() > 1, std::runtime_error, "SPIR-V module must be specified alone");
+  ProgramHandle program = hasSpirv
+    ? createProgramWithIl(context, deviceIds, kernelSources[0])
+    : createProgramWithSource(context, kernelSources);
+
+  // Compile kernel source code
+  errCode = buildProgramAndWait(program.get(), deviceIds, options);
+  return program;
+}
+
+
+/*!
+ * @brief Create program from kernel sources or one SPIR-V module and build it
+ * @param [in] context        Context which contains the target devices
+ * @param [in] deviceIds      Target device IDs
+ * @param [in] kernelSources  Kernel source codes, or one SPIR-V module
+ * @param [in] options        Compile options
+ * @param [in] name           Name of the program which is shown in the build logs, or empty
+ * @return  Built program
+ */
+static inline ProgramHandle
+buildProgramFromSource(
+    cl_context context,
+    const std::vector<cl_device_id>& deviceIds,
+    const std::vector<SourceFile>& kernelSources,
+    const std::string& options,
+    const std::string& name = "")
+{
+  cl_int errCode;
+  ProgramHandle program = createAndBuildProgram(context, deviceIds, kernelSources, options, errCode);
+  switch (errCode) {
+    case CL_SUCCESS:
+      // Show warnings
+      reportBuildLogs(program.get(), deviceIds, name, false);
+      break;
+    case CL_BUILD_PROGRAM_FAILURE:
+      OCLC_CHECK_ERROR_WITH_MSG(errCode, reportBuildLogs(program.get(), deviceIds, name, true));
+      break;
+    case CL_INVALID_BUILD_OPTIONS:
+      OCLC_CHECK_ERROR(errCode);
+      break;
+    default:
+      OCLC_CHECK_ERROR(errCode);
+  }
+  return program;
+}
+
+
+/*!
+ * @brief Create program from kernel sources or one SPIR-V module, build it and
+ *        record the build status for each device instead of throwing on build errors
+ *
+ * The build logs go to the diagnostics, and also to the build log writer only
+ * if --log-file is specified, so that stderr keeps one line per failure.
+ * @param [in]  context        Context which contains the target devices
+ * @param [in]  deviceIds      Target device IDs
+ * @param [in]  kernelSources  Kernel source codes, or one SPIR-V module
+ * @param [in]  options        Compile options
+ * @param [in]  filenames      Output file names for each device, or one file name for IL, or empty
+ * @param [in]  name           Name of the program which is shown in the build logs, or empty
+ * @param [out] diagnostics    Build status which the devices are appended to
+ * @return  Built program, or nullptr if the build failed
+ */
+static inline ProgramHandle
+buildProgramWithDiagnostics(
+    cl_context context,
+    const std::vector<cl_device_id>& deviceIds,
+    const std::vector<SourceFile>& kernelSources,
+    const std::string& options,
+    const std::vector<std::string>& filenames,
+    const std::string& name,
+    BuildDiagnostics& diagnostics)
+{
+  cl_int errCode;
+  ProgramHandle program = createAndBuildProgram(context, deviceIds, kernelSources, options, errCode);
+  for (std::remove_reference<decltype(deviceIds)>::type::size_type i = 0; i < deviceIds.size(); i++) {
+    cl_build_status buildStatus = CL_BUILD_NONE;
+    clGetProgramBuildInfo(program.get(), deviceIds[i], CL_PROGRAM_BUILD_STATUS, sizeof(buildStatus), &buildStatus, nullptr);
+    std::string status = buildStatus == CL_BUILD_SUCCESS ? "succeeded"
+      : buildStatus == CL_BUILD_ERROR || errCode != CL_BUILD_PROGRAM_FAILURE ? "failed" : "skipped";
+    diagnostics.devices.emplace_back(DeviceDiagnostics{
+      filenames.empty() ? "" : filenames[std::min(i, filenames.size() - 1)],
+      getDeviceInfoString(deviceIds[i], CL_DEVICE_NAME),
+      errCode == CL_SUCCESS ? "succeeded" : status,
+      getBuildLog(program.get(), deviceIds[i])});
+  }
+  if (!buildLogWriter.getFilename().empty()) {
+    reportBuildLogs(program.get(), deviceIds, name, errCode != CL_SUCCESS);
+  }
+  if (errCode != CL_SUCCESS) {
+    if (diagnostics.errCode == CL_SUCCESS) {
+      diagnostics.errCode = errCode;
+    }
+    return nullptr;
+  }
+  return program;
+}
+
+
+/*!
+ * @brief Get binaries of built program for specified devices
+ *
+ * The program may be associated with more devices than the target devices,
+ * so the binaries are picked up in the order of the specified device IDs.
+ * @param [in] program    Built program
+ * @param [in] deviceIds  Target device IDs
+ * @return  Binaries for each target device
+ */
+static inline ProgramBinaries
+getProgramBinaries(cl_program program, const std::vector<cl_device_id>& deviceIds)
+{
+  PhaseTimer::Scope scope = phaseTimer.measure("Binary query");
+
+  // figure out number of devices and the sizes of the binary for each device.
+  cl_uint nDevice;
+  cl_int errCode = clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(nDevice), &nDevice, nullptr);
+  OCLC_CHECK_ERROR(errCode);
+
+  std::vector<cl_device_id> programDeviceIds(nDevice);
+  errCode = clGetProgramInfo(program, CL_PROGRAM_DEVICES, sizeof(cl_device_id) * nDevice, programDeviceIds.data(), nullptr);
+  OCLC_CHECK_ERROR(errCode);
+
+  std::vector<std::size_t> binSizes(nDevice);
+  errCode = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(std::size_t) * nDevice, binSizes.data(), nullptr);
+  OCLC_CHECK_ERROR(errCode);
+
+  // copy over all of the generated bins into one arena.
+  std::size_t totalSize = 0;
+  for (const auto& binSize : binSizes) {
+    totalSize += binSize;
+  }
+  ProgramBinaries bins{std::unique_ptr<char[]>(new char[totalSize]), {}, {}};
+  std::vector<char*> binPtrs(nDevice);
+  for (std::size_t i = 0, offset = 0; i < nDevice; offset += binSizes[i++]) {
+    binPtrs[i] = binSizes[i] == 0 ? nullptr : bins.arena.get() + offset;
+  }
+  errCode = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(char*) * nDevice, binPtrs.data(), nullptr);
+  OCLC_CHECK_ERROR(errCode);
+
+  bins.data.reserve(deviceIds.size());
+  bins.sizes.reserve(deviceIds.size());
+  for (const auto& deviceId : deviceIds) {
+    auto it = std::find(programDeviceIds.begin(), programDeviceIds.end(), deviceId);
+    auto j = static_cast<std::size_t>(it - programDeviceIds.begin());
+    bins.data.emplace_back(it == programDeviceIds.end() ? nullptr : binPtrs[j]);
+    bins.sizes.emplace_back(it == programDeviceIds.end() ? 0 : binSizes[j]);
+  }
+  return bins;
+}
+
+
+/*!
+ * @brief Get intermediate language of built program
+ * @param [in] program  Built program
+ * @return  SPIR-V module of the program
+ */
+static inline std::vector<char>
+getProgramIl(cl_program program)
+{
+  PhaseTimer::Scope scope = phaseTimer.measure("IL query");
+  std::vector<char> il;
+#ifdef CL_VERSION_2_1
+  std::size_t ilSize;
+  cl_int errCode = clGetProgramInfo(program, CL_PROGRAM_IL, 0, nullptr, &ilSize);
+  OCLC_CHECK_ERROR(errCode);
+  il.resize(ilSize);
+  if (!il.empty()) {
+    errCode = clGetProgramInfo(program, CL_PROGRAM_IL, il.size(), il.data(), nullptr);
+    OCLC_CHECK_ERROR(errCode);
+  }
+#else
+  static_cast<void>(program);
+#endif  // CL_VERSION_2_1
+  KOTLIB_THROW_IF(il.empty(), std::runtime_error, "Platform does not provide IL of the program");
+  return il;
+}
+
+
+/*!
+ * @brief Build kernel sources in specified context and write the binaries
+ * @param [in] context        Context which contains the target devices
+ * @param [in] deviceIds      Target device IDs
+ * @param [in] kernelSources  Kernel source codes
+ * @param [in] options        Compile options
+ * @param [in] filenames      Output file names for each device, or one file name for IL
+ * @param [in] isSyntaxOnly   Check syntax only, not generate binary
+ * @param [in] isEmitIl       Write IL of the program instead of binaries
+ * @param [in] cache          Binary cache, or nullptr if disabled
+ * @param [in] cacheKeys      Cache keys for each device, which are used to store binaries
+ * @param [in] name           Name of the program which is shown in the build logs, or empty
+ * @param [in] diagnostics    Build status to record build errors in instead of throwing them, or nullptr
+ * @return  true if the program is built, false if the build failed and is recorded in the diagnostics
+ */
+static inline bool
+buildAndWriteProgram(
+    cl_context context,
+    const std::vector<cl_device_id>& deviceIds,
+    const std::vector<SourceFile>& kernelSources,
+    const std::string& options,
+    const std::vector<std::string>& filenames,
+    bool isSyntaxOnly,
+    bool isEmitIl,
+    const BinaryCache* cache,
+    const std::vector<std::string>& cacheKeys,
+    const std::string& name = "",
+    BuildDiagnostics* diagnostics = nullptr)
+{
+  ProgramHandle program = diagnostics == nullptr ? buildProgramFromSource(context, deviceIds, kernelSources, options, name)
+    : buildProgramWithDiagnostics(context, deviceIds, kernelSources, options, isSyntaxOnly ? std::vector<std::string>{} : filenames, name, *diagnostics);
+  if (program == nullptr) {
+    return false;
+  }
+  if (isSyntaxOnly) {
+    return true;
+  }
+  if (isEmitIl) {
+    std::vector<char> il = getProgramIl(program.get());
+    writeBinary(filenames[0], il.data(), il.size());
+    return true;
+  }
+
+  ProgramBinaries bins = getProgramBinaries(program.get(), deviceIds);
+  for (decltype(bins.data)::size_type i = 0; i < bins.data.size(); i++) {
+    if (bins.data[i] == nullptr) {
+      continue;
+    }
+    writeBinary(filenames[i], bins.data[i], bins.sizes[i]);
+  }
+
+  reportKernels(program.get(), deviceIds, filenames, cache, cacheKeys);
+  if (cache != nullptr) {
+    storeCachedBinaries(*cache, cacheKeys, bins);
+  }
+  return true;
+}
+
+
+/*!
+ * @brief Compile kernel sources for specified devices and write the binaries
+ * @param [in] platformId     Platform ID of the devices
+ * @param [in] deviceIds      Target device IDs
+ * @param [in] kernelSources  Kernel source codes
+ * @param [in] options        Compile options
+ * @param [in] filenames      Output file names for each device, or one file name for IL
+ * @param [in] isSyntaxOnly   Check syntax only, not generate binary
+ * @param [in] isEmitIl       Write IL of the program instead of binaries
+ * @param [in] cache          Binary cache, or nullptr if disabled
+ * @param [in] contentDigest  Digest of the sources and their headers for the cache keys, or empty to hash the sources
+ * @param [in] diagnostics    Build status to record build errors in instead of throwing them, or nullptr
+ * @return  true if the program is built or cached, false if the build failed and is recorded in the diagnostics
+ */
+static inline bool
+compileProgram(
+    cl_platform_id platformId,
+    const std::vector<cl_device_id>& deviceIds,
+    const std::vector<SourceFile>& kernelSources,
+    const std::string& options,
+    const std::vector<std::string>& filenames,
+    bool isSyntaxOnly,
+    bool isEmitIl,
+    const BinaryCache* cache,
+    const std::string& contentDigest = "",
+    BuildDiagnostics* diagnostics = nullptr)
+{
+  // Look up binary cache, and write binaries without compilation if all of them are cached
+  std::vector<std::string> cacheKeys;
+  if (cache != nullptr && !isSyntaxOnly && !isEmitIl) {
+    std::vector<std::string> deviceIdentities = getDeviceIdentities(platformId, deviceIds);
+    cacheKeys = contentDigest.empty() ? makeCacheKeys(deviceIdentities, kernelSources, options)
+      : makeCacheKeys(deviceIdentities, contentDigest, options);
+    if (writeCachedBinaries(*cache, cacheKeys, filenames)) {
+      if (diagnostics != nullptr) {
+        diagnostics->addCached(filenames);
+      }
+      return true;
+    }
+  }
+
+  return buildAndWriteProgram(contextPool.getContext(deviceIds), deviceIds, kernelSources, options, filenames, isSyntaxOnly, isEmitIl, cache, cacheKeys, "", diagnostics);
+}
+
+
+/*!
+ * @brief Reuse binaries of an earlier build which the current driver still accepts
+ *
+ * Each binary is created with clCreateProgramWithBinary() for its device
+ * alone, so that one rejected binary does not reject the others, and is built
+ * with clBuildProgram(), which only finalizes the binary on most drivers.
+ * The binaries must have been built from the same sources and options, which
+ * cannot be verified, so they are not stored to the binary cache.
+ * @param [in]     context       Context which contains the target devices
+ * @param [in]     deviceIds     Target device IDs
+ * @param [in]     oldFilenames  Binary files of the earlier build for each device
+ * @param [in]     options       Compile options
+ * @param [in]     filenames     Output file names for each device
+ * @param [in,out] diagnostics   Build status which the reused binaries are appended to, or nullptr
+ * @return  Indices of the devices whose binaries are rejected, which need to be built from the sources
+ */
+static inline std::vector<std::size_t>
+revalidateBinaries(
+    cl_context context,
+    const std::vector<cl_device_id>& deviceIds,
+    const std::vector<std::string>& oldFilenames,
+    const std::string& options,
+    const std::vector<std::string>& filenames,
+    BuildDiagnostics* diagnostics)
+{
+  std::vector<std::size_t> rejectedIndices;
+  for (std::remove_reference<decltype(deviceIds)>::type::size_type i = 0; i < deviceIds.size(); i++) {
+    SourceFile bin;
+    try {
+      PhaseTimer::Scope scope = phaseTimer.measure("Binary read");
+      bin = SourceFile::read(oldFilenames[i]);
+    } catch (const std::runtime_error& e) {
+      std::cerr << e.what() << "; building from the sources" << std::endl;
+      rejectedIndices.emplace_back(i);
+      continue;
+    }
+
+    const unsigned char* binPtr = reinterpret_cast<const unsigned char*>(bin.data());
+    std::size_t binSize = bin.size();
+    cl_int binStatus = CL_SUCCESS;
+    cl_int errCode;
+    ProgramHandle program;
+    {
+      PhaseTimer::Scope scope = phaseTimer.measure("clCreateProgramWithBinary");
+      program.reset(clCreateProgramWithBinary(context, 1, &deviceIds[i], &binSize, &binPtr, &binStatus, &errCode));
+    }
+    if (errCode == CL_SUCCESS && binStatus != CL_SUCCESS) {
+      errCode = binStatus;
+    }
+    if (errCode == CL_SUCCESS) {
+      errCode = buildProgramAndWait(program.get(), {deviceIds[i]}, options);
+    }
+    if (errCode != CL_SUCCESS) {
+      std::cerr << "Binary is rejected by the driver (" << getClErrorMessage(errCode) << "); building from the sources: " << oldFilenames[i] << std::endl;
+      rejectedIndices.emplace_back(i);
+      continue;
+    }
+
+    // Write the binary which the driver returns, since it may have been upgraded
+    if (diagnostics == nullptr || !buildLogWriter.getFilename().empty()) {
+      reportBuildLogs(program.get(), {deviceIds[i]}, "", false);
+    }
+    ProgramBinaries bins = getProgramBinaries(program.get(), {deviceIds[i]});
+    if (bins.data[0] == nullptr) {
+      writeBinary(filenames[i], bin.data(), bin.size());
+    } else {
+      writeBinary(filenames[i], bins.data[0], bins.sizes[0]);
+    }
+    reportKernels(program.get(), {deviceIds[i]}, {filenames[i]}, nullptr, {});
+    if (diagnostics != nullptr) {
+      diagnostics->devices.emplace_back(DeviceDiagnostics{filenames[i], getDeviceInfoString(deviceIds[i], CL_DEVICE_NAME), "revalidated", getBuildLog(program.get(), deviceIds[i])});
+    }
+  }
+  return rejectedIndices;
+}
+
+
+/*!
+ * @brief Compile one kernel source into an object for specified devices
+ *
+ * The object is loaded from binary cache if it is cached for all devices,
+ * otherwise it is compiled with clCompileProgram and stored to the cache.
+ * @param [in] platformId      Platform ID of the devices
+ * @param [in] context         Context which contains the target devices
+ * @param [in] deviceIds       Target device IDs
+ * @param [in] kernelSource    Kernel source code
+ * @param [in] headerPrograms  Programs of embedded headers
+ * @param [in] headerNames     Include names of the embedded headers
+ * @param [in] options         Compile options
+ * @param [in] keyOptions      String which is mixed into cache keys instead of the compile options
+ * @param [in] cache           Binary cache, or nullptr if disabled
+ * @param [in] name            Name of the kernel source which is shown in the build logs
+ * @return  Compiled object
+ */
+static inline ProgramHandle
+compileObject(
+    cl_platform_id platformId,
+    cl_context context,
+    const std::vector<cl_device_id>& deviceIds,
+    const SourceFile& kernelSource,
+    const std::vector<cl_program>& headerPrograms,
+    const std::vector<const char*>& headerNames,
+    const std::string& options,
+    const std::string& keyOptions,
+    const BinaryCache* cache,
+    const std::string& name)
+{
+  std::vector<std::string> cacheKeys;
+  if (cache != nullptr) {
+    PhaseTimer::Scope scope = phaseTimer.measure("Cache key computation");
+    for (const auto& deviceId : deviceIds) {
+      cacheKeys.emplace_back(BinaryCache::makeKey(kernelSource.data(), kernelSource.size(), keyOptions, getDeviceIdentity(platformId, deviceId)));
+    }
+    std::vector<std::vector<char> > bins;
+    if (loadCachedBinaries(*cache, cacheKeys, bins)) {
+      return createProgramWithBinary(context, deviceIds, bins);
+    }
+  }
+
+  ProgramHandle object = createProgramWithSource(context, kernelSource);
+  cl_int errCode;
+  {
+    PhaseTimer::Scope scope = phaseTimer.measure("clCompileProgram");
+    errCode = clCompileProgram(
+        object.get(),
+        static_cast<cl_uint>(deviceIds.size()),
+        deviceIds.data(),
+        options.c_str(),
+        static_cast<cl_uint>(headerPrograms.size()),
+        headerPrograms.empty() ? nullptr : headerPrograms.data(),
+        headerNames.empty() ? nullptr : const_cast<const char**>(headerNames.data()),
+        nullptr,
+        nullptr);
+  }
+  if (errCode == CL_COMPILE_PROGRAM_FAILURE) {
+    OCLC_CHECK_ERROR_WITH_MSG(errCode, reportBuildLogs(object.get(), deviceIds, name, true));
+  }
+  OCLC_CHECK_ERROR(errCode);
+  reportBuildLogs(object.get(), deviceIds, name, false);
+
+  if (cache != nullptr) {
+    storeCachedBinaries(*cache, cacheKeys, getProgramBinaries(object.get(), deviceIds));
+  }
+  return object;
+}
+
+
+/*!
+ * @brief Compile each kernel source separately, link them and write the binaries
+ *
+ * Each kernel source is compiled into its own object with clCompileProgram,
+ * and the objects are linked with clLinkProgram.
+ * Both the objects and the linked binaries are cached, so only changed files
+ * are recompiled.
+ * Since it is unknown which embedded header is included by which source, a
+ * change of any embedded header invalidates all objects, while a header on disk
+ * invalidates only the objects of the sources which include it.
+ * @param [in] platformId     Platform ID of the devices
+ * @param [in] deviceIds      Target device IDs
+ * @param [in] kernelSources  Kernel source codes
+ * @param [in] sourceNames    File names of the kernel sources, which are shown in the build logs
+ * @param [in] sourceIndex    Index which has scanned the kernel sources for the cache keys
+ * @param [in] headers        Headers which are embedded with their include names
+ * @param [in] headerNames    Include names of the headers
+ * @param [in] options        Compile options
+ * @param [in] linkOptions    Link options
+ * @param [in] filenames      Output file names for each device
+ * @param [in] isSyntaxOnly   Check syntax only, not link and generate binary
+ * @param [in] cache          Binary cache, or nullptr if disabled
+ */
+static inline void
+compileProgramIncrementally(
+    cl_platform_id platformId,
+    const std::vector<cl_device_id>& deviceIds,
+    const std::vector<SourceFile>& kernelSources,
+    const std::vector<std::string>& sourceNames,
+    const SourceIndex& sourceIndex,
+    const std::vector<SourceFile>& headers,
+    const std::vector<std::string>& headerNames,
+    const std::string& options,
+    const std::string& linkOptions,
+    const std::vector<std::string>& filenames,
+    bool isSyntaxOnly,
+    const BinaryCache* cache)
+{
+  KOTLIB_THROW_IF(std::any_of(kernelSources.begin(), kernelSources.end(), isSpirv), std::runtime_error, "SPIR-V module cannot be compiled incrementally");
+
+  // Mix headers and their names into the cache keys
+  std::string headerKey;
+  for (const auto& headerName : headerNames) {
+    headerKey += headerName + "\n";
+  }
+  headerKey = BinaryCache::makeKey(headers, headerKey, "");
+  std::string objectKeyOptions = "clCompileProgram\n" + options + "\n" + headerKey;
+
+  // Look up binary cache of the linked binaries
+  std::vector<std::string> cacheKeys;
+  if (cache != nullptr && !isSyntaxOnly) {
+    cacheKeys = makeCacheKeys(getDeviceIdentities(platformId, deviceIds), sourceIndex.getDigest(sourceNames),
+        "clLinkProgram\n" + linkOptions + "\n" + objectKeyOptions);
+    if (writeCachedBinaries(*cache, cacheKeys, filenames)) {
+      return;
+    }
+  }
+
+  cl_context context = contextPool.getContext(deviceIds);
+
+  std::vector<ProgramHandle> headerProgramHolders;
+  std::vector<cl_program> headerPrograms;
+  std::vector<const char*> headerNamePtrs;
+  for (std::remove_reference<decltype(headers)>::type::size_type i = 0; i < headers.size(); i++) {
+    headerProgramHolders.emplace_back(createProgramWithSource(context, headers[i]));
+    headerPrograms.emplace_back(headerProgramHolders.back().get());
+    headerNamePtrs.emplace_back(headerNames[i].c_str());
+  }
+
+  std::vector<ProgramHandle> objectHolders;
+  std::vector<cl_program> objects;
+  for (std::remove_reference<decltype(kernelSources)>::type::size_type i = 0; i < kernelSources.size(); i++) {
+    // Mix the headers which the source includes from disk into the object key
+    std::string keyOptions = cache == nullptr ? objectKeyOptions : objectKeyOptions + "\n" + sourceIndex.getDigest({sourceNames[i]});
+    objectHolders.emplace_back(compileObject(platformId, context, deviceIds, kernelSources[i], headerPrograms, headerNamePtrs, options, keyOptions, cache, sourceNames[i]));
+    objects.emplace_back(objectHolders.back().get());
+  }
+  if (isSyntaxOnly) {
+    return;
+  }
+
+  cl_int errCode;
+  ProgramHandle program;
+  {
+    PhaseTimer::Scope scope = phaseTimer.measure("clLinkProgram");
+    program.reset(
+        clLinkProgram(
+          context,
+          static_cast<cl_uint>(deviceIds.size()),
+          deviceIds.data(),
+          linkOptions.c_str(),
+          static_cast<cl_uint>(objects.size()),
+          objects.data(),
+          nullptr,
+          nullptr,
+          &errCode));
+  }
+  if (errCode == CL_LINK_PROGRAM_FAILURE && program != nullptr) {
+    OCLC_CHECK_ERROR_WITH_MSG(errCode, reportBuildLogs(program.get(), deviceIds, "clLinkProgram", true));
+  }
+  OCLC_CHECK_ERROR(errCode);
+  reportBuildLogs(program.get(), deviceIds, "clLinkProgram", false);
+
+  ProgramBinaries bins = getProgramBinaries(program.get(), deviceIds);
+  for (decltype(bins.data)::size_type i = 0; i < bins.data.size(); i++) {
+    if (bins.data[i] != nullptr) {
+      writeBinary(filenames[i], bins.data[i], bins.sizes[i]);
+    }
+  }
+  reportKernels(program.get(), deviceIds, filenames, cache, cacheKeys);
+  if (cache != nullptr) {
+    storeCachedBinaries(*cache, cacheKeys, bins);
+  }
+}
+
+
+/*!
+ * @brief Show errors which are captured in worker threads
+ * @param [in] errors  Captured errors, nullptr for succeeded items
+ * @param [in] labels  Labels of the items to prefix error messages
+ * @return  true if there is at least one error, otherwise false
+ */
+static inline bool
+reportErrors(const std::vector<std::exception_ptr>& errors, const std::vector<std::string>& labels)
+{
+  bool isFailed = false;
+  for (std::remove_reference<decltype(errors)>::type::size_type i = 0; i < errors.size(); i++) {
+    if (errors[i] == nullptr) {
+      continue;
+    }
+    try {
+      std::rethrow_exception(errors[i]);
+    } catch (const std::exception& e) {
+      std::cerr << "[" << labels[i] << "] " << e.what() << std::endl;
+    }
+    isFailed = true;
+  }
+  return isFailed;
+}
+
+
+/*!
+ * @brief Read manifest file which lists kernel source files line by line
+ *
+ * Empty lines and lines which start with '#' are ignored.
+ * @param [in] filename  Manifest file name
+ * @return  Kernel source files listed in the manifest
+ */
+static inline std::vector<std::string>
+readManifest(const std::string& filename)
+{
+  std::ifstream ifs(filename.c_str());
+  KOTLIB_THROW_IF(!ifs.is_open(), std::runtime_error, "Failed to read file: " + filename);
+  std::vector<std::string> inputFiles;
+  for (std::string line; std::getline(ifs, line);) {
+    std::string::size_type first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos || line[first] == '#') {
+      continue;
+    }
+    inputFiles.emplace_back(line.substr(first, line.find_last_not_of(" \t\r") - first + 1));
+  }
+  return inputFiles;
+}
+
+
+/*!
+ * @brief Get include directories which are specified with -I in compile options
+ * @param [in] options  Compile options
+ * @return  Include directories
+ */
+static inline std::vector<std::string>
+getIncludeDirectories(const std::string& options)
+{
+  std::istringstream iss(options);
+  std::vector<std::string> includeDirs;
+  for (std::string token; iss >> token;) {
+    if (token == "-I") {
+      if (iss >> token) {
+        includeDirs.emplace_back(token);
+      }
+    } else if (token.compare(0, 2, "-I") == 0) {
+      includeDirs.emplace_back(token.substr(2));
+    }
+  }
+  return includeDirs;
+}
+
+
+/*!
+ * @brief Make relative include directories in compile options absolute
+ *
+ * The other options, and the spacing between them, are kept as they are.
+ * @param [in] options  Compile options
+ * @param [in] dir      Absolute directory which the relative include directories are relative to
+ * @return  Compile options whose include directories are absolute
+ */
+static inline std::string
+makeIncludeDirectoriesAbsolute(const std::string& options, const std::string& dir)
+{
+  static const char* kBlanks = " \t\r\n";
+  std::string result;
+  bool isIncludeArgument = false;
+  for (std::string::size_type first = 0; first < options.size();) {
+    std::string::size_type last = options.find_first_not_of(kBlanks, first);
+    result.append(options, first, last == std::string::npos ? std::string::npos : last - first);
+    if (last == std::string::npos) {
+      break;
+    }
+    first = last;
+    last = options.find_first_of(kBlanks, first);
+    std::string token = options.substr(first, last == std::string::npos ? std::string::npos : last - first);
+    first = last == std::string::npos ? options.size() : last;
+    std::string::size_type pathPos = isIncludeArgument ? 0
+      : token.size() > 2 && token.compare(0, 2, "-I") == 0 ? 2
+      : std::string::npos;
+    if (pathPos != std::string::npos && !isAbsolutePath(token.substr(pathPos))) {
+      token.insert(pathPos, dir + "/");
+    }
+    isIncludeArgument = token == "-I";
+    result += token;
+  }
+  return result;
+}
+
+
+/*!
+ * @brief Escape a file name for Makefile syntax
+ * @param [in] filename  File name
+ * @return  Escaped file name
+ */
+static inline std::string
+escapeMakeFileName(const std::string& filename)
+{
+  std::string escaped;
+  for (auto c : filename) {
+    if (c == ' ' || c == '#') {
+      escaped += '\\';
+    } else if (c == '$') {
+      escaped += '$';
+    }
+    escaped += c;
+  }
+  return escaped;
+}
+
+
+/*!
+ * @brief Write dependency file in Makefile syntax, which make and ninja can include
+ *
+ * An empty rule for each header is also written, like -MP of GCC, so that
+ * make does not fail after a header is removed.
+ * @param [in] filename      Dependency file name
+ * @param [in] targets       Output files
+ * @param [in] dependencies  Kernel source files followed by the included headers
+ * @param [in] nSource       Number of the kernel source files at the top of dependencies
+ */
+static inline void
+writeDependencyFile(
+    const std::string& filename,
+    const std::vector<std::string>& targets,
+    const std::vector<std::string>& dependencies,
+    std::size_t nSource)
+{
+  std::string content;
+  for (const auto& target : targets) {
+    content += (content.empty() ? "" : " ") + escapeMakeFileName(target);
+  }
+  content += ":";
+  for (const auto& dependency : dependencies) {
+    content += " \\\n  " + escapeMakeFileName(dependency);
+  }
+  content += "\n";
+  for (std::remove_reference<decltype(dependencies)>::type::size_type i = nSource; i < dependencies.size(); i++) {
+    content += "\n" + escapeMakeFileName(dependencies[i]) + ":\n";
+  }
+  KOTLIB_THROW_IF(!writeFileAtomically(filename, content.data(), content.size()), std::runtime_error, "Failed to write: " + filename);
+}
+
+
+/*!
+ * @brief Compile kernel sources for all devices of all platforms
+ *
+ * One program is built per platform, and the builds of the platforms run in
+ * parallel on their own threads so that slow vendor compilers overlap.
+ * The binary for the j-th device of the i-th platform is written to
+ * "<outputBase>.<i>.<j>".
+ * @param [in] platformIds    Platform IDs
+ * @param [in] deviceType     Device type to compile for
+ * @param [in] kernelSources  Kernel source codes
+ * @param [in] options        Compile options
+ * @param [in] outputBase     Base of the output file names
+ * @param [in] isSyntaxOnly   Check syntax only, not generate binary
+ * @param [in] cache          Binary cache, or nullptr if disabled
+ * @param [in] contentDigest  Digest of the sources and their headers for the cache keys
+ */
+static inline void
+compileForAllDevices(
+    const std::vector<cl_platform_id>& platformIds,
+    cl_int deviceType,
+    const std::vector<SourceFile>& kernelSources,
+    const std::string& options,
+    const std::string& outputBase,
+    bool isSyntaxOnly,
+    const BinaryCache* cache,
+    const std::string& contentDigest)
+{
+  std::vector<std::exception_ptr> errors(platformIds.size());
+  std::vector<std::thread> threads;
+  threads.reserve(platformIds.size());
+  for (std::remove_reference<decltype(platformIds)>::type::size_type i = 0; i < platformIds.size(); i++) {
+    threads.emplace_back([&, i] {
+      try {
+        cl_uint nDevice;
+        if (clGetDeviceIDs(platformIds[i], deviceType, 0, nullptr, &nDevice) == CL_DEVICE_NOT_FOUND) {
+          return;
+        }
+        std::vector<cl_device_id> deviceIds = getDeviceIds(platformIds[i], kNDefaultDeviceEntry, deviceType, &phaseTimer);
+        std::vector<std::string> filenames;
+        for (decltype(deviceIds)::size_type j = 0; j < deviceIds.size(); j++) {
+          filenames.emplace_back(outputBase + "." + std::to_string(i) + "." + std::to_string(j));
+        }
+        compileProgram(platformIds[i], deviceIds, kernelSources, options, filenames, isSyntaxOnly, false, cache, contentDigest);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::vector<std::string> labels;
+  for (decltype(errors)::size_type i = 0; i < errors.size(); i++) {
+    labels.emplace_back("Platform " + std::to_string(i));
+  }
+  KOTLIB_THROW_IF(reportErrors(errors, labels), std::runtime_error, "Failed to compile for some platforms");
+}
+
+
+/*!
+ * @brief Run tasks on a pool of worker threads
+ *
+ * Each worker picks up the next task until all tasks are done, so that up to
+ * nJob tasks run at the same time.
+ * A failure of one task does not stop the others.
+ * @param [in] nTask  Number of tasks
+ * @param [in] nJob   Number of worker threads
+ * @param [in] task   Task function which takes the task index
+ * @return  Errors thrown by each task, nullptr for succeeded tasks
+ */
+static inline std::vector<std::exception_ptr>
+runWorkers(std::size_t nTask, std::size_t nJob, const std::function<void(std::size_t)>& task)
+{
+  std::atomic<std::size_t> nextIndex(0);
+  std::vector<std::exception_ptr> errors(nTask);
+  auto worker = [&] {
+    for (std::size_t i = nextIndex++; i < nTask; i = nextIndex++) {
+      try {
+        task(i);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  nJob = std::min(nJob, nTask);
+  threads.reserve(nJob);
+  for (std::size_t i = 0; i < nJob; i++) {
+    threads.emplace_back(worker);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return errors;
+}
+
+
+/*!
+ * @brief Get output file names of one program in batch mode
+ * @param [in] inputFile  Kernel source file
+ * @param [in] nDevice    Number of target devices
+ * @param [in] isEmitIl   Write IL of the program instead of binaries
+ * @return  Output file names, "<name>.bin" or "<name>.bin.<i>" for each device, or "<name>.spv"
+ */
+static inline std::vector<std::string>
+getBatchOutputFileNames(const std::string& inputFile, std::size_t nDevice, bool isEmitIl)
+{
+  std::string outputBase = removeSuffix(inputFile) + (isEmitIl ? ".spv" : ".bin");
+  std::size_t nOutput = isEmitIl ? 1 : nDevice;
+  std::vector<std::string> filenames;
+  for (std::size_t i = 0; i < nOutput; i++) {
+    filenames.emplace_back(getOutputFileName(outputBase, i, nOutput));
+  }
+  return filenames;
+}
+
+
+/*!
+ * @brief Write binaries of the programs which are cached, without any OpenCL call
+ *
+ * The target devices are identified with the device inventory, so that a
+ * batch whose programs are all cached never loads the OpenCL drivers.
+ * The dependency files of the cached programs are written as well.
+ * Misses are not recorded, since the build of the remaining programs looks
+ * them up again.
+ * @param [in] cache             Binary cache
+ * @param [in] deviceIdentities  Identities of the target devices from the device inventory
+ * @param [in] inputFiles        Kernel source files
+ * @param [in] index             Source index which has scanned the kernel source files
+ * @param [in] options           Compile options
+ * @param [in] nJob              Number of worker threads
+ * @param [in] isDependency      Write dependency file of each program
+ * @return  Kernel source files whose binaries are not cached
+ */
+static inline std::vector<std::string>
+writeCachedBatch(
+    const BinaryCache& cache,
+    const std::vector<std::string>& deviceIdentities,
+    const std::vector<std::string>& inputFiles,
+    const SourceIndex& index,
+    const std::string& options,
+    std::size_t nJob,
+    bool isDependency)
+{
+  // A program which fails here, such as of a missing file, is reported by the build which follows
+  std::unique_ptr<bool[]> isHits(new bool[inputFiles.size()]());
+  runWorkers(inputFiles.size(), nJob, [&](std::size_t i) {
+    std::vector<std::string> filenames = getBatchOutputFileNames(inputFiles[i], deviceIdentities.size(), false);
+    isHits[i] = writeCachedBinaries(cache, makeCacheKeys(deviceIdentities, index.getDigest({inputFiles[i]}), options), filenames, false);
+    if (isHits[i] && isDependency) {
+      writeDependencyFile(removeSuffix(inputFiles[i]) + ".d", filenames, index.getDependencies({inputFiles[i]}), 1);
+    }
+    if (isHits[i] && diagnosticsWriter.isEnabled()) {
+      BuildDiagnostics diagnostics{CL_SUCCESS, "", {}};
+      diagnostics.addCached(filenames);
+      diagnosticsWriter.add(inputFiles[i], std::move(diagnostics));
+    }
+  });
+
+  std::vector<std::string> missedFiles;
+  for (std::remove_reference<decltype(inputFiles)>::type::size_type i = 0; i < inputFiles.size(); i++) {
+    if (!isHits[i]) {
+      missedFiles.emplace_back(inputFiles[i]);
+    }
+  }
+  return missedFiles;
+}
+
+
+/*!
+ * @brief Compile each kernel source file as an independent program
+ *
+ * All programs share one context for each platform of the target devices,
+ * which is created on the first cache miss unless it is given.
+ * Worker threads keep up to nJob builds in flight, and the binary of
+ * "<name>.cl" is written to "<name>.bin", or "<name>.bin.<i>" for the i-th
+ * device of all targets, or its IL to "<name>.spv".
+ * The dependency file of each program is written to "<name>.d" before its
+ * build if requested.
+ * The dependencies and the cache keys are taken from the source index, so a
+ * program whose binaries are cached is not even read.
+ * A failure of one file does not stop the builds of the others.
+ * @param [in] targets       Target devices of each platform
+ * @param [in] inputFiles    Kernel source files
+ * @param [in] index         Source index which has scanned the kernel source files
+ * @param [in] options       Compile options
+ * @param [in] nJob          Number of builds in flight
+ * @param [in] isSyntaxOnly  Check syntax only, not generate binary
+ * @param [in] isEmitIl      Write IL of each program instead of binaries
+ * @param [in] isDependency  Write dependency file of each program
+ * @param [in] cache         Binary cache, or nullptr if disabled
+ */
+static inline void
+compileBatch(
+    const std::vector<TargetDevices>& targets,
+    const std::vector<std::string>& inputFiles,
+    const SourceIndex& index,
+    const std::string& options,
+    std::size_t nJob,
+    bool isSyntaxOnly,
+    bool isEmitIl,
+    bool isDependency,
+    const BinaryCache* cache)
+{
+  std::vector<std::vector<std::string> > deviceIdentities;
+  std::size_t nDevice = 0;
+  for (const auto& target : targets) {
+    deviceIdentities.emplace_back();
+    if (cache != nullptr && !isSyntaxOnly && !isEmitIl) {
+      deviceIdentities.back() = getDeviceIdentities(target.platformId, target.deviceIds);
+    }
+    nDevice += target.deviceIds.size();
+  }
+
+  // With --diagnostics=json, a build error is recorded as a status instead of an exception,
+  // so that the failures of many programs do not unwind one by one
+  std::unique_ptr<cl_int[]> buildErrors(new cl_int[inputFiles.size()]());
+  std::vector<std::exception_ptr> errors = runWorkers(inputFiles.size(), nJob, [&](std::size_t i) {
+    std::vector<std::string> filenames = getBatchOutputFileNames(inputFiles[i], nDevice, isEmitIl);
+    if (isDependency) {
+      writeDependencyFile(removeSuffix(inputFiles[i]) + ".d", filenames, index.getDependencies({inputFiles[i]}), 1);
+    }
+
+    // Build the program for each platform whose binaries are not cached, reading the source at most once
+    BuildDiagnostics diagnostics{CL_SUCCESS, "", {}};
+    BuildDiagnostics* pDiagnostics = diagnosticsWriter.isEnabled() ? &diagnostics : nullptr;
+    std::vector<SourceFile> kernelSources;
+    auto first = filenames.begin();
+    for (decltype(targets.size()) j = 0; j < targets.size(); j++) {
+      const std::vector<cl_device_id>& deviceIds = targets[j].deviceIds;
+      std::vector<std::string> targetFilenames = isEmitIl ? filenames : std::vector<std::string>(first, first + static_cast<std::ptrdiff_t>(deviceIds.size()));
+      first += isEmitIl ? 0 : static_cast<std::ptrdiff_t>(deviceIds.size());
+
+      std::vector<std::string> cacheKeys;
+      if (cache != nullptr && !isSyntaxOnly && !isEmitIl) {
+        cacheKeys = makeCacheKeys(deviceIdentities[j], index.getDigest({inputFiles[i]}), options);
+        if (writeCachedBinaries(*cache, cacheKeys, targetFilenames)) {
+          diagnostics.addCached(targetFilenames);
+          continue;
+        }
+      }
+
+      if (kernelSources.empty()) {
+        kernelSources.emplace_back(readSource(inputFiles[i]));
+      }
+      buildAndWriteProgram(contextPool.getContext(deviceIds), deviceIds, kernelSources, options, targetFilenames, isSyntaxOnly, isEmitIl, cache, cacheKeys, inputFiles[i], pDiagnostics);
+    }
+    if (pDiagnostics != nullptr) {
+      buildErrors[i] = diagnostics.errCode;
+      diagnosticsWriter.add(inputFiles[i], std::move(diagnostics));
+    }
+  });
+
+  bool isFailed = false;
+  for (std::remove_reference<decltype(inputFiles)>::type::size_type i = 0; i < inputFiles.size(); i++) {
+    if (buildErrors[i] != CL_SUCCESS) {
+      std::cerr << "[" << inputFiles[i] << "] " << getClErrorMessage(buildErrors[i]) << std::endl;
+      isFailed = true;
+    }
+    if (errors[i] != nullptr && diagnosticsWriter.isEnabled()) {
+      try {
+        std::rethrow_exception(errors[i]);
+      } catch (const std::exception& e) {
+        diagnosticsWriter.addFailure(inputFiles[i], e.what());
+      }
+    }
+  }
+  isFailed = reportErrors(errors, inputFiles) || isFailed;
+  KOTLIB_THROW_IF(isFailed, std::runtime_error, "Failed to compile some files");
+}
+
+
+/*!
+ * @brief Build programs, and rebuild them whenever their sources or included headers change
+ *
+ * Only the programs which depend on the changed files are rebuilt.
+ * A build failure, including the build log, is shown right away and does not
+ * stop watching.
+ * This function never returns unless watching fails.
+ * The changed files are rescanned in the source index before each rebuild, so
+ * the build function can take the dependencies and the digests from it.
+ * @param [in]     programFiles  Kernel source files of each program
+ * @param [in]     extraFiles    Files which all programs depend on, such as embedded headers
+ * @param [in,out] index         Source index of the kernel source files
+ * @param [in]     nJob          Number of worker threads to scan the sources
+ * @param [in]     build         Function which builds the programs of the specified indices
+ */
+static inline void
+watchPrograms(
+    const std::vector<std::vector<std::string> >& programFiles,
+    const std::vector<std::string>& extraFiles,
+    SourceIndex& index,
+    std::size_t nJob,
+    const std::function<void(const std::vector<std::size_t>&)>& build)
+{
+  std::unordered_set<std::string> extraFileSet(extraFiles.begin(), extraFiles.end());
+  std::vector<std::unordered_set<std::string> > dependencies(programFiles.size());
+  std::vector<std::size_t> indices;
+  for (std::remove_reference<decltype(programFiles)>::type::size_type i = 0; i < programFiles.size(); i++) {
+    indices.emplace_back(i);
+  }
+
+  FileWatcher watcher;
+  for (;;) {
+    // Rescan the dependencies of the programs to build, which may include new headers
+    std::vector<std::string> filesToScan;
+    for (const auto& i : indices) {
+      filesToScan.insert(filesToScan.end(), programFiles[i].begin(), programFiles[i].end());
+    }
+    index.scan(filesToScan, nJob);
+    for (const auto& i : indices) {
+      std::vector<std::string> files = index.getDependencies(programFiles[i]);
+      dependencies[i] = std::unordered_set<std::string>(files.begin(), files.end());
+    }
+    std::unordered_set<std::string> watchedFiles(extraFileSet);
+    for (const auto& programDependencies : dependencies) {
+      watchedFiles.insert(programDependencies.begin(), programDependencies.end());
+    }
+    watcher.watch(std::vector<std::string>(watchedFiles.begin(), watchedFiles.end()));
+
+    PhaseTimer::Clock::time_point start = PhaseTimer::Clock::now();
+    bool isSucceeded = true;
+    try {
+      build(indices);
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      isSucceeded = false;
+    }
+    // Keep the kernel report up to date, since watch mode is stopped with Ctrl-C
+    if (kernelReportWriter.isEnabled()) {
+      try {
+        kernelReportWriter.write();
+      } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+      }
+    }
+    std::cerr << (isSucceeded ? "Build succeeded" : "Build failed") << " in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(PhaseTimer::Clock::now() - start).count()
+              << " ms, watching " << watchedFiles.size() << " files for changes" << std::endl;
+
+    // Wait for changes of the files which some programs depend on
+    indices.clear();
+    while (indices.empty()) {
+      std::vector<std::string> changedFiles = watcher.wait();
+      index.invalidate(changedFiles);
+      bool isExtraChanged = std::any_of(changedFiles.begin(), changedFiles.end(), [&](const std::string& file) {
+        return extraFileSet.find(file) != extraFileSet.end();
+      });
+      for (decltype(dependencies)::size_type i = 0; i < dependencies.size(); i++) {
+        if (isExtraChanged || std::any_of(changedFiles.begin(), changedFiles.end(), [&](const std::string& file) {
+              return dependencies[i].find(file) != dependencies[i].end();
+            })) {
+          indices.emplace_back(i);
+        }
+      }
+    }
+  }
+}
 
 
-#define OCLC_CHECK_ERROR(errCode) \
-  KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, std::string("[OpenCL] [") + std::to_string(errCode) + "] " + kErrorMessageMap.at(errCode))
+/*!
+ * @brief Specification of the build option autotuner
+ */
+struct TuneSpec
+{
+  //! Alternative option sets, one of which is used for each variant
+  std::vector<std::string> optionSets;
+  //! Macro names and their candidate values, all combinations of which are tried
+  std::vector<std::pair<std::string, std::vector<std::string> > > defines;
+  //! Arguments of the benchmark command which specify the kernel and its work sizes
+  std::string benchArgs;
+};
+
+
+/*!
+ * @brief Read specification file of the autotuner
+ *
+ * Each line is one of the following directives.
+ * Empty lines and lines which start with '#' are ignored.
+ * - option <OPTIONS>: Alternative option set
+ * - define <NAME> <VALUE>...: Candidate values of macro NAME
+ * - bench <ARGS>: Arguments of the benchmark command
+ * @param [in] filename  Specification file name
+ * @return  Specification of the autotuner
+ */
+static inline TuneSpec
+readTuneSpec(const std::string& filename)
+{
+  std::ifstream ifs(filename.c_str());
+  KOTLIB_THROW_IF(!ifs.is_open(), std::runtime_error, "Failed to read file: " + filename);
+  TuneSpec spec{{}, {}, ""};
+  for (std::string line; std::getline(ifs, line);) {
+    std::istringstream iss(line);
+    std::string directive;
+    if (!(iss >> directive) || directive[0] == '#') {
+      continue;
+    }
+    std::string rest;
+    std::getline(iss >> std::ws, rest);
+    rest = rest.substr(0, rest.find_last_not_of(" \t\r") + 1);
+    if (directive == "option") {
+      spec.optionSets.emplace_back(rest);
+    } else if (directive == "define") {
+      std::istringstream defineIss(rest);
+      std::string name;
+      KOTLIB_THROW_IF(!(defineIss >> name), std::runtime_error, "Macro name is missing: " + line);
+      std::vector<std::string> values;
+      for (std::string value; defineIss >> value;) {
+        values.emplace_back(value);
+      }
+      KOTLIB_THROW_IF(values.empty(), std::runtime_error, "Macro values are missing: " + line);
+      spec.defines.emplace_back(name, values);
+    } else if (directive == "bench") {
+      spec.benchArgs = rest;
+    } else {
+      KOTLIB_THROW_IF(true, std::runtime_error, "Unknown directive in " + filename + ": " + directive);
+    }
+  }
+  if (spec.optionSets.empty()) {
+    spec.optionSets.emplace_back("");
+  }
+  return spec;
+}
+
+
+/*!
+ * @brief Make all combinations of macro values
+ * @param [in] defines  Macro names and their candidate values
+ * @return  Comma-separated NAME=VALUE pairs of each combination, where the first macro varies fastest
+ */
+static inline std::vector<std::string>
+makeDefineCombinations(const std::vector<std::pair<std::string, std::vector<std::string> > >& defines)
+{
+  std::vector<std::string> combinations;
+  // Enumerate all combinations of macro values like an odometer
+  std::vector<std::size_t> indices(defines.size(), 0);
+  for (bool isDone = false; !isDone;) {
+    std::string combination;
+    for (decltype(indices)::size_type i = 0; i < indices.size(); i++) {
+      combination += (i == 0 ? "" : ",") + defines[i].first + "=" + defines[i].second[indices[i]];
+    }
+    combinations.emplace_back(combination);
+    isDone = true;
+    for (decltype(indices)::size_type i = 0; i < indices.size() && isDone; i++) {
+      indices[i] = (indices[i] + 1) % defines[i].second.size();
+      isDone = indices[i] == 0;
+    }
+  }
+  return combinations;
+}
+
+
+/*!
+ * @brief Make compile options of all variants of the autotuner
+ * @param [in] spec     Specification of the autotuner
+ * @param [in] options  Compile options which are common to all variants
+ * @return  Compile options of each variant
+ */
+static inline std::vector<std::string>
+makeTuneVariants(const TuneSpec& spec, const std::string& options)
+{
+  std::vector<std::string> variants;
+  std::vector<std::string> combinations = makeDefineCombinations(spec.defines);
+  for (const auto& optionSet : spec.optionSets) {
+    for (const auto& combination : combinations) {
+      std::string variant = options;
+      if (!optionSet.empty()) {
+        variant += (variant.empty() ? "" : " ") + optionSet;
+      }
+      std::string defineOptions = makeVariantOptions(combination);
+      variant += variant.empty() && !defineOptions.empty() ? defineOptions.substr(1) : defineOptions;
+      variants.emplace_back(variant);
+    }
+  }
+  return variants;
+}
+
 
-#define OCLC_CHECK_ERROR_WITH_MSG(errCode, msg) \
-  KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, std::string("[OpenCL] [") + std::to_string(errCode) + "] " + kErrorMessageMap.at(errCode) + "\n" + msg)
+/*!
+ * @brief Parse the macros to specialize the program with
+ * @param [in] spec  Semicolon-separated NAME=VALUE,VALUE,... lists, such as "VEC=1,2,4;TILE=8,16"
+ * @return  Variant names, which are all combinations of the values
+ */
+static inline std::vector<std::string>
+parseSpecializations(const std::string& spec)
+{
+  std::vector<std::pair<std::string, std::vector<std::string> > > defines;
+  for (const auto& define : splitString(spec, ';')) {
+    std::string::size_type pos = define.find('=');
+    KOTLIB_THROW_IF(pos == std::string::npos || pos == 0, std::runtime_error, "Invalid specialization: " + define);
+    std::vector<std::string> values = splitString(define.substr(pos + 1), ',');
+    KOTLIB_THROW_IF(values.empty(), std::runtime_error, "No value of specialization: " + define);
+    defines.emplace_back(define.substr(0, pos), std::move(values));
+  }
+  KOTLIB_THROW_IF(defines.empty(), std::runtime_error, "No macro to specialize: " + spec);
+  return makeDefineCombinations(defines);
+}
 
 
 /*!
- * @brief Get platform IDs
- * @param [in] nPlatformEntry  Max number of platform IDs to get
- * @return  std::vector which contains obtained platform IDs
+ * @brief Quote specified string for the shell
+ * @param [in] str  String to quote
+ * @return  Quoted string
  */
-static inline std::vector<cl_platform_id>
-getPlatformIds(cl_uint nPlatformEntry = kNDefaultPlatformEntry)
+static inline std::string
+quoteShellArgument(const std::string& str)
 {
-  std::vector<cl_platform_id> platformIds(nPlatformEntry);
-  cl_uint nPlatform;
-  cl_int errCode = clGetPlatformIDs(nPlatformEntry, platformIds.data(), &nPlatform);
-  OCLC_CHECK_ERROR(errCode);
-  platformIds.resize(nPlatform);
-  return platformIds;
+#ifdef _WIN32
+  return "\"" + str + "\"";
+#else
+  std::string quoted = "'";
+  for (const auto& c : str) {
+    quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+  }
+  return quoted + "'";
+#endif  // _WIN32
 }
 
 
 /*!
- * @brief  Get device IDs
- * @param [in] platformId    One platform ID
- * @param [in] nDeviceEntry  Max number of device IDs to get
- * @param [in] deviceType    Device type which means CPU, GPU, or both.
- * @return  std::vector which contains obtained device IDs
+ * @brief Run the benchmark command for specified kernel binary
+ * @param [in] command  Command line without the kernel binary file name
+ * @param [in] binFile  Kernel binary file name
+ * @return  Median kernel time in microseconds which the benchmark command reported
  */
-static inline std::vector<cl_device_id>
-getDeviceIds(const cl_platform_id& platformId, cl_uint nDeviceEntry = kNDefaultDeviceEntry, cl_int deviceType = CL_DEVICE_TYPE_DEFAULT)
+static inline double
+runBenchmark(const std::string& command, const std::string& binFile)
 {
-  std::vector<cl_device_id> deviceIds(nDeviceEntry);
-  cl_uint nDevice;
-  cl_int errCode = clGetDeviceIDs(platformId, deviceType, nDeviceEntry, deviceIds.data(), &nDevice);
-  OCLC_CHECK_ERROR(errCode);
-  deviceIds.resize(nDevice);
-  return deviceIds;
+  PhaseTimer::Scope scope = phaseTimer.measure("Benchmark");
+  std::string commandLine = command + " " + quoteShellArgument(binFile);
+#ifdef _WIN32
+  std::unique_ptr<std::FILE, decltype(&::_pclose)> pipe(::_popen(commandLine.c_str(), "r"), ::_pclose);
+#else
+  std::unique_ptr<std::FILE, decltype(&::pclose)> pipe(::popen(commandLine.c_str(), "r"), ::pclose);
+#endif  // _WIN32
+  KOTLIB_THROW_IF(pipe == nullptr, std::runtime_error, "Failed to run: " + commandLine);
+
+  static const std::string kMedianLabel = "Median: ";
+  double median = -1.0;
+  std::array<char, 256> buf;
+  while (std::fgets(buf.data(), static_cast<int>(buf.size()), pipe.get()) != nullptr) {
+    std::string line(buf.data());
+    if (line.compare(0, kMedianLabel.length(), kMedianLabel) == 0) {
+      median = std::strtod(line.c_str() + kMedianLabel.length(), nullptr);
+    }
+  }
+  KOTLIB_THROW_IF(median < 0.0, std::runtime_error, "Benchmark failed: " + commandLine);
+  return median;
 }
 
 
 /*!
- * @brief Read specified file as a text file and return std::string of the file
- * @param [in] filename  File name to read
- * @return  std::string which contains the specified file content
+ * @brief Compile variants of build options of one program in parallel
+ *
+ * All variants share one context, which is created on the first cache miss.
+ * @param [in] platformId        Platform ID of the devices
+ * @param [in] deviceIds         Target device IDs
+ * @param [in] kernelSources     Kernel source codes
+ * @param [in] variants          Compile options of each variant
+ * @param [in] variantFilenames  Output file names for each device of each variant
+ * @param [in] nJob              Number of builds in flight
+ * @param [in] cache             Binary cache, or nullptr if disabled
+ * @param [in] contentDigest     Digest of the sources and their headers for the cache keys
+ * @return  Errors of each variant, which are nullptr for the succeeded variants
  */
-static inline std::string
-readSource(const std::string& filename)
+static inline std::vector<std::exception_ptr>
+compileVariants(
+    cl_platform_id platformId,
+    const std::vector<cl_device_id>& deviceIds,
+    const std::vector<SourceFile>& kernelSources,
+    const std::vector<std::string>& variants,
+    const std::vector<std::vector<std::string> >& variantFilenames,
+    std::size_t nJob,
+    const BinaryCache* cache,
+    const std::string& contentDigest)
 {
-  std::ifstream ifs(filename.c_str());
-  KOTLIB_THROW_IF(!ifs.is_open(), std::runtime_error, "Failed to read file: " + filename);
-  return std::string((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+  std::vector<std::string> deviceIdentities;
+  if (cache != nullptr) {
+    deviceIdentities = getDeviceIdentities(platformId, deviceIds);
+  }
+  return runWorkers(variants.size(), nJob, [&](std::size_t i) {
+    std::vector<std::string> cacheKeys;
+    if (cache != nullptr) {
+      cacheKeys = makeCacheKeys(deviceIdentities, contentDigest, variants[i]);
+      if (writeCachedBinaries(*cache, cacheKeys, variantFilenames[i])) {
+        return;
+      }
+    }
+    buildAndWriteProgram(contextPool.getContext(deviceIds), deviceIds, kernelSources, variants[i], variantFilenames[i], false, false, cache, cacheKeys, "variant \"" + variants[i] + "\"");
+  });
 }
 
 
 /*!
- * @brief Read specified files and return std::vector of std::string of the file
- * @param [in] filenames  Vector of file names to read
- * @return  std::vector which contains std::string of the files
+ * @brief Compile all variants of build options, benchmark them, and write the
+ *        fastest binary for each device
+ *
+ * Variants are compiled in parallel on the batch worker pool, and benchmarked
+ * one by one so that they do not disturb each other.
+ * The benchmark command is run as "<benchCommand> <benchArgs> -p <PLATFORM_INDEX>
+ * -d <DEVICE_INDEX> -t <DEVICE_TYPE> <BINARY>" and must print "Median: <TIME>".
+ * @param [in]     platformId      Platform ID of the devices
+ * @param [in]     deviceIds       Target device IDs
+ * @param [in]     kernelSources   Kernel source codes
+ * @param [in]     options         Compile options which are common to all variants
+ * @param [in]     spec            Specification of the autotuner
+ * @param [in]     benchCommand    Benchmark command
+ * @param [in]     platformIndex   Platform index to pass to the benchmark command
+ * @param [in]     deviceIndex     Index of the first target device to pass to the benchmark command
+ * @param [in]     deviceType      Device type name to pass to the benchmark command
+ * @param [in]     filenames       Output file names for each device
+ * @param [in]     nJob            Number of builds in flight
+ * @param [in]     cache           Binary cache, or nullptr if disabled
+ * @param [in]     contentDigest   Digest of the sources and their headers for the cache keys
+ * @param [in,out] os              Output stream of the report
  */
-static inline std::vector<std::string>
-readSource(const std::vector<std::string>& filenames)
+static inline void
+tuneProgram(
+    cl_platform_id platformId,
+    const std::vector<cl_device_id>& deviceIds,
+    const std::vector<SourceFile>& kernelSources,
+    const std::string& options,
+    const TuneSpec& spec,
+    const std::string& benchCommand,
+    std::size_t platformIndex,
+    std::size_t deviceIndex,
+    const std::string& deviceType,
+    const std::vector<std::string>& filenames,
+    std::size_t nJob,
+    const BinaryCache* cache,
+    const std::string& contentDigest,
+    std::ostream& os)
 {
-  std::vector<std::string> srcs(filenames.size());
-  for (decltype(srcs)::size_type i = 0; i < srcs.size(); i++) {
-    srcs[i] = readSource(filenames[i]);
+  std::vector<std::string> variants = makeTuneVariants(spec, options);
+  std::vector<std::vector<std::string> > variantFilenames(variants.size());
+  for (decltype(variants)::size_type i = 0; i < variants.size(); i++) {
+    for (std::remove_reference<decltype(filenames)>::type::size_type j = 0; j < filenames.size(); j++) {
+      variantFilenames[i].emplace_back(makeTemporaryPath(filenames[j]));
+      kernelReportWriter.setAlias(variantFilenames[i].back(), filenames[j], variants[i]);
+    }
+  }
+
+  // Compile all variants
+  std::vector<std::exception_ptr> errors = compileVariants(platformId, deviceIds, kernelSources, variants, variantFilenames, nJob, cache, contentDigest);
+  std::vector<std::string> labels;
+  for (const auto& variant : variants) {
+    labels.emplace_back("Variant: " + variant);
+  }
+  reportErrors(errors, labels);
+
+  // Benchmark the variants for each device one by one
+  std::vector<std::vector<double> > medians(variants.size(), std::vector<double>(filenames.size(), -1.0));
+  for (decltype(variants)::size_type i = 0; i < variants.size(); i++) {
+    if (errors[i] != nullptr) {
+      continue;
+    }
+    for (std::remove_reference<decltype(filenames)>::type::size_type j = 0; j < filenames.size(); j++) {
+      std::string command = benchCommand + " " + spec.benchArgs
+        + " -p " + std::to_string(platformIndex)
+        + " -d " + std::to_string(deviceIndex + j)
+        + " -t " + deviceType;
+      try {
+        medians[i][j] = runBenchmark(command, variantFilenames[i][j]);
+      } catch (const std::exception& e) {
+        std::cerr << "[Variant: " << variants[i] << "] " << e.what() << std::endl;
+      }
+    }
+  }
+
+  // Keep the fastest variant for each device
+  std::vector<std::size_t> bestIndices(filenames.size(), variants.size());
+  for (std::remove_reference<decltype(filenames)>::type::size_type j = 0; j < filenames.size(); j++) {
+    for (decltype(variants)::size_type i = 0; i < variants.size(); i++) {
+      if (medians[i][j] >= 0.0 && (bestIndices[j] == variants.size() || medians[i][j] < medians[bestIndices[j]][j])) {
+        bestIndices[j] = i;
+      }
+    }
+    if (bestIndices[j] != variants.size() && !replaceFile(variantFilenames[bestIndices[j]][j], filenames[j])) {
+      std::cerr << "Failed to write: " << filenames[j] << std::endl;
+    }
+  }
+  for (const auto& names : variantFilenames) {
+    for (const auto& name : names) {
+      std::remove(name.c_str());
+    }
+  }
+
+  // Show report
+  std::ios::fmtflags flags = os.flags();
+  std::streamsize precision = os.precision();
+  os << "================================== Tune Report =================================\n";
+  for (decltype(variants)::size_type i = 0; i < variants.size(); i++) {
+    os << "Variant " << i << ": " << (variants[i].empty() ? "(no option)" : variants[i]) << "\n";
+    for (std::remove_reference<decltype(filenames)>::type::size_type j = 0; j < filenames.size(); j++) {
+      os << "  Device " << j << ": ";
+      if (medians[i][j] < 0.0) {
+        os << "failed";
+      } else {
+        os << std::fixed << std::setprecision(3) << medians[i][j] << " us" << (bestIndices[j] == i ? " (best)" : "");
+      }
+      os << "\n";
+    }
+  }
+  os << "================================================================================" << std::endl;
+  os.flags(flags);
+  os.precision(precision);
+
+  for (std::remove_reference<decltype(filenames)>::type::size_type j = 0; j < filenames.size(); j++) {
+    KOTLIB_THROW_IF(bestIndices[j] == variants.size(), std::runtime_error, "No variant succeeded for device " + std::to_string(j));
   }
-  return srcs;
 }
 
 
 /*!
- * @brief Remove suffix of specified file name
- * @param [in] filename  FIle name which you want to remove suffix
- * @return  File name which removed suffix
+ * @brief Bundle binaries for each device into one fat binary file
+ *
+ * The binary files for each device are removed after bundling.
+ * With EmitFormat::kCArray or EmitFormat::kObject, the fat binary image is
+ * streamed into a C++ header or a linkable object, so that the binaries are
+ * mapped in with the executable.
+ * @param [in] deviceIds       Target device IDs
+ * @param [in] partFilenames   Binary files for each device of each variant
+ * @param [in] options         Build options of the binaries, to which the macros of each variant are added
+ * @param [in] variants        Variant names, or one empty name if not specialized
+ * @param [in] embeddedSource  Kernel source to embed for rebuilding stale binaries, or empty not to embed
+ * @param [in] format          Output format
+ * @param [in] symbol          Base name of the symbols for EmitFormat::kCArray and EmitFormat::kObject
+ * @param [in] filename        Output file name of the fat binary
  */
-static inline std::string
-removeSuffix(const std::string& filename) noexcept
+static inline void
+bundleBinaries(
+    const std::vector<cl_device_id>& deviceIds,
+    const std::vector<std::string>& partFilenames,
+    const std::string& options,
+    const std::vector<std::string>& variants,
+    const std::string& embeddedSource,
+    EmitFormat format,
+    const std::string& symbol,
+    const std::string& filename)
 {
-  return filename.substr(0, filename.find_last_of("."));
+  std::vector<SourceFile> parts = readSource(partFilenames);
+  std::vector<FatBinaryEntry> entries;
+  for (std::remove_reference<decltype(variants)>::type::size_type i = 0; i < variants.size(); i++) {
+    for (std::remove_reference<decltype(deviceIds)>::type::size_type j = 0; j < deviceIds.size(); j++) {
+      const SourceFile& part = parts[i * deviceIds.size() + j];
+      entries.push_back(FatBinaryEntry{
+          getDeviceInfoString(deviceIds[j], CL_DEVICE_NAME),
+          getDeviceInfoString(deviceIds[j], CL_DRIVER_VERSION),
+          options + makeVariantOptions(variants[i]),
+          variants[i],
+          part.data(),
+          part.size()});
+    }
+  }
+  if (!embeddedSource.empty()) {
+    entries.push_back(FatBinaryEntry{"", "", options, "", embeddedSource.data(), embeddedSource.size()});
+  }
+  switch (format) {
+    case EmitFormat::kBinary:
+      {
+        std::string image = makeFatBinary(entries);
+        writeBinary(filename, image.data(), image.size());
+      }
+      break;
+    case EmitFormat::kCArray:
+      {
+        PhaseTimer::Scope scope = phaseTimer.measure("File write");
+        writeEmbeddedCArray(filename, symbol, entries);
+      }
+      break;
+    case EmitFormat::kObject:
+      {
+        PhaseTimer::Scope scope = phaseTimer.measure("File write");
+        writeEmbeddedObject(filename, symbol, entries);
+      }
+      break;
+  }
+  parts.clear();
+  for (const auto& partFilename : partFilenames) {
+    std::remove(partFilename.c_str());
+  }
 }
 
 
 /*!
- * @brief Show specified platform information
- * @param [in] platformId  Platform ID
+ * @brief Load binaries of kernel sources from binary cache, or build them, and
+ *        append them to a compile response
+ * @param [in]     platformId     Platform ID of the devices
+ * @param [in]     context        Context which contains the target devices
+ * @param [in]     deviceIds      Target device IDs
+ * @param [in]     kernelSources  Kernel source codes
+ * @param [in]     options        Compile options
+ * @param [in]     isSyntaxOnly   Check syntax only, not generate binary
+ * @param [in]     cache          Binary cache, or nullptr if disabled
+ * @param [in]     sourceDir      Directory of quoted headers of the sources with a trailing separator, or empty for the current directory
+ * @param [in]     name           Name of the program which is shown in the build logs, or empty
+ * @param [in,out] response       Response which the binaries for each device are appended to
  */
 static inline void
-showPlatformInfo(cl_platform_id platformId)
+appendResponseBinaries(
+    cl_platform_id platformId,
+    cl_context context,
+    const std::vector<cl_device_id>& deviceIds,
+    const std::vector<SourceFile>& kernelSources,
+    const std::string& options,
+    bool isSyntaxOnly,
+    const BinaryCache* cache,
+    const std::string& sourceDir,
+    const std::string& name,
+    CompileResponse& response)
 {
-  std::array<char, 1024> info;
-  std::size_t size;
+  std::vector<std::string> cacheKeys;
+  if (cache != nullptr && !isSyntaxOnly) {
+    // The sources come without file names, so their headers are scanned for each request
+    std::string contentDigest;
+    {
+      PhaseTimer::Scope scope = phaseTimer.measure("Source scan");
+      contentDigest = SourceIndex(getIncludeDirectories(options)).getContentDigest(kernelSources, sourceDir, 1);
+    }
+    cacheKeys = makeCacheKeys(getDeviceIdentities(platformId, deviceIds), contentDigest, options);
+    std::vector<std::vector<char> > cachedBins;
+    if (loadCachedBinaries(*cache, cacheKeys, cachedBins)) {
+      response.binaries.insert(response.binaries.end(), std::make_move_iterator(cachedBins.begin()), std::make_move_iterator(cachedBins.end()));
+      return;
+    }
+  }
+  ProgramHandle program = buildProgramFromSource(context, deviceIds, kernelSources, options, name);
+  if (isSyntaxOnly) {
+    return;
+  }
+  ProgramBinaries bins = getProgramBinaries(program.get(), deviceIds);
+  if (cache != nullptr) {
+    storeCachedBinaries(*cache, cacheKeys, bins);
+  }
+  for (decltype(bins.data)::size_type i = 0; i < bins.data.size(); i++) {
+    response.binaries.emplace_back(bins.data[i], bins.data[i] + bins.sizes[i]);
+  }
+}
 
-  cl_int errCode = clGetPlatformInfo(platformId, CL_PLATFORM_NAME, info.size(), info.data(), &size);
-  OCLC_CHECK_ERROR(errCode);
-  std::cout << "  CL_PLATFORM_NAME: " << info.data() << std::endl;
 
-  errCode = clGetPlatformInfo(platformId, CL_PLATFORM_VERSION, info.size(), info.data(), &size);
-  OCLC_CHECK_ERROR(errCode);
-  std::cout << "  CL_PLATFORM_VERSION: " << info.data() << std::endl;
+/*!
+ * @brief Handle one compile request on the server
+ * @param [in] sock               Connected socket
+ * @param [in] platformIds        Platform IDs
+ * @param [in] platformDeviceIds  All devices of each platform, whose contexts are warm, empty for platforms without devices
+ * @param [in] cache              Binary cache, or nullptr if disabled
+ */
+static inline void
+handleCompileRequest(
+    const UnixSocket& sock,
+    const std::vector<cl_platform_id>& platformIds,
+    const std::vector<std::vector<cl_device_id> >& platformDeviceIds,
+    const BinaryCache* cache)
+{
+  CompileResponse response{false, "", {}};
+  try {
+    CompileRequest request = CompileRequest::recv(sock);
+    KOTLIB_THROW_IF(request.platformIndex >= platformIds.size() || platformDeviceIds[request.platformIndex].empty(),
+        std::out_of_range, "Invalid platform index: " + std::to_string(request.platformIndex));
+    cl_platform_id platformId = platformIds[request.platformIndex];
+    std::vector<cl_device_id> deviceIds = selectTargetDevices(
+        getDeviceIds(platformId, kNDefaultDeviceEntry, static_cast<cl_int>(request.deviceType), &phaseTimer),
+        request.deviceIndex);
+    // Resolve relative paths against the client's directory, which is searched first for quoted headers as in a local build
+    std::string options = request.options;
+    std::string sourceDir;
+    if (!request.workingDirectory.empty()) {
+      options = "-I" + request.workingDirectory + " " + makeIncludeDirectoriesAbsolute(request.options, request.workingDirectory);
+      sourceDir = request.workingDirectory + "/";
+    }
+    appendResponseBinaries(platformId, contextPool.getContext(platformDeviceIds[request.platformIndex]), deviceIds,
+        request.sources, options, request.isSyntaxOnly, cache, sourceDir, "", response);
+    response.isSucceeded = true;
+  } catch (const std::exception& e) {
+    response.isSucceeded = false;
+    response.message = e.what();
+    response.binaries.clear();
+  }
+  try {
+    response.send(sock);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+  }
 }
 
 
 /*!
- * @brief Show specified device information
- * @param [in] deviceId  Device ID
+ * @brief State of the compile server which is shared with the connection threads
+ *
+ * The connection threads are detached, so they hold this state through a
+ * std::shared_ptr instead of referring to the stack of serve().
+ */
+struct ServerState
+{
+  /*!
+   * @brief Initialize with no platforms and no connections
+   */
+  ServerState() :
+    platformIds(),
+    platformDeviceIds(),
+    mtx(),
+    cv(),
+    nConnection(0)
+  {}
+
+  //! Platform IDs
+  std::vector<cl_platform_id> platformIds;
+  //! Device IDs of each platform
+  std::vector<std::vector<cl_device_id> > platformDeviceIds;
+  //! Mutex for nConnection
+  std::mutex mtx;
+  //! Condition variable which is notified when a connection is closed
+  std::condition_variable cv;
+  //! Number of connections being handled
+  std::size_t nConnection;
+};
+
+
+/*!
+ * @brief Run compile server which keeps contexts for all devices warm
+ *
+ * One context which contains all devices is created for each platform, and
+ * every accepted connection is handled on its own thread.
+ * At most kMaxServerConnections connections are handled at once; further
+ * clients wait in the listen backlog.
+ * This function never returns unless an error occurs.
+ * @param [in] socketPath  Path of the Unix domain socket to listen on
+ * @param [in] cache       Binary cache, or nullptr if disabled
  */
 static inline void
-showDeviceInfo(cl_device_id deviceId)
+serve(const std::string& socketPath, const BinaryCache* cache)
 {
-  std::array<char, 1024> info;
-  std::size_t size;
+  std::shared_ptr<ServerState> state = std::make_shared<ServerState>();
+  state->platformIds = getPlatformIds(kNDefaultPlatformEntry, &phaseTimer);
+  state->platformDeviceIds.resize(state->platformIds.size());
+  for (decltype(state->platformIds)::size_type i = 0; i < state->platformIds.size(); i++) {
+    cl_uint nDevice;
+    if (clGetDeviceIDs(state->platformIds[i], CL_DEVICE_TYPE_ALL, 0, nullptr, &nDevice) == CL_DEVICE_NOT_FOUND) {
+      continue;
+    }
+    state->platformDeviceIds[i] = getDeviceIds(state->platformIds[i], kNDefaultDeviceEntry, static_cast<cl_int>(CL_DEVICE_TYPE_ALL), &phaseTimer);
+    contextPool.getContext(state->platformDeviceIds[i]);
+  }
 
-  cl_int errCode = clGetDeviceInfo(deviceId, CL_DEVICE_NAME, info.size(), info.data(), &size);
-  OCLC_CHECK_ERROR(errCode);
-  std::cout << "    CL_DEVICE_NAME: " << info.data() << std::endl;
+  UnixSocket server = UnixSocket::listen(socketPath);
+  std::cerr << "Listening on " << socketPath << std::endl;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(state->mtx);
+      state->cv.wait(lock, [&state] {
+        return state->nConnection < kMaxServerConnections;
+      });
+    }
+    UnixSocket sock = server.accept();
+    {
+      std::lock_guard<std::mutex> lock(state->mtx);
+      state->nConnection++;
+    }
+    std::thread([state, cache](UnixSocket&& sock) {
+      handleCompileRequest(sock, state->platformIds, state->platformDeviceIds, cache);
+      std::lock_guard<std::mutex> lock(state->mtx);
+      state->nConnection--;
+      state->cv.notify_one();
+    }, std::move(sock)).detach();
+  }
+}
 
-  errCode = clGetDeviceInfo(deviceId, CL_DEVICE_VERSION, info.size(), info.data(), &size);
-  OCLC_CHECK_ERROR(errCode);
-  std::cout << "    CL_DEVICE_VERSION: " << info.data() << std::endl;
+
+/*!
+ * @brief Compile kernel sources on the compile server and write the binaries
+ * @param [in] sock        Socket connected to the server
+ * @param [in] request     Compile request
+ * @param [in] outputBase  Output file name for a single device, or "-" for standard output
+ */
+static inline void
+compileOnServer(const UnixSocket& sock, const CompileRequest& request, const std::string& outputBase)
+{
+  CompileResponse response{false, "", {}};
+  {
+    PhaseTimer::Scope scope = phaseTimer.measure("Server request");
+    request.send(sock);
+    response = CompileResponse::recv(sock);
+  }
+  KOTLIB_THROW_IF(!response.isSucceeded, std::runtime_error, response.message);
+  // The number of target devices is known only from the response
+  KOTLIB_THROW_IF(outputBase == kStdioFileName && response.binaries.size() > 1, std::runtime_error,
+      "Standard output can take only one binary; select one device or use --bundle");
+  for (decltype(response.binaries)::size_type i = 0; i < response.binaries.size(); i++) {
+    if (!response.binaries[i].empty()) {
+      writeBinary(getOutputFileName(outputBase, i, response.binaries.size()), response.binaries[i].data(), response.binaries[i].size());
+    }
+  }
 }
 
 
 /*!
- * @brief Show all information of platform and device information
- * @param [in] platformIds  Platform IDs
- * @param [in] deviceType   Device type which you want to know the information
+ * @brief Build programs whose sources are framed on stdin, and write the
+ *        framed responses to stdout in the same order
+ *
+ * Each input frame is the source of one program prefixed with its 64-bit
+ * little-endian length, and each output frame is a CompileResponse with the
+ * binaries for all target devices, or the error message.
+ * Up to nJob programs are built at a time in the pooled contexts, and each
+ * response is written as soon as it and all earlier ones are ready, so that a
+ * generator which waits for every response before sending the next program
+ * works as well as one which sends them all.
+ * @param [in] targets       Target devices on each platform
+ * @param [in] options       Compile options
+ * @param [in] nJob          Max number of builds in flight
+ * @param [in] isSyntaxOnly  Check syntax only, not generate binary
+ * @param [in] cache         Binary cache, or nullptr if disabled
  */
 static inline void
-showInfo(const std::vector<cl_platform_id>& platformIds, cl_int deviceType = CL_DEVICE_TYPE_DEFAULT)
+streamPrograms(const std::vector<TargetDevices>& targets, const std::string& options, std::size_t nJob, bool isSyntaxOnly, const BinaryCache* cache)
 {
-  static constexpr int MAX_DEVICE_IDS = 8;
+  for (const auto& target : targets) {
+    contextPool.getContext(target.deviceIds);
+  }
+  PipeChannel channel = PipeChannel::getStandardStreams();
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::deque<std::future<CompileResponse> > responses;
+  bool isEnd = false;
 
-  std::cout << "============================= Platform Information =============================";
-  for (std::remove_reference<decltype(platformIds)>::type::size_type i = 0; i < platformIds.size(); i++) {
-    std::cout << "\nPlatform: " << i << std::endl;
-    showPlatformInfo(platformIds[i]);
+  // Write the responses in order; after a write error, the rest are drained without writing
+  std::exception_ptr writeError;
+  std::thread writer([&] {
+    for (;;) {
+      std::future<CompileResponse> response;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&responses, &isEnd] {
+          return !responses.empty() || isEnd;
+        });
+        if (responses.empty()) {
+          return;
+        }
+        response = std::move(responses.front());
+      }
+      try {
+        CompileResponse r = response.get();
+        if (writeError == nullptr) {
+          r.send(channel);
+        }
+      } catch (...) {
+        writeError = std::current_exception();
+      }
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        responses.pop_front();
+      }
+      cv.notify_all();
+    }
+  });
 
-    std::vector<cl_device_id> deviceIds = getDeviceIds(platformIds[i], MAX_DEVICE_IDS, deviceType);
-    for (decltype(deviceIds)::size_type j = 0; j < deviceIds.size(); j++) {
-      std::cout << "  Device: " << j << std::endl;
-      showDeviceInfo(deviceIds[j]);
+  std::exception_ptr readError;
+  try {
+    for (std::size_t i = 0; channel.hasMore(); i++) {
+      std::vector<SourceFile> kernelSources;
+      kernelSources.emplace_back(channel.recvBlob<std::string>());
+      std::unique_lock<std::mutex> lock(mtx);
+      cv.wait(lock, [&responses, nJob] {
+        return responses.size() < nJob;
+      });
+      responses.emplace_back(std::async(std::launch::async, [&targets, &options, isSyntaxOnly, cache, i](const std::vector<SourceFile>& sources) {
+        CompileResponse response{false, "", {}};
+        try {
+          for (const auto& target : targets) {
+            appendResponseBinaries(target.platformId, contextPool.getContext(target.deviceIds), target.deviceIds,
+                sources, options, isSyntaxOnly, cache, "", "program " + std::to_string(i), response);
+          }
+          response.isSucceeded = true;
+        } catch (const std::exception& e) {
+          response.message = e.what();
+          response.binaries.clear();
+        }
+        return response;
+      }, std::move(kernelSources)));
+      cv.notify_all();
     }
+  } catch (...) {
+    readError = std::current_exception();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    isEnd = true;
+  }
+  cv.notify_all();
+  writer.join();
+  if (readError != nullptr) {
+    std::rethrow_exception(readError);
+  }
+  if (writeError != nullptr) {
+    std::rethrow_exception(writeError);
   }
-  std::cout << "================================================================================" << std::endl;
 }
 
 
@@ -189,8 +2806,14 @@ main(int argc, char* argv[])
 {
   try {
     kot::OptionParser op(argv[0]);
-    op.setOption("all", 'a', kot::OptionParser::NO_ARGUMENT, false, "Compile kernel program for all detected devices");
+    op.setOption("all", 'a', kot::OptionParser::NO_ARGUMENT, false,
+        "Compile kernel program for all detected devices\n"
+        "      Binaries are written to <FILE_NAME>.<PLATFORM_INDEX>.<DEVICE_INDEX>");
     op.setOption("list", 'l', kot::OptionParser::NO_ARGUMENT, false, "List up all platforms and devices");
+    op.setOption("inventory", kot::OptionParser::REQUIRED_ARGUMENT, "",
+        "Specify device inventory file, which caches platforms and devices until the drivers change\n"
+        "      Defaults to $XDG_CACHE_HOME/oclc/devices or ~/.cache/oclc/devices", "FILE_NAME");
+    op.setOption("refresh-inventory", kot::OptionParser::NO_ARGUMENT, false, "Probe platforms and devices again and update the device inventory");
     op.setOption("device-type", 't', kot::OptionParser::REQUIRED_ARGUMENT, "default",
         "Specify device type\n"
         "      all: CPU and GPU\n"
@@ -200,115 +2823,546 @@ main(int argc, char* argv[])
     op.setOption("option", 'O', kot::OptionParser::REQUIRED_ARGUMENT, "", "Specify compile option", "COMPILE_OPTION");
     op.setOption("platform", 'p', kot::OptionParser::REQUIRED_ARGUMENT, 0, "Specify platform index", "PLATFORM_INDEX");
     op.setOption("device", 'd', kot::OptionParser::REQUIRED_ARGUMENT, 0, "Specify device index", "DEVICE_INDEX");
+    op.setOption("target", kot::OptionParser::REQUIRED_ARGUMENT, "",
+        "Select target devices by KEY=PATTERN conditions instead of indices and device type\n"
+        "      Keys are platform, vendor, name, version, driver and type, such as \"vendor=NVIDIA,name=*A100*\"\n"
+        "      Multiple targets are separated by ';', and patterns may contain '*' and '?'", "SELECTORS");
     op.setOption("fsyntax-only", kot::OptionParser::NO_ARGUMENT, false, "Check syntax only, not generate binary");
+    op.setOption("MD", kot::OptionParser::NO_ARGUMENT, false,
+        "Write dependency file in Makefile syntax, which lists included headers found with -I of --option\n"
+        "      Written to <OUTPUT_NAME>.d, or <SOURCE_NAME>.d for each source in batch mode");
+    op.setOption("MF", kot::OptionParser::REQUIRED_ARGUMENT, "", "Specify dependency file name, which implies --MD", "FILE_NAME");
+    op.setOption("emit-il", kot::OptionParser::NO_ARGUMENT, false,
+        "Write SPIR-V module of the program (CL_PROGRAM_IL) instead of binaries\n"
+        "      Output file name defaults to <SOURCE_NAME>.spv");
+    op.setOption("incremental", kot::OptionParser::NO_ARGUMENT, false,
+        "Compile each source file separately with clCompileProgram and link them with clLinkProgram\n"
+        "      Compiled objects are cached per file with --cache-dir");
+    op.setOption("header", kot::OptionParser::REQUIRED_ARGUMENT, "",
+        "Specify comma-separated header files to embed in incremental mode\n"
+        "      Each header is included with its file name as specified", "FILE_NAMES");
+    op.setOption("link-option", kot::OptionParser::REQUIRED_ARGUMENT, "", "Specify link option in incremental mode", "LINK_OPTION");
+    op.setOption("bundle", kot::OptionParser::NO_ARGUMENT, false,
+        "Write binaries for all target devices into one fat binary file\n"
+        "      which is indexed by device name, driver version and build options");
+    op.setOption("embed-source", kot::OptionParser::NO_ARGUMENT, false,
+        "Embed kernel source in the fat binary, so that the runtime loader can rebuild stale binaries");
+    op.setOption("emit", kot::OptionParser::REQUIRED_ARGUMENT, "binary",
+        "Specify output format of binaries\n"
+        "      binary: Binary file for each device, or fat binary with --bundle\n"
+        "      c-array: C++ header which defines fat binary as an alignas/constexpr array (<SOURCE_NAME>.h)\n"
+        "      obj: Linkable ELF/COFF object which defines fat binary (<SOURCE_NAME>.o)", "FORMAT");
+    op.setOption("symbol", kot::OptionParser::REQUIRED_ARGUMENT, "",
+        "Specify base name of symbols with --emit=c-array or --emit=obj\n"
+        "      Derived from the output file name if omitted", "NAME");
+    op.setOption("specialize", kot::OptionParser::REQUIRED_ARGUMENT, "",
+        "Build a variant for each combination of macro values, such as \"VEC=1,2,4;TILE=8,16\", into one fat binary\n"
+        "      Variants are named like \"VEC=4,TILE=16\", by which the runtime loader selects the binary", "MACROS");
+    op.setOption("batch", 'b', kot::OptionParser::NO_ARGUMENT, false, "Compile each source file as an independent program");
+    op.setOption("manifest", 'm', kot::OptionParser::REQUIRED_ARGUMENT, "", "Specify file which lists source files to compile in batch mode", "FILE_NAME");
+    op.setOption("jobs", 'j', kot::OptionParser::REQUIRED_ARGUMENT, 0,
+        "Specify number of builds in flight and enable batch mode\n"
+        "      0: Number of hardware threads", "N");
+    op.setOption("watch", kot::OptionParser::NO_ARGUMENT, false,
+        "Keep running and rebuild whenever source files or their included headers change\n"
+        "      Only changed files are recompiled with --incremental and --cache-dir");
+    op.setOption("tune", kot::OptionParser::REQUIRED_ARGUMENT, "",
+        "Compile variants of build options listed in specified file, benchmark them,\n"
+        "      and write the fastest binary for each device", "SPEC_FILE");
+    op.setOption("tune-bench", kot::OptionParser::REQUIRED_ARGUMENT, "test/main.exe", "Specify benchmark command of autotuner", "COMMAND");
+    op.setOption("cache-dir", kot::OptionParser::REQUIRED_ARGUMENT, "", "Specify directory of binary cache (Disabled if empty)", "DIRECTORY");
+    op.setOption("cache-size", kot::OptionParser::REQUIRED_ARGUMENT, kDefaultCacheSizeMiB, "Specify max size of binary cache in MiB", "SIZE");
+    op.setOption("cache-stats", kot::OptionParser::NO_ARGUMENT, false, "Show hit/miss counters of binary cache and exit this program");
+    op.setOption("revalidate", kot::OptionParser::REQUIRED_ARGUMENT, "",
+        "Reuse binary of an earlier build of the same sources and options if the current driver still accepts it,\n"
+        "      and build from the sources only for the devices whose binaries are rejected\n"
+        "      Binary <FILE_NAME>.<DEVICE_INDEX> is used for each device if there are multiple target devices", "FILE_NAME");
+    op.setOption("serve", kot::OptionParser::REQUIRED_ARGUMENT, "", "Run as compile server listening on specified Unix domain socket", "SOCKET");
+    op.setOption("socket", kot::OptionParser::REQUIRED_ARGUMENT, "",
+        "Specify Unix domain socket of compile server to forward compilation to\n"
+        "      Environment variable OCLC_SOCKET is used if omitted", "SOCKET");
+    op.setOption("stream", kot::OptionParser::NO_ARGUMENT, false,
+        "Read program sources from stdin and write binaries to stdout until stdin ends, in frames of 64-bit little-endian lengths\n"
+        "      Up to -j N programs are built at a time, and the responses are written in input order");
+    op.setOption("log-file", kot::OptionParser::REQUIRED_ARGUMENT, "", "Write build logs of all devices to specified file instead of stderr", "FILE_NAME");
+    op.setOption("kernel-report", kot::OptionParser::REQUIRED_ARGUMENT, "",
+        "Write work-group sizes, local/private memory sizes and arguments of every kernel for each device to specified JSON file\n"
+        "      Kernels which may spill registers are warned to stderr; argument names usually need -cl-kernel-arg-info", "FILE_NAME");
+    op.setOption("private-mem-limit", kot::OptionParser::REQUIRED_ARGUMENT, static_cast<std::size_t>(kDefaultPrivateMemLimit),
+        "Specify private memory per work-item in bytes above which --kernel-report warns", "SIZE");
+    op.setOption("time-report", kot::OptionParser::NO_ARGUMENT, false, "Show elapsed time of each phase to stderr");
+    op.setOption("time-report-format", kot::OptionParser::REQUIRED_ARGUMENT, "table",
+        "Specify format of time report\n"
+        "      table: Human readable table\n"
+        "      json: JSON", "FORMAT");
+    op.setOption("diagnostics", kot::OptionParser::REQUIRED_ARGUMENT, "text",
+        "Specify format of build diagnostics\n"
+        "      text: Build logs to stderr or --log-file\n"
+        "      json: Status, error code and parsed compiler diagnostics of every program and device to stdout,\n"
+        "            and one line per failed program to stderr", "FORMAT");
     op.setOption("help", 'h', kot::OptionParser::NO_ARGUMENT, false, "Show help and exit this program");
     op.parse(argc, argv);
 
+    if (op.get<bool>("time-report")) {
+      phaseTimer.enable();
+    }
+    PhaseTimerReporter timeReporter(phaseTimer, std::cerr, kTimeReportFormatMap.at(op.get("time-report-format")));
+
     // Show help and exit this program
     if (op.get<bool>("help")) {
       op.showUsage();
       return EXIT_SUCCESS;
     }
 
-    // Get platform information
-    std::vector<cl_platform_id> platformIds = getPlatformIds(kNDefaultPlatformEntry);
+    // Open binary cache
+    std::unique_ptr<BinaryCache> cache;
+    if (op.get("cache-dir") != "") {
+      cache.reset(new BinaryCache(op.get("cache-dir"), static_cast<std::uintmax_t>(op.get<std::size_t>("cache-size")) << 20));
+      if (op.get<bool>("cache-stats")) {
+        cache->showStats(std::cout);
+        return EXIT_SUCCESS;
+      }
+    } else if (op.get<bool>("cache-stats")) {
+      std::cerr << "Please specify cache directory with --cache-dir" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    if (op.get("log-file") != "") {
+      buildLogWriter.open(op.get("log-file"));
+    }
+
+    // Run as compile server
+    if (op.get("serve") != "") {
+      // Return build logs to the clients unless the server has its own log file
+      if (op.get("log-file") == "") {
+        buildLogWriter.disable();
+      }
+      serve(op.get("serve"), cache.get());
+      return EXIT_SUCCESS;
+    }
+
+    std::string inventoryPath = op.get("inventory") != "" ? op.get("inventory") : DeviceInventory::getDefaultPath();
     if (op.get<bool>("list")) {
-      showInfo(platformIds, kDeviceTypeMap.at(op.get("device-type")));
+      bool isProbed;
+      KOTLIB_THROW_IF(kDeviceTypeMap.find(op.get("device-type")) == kDeviceTypeMap.end(), std::out_of_range, "Invalid device type: " + op.get("device-type"));
+      showInfo(openDeviceInventory(inventoryPath, op.get<bool>("refresh-inventory"), isProbed), op.get("device-type"));
       return EXIT_SUCCESS;
     }
 
     // Get source file
     std::vector<std::string> args = op.getArguments();
-    if (args.size() < 1) {
+    bool isTune = op.get("tune") != "";
+    bool isStream = op.get<bool>("stream");
+    bool isBatch = op.get<bool>("batch") || op.get("manifest") != "" || (!isTune && !isStream && op.get<std::size_t>("jobs") > 0);
+    if (op.get("manifest") != "") {
+      std::vector<std::string> inputFiles = readManifest(op.get("manifest"));
+      args.insert(args.end(), inputFiles.begin(), inputFiles.end());
+    }
+    if (args.size() < 1 && !isStream) {
       std::cerr << "Please specify only one or more source file" << std::endl;
       return EXIT_FAILURE;
     }
+    if (isBatch && (op.get<bool>("all") || op.get("output") != "")) {
+      std::cerr << "Batch mode cannot be used with --all or --output" << std::endl;
+      return EXIT_FAILURE;
+    }
+    bool isEmitIl = op.get<bool>("emit-il");
+    if (isEmitIl && op.get<bool>("all")) {
+      std::cerr << "--emit-il cannot be used with --all" << std::endl;
+      return EXIT_FAILURE;
+    }
+    bool isIncremental = op.get<bool>("incremental");
+    if (isIncremental && (isBatch || isEmitIl || op.get<bool>("all"))) {
+      std::cerr << "Incremental mode cannot be used with batch mode, --emit-il or --all" << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (isTune && (isBatch || isEmitIl || isIncremental || op.get<bool>("all") || op.get<bool>("fsyntax-only"))) {
+      std::cerr << "--tune cannot be used with batch mode, --emit-il, incremental mode, --all or --fsyntax-only" << std::endl;
+      return EXIT_FAILURE;
+    }
+    EmitFormat emitFormat = kEmitFormatMap.at(op.get("emit"));
+    bool isSpecialize = op.get("specialize") != "";
+    if (isSpecialize && (isIncremental || isTune)) {
+      std::cerr << "--specialize cannot be used with incremental mode or --tune" << std::endl;
+      return EXIT_FAILURE;
+    }
+    // Embedding binaries into an executable and specializing always bundle them
+    bool isBundle = op.get<bool>("bundle") || emitFormat != EmitFormat::kBinary || isSpecialize;
+    if (isBundle && (isBatch || isEmitIl || op.get<bool>("all") || op.get<bool>("fsyntax-only"))) {
+      std::cerr << "--bundle, --emit and --specialize cannot be used with batch mode, --emit-il, --all or --fsyntax-only" << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (op.get<bool>("embed-source") && (!isBundle || isIncremental)) {
+      std::cerr << "--embed-source can be used only with --bundle or --emit, and not in incremental mode" << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (op.get("symbol") != "" && emitFormat == EmitFormat::kBinary) {
+      std::cerr << "--symbol can be used only with --emit=c-array or --emit=obj" << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (!isIncremental && (op.get("header") != "" || op.get("link-option") != "")) {
+      std::cerr << "--header and --link-option can be used only in incremental mode" << std::endl;
+      return EXIT_FAILURE;
+    }
 
+    bool isDependency = op.get<bool>("MD") || op.get("MF") != "";
+    if (isDependency && (op.get<bool>("all") || op.get<bool>("fsyntax-only") || (isBatch && op.get("MF") != ""))) {
+      std::cerr << "--MD cannot be used with --all or --fsyntax-only, and --MF cannot be used in batch mode" << std::endl;
+      return EXIT_FAILURE;
+    }
+    bool isWatch = op.get<bool>("watch");
+    if (isWatch && (isTune || op.get<bool>("all"))) {
+      std::cerr << "--watch cannot be used with --tune or --all" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    cl_int deviceType = kDeviceTypeMap.at(op.get("device-type"));
+    const char* outputSuffix = isEmitIl ? ".spv"
+      : emitFormat == EmitFormat::kCArray ? ".h"
+      : emitFormat == EmitFormat::kObject ? kEmbedObjectSuffix
+      : ".bin";
+    // Standard input is compiled to standard output unless --output is specified
+    std::string outputBase = op.get("output") != "" ? op.get("output")
+      : args.empty() ? ""
+      : args[0] == kStdioFileName ? kStdioFileName
+      : removeSuffix(args[0]) + outputSuffix;
+    bool isStdin = std::find(args.begin(), args.end(), kStdioFileName) != args.end();
+    bool isStdout = outputBase == kStdioFileName;
+    if ((isStdin || isStdout) && (isBatch || isWatch || isTune || isDependency || op.get<bool>("all"))) {
+      std::cerr << "Standard input and output cannot be used with batch mode, --watch, --tune, --MD or --all" << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (isStdout && emitFormat != EmitFormat::kBinary) {
+      std::cerr << "Standard output cannot be used with --emit=c-array or --emit=obj" << std::endl;
+      return EXIT_FAILURE;
+    }
+    // Standard output takes one binary, which may be a fat binary
+    auto isStdoutOverflow = [&](std::size_t nDevice) {
+      return isStdout && !isBundle && !isEmitIl && nDevice > 1;
+    };
     std::size_t pi = op.get<std::size_t>("platform");
     std::size_t di = op.get<std::size_t>("device");
+    std::vector<TargetSelector> targetSelectors = TargetSelector::parseList(op.get("target"));
+    if (!targetSelectors.empty() && (isTune || op.get<bool>("all"))) {
+      std::cerr << "--target cannot be used with --tune or --all" << std::endl;
+      return EXIT_FAILURE;
+    }
+    bool isKernelReport = op.get("kernel-report") != "";
+    if (isKernelReport && (isEmitIl || op.get<bool>("fsyntax-only"))) {
+      std::cerr << "--kernel-report cannot be used with --emit-il or --fsyntax-only" << std::endl;
+      return EXIT_FAILURE;
+    }
+    KOTLIB_THROW_IF(op.get("diagnostics") != "text" && op.get("diagnostics") != "json", std::out_of_range, "Invalid diagnostics format: " + op.get("diagnostics"));
+    bool isJsonDiagnostics = op.get("diagnostics") == "json";
+    if (isJsonDiagnostics && (isWatch || isTune || isIncremental || isSpecialize || op.get<bool>("all") || isStdout)) {
+      std::cerr << "--diagnostics=json cannot be used with --watch, --tune, incremental mode, --specialize, --all or standard output" << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (isStream && (!args.empty() || isBatch || isWatch || isTune || isIncremental || isBundle || isEmitIl || isDependency || isKernelReport || isJsonDiagnostics
+          || op.get<bool>("all") || op.get("output") != "")) {
+      std::cerr << "--stream takes no source file, and cannot be used with batch mode, --output, --watch, --tune, incremental mode,\n"
+        << "--bundle, --emit, --specialize, --emit-il, --MD, --kernel-report, --diagnostics=json or --all" << std::endl;
+      return EXIT_FAILURE;
+    }
 
-    // Get device information
-    std::vector<cl_device_id> deviceIds = getDeviceIds(platformIds[pi], kNDefaultDeviceEntry, kDeviceTypeMap.at(op.get("device-type")));
+    bool isRevalidate = op.get("revalidate") != "";
+    if (isRevalidate && (isBatch || isStream || isWatch || isTune || isIncremental || isBundle || isEmitIl || op.get<bool>("all") || op.get<bool>("fsyntax-only"))) {
+      std::cerr << "--revalidate cannot be used with batch mode, --stream, --watch, --tune, incremental mode,\n"
+        << "--bundle, --emit, --specialize, --emit-il, --all or --fsyntax-only" << std::endl;
+      return EXIT_FAILURE;
+    }
 
-    // Generate context
-    cl_int errCode;
-    std::unique_ptr<std::remove_pointer<cl_context>::type, decltype(&clReleaseContext)> context(
-        clCreateContext(nullptr, static_cast<cl_uint>(deviceIds.size()), &deviceIds[di], nullptr, nullptr, &errCode), clReleaseContext);
-    OCLC_CHECK_ERROR(errCode);
+    // Forward compilation to compile server if it is running
+    std::string socketPath = op.get("socket");
+    if (socketPath == "" && std::getenv("OCLC_SOCKET") != nullptr) {
+      socketPath = std::getenv("OCLC_SOCKET");
+    }
+    // The dependency file and the build log file are written only by a local build
+    if (!isBatch && !op.get<bool>("all") && !isEmitIl && !isIncremental && !isTune && !isBundle && !isWatch && targetSelectors.empty() && !isKernelReport && !isJsonDiagnostics && !isStream && !isRevalidate
+        && !isDependency && op.get("log-file") == "" && socketPath != "") {
+      UnixSocket sock = UnixSocket::connect(socketPath);
+      if (sock.isValid()) {
+        CompileRequest request{pi, static_cast<std::uint64_t>(deviceType), di, op.get<bool>("fsyntax-only"), op.get("option"), getCurrentDirectory(), readSource(args)};
+        compileOnServer(sock, request, outputBase);
+        return EXIT_SUCCESS;
+      }
+    }
 
-    std::vector<std::string> kernelSources = readSource(op.getArguments());
-    std::pair<std::vector<const char*>, std::vector<std::string::size_type> > kernelSourcePairs;
-    kernelSourcePairs.first.reserve(kernelSources.size());
-    kernelSourcePairs.second.reserve(kernelSources.size());
-    for (const auto& kernelSource : kernelSources) {
-      kernelSourcePairs.first.emplace_back(kernelSource.c_str());
-      kernelSourcePairs.second.emplace_back(kernelSource.length());
+    // Write the kernel report when leaving main(), as well as when some builds fail
+    if (isKernelReport) {
+      kernelReportWriter.enable(op.get("kernel-report"), static_cast<std::uint64_t>(op.get<std::size_t>("private-mem-limit")));
+    }
+    KernelReportFlusher kernelReportFlusher(kernelReportWriter);
+    // Write the diagnostics to stdout likewise
+    if (isJsonDiagnostics) {
+      diagnosticsWriter.enable();
+    }
+    DiagnosticsFlusher diagnosticsFlusher(diagnosticsWriter);
+    std::string diagnosticsInput;
+    for (const auto& arg : args) {
+      diagnosticsInput += (diagnosticsInput.empty() ? "" : " ") + arg;
     }
-    std::unique_ptr<std::remove_pointer<cl_program>::type, decltype(&clReleaseProgram)> program(
-        clCreateProgramWithSource(
-          context.get(),
-          static_cast<cl_uint>(kernelSourcePairs.first.size()),
-          kernelSourcePairs.first.data(),
-          kernelSourcePairs.second.data(),
-          &errCode),
-        clReleaseProgram);
-    OCLC_CHECK_ERROR(errCode);
 
-    // Compile kernel source code
-    errCode = clBuildProgram(program.get(), static_cast<cl_uint>(deviceIds.size()), &deviceIds[di], op.get("option").c_str(), nullptr, nullptr);
-    switch (errCode) {
-      case CL_SUCCESS:
-        break;
-      case CL_BUILD_PROGRAM_FAILURE:
-        {
-          std::array<char, 2048> buildLog;
-          std::size_t logSize;
-          clGetProgramBuildInfo(program.get(), deviceIds[di], CL_PROGRAM_BUILD_LOG, buildLog.size(), buildLog.data(), &logSize);
-          OCLC_CHECK_ERROR_WITH_MSG(errCode, buildLog.data());
+    std::size_t nJob = op.get<std::size_t>("jobs");
+    if (nJob == 0) {
+      nJob = std::max(std::thread::hardware_concurrency(), 1U);
+    }
+    // Read, hash and scan the sources and their headers before any OpenCL call
+    SourceIndex sourceIndex(getIncludeDirectories(op.get("option")));
+    {
+      PhaseTimer::Scope scope = phaseTimer.measure("Source scan");
+      sourceIndex.scan(args, nJob);
+    }
+
+    // Identify the target devices with the device inventory to look up the binary cache without
+    // loading the drivers, probing again if the inventory does not know the selected devices
+    DeviceInventory inventory;
+    bool isInventoryProbed = false;
+    bool isInventoryUsed = (cache != nullptr || !targetSelectors.empty()) && !op.get<bool>("all");
+    std::vector<TargetGroup> targetGroups;
+    std::vector<std::string> targetIdentities;
+    auto selectInventoryDevices = [&] {
+      if (targetSelectors.empty()) {
+        targetIdentities = inventory.getIdentities(pi, op.get("device-type"), di);
+      } else {
+        targetGroups = TargetSelector::select(inventory, targetSelectors);
+        targetIdentities = getTargetIdentities(inventory, targetGroups);
+      }
+    };
+    auto checkTargetGroups = [&] {
+      for (const auto& targetSelector : targetSelectors) {
+        KOTLIB_THROW_IF(TargetSelector::select(inventory, {targetSelector}).empty(), std::runtime_error, "No device matches target: " + targetSelector.getText());
+      }
+    };
+    if (isInventoryUsed) {
+      inventory = openDeviceInventory(inventoryPath, op.get<bool>("refresh-inventory"), isInventoryProbed);
+      selectInventoryDevices();
+      if (targetIdentities.empty() && !isInventoryProbed) {
+        inventory = refreshDeviceInventory(inventoryPath, inventory.getFingerprint());
+        isInventoryProbed = true;
+        selectInventoryDevices();
+      }
+      checkTargetGroups();
+      if (isStdoutOverflow(targetIdentities.size())) {
+        std::cerr << "Standard output can take only one binary; select one device or use --bundle" << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+
+    // Write cached binaries without any OpenCL call, and build only the rest
+    std::string dependencyFile = op.get("MF") != "" ? op.get("MF") : removeSuffix(outputBase) + ".d";
+    if (cache != nullptr && !targetIdentities.empty() && !op.get<bool>("fsyntax-only") && !isEmitIl && !isWatch && !isStream) {
+      if (isBatch) {
+        args = writeCachedBatch(*cache, targetIdentities, args, sourceIndex, op.get("option"), nJob, isDependency);
+        if (args.empty()) {
+          return EXIT_SUCCESS;
+        }
+      } else if (!isIncremental && !isTune && !isBundle) {
+        std::vector<std::string> filenames;
+        for (std::size_t i = 0; i < targetIdentities.size(); i++) {
+          filenames.emplace_back(getOutputFileName(outputBase, i, targetIdentities.size()));
+        }
+        if (writeCachedBinaries(*cache, makeCacheKeys(targetIdentities, sourceIndex.getDigest(args), op.get("option")), filenames, false)) {
+          if (isDependency) {
+            writeDependencyFile(dependencyFile, filenames, sourceIndex.getDependencies(args), args.size());
+          }
+          if (isJsonDiagnostics) {
+            BuildDiagnostics diagnostics{CL_SUCCESS, "", {}};
+            diagnostics.addCached(filenames);
+            diagnosticsWriter.add(diagnosticsInput, std::move(diagnostics));
+          }
+          return EXIT_SUCCESS;
         }
-        break;
-      case CL_INVALID_BUILD_OPTIONS:
-        OCLC_CHECK_ERROR(errCode);
-        break;
-      default:
-        OCLC_CHECK_ERROR(errCode);
-    }
-    if (op.get<bool>("fsyntax-only")) {
+      }
+    }
+
+    // Get platform information
+    std::vector<cl_platform_id> platformIds = getPlatformIds(kNDefaultPlatformEntry, &phaseTimer);
+
+    if (op.get<bool>("all")) {
+      std::vector<SourceFile> kernelSources = readSource(args);
+      // Compile for every device of every platform unless the device type is explicitly specified
+      compileForAllDevices(platformIds, op.get("device-type") == "default" ? static_cast<cl_int>(CL_DEVICE_TYPE_ALL) : deviceType, kernelSources, op.get("option"), outputBase, op.get<bool>("fsyntax-only"), cache.get(),
+          sourceIndex.getDigest(args));
       return EXIT_SUCCESS;
     }
 
-    // figure out number of devices and the sizes of the binary for each device.
-    cl_uint nDevice;
-    errCode = clGetProgramInfo(program.get(), CL_PROGRAM_NUM_DEVICES, sizeof(nDevice), &nDevice, nullptr);
-    OCLC_CHECK_ERROR(errCode);
+    // Get device information
+    std::vector<TargetDevices> targets;
+    if (targetSelectors.empty()) {
+      KOTLIB_THROW_IF(pi >= platformIds.size(), std::out_of_range, "Invalid platform index: " + std::to_string(pi));
+      targets.emplace_back(TargetDevices{platformIds[pi], selectTargetDevices(getDeviceIds(platformIds[pi], kNDefaultDeviceEntry, deviceType, &phaseTimer), di)});
+    } else {
+      targets = getTargetDevices(platformIds, targetGroups);
+    }
+    std::vector<std::string> deviceIdentities;
+    for (const auto& target : targets) {
+      std::vector<std::string> identities = getDeviceIdentities(target.platformId, target.deviceIds);
+      deviceIdentities.insert(deviceIdentities.end(), identities.begin(), identities.end());
+    }
+    if (isInventoryUsed && !isInventoryProbed && deviceIdentities != targetIdentities) {
+      inventory = refreshDeviceInventory(inventoryPath, inventory.getFingerprint());
+      // Select the devices again, since the stale inventory may have pointed to other devices
+      if (!targetSelectors.empty()) {
+        selectInventoryDevices();
+        checkTargetGroups();
+        targets = getTargetDevices(platformIds, targetGroups);
+      }
+    }
+    KOTLIB_THROW_IF(targets.empty(), std::runtime_error, "Devices changed while probing them");
+    if (targets.size() > 1 && (isWatch || isEmitIl)) {
+      std::cerr << "--watch and --emit-il cannot be used with targets on multiple platforms" << std::endl;
+      return EXIT_FAILURE;
+    }
+    std::vector<cl_device_id> targetDeviceIds;
+    for (const auto& target : targets) {
+      targetDeviceIds.insert(targetDeviceIds.end(), target.deviceIds.begin(), target.deviceIds.end());
+    }
+    if (isStdoutOverflow(targetDeviceIds.size())) {
+      std::cerr << "Standard output can take only one binary; select one device or use --bundle" << std::endl;
+      return EXIT_FAILURE;
+    }
 
-    std::unique_ptr<std::size_t[]> binSizes(new std::size_t[nDevice]);
-    errCode = clGetProgramInfo(program.get(), CL_PROGRAM_BINARY_SIZES, sizeof(std::size_t) * nDevice, binSizes.get(), nullptr);
-    OCLC_CHECK_ERROR(errCode);
+    if (isStream) {
+      // Return build logs in the responses unless they are written to a log file, as the compile server does
+      if (op.get("log-file") == "") {
+        buildLogWriter.disable();
+      }
+      streamPrograms(targets, op.get("option"), nJob, op.get<bool>("fsyntax-only"), cache.get());
+      return EXIT_SUCCESS;
+    }
 
-    // copy over all of the generated bins.
-    std::vector<std::unique_ptr<char> > bins(nDevice);
-    for (std::size_t i = 0; i < nDevice; i++) {
-      bins[i] = std::unique_ptr<char>(binSizes[i] == 0 ? nullptr : new char[binSizes[i]]);
+    if (isBatch) {
+      if (!isWatch) {
+        compileBatch(targets, args, sourceIndex, op.get("option"), nJob, op.get<bool>("fsyntax-only"), isEmitIl, isDependency, cache.get());
+        return EXIT_SUCCESS;
+      }
+      std::vector<std::vector<std::string> > programFiles;
+      for (const auto& arg : args) {
+        programFiles.emplace_back(1, arg);
+      }
+      watchPrograms(programFiles, {}, sourceIndex, nJob, [&](const std::vector<std::size_t>& indices) {
+        std::vector<std::string> inputFiles;
+        for (const auto& i : indices) {
+          inputFiles.emplace_back(args[i]);
+        }
+        compileBatch(targets, inputFiles, sourceIndex, op.get("option"), nJob, op.get<bool>("fsyntax-only"), isEmitIl, isDependency, cache.get());
+      });
+      return EXIT_SUCCESS;
     }
-    errCode = clGetProgramInfo(program.get(), CL_PROGRAM_BINARIES, sizeof(char*) * nDevice, bins.data(), nullptr);
-    OCLC_CHECK_ERROR(errCode);
 
-    std::string basename = removeSuffix(args[0]);
-    for (std::size_t i = 0; i < nDevice; i++) {
-      if (bins[i] == nullptr) {
-        continue;
+    std::size_t nOutput = isEmitIl ? 1 : targetDeviceIds.size();
+    std::vector<std::string> variants = isSpecialize ? parseSpecializations(op.get("specialize")) : std::vector<std::string>{""};
+    std::vector<std::string> filenames;
+    for (std::size_t i = 0; i < variants.size() * nOutput; i++) {
+      // Binaries for each device are written to temporary files and bundled later
+      filenames.emplace_back(isBundle ? makeTemporaryPath(outputBase) : getOutputFileName(outputBase, i, nOutput));
+      if (isBundle) {
+        kernelReportWriter.setAlias(filenames.back(), outputBase, variants[i / nOutput]);
+      }
+    }
+    std::vector<std::string> oldFilenames;
+    for (std::size_t i = 0; isRevalidate && i < nOutput; i++) {
+      oldFilenames.emplace_back(getOutputFileName(op.get("revalidate"), i, nOutput));
+    }
+    std::vector<std::string> headerNames = splitString(op.get("header"), ',');
+    auto buildProgram = [&]() -> bool {
+      if (isDependency) {
+        std::vector<std::string> dependencies = sourceIndex.getDependencies(args);
+        dependencies.insert(dependencies.end(), headerNames.begin(), headerNames.end());
+        writeDependencyFile(dependencyFile, isBundle ? std::vector<std::string>{outputBase} : filenames, dependencies, args.size());
       }
-      std::string filename = op.get("output") == "" ? (basename + ".bin") : op.get("output");
-      if (nDevice > 1) {
-        filename += "." + std::to_string(i);
+      std::vector<SourceFile> kernelSources = readSource(args);
+      std::vector<SourceFile> headers = readSource(headerNames);
+      // Build one program for each platform, whose binaries are written to its slice of the output files
+      BuildDiagnostics diagnostics{CL_SUCCESS, "", {}};
+      std::size_t offset = 0;
+      for (const auto& target : targets) {
+        auto getTargetFilenames = [&](std::size_t variantIndex) {
+          auto first = filenames.begin() + static_cast<std::ptrdiff_t>(variantIndex * nOutput + offset);
+          return isEmitIl ? filenames : std::vector<std::string>(first, first + static_cast<std::ptrdiff_t>(target.deviceIds.size()));
+        };
+        std::vector<std::string> targetFilenames = getTargetFilenames(0);
+        if (isSpecialize) {
+          // All variants of one platform are built in parallel in one context
+          std::vector<std::string> variantOptions;
+          std::vector<std::vector<std::string> > variantFilenames;
+          std::vector<std::string> labels;
+          for (decltype(variants)::size_type i = 0; i < variants.size(); i++) {
+            variantOptions.emplace_back(op.get("option") + makeVariantOptions(variants[i]));
+            variantFilenames.emplace_back(getTargetFilenames(i));
+            labels.emplace_back("Variant: " + variants[i]);
+          }
+          std::vector<std::exception_ptr> errors = compileVariants(target.platformId, target.deviceIds, kernelSources, variantOptions, variantFilenames, nJob, cache.get(),
+              sourceIndex.getDigest(args));
+          KOTLIB_THROW_IF(reportErrors(errors, labels), std::runtime_error, "Failed to compile some variants");
+        } else if (isTune) {
+          tuneProgram(target.platformId, target.deviceIds, kernelSources, op.get("option"), readTuneSpec(op.get("tune")), op.get("tune-bench"),
+              pi, di, op.get("device-type"), targetFilenames, nJob, cache.get(), sourceIndex.getDigest(args), std::cout);
+        } else if (isIncremental) {
+          compileProgramIncrementally(target.platformId, target.deviceIds, kernelSources, args, sourceIndex, headers, headerNames, op.get("option"), op.get("link-option"), targetFilenames, op.get<bool>("fsyntax-only"), cache.get());
+        } else {
+          std::vector<cl_device_id> deviceIds = target.deviceIds;
+          if (isRevalidate) {
+            // Build only the devices whose binaries of the earlier build are rejected
+            auto first = oldFilenames.begin() + static_cast<std::ptrdiff_t>(offset);
+            std::vector<std::size_t> rejectedIndices = revalidateBinaries(contextPool.getContext(target.deviceIds), target.deviceIds,
+                std::vector<std::string>(first, first + static_cast<std::ptrdiff_t>(target.deviceIds.size())), op.get("option"), targetFilenames,
+                isJsonDiagnostics ? &diagnostics : nullptr);
+            deviceIds.clear();
+            std::vector<std::string> rejectedFilenames;
+            for (const auto& i : rejectedIndices) {
+              deviceIds.emplace_back(target.deviceIds[i]);
+              rejectedFilenames.emplace_back(targetFilenames[i]);
+            }
+            targetFilenames = rejectedFilenames;
+          }
+          if (!deviceIds.empty()) {
+            compileProgram(target.platformId, deviceIds, kernelSources, op.get("option"), targetFilenames, op.get<bool>("fsyntax-only"), isEmitIl, cache.get(),
+                sourceIndex.getDigest(args), isJsonDiagnostics ? &diagnostics : nullptr);
+          }
+        }
+        offset += target.deviceIds.size();
       }
-      std::ofstream ofs(filename, std::ios::binary);
-      if (ofs.is_open()) {
-        ofs.write(bins[i].get(), binSizes[i]);
-      } else {
-        std::cerr << "Failed to open: " << filename << std::endl;
+      if (isJsonDiagnostics) {
+        cl_int errCode = diagnostics.errCode;
+        diagnosticsWriter.add(diagnosticsInput, std::move(diagnostics));
+        if (errCode != CL_SUCCESS) {
+          std::cerr << getClErrorMessage(errCode) << std::endl;
+          return false;
+        }
+      }
+      if (isBundle) {
+        std::string embeddedSource;
+        if (op.get<bool>("embed-source")) {
+          KOTLIB_THROW_IF(std::any_of(kernelSources.begin(), kernelSources.end(), isSpirv), std::runtime_error, "SPIR-V module cannot be embedded as source");
+          for (const auto& kernelSource : kernelSources) {
+            embeddedSource.append(kernelSource.data(), kernelSource.size());
+          }
+        }
+        bundleBinaries(targetDeviceIds, filenames, op.get("option"), variants, embeddedSource, emitFormat,
+            op.get("symbol") != "" ? op.get("symbol") : makeEmbedSymbolName(outputBase), outputBase);
+      }
+      return true;
+    };
+    if (isWatch) {
+      watchPrograms({args}, headerNames, sourceIndex, nJob, [&](const std::vector<std::size_t>&) {
+        buildProgram();
+      });
+    } else if (isJsonDiagnostics) {
+      // Record the failures other than build errors, such as of a missing file, before reporting them
+      bool isBuilt;
+      try {
+        isBuilt = buildProgram();
+      } catch (const std::exception& e) {
+        diagnosticsWriter.addFailure(diagnosticsInput, e.what());
+        throw;
+      }
+      if (!isBuilt) {
+        return EXIT_FAILURE;
       }
+    } else {
+      buildProgram();
     }
   } catch (const std::exception& e) {
     std::cerr << e.what() << std::endl;
@@ -0,0 +1,627 @@
+#ifndef OCL_BINARY_CACHE
+#define OCL_BINARY_CACHE
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef _WIN32
+#  include <sys/utime.h>
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <sys/file.h>
+#  include <unistd.h>
+#  include <utime.h>
+#endif  // _WIN32
+
+#include <kotlib/macro.h>
+#include "oclFileUtil.h"
+
+
+/*!
+ * @brief Incremental 64-bit xxHash (XXH64) hasher
+ *
+ * The input is consumed in 32-byte stripes with four independent lanes, which
+ * is several times faster than hashing one byte per multiply as FNV-1a does.
+ * The hash value is the same as the reference implementation of XXH64.
+ */
+class XxHash64
+{
+public:
+  /*!
+   * @brief Start hashing with the specified seed
+   * @param [in] seed  Seed of the hash
+   */
+  explicit XxHash64(std::uint64_t seed = 0) noexcept :
+    seed_(seed),
+    v1_(seed + kPrime1 + kPrime2),
+    v2_(seed + kPrime2),
+    v3_(seed),
+    v4_(seed - kPrime1),
+    totalSize_(0),
+    buffer_(),
+    bufferSize_(0)
+  {}
+
+  /*!
+   * @brief Feed raw bytes
+   * @param [in] data  Pointer to the bytes
+   * @param [in] size  Number of bytes
+   * @return  Reference to this object
+   */
+  XxHash64&
+  update(const void* data, std::size_t size) noexcept
+  {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + size;
+    totalSize_ += size;
+    if (bufferSize_ + size < kStripeSize) {
+      std::copy(p, end, buffer_ + bufferSize_);
+      bufferSize_ += size;
+      return *this;
+    }
+    if (bufferSize_ > 0) {
+      std::size_t n = kStripeSize - bufferSize_;
+      std::copy(p, p + n, buffer_ + bufferSize_);
+      consumeStripe(buffer_, v1_, v2_, v3_, v4_);
+      p += n;
+      bufferSize_ = 0;
+    }
+    // Keep the lanes in locals, since the members may alias the input bytes
+    std::uint64_t v1 = v1_, v2 = v2_, v3 = v3_, v4 = v4_;
+    for (; static_cast<std::size_t>(end - p) >= kStripeSize; p += kStripeSize) {
+      consumeStripe(p, v1, v2, v3, v4);
+    }
+    v1_ = v1;
+    v2_ = v2;
+    v3_ = v3;
+    v4_ = v4;
+    std::copy(p, end, buffer_);
+    bufferSize_ = static_cast<std::size_t>(end - p);
+    return *this;
+  }
+
+  /*!
+   * @brief Feed raw bytes together with their length so that adjacent fields
+   *        cannot be confused with each other
+   * @param [in] data  Pointer to the bytes
+   * @param [in] size  Number of bytes
+   * @return  Reference to this object
+   */
+  XxHash64&
+  updateField(const void* data, std::size_t size) noexcept
+  {
+    std::uint64_t length = size;
+    update(&length, sizeof(length));
+    return update(data, size);
+  }
+
+  /*!
+   * @brief Feed a string together with its length
+   * @param [in] str  String to feed
+   * @return  Reference to this object
+   */
+  XxHash64&
+  update(const std::string& str) noexcept
+  {
+    return updateField(str.data(), str.length());
+  }
+
+  /*!
+   * @brief Get the hash value of the bytes fed so far
+   * @return  Hash value
+   */
+  std::uint64_t
+  digest() const noexcept
+  {
+    std::uint64_t h;
+    if (totalSize_ >= kStripeSize) {
+      h = rotl(v1_, 1) + rotl(v2_, 7) + rotl(v3_, 12) + rotl(v4_, 18);
+      h = mergeRound(h, v1_);
+      h = mergeRound(h, v2_);
+      h = mergeRound(h, v3_);
+      h = mergeRound(h, v4_);
+    } else {
+      h = seed_ + kPrime5;
+    }
+    h += totalSize_;
+
+    const unsigned char* p = buffer_;
+    const unsigned char* end = buffer_ + bufferSize_;
+    for (; end - p >= 8; p += 8) {
+      h ^= round(0, readLe(p, 8));
+      h = rotl(h, 27) * kPrime1 + kPrime4;
+    }
+    if (end - p >= 4) {
+      h ^= readLe(p, 4) * kPrime1;
+      h = rotl(h, 23) * kPrime2 + kPrime3;
+      p += 4;
+    }
+    for (; p < end; p++) {
+      h ^= static_cast<std::uint64_t>(*p) * kPrime5;
+      h = rotl(h, 11) * kPrime1;
+    }
+
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
+  }
+
+  /*!
+   * @brief Get the hash value as a 16-digit hex string
+   * @return  Hex string of the hash value
+   */
+  std::string
+  hexdigest() const
+  {
+    std::ostringstream oss;
+    oss << std::hex << std::setw(16) << std::setfill('0') << digest();
+    return oss.str();
+  }
+
+private:
+  //! Primes of XXH64
+  static constexpr std::uint64_t kPrime1 = 0x9e3779b185ebca87ULL;
+  static constexpr std::uint64_t kPrime2 = 0xc2b2ae3d27d4eb4fULL;
+  static constexpr std::uint64_t kPrime3 = 0x165667b19e3779f9ULL;
+  static constexpr std::uint64_t kPrime4 = 0x85ebca77c2b2ae63ULL;
+  static constexpr std::uint64_t kPrime5 = 0x27d4eb2f165667c5ULL;
+  //! Number of bytes which are consumed at once by the four lanes
+  static constexpr std::size_t kStripeSize = 32;
+
+  //! Seed of the hash
+  std::uint64_t seed_;
+  //! Accumulators of the four lanes
+  std::uint64_t v1_;
+  std::uint64_t v2_;
+  std::uint64_t v3_;
+  std::uint64_t v4_;
+  //! Total number of bytes fed
+  std::uint64_t totalSize_;
+  //! Bytes which do not fill a stripe yet
+  unsigned char buffer_[kStripeSize];
+  //! Number of bytes in the buffer
+  std::size_t bufferSize_;
+
+  /*!
+   * @brief Read a little-endian unsigned integer
+   * @param [in] p      Pointer to the bytes
+   * @param [in] nByte  Number of bytes, up to 8
+   * @return  Read value
+   */
+  static std::uint64_t
+  readLe(const unsigned char* p, int nByte) noexcept
+  {
+    std::uint64_t value = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (int i = 0; i < nByte; i++) {
+      value |= static_cast<std::uint64_t>(p[i]) << (i * 8);
+    }
+#else
+    std::memcpy(&value, p, static_cast<std::size_t>(nByte));
+#endif  // defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return value;
+  }
+
+  /*!
+   * @brief Rotate bits to the left
+   * @param [in] x  Value to rotate
+   * @param [in] r  Number of bits
+   * @return  Rotated value
+   */
+  static std::uint64_t
+  rotl(std::uint64_t x, int r) noexcept
+  {
+    return (x << r) | (x >> (64 - r));
+  }
+
+  /*!
+   * @brief Mix one 64-bit input into an accumulator
+   * @param [in] acc    Accumulator
+   * @param [in] input  Input value
+   * @return  New accumulator
+   */
+  static std::uint64_t
+  round(std::uint64_t acc, std::uint64_t input) noexcept
+  {
+    return rotl(acc + input * kPrime2, 31) * kPrime1;
+  }
+
+  /*!
+   * @brief Merge an accumulator of a lane into the hash value
+   * @param [in] h    Hash value
+   * @param [in] acc  Accumulator of the lane
+   * @return  New hash value
+   */
+  static std::uint64_t
+  mergeRound(std::uint64_t h, std::uint64_t acc) noexcept
+  {
+    return (h ^ round(0, acc)) * kPrime1 + kPrime4;
+  }
+
+  /*!
+   * @brief Consume one stripe with the four lanes
+   * @param [in]     p   Pointer to the stripe
+   * @param [in,out] v1  Accumulator of the first lane
+   * @param [in,out] v2  Accumulator of the second lane
+   * @param [in,out] v3  Accumulator of the third lane
+   * @param [in,out] v4  Accumulator of the fourth lane
+   */
+  static void
+  consumeStripe(const unsigned char* p, std::uint64_t& v1, std::uint64_t& v2, std::uint64_t& v3, std::uint64_t& v4) noexcept
+  {
+    v1 = round(v1, readLe(p, 8));
+    v2 = round(v2, readLe(p + 8, 8));
+    v3 = round(v3, readLe(p + 16, 8));
+    v4 = round(v4, readLe(p + 24, 8));
+  }
+};  // class XxHash64
+
+
+/*!
+ * @brief Content-addressed on-disk cache for compiled kernel binaries
+ *
+ * Each entry is stored as "<key>.bin" in the cache directory.
+ * The modification time of an entry is refreshed on every hit, and the least
+ * recently used entries are removed when the total size exceeds the limit.
+ * Hit and miss counters are persisted in the "stats" file of the directory,
+ * which is updated under the "stats.lock" file lock, so that oclc processes
+ * sharing the directory do not lose counts.
+ * All member functions are safe to call from multiple threads.
+ */
+class BinaryCache
+{
+public:
+  /*!
+   * @brief Open the cache directory, creating it if it does not exist
+   * @param [in] cacheDir  Cache directory
+   * @param [in] maxSize   Max total size of the cache entries in bytes
+   */
+  BinaryCache(const std::string& cacheDir, std::uintmax_t maxSize) :
+    cacheDir_(cacheDir),
+    maxSize_(maxSize),
+    statsMutex_()
+  {
+    makeDirectories(cacheDir_);
+  }
+
+  /*!
+   * @brief Compute a cache key from everything which affects a compiled binary
+   * @tparam Sources  Container of sources which have data() and size()
+   * @param [in] sources         Kernel source codes
+   * @param [in] options         Compile options
+   * @param [in] deviceIdentity  String which identifies the platform, device and driver
+   * @return  Cache key
+   */
+  template<typename Sources>
+  static std::string
+  makeKey(const Sources& sources, const std::string& options, const std::string& deviceIdentity)
+  {
+    XxHash64 hasher;
+    hasher.update(kFormatVersion);
+    for (const auto& source : sources) {
+      hasher.updateField(source.data(), source.size());
+    }
+    return hasher.update(options).update(deviceIdentity).hexdigest();
+  }
+
+  /*!
+   * @brief Compute a cache key of one source, such as a compiled object of one file
+   * @param [in] data            Pointer to the source
+   * @param [in] size            Size of the source
+   * @param [in] options         Compile options
+   * @param [in] deviceIdentity  String which identifies the platform, device and driver
+   * @return  Cache key
+   */
+  static std::string
+  makeKey(const char* data, std::size_t size, const std::string& options, const std::string& deviceIdentity)
+  {
+    XxHash64 hasher;
+    hasher.update(kFormatVersion);
+    hasher.updateField(data, size);
+    return hasher.update(options).update(deviceIdentity).hexdigest();
+  }
+
+  /*!
+   * @brief Load the entry of the specified key and mark it as recently used
+   * @param [in]  key  Cache key
+   * @param [out] bin  Loaded binary
+   * @return  true if the entry exists, otherwise false
+   */
+  bool
+  load(const std::string& key, std::vector<char>& bin) const
+  {
+    std::string path = entryPath(key);
+    std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+    if (!ifs.is_open()) {
+      return false;
+    }
+    bin.resize(static_cast<std::vector<char>::size_type>(ifs.tellg()));
+    ifs.seekg(0);
+    ifs.read(bin.data(), static_cast<std::streamsize>(bin.size()));
+    if (!ifs) {
+      return false;
+    }
+    touch(path);
+    return true;
+  }
+
+  /*!
+   * @brief Store a binary as the entry of the specified key
+   *
+   * The binary is written to a temporary file first and then renamed, so that
+   * concurrent oclc processes never read a half-written entry.
+   * @param [in] key   Cache key
+   * @param [in] data  Pointer to the binary
+   * @param [in] size  Size of the binary
+   */
+  void
+  store(const std::string& key, const char* data, std::size_t size) const
+  {
+    std::string path = entryPath(key);
+    KOTLIB_THROW_IF(!writeFileAtomically(path, data, size), std::runtime_error, "Failed to write: " + path);
+  }
+
+  /*!
+   * @brief Remove least recently used entries until the total size of the
+   *        entries fits in the limit
+   */
+  void
+  evict() const
+  {
+    std::vector<Entry> entries = listEntries();
+    std::uintmax_t totalSize = 0;
+    for (const auto& entry : entries) {
+      totalSize += entry.size;
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& lhs, const Entry& rhs) {
+      return lhs.mtime < rhs.mtime;
+    });
+    for (const auto& entry : entries) {
+      if (totalSize <= maxSize_) {
+        break;
+      }
+      if (std::remove(entry.path.c_str()) == 0) {
+        totalSize -= entry.size;
+      }
+    }
+  }
+
+  /*!
+   * @brief Increment the persistent hit counter
+   */
+  void
+  recordHit() const
+  {
+    std::lock_guard<std::mutex> lock(statsMutex_);
+    StatsFileLock fileLock(cacheDir_ + "/" + kStatsLockFileName);
+    std::pair<std::uintmax_t, std::uintmax_t> stats = readStats();
+    writeStats(stats.first + 1, stats.second);
+  }
+
+  /*!
+   * @brief Increment the persistent miss counter
+   */
+  void
+  recordMiss() const
+  {
+    std::lock_guard<std::mutex> lock(statsMutex_);
+    StatsFileLock fileLock(cacheDir_ + "/" + kStatsLockFileName);
+    std::pair<std::uintmax_t, std::uintmax_t> stats = readStats();
+    writeStats(stats.first, stats.second + 1);
+  }
+
+  /*!
+   * @brief Show hit/miss counters and the usage of the cache
+   * @param [in,out] os  Output stream
+   */
+  void
+  showStats(std::ostream& os) const
+  {
+    std::pair<std::uintmax_t, std::uintmax_t> stats;
+    {
+      std::lock_guard<std::mutex> lock(statsMutex_);
+      stats = readStats();
+    }
+    std::vector<Entry> entries = listEntries();
+    std::uintmax_t totalSize = 0;
+    for (const auto& entry : entries) {
+      totalSize += entry.size;
+    }
+    os << "Cache directory: " << cacheDir_ << "\n"
+       << "  Hits: " << stats.first << "\n"
+       << "  Misses: " << stats.second << "\n"
+       << "  Entries: " << entries.size() << "\n"
+       << "  Size: " << totalSize << " / " << maxSize_ << " bytes" << std::endl;
+  }
+
+private:
+  /*!
+   * @brief Information of one cache entry
+   */
+  struct Entry
+  {
+    //! Path to the entry
+    std::string path;
+    //! Size of the entry
+    std::uintmax_t size;
+    //! Last modified time of the entry
+    std::time_t mtime;
+  };
+
+  //! Version of the cache format, which is mixed into every key
+  static constexpr const char* kFormatVersion = "oclc-binary-cache-v2";
+  //! Suffix of the cache entries
+  static constexpr const char* kEntrySuffix = ".bin";
+  //! File name of the hit/miss counters
+  static constexpr const char* kStatsFileName = "stats";
+  //! File name of the lock of the hit/miss counters across processes
+  static constexpr const char* kStatsLockFileName = "stats.lock";
+
+  /*!
+   * @brief Exclusive lock of a lock file, which is held until destruction
+   *
+   * Locking is best effort like the counters themselves, so a lock file which
+   * cannot be opened leaves the counters unlocked.
+   */
+  class StatsFileLock
+  {
+  public:
+    /*!
+     * @brief Open the lock file, creating it if it does not exist, and lock it
+     * @param [in] path  Path to the lock file
+     */
+    explicit StatsFileLock(const std::string& path) noexcept :
+#ifdef _WIN32
+      handle_(::CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr))
+#else
+      fd_(::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644))
+#endif  // _WIN32
+    {
+#ifdef _WIN32
+      if (handle_ != INVALID_HANDLE_VALUE) {
+        OVERLAPPED overlapped = {};
+        ::LockFileEx(handle_, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped);
+      }
+#else
+      while (fd_ != -1 && ::flock(fd_, LOCK_EX) == -1 && errno == EINTR) {
+      }
+#endif  // _WIN32
+    }
+
+    StatsFileLock(const StatsFileLock&) = delete;
+
+    StatsFileLock&
+    operator=(const StatsFileLock&) = delete;
+
+    /*!
+     * @brief Unlock and close the lock file
+     */
+    ~StatsFileLock()
+    {
+#ifdef _WIN32
+      if (handle_ != INVALID_HANDLE_VALUE) {
+        OVERLAPPED overlapped = {};
+        ::UnlockFileEx(handle_, 0, 1, 0, &overlapped);
+        ::CloseHandle(handle_);
+      }
+#else
+      if (fd_ != -1) {
+        ::flock(fd_, LOCK_UN);
+        ::close(fd_);
+      }
+#endif  // _WIN32
+    }
+
+  private:
+#ifdef _WIN32
+    //! Handle of the lock file
+    HANDLE handle_;
+#else
+    //! File descriptor of the lock file
+    int fd_;
+#endif  // _WIN32
+  };  // class StatsFileLock
+
+  //! Cache directory
+  const std::string cacheDir_;
+  //! Max total size of the cache entries in bytes
+  const std::uintmax_t maxSize_;
+  //! Mutex for read-modify-write of the hit/miss counters among threads
+  mutable std::mutex statsMutex_;
+
+  /*!
+   * @brief Get the path of the entry of the specified key
+   * @param [in] key  Cache key
+   * @return  Path to the entry
+   */
+  std::string
+  entryPath(const std::string& key) const
+  {
+    return cacheDir_ + "/" + key + kEntrySuffix;
+  }
+
+  /*!
+   * @brief Enumerate all entries in the cache directory
+   * @return  Entries in the cache directory
+   */
+  std::vector<Entry>
+  listEntries() const
+  {
+    static const std::string suffix(kEntrySuffix);
+    std::vector<Entry> entries;
+    for (const auto& name : listDirectory(cacheDir_)) {
+      if (name.length() <= suffix.length() || name.compare(name.length() - suffix.length(), suffix.length(), suffix) != 0) {
+        continue;
+      }
+      std::string path = cacheDir_ + "/" + name;
+      struct stat st;
+      if (::stat(path.c_str(), &st) == 0) {
+        entries.push_back(Entry{path, static_cast<std::uintmax_t>(st.st_size), st.st_mtime});
+      }
+    }
+    return entries;
+  }
+
+  /*!
+   * @brief Read the persistent hit/miss counters
+   * @return  Pair of the number of hits and misses
+   */
+  std::pair<std::uintmax_t, std::uintmax_t>
+  readStats() const
+  {
+    std::pair<std::uintmax_t, std::uintmax_t> stats(0, 0);
+    std::ifstream ifs(cacheDir_ + "/" + kStatsFileName);
+    if (ifs.is_open() && !(ifs >> stats.first >> stats.second)) {
+      stats = std::make_pair(0, 0);
+    }
+    return stats;
+  }
+
+  /*!
+   * @brief Write the persistent hit/miss counters
+   * @param [in] nHit   Number of hits
+   * @param [in] nMiss  Number of misses
+   */
+  void
+  writeStats(std::uintmax_t nHit, std::uintmax_t nMiss) const
+  {
+    std::string stats = std::to_string(nHit) + " " + std::to_string(nMiss) + "\n";
+    writeFileAtomically(cacheDir_ + "/" + kStatsFileName, stats.data(), stats.size());
+  }
+
+  /*!
+   * @brief Refresh the modification time of the specified file
+   * @param [in] path  File path
+   */
+  static void
+  touch(const std::string& path) noexcept
+  {
+#ifdef _WIN32
+    ::_utime(path.c_str(), nullptr);
+#else
+    ::utime(path.c_str(), nullptr);
+#endif  // _WIN32
+  }
+};  // class BinaryCache
+
+
+#endif  // OCL_BINARY_CACHE
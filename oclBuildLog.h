@@ -0,0 +1,111 @@
+#ifndef OCL_BUILD_LOG
+#define OCL_BUILD_LOG
+
+
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+
+#include <kotlib/macro.h>
+
+
+/*!
+ * @brief Writer of build logs to stderr or a log file
+ *
+ * Each log is written with one call under a mutex, so that logs of builds on
+ * multiple threads are never interleaved.
+ * When the writer is disabled, as on the compile server which has no user to
+ * show the logs to, the logs are returned to the caller instead.
+ */
+class BuildLogWriter
+{
+public:
+  /*!
+   * @brief Construct a writer to stderr
+   */
+  BuildLogWriter() :
+    mtx_(),
+    ofs_(),
+    filename_(),
+    isEnabled_(true)
+  {}
+
+  BuildLogWriter(const BuildLogWriter&) = delete;
+
+  BuildLogWriter&
+  operator=(const BuildLogWriter&) = delete;
+
+  /*!
+   * @brief Write logs to the specified file instead of stderr
+   * @param [in] filename  Log file name, which is truncated
+   */
+  void
+  open(const std::string& filename)
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    ofs_.open(filename.c_str(), std::ios::binary | std::ios::trunc);
+    KOTLIB_THROW_IF(!ofs_.is_open(), std::runtime_error, "Failed to open log file: " + filename);
+    filename_ = filename;
+  }
+
+  /*!
+   * @brief Disable writing, so that callers return the logs with errors
+   */
+  void
+  disable() noexcept
+  {
+    isEnabled_ = false;
+  }
+
+  /*!
+   * @brief Check whether the writer is enabled or not
+   * @return  true if the logs are written by this writer, otherwise false
+   */
+  bool
+  isEnabled() const noexcept
+  {
+    return isEnabled_;
+  }
+
+  /*!
+   * @brief Get the log file name
+   * @return  Log file name, or empty if the logs are written to stderr
+   */
+  const std::string&
+  getFilename() const noexcept
+  {
+    return filename_;
+  }
+
+  /*!
+   * @brief Write one log with its title
+   * @param [in] title  Title which is written before the log
+   * @param [in] log    Log to write
+   */
+  void
+  write(const std::string& title, const std::string& log)
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::ostream& os = ofs_.is_open() ? static_cast<std::ostream&>(ofs_) : std::cerr;
+    os << "=== " << title << " ===\n";
+    os.write(log.data(), static_cast<std::streamsize>(log.size()));
+    if (!log.empty() && log.back() != '\n') {
+      os << '\n';
+    }
+    os.flush();
+  }
+
+private:
+  //! Mutex for the output stream
+  std::mutex mtx_;
+  //! Log file stream, which is not opened when writing to stderr
+  std::ofstream ofs_;
+  //! Log file name
+  std::string filename_;
+  //! Whether this writer writes the logs or not
+  bool isEnabled_;
+};  // class BuildLogWriter
+
+
+#endif  // OCL_BUILD_LOG
@@ -0,0 +1,461 @@
+#ifndef OCL_DEVICE_INVENTORY
+#define OCL_DEVICE_INVENTORY
+
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <sys/utsname.h>
+#endif  // _WIN32
+
+#include <kotlib/macro.h>
+#include "oclBinaryCache.h"
+#include "oclFileUtil.h"
+
+
+//! Header line of device inventory files, which is changed when the format changes
+static constexpr const char* kDeviceInventoryFormat = "oclc-device-inventory-v2";
+
+
+/*!
+ * @brief Capabilities of one device which are recorded in the device inventory
+ */
+struct DeviceRecord
+{
+  //! Device name (CL_DEVICE_NAME)
+  std::string name;
+  //! Device vendor (CL_DEVICE_VENDOR)
+  std::string vendor;
+  //! Device version (CL_DEVICE_VERSION)
+  std::string version;
+  //! Driver version (CL_DRIVER_VERSION)
+  std::string driverVersion;
+  //! Space-separated extensions (CL_DEVICE_EXTENSIONS)
+  std::string extensions;
+  //! Device type bits (CL_DEVICE_TYPE)
+  std::uint64_t type;
+  //! Number of compute units (CL_DEVICE_MAX_COMPUTE_UNITS)
+  std::uint64_t maxComputeUnits;
+  //! Max work-group size (CL_DEVICE_MAX_WORK_GROUP_SIZE)
+  std::uint64_t maxWorkGroupSize;
+};
+
+
+/*!
+ * @brief One platform and its devices which are recorded in the device inventory
+ */
+struct PlatformRecord
+{
+  //! Platform name (CL_PLATFORM_NAME)
+  std::string name;
+  //! Platform vendor (CL_PLATFORM_VENDOR)
+  std::string vendor;
+  //! Platform version (CL_PLATFORM_VERSION)
+  std::string version;
+  //! All devices of the platform, in the order of clGetDeviceIDs() with CL_DEVICE_TYPE_ALL
+  std::vector<DeviceRecord> devices;
+  //! Indices of devices which clGetDeviceIDs() returns for each device type name, such as "gpu"
+  std::vector<std::pair<std::string, std::vector<std::size_t> > > typeDevices;
+};
+
+
+/*!
+ * @brief Persistent inventory of platforms and devices
+ *
+ * Enumerating platforms loads every vendor driver, which can take hundreds of
+ * milliseconds, so the inventory is saved to a file and reused as long as the
+ * fingerprint of the installed drivers is unchanged.
+ * The file is a text file whose fields are separated by tabs, with tabs,
+ * newlines and backslashes escaped.
+ */
+class DeviceInventory
+{
+public:
+  /*!
+   * @brief Construct empty inventory
+   * @param [in] fingerprint  Fingerprint of the drivers which the inventory is probed with
+   */
+  explicit DeviceInventory(const std::string& fingerprint = "") :
+    fingerprint_(fingerprint),
+    platforms_()
+  {}
+
+  /*!
+   * @brief Get the default path of the inventory file
+   *
+   * The file is placed in the user cache directory: $XDG_CACHE_HOME,
+   * $HOME/.cache, or %LOCALAPPDATA% on Windows.
+   * @return  Path of the inventory file, or empty if no cache directory is known
+   */
+  static std::string
+  getDefaultPath()
+  {
+#ifdef _WIN32
+    const char* dir = std::getenv("LOCALAPPDATA");
+    return dir == nullptr || *dir == '\0' ? "" : std::string(dir) + "\\oclc\\devices";
+#else
+    const char* dir = std::getenv("XDG_CACHE_HOME");
+    if (dir != nullptr && *dir != '\0') {
+      return std::string(dir) + "/oclc/devices";
+    }
+    dir = std::getenv("HOME");
+    return dir == nullptr || *dir == '\0' ? "" : std::string(dir) + "/.cache/oclc/devices";
+#endif  // _WIN32
+  }
+
+  /*!
+   * @brief Compute the fingerprint of the installed OpenCL drivers without loading them
+   *
+   * The fingerprint covers the ICD registry (the vendor files of the ICD
+   * loader, or the registry on Windows), the size and modification time of
+   * each driver library, the environment variables which redirect the ICD
+   * loader, and the operating system version.
+   * @return  Hex string of the fingerprint
+   */
+  static std::string
+  getDriverFingerprint()
+  {
+    XxHash64 hasher;
+    hasher.update(kDeviceInventoryFormat);
+#ifdef _WIN32
+    HKEY hKey;
+    if (::RegOpenKeyExA(HKEY_LOCAL_MACHINE, "SOFTWARE\\Khronos\\OpenCL\\Vendors", 0, KEY_READ, &hKey) == ERROR_SUCCESS) {
+      std::vector<std::string> libraries;
+      char name[MAX_PATH];
+      for (DWORD i = 0; ; i++) {
+        DWORD nameSize = sizeof(name);
+        if (::RegEnumValueA(hKey, i, name, &nameSize, nullptr, nullptr, nullptr, nullptr) != ERROR_SUCCESS) {
+          break;
+        }
+        libraries.emplace_back(name, nameSize);
+      }
+      ::RegCloseKey(hKey);
+      std::sort(libraries.begin(), libraries.end());
+      for (const auto& library : libraries) {
+        hasher.update(library).update(getFileStamp(library));
+      }
+    }
+#else
+    static const char* const kEnvNames[] = {"OCL_ICD_VENDORS", "OCL_ICD_FILENAMES", "OPENCL_VENDOR_PATH", "LD_LIBRARY_PATH"};
+    for (const auto& envName : kEnvNames) {
+      const char* value = std::getenv(envName);
+      hasher.update(value == nullptr ? "" : value);
+    }
+    const char* vendorDir = std::getenv("OCL_ICD_VENDORS");
+    std::string icdDir = vendorDir != nullptr && *vendorDir != '\0' ? vendorDir : "/etc/OpenCL/vendors";
+    std::vector<std::string> names = listDirectory(icdDir);
+    std::sort(names.begin(), names.end());
+    for (const auto& name : names) {
+      if (name.length() < 4 || name.compare(name.length() - 4, 4, ".icd") != 0) {
+        continue;
+      }
+      std::ifstream ifs((icdDir + "/" + name).c_str());
+      std::string library;
+      std::getline(ifs, library);
+      library.erase(library.find_last_not_of(" \t\r") + 1);
+      hasher.update(name).update(library).update(getFileStamp(findLibrary(library)));
+    }
+    std::istringstream filenames(std::getenv("OCL_ICD_FILENAMES") == nullptr ? "" : std::getenv("OCL_ICD_FILENAMES"));
+    for (std::string library; std::getline(filenames, library, ':');) {
+      hasher.update(getFileStamp(library));
+    }
+    struct utsname uts;
+    if (::uname(&uts) == 0) {
+      hasher.update(uts.sysname).update(uts.release).update(uts.version).update(uts.machine);
+    }
+#endif  // _WIN32
+    return hasher.hexdigest();
+  }
+
+  /*!
+   * @brief Load the inventory from a file
+   * @param [in] path  Path of the inventory file
+   * @return  true if the file is read and valid, otherwise false
+   */
+  bool
+  load(const std::string& path)
+  {
+    std::ifstream ifs(path.c_str(), std::ios::binary);
+    std::string line;
+    if (!std::getline(ifs, line) || line != kDeviceInventoryFormat) {
+      return false;
+    }
+    fingerprint_.clear();
+    platforms_.clear();
+    // A broken file, such as one written by another version, is treated as missing
+    try {
+      for (; std::getline(ifs, line);) {
+        std::vector<std::string> fields = splitFields(line);
+        if (fields[0] == "fingerprint" && fields.size() == 2) {
+          fingerprint_ = fields[1];
+        } else if (fields[0] == "platform" && fields.size() == 4) {
+          platforms_.emplace_back(PlatformRecord{fields[1], fields[2], fields[3], {}, {}});
+        } else if (fields[0] == "device" && fields.size() == 9 && !platforms_.empty()) {
+          platforms_.back().devices.emplace_back(DeviceRecord{fields[1], fields[2], fields[3], fields[4], fields[5],
+              std::stoull(fields[6]), std::stoull(fields[7]), std::stoull(fields[8])});
+        } else if (fields[0] == "type" && fields.size() >= 2 && !platforms_.empty()) {
+          std::vector<std::size_t> indices;
+          for (decltype(fields)::size_type i = 2; i < fields.size(); i++) {
+            indices.emplace_back(static_cast<std::size_t>(std::stoull(fields[i])));
+            if (indices.back() >= platforms_.back().devices.size()) {
+              return false;
+            }
+          }
+          platforms_.back().typeDevices.emplace_back(fields[1], std::move(indices));
+        } else {
+          return false;
+        }
+      }
+    } catch (const std::exception&) {
+      return false;
+    }
+    return !fingerprint_.empty();
+  }
+
+  /*!
+   * @brief Save the inventory to a file atomically, creating its directory
+   * @param [in] path  Path of the inventory file
+   * @return  true if succeeded, otherwise false
+   */
+  bool
+  save(const std::string& path) const
+  {
+    std::string::size_type pos = path.find_last_of("/\\");
+    try {
+      if (pos != std::string::npos && pos > 0) {
+        makeDirectories(path.substr(0, pos));
+      }
+    } catch (const std::runtime_error&) {
+      return false;
+    }
+    return writeStreamAtomically(path, [this](std::ostream& os) {
+      os << kDeviceInventoryFormat << "\n"
+         << "fingerprint\t" << escapeField(fingerprint_) << "\n";
+      for (const auto& platform : platforms_) {
+        os << "platform\t" << escapeField(platform.name) << "\t" << escapeField(platform.vendor) << "\t"
+           << escapeField(platform.version) << "\n";
+        for (const auto& device : platform.devices) {
+          os << "device\t" << escapeField(device.name) << "\t" << escapeField(device.vendor) << "\t" << escapeField(device.version) << "\t"
+             << escapeField(device.driverVersion) << "\t" << escapeField(device.extensions) << "\t"
+             << device.type << "\t" << device.maxComputeUnits << "\t" << device.maxWorkGroupSize << "\n";
+        }
+        for (const auto& typeDevices : platform.typeDevices) {
+          os << "type\t" << escapeField(typeDevices.first);
+          for (const auto& index : typeDevices.second) {
+            os << "\t" << index;
+          }
+          os << "\n";
+        }
+      }
+    });
+  }
+
+  /*!
+   * @brief Add a probed platform
+   * @param [in] platform  Platform and its devices
+   */
+  void
+  addPlatform(PlatformRecord&& platform)
+  {
+    platforms_.emplace_back(std::move(platform));
+  }
+
+  /*!
+   * @brief Get the fingerprint of the drivers which the inventory is probed with
+   * @return  Fingerprint of the drivers
+   */
+  const std::string&
+  getFingerprint() const noexcept
+  {
+    return fingerprint_;
+  }
+
+  /*!
+   * @brief Get all platforms
+   * @return  Platforms in the order of clGetPlatformIDs()
+   */
+  const std::vector<PlatformRecord>&
+  getPlatforms() const noexcept
+  {
+    return platforms_;
+  }
+
+  /*!
+   * @brief Get the devices which clGetDeviceIDs() returns for a device type
+   * @param [in] platformIndex  Platform index
+   * @param [in] typeName       Device type name, such as "gpu"
+   * @return  Devices of the type, which are empty if the platform index is invalid
+   */
+  std::vector<const DeviceRecord*>
+  getDevices(std::size_t platformIndex, const std::string& typeName) const
+  {
+    std::vector<const DeviceRecord*> devices;
+    if (platformIndex >= platforms_.size()) {
+      return devices;
+    }
+    const PlatformRecord& platform = platforms_[platformIndex];
+    for (const auto& typeDevices : platform.typeDevices) {
+      if (typeDevices.first != typeName) {
+        continue;
+      }
+      for (const auto& index : typeDevices.second) {
+        devices.emplace_back(&platform.devices[index]);
+      }
+    }
+    return devices;
+  }
+
+  /*!
+   * @brief Get the identities of the target devices
+   * @param [in] platformIndex  Platform index
+   * @param [in] typeName       Device type name, such as "gpu"
+   * @param [in] deviceIndex    Index of the first target device
+   * @return  Identities of the devices from the first target device, or empty if either index is invalid
+   */
+  std::vector<std::string>
+  getIdentities(std::size_t platformIndex, const std::string& typeName, std::size_t deviceIndex) const
+  {
+    std::vector<std::string> identities;
+    std::vector<const DeviceRecord*> devices = getDevices(platformIndex, typeName);
+    for (decltype(devices)::size_type i = deviceIndex; i < devices.size(); i++) {
+      const PlatformRecord& platform = platforms_[platformIndex];
+      identities.emplace_back(makeIdentity(platform.name, platform.version, devices[i]->name, devices[i]->version, devices[i]->driverVersion));
+    }
+    return identities;
+  }
+
+  /*!
+   * @brief Make the string which identifies the compiler for a device
+   * @param [in] platformName     Platform name
+   * @param [in] platformVersion  Platform version
+   * @param [in] deviceName       Device name
+   * @param [in] deviceVersion    Device version
+   * @param [in] driverVersion    Driver version
+   * @return  Identity string, which is mixed into binary cache keys
+   */
+  static std::string
+  makeIdentity(
+      const std::string& platformName,
+      const std::string& platformVersion,
+      const std::string& deviceName,
+      const std::string& deviceVersion,
+      const std::string& driverVersion)
+  {
+    return platformName + "\n" + platformVersion + "\n" + deviceName + "\n" + deviceVersion + "\n" + driverVersion;
+  }
+
+private:
+  //! Fingerprint of the drivers
+  std::string fingerprint_;
+  //! Platforms and their devices
+  std::vector<PlatformRecord> platforms_;
+
+  /*!
+   * @brief Escape tabs, newlines and backslashes of a field
+   * @param [in] field  Field to escape
+   * @return  Escaped field
+   */
+  static std::string
+  escapeField(const std::string& field)
+  {
+    std::string escaped;
+    for (auto c : field) {
+      if (c == '\\') {
+        escaped += "\\\\";
+      } else if (c == '\t') {
+        escaped += "\\t";
+      } else if (c == '\n') {
+        escaped += "\\n";
+      } else {
+        escaped += c;
+      }
+    }
+    return escaped;
+  }
+
+  /*!
+   * @brief Split a line into unescaped fields
+   * @param [in] line  Line of the inventory file
+   * @return  Fields of the line
+   */
+  static std::vector<std::string>
+  splitFields(const std::string& line)
+  {
+    std::vector<std::string> fields(1);
+    for (std::string::size_type i = 0; i < line.length(); i++) {
+      if (line[i] == '\t') {
+        fields.emplace_back();
+      } else if (line[i] == '\\' && i + 1 < line.length()) {
+        i++;
+        fields.back() += line[i] == 't' ? '\t' : line[i] == 'n' ? '\n' : line[i];
+      } else {
+        fields.back() += line[i];
+      }
+    }
+    return fields;
+  }
+
+#ifndef _WIN32
+  /*!
+   * @brief Find a driver library which is named in an ICD vendor file
+   *
+   * A name without a directory is searched in $LD_LIBRARY_PATH and the usual
+   * library directories, as the dynamic loader does.
+   * @param [in] library  Library path or name
+   * @return  Path of the library, or the given name if it is not found
+   */
+  static std::string
+  findLibrary(const std::string& library)
+  {
+    if (library.find('/') != std::string::npos) {
+      return library;
+    }
+    std::vector<std::string> dirs;
+    std::istringstream iss(std::getenv("LD_LIBRARY_PATH") == nullptr ? "" : std::getenv("LD_LIBRARY_PATH"));
+    for (std::string dir; std::getline(iss, dir, ':');) {
+      dirs.emplace_back(dir);
+    }
+    for (const auto& dir : {"/usr/local/lib", "/usr/lib/x86_64-linux-gnu", "/usr/lib/aarch64-linux-gnu", "/usr/lib64", "/usr/lib", "/lib64", "/lib"}) {
+      dirs.emplace_back(dir);
+    }
+    for (const auto& dir : dirs) {
+      struct stat st;
+      std::string path = dir + "/" + library;
+      if (::stat(path.c_str(), &st) == 0) {
+        return path;
+      }
+    }
+    return library;
+  }
+#endif  // _WIN32
+
+  /*!
+   * @brief Get the size and the modification time of a file
+   * @param [in] path  File path, which is resolved through symbolic links
+   * @return  String of the size and the modification time, or empty if the file does not exist
+   */
+  static std::string
+  getFileStamp(const std::string& path)
+  {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) {
+      return "";
+    }
+    return std::to_string(static_cast<long long>(st.st_size)) + " " + std::to_string(static_cast<long long>(st.st_mtime));
+  }
+};  // class DeviceInventory
+
+
+#endif  // OCL_DEVICE_INVENTORY
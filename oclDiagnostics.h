@@ -0,0 +1,389 @@
+#ifndef OCL_DIAGNOSTICS
+#define OCL_DIAGNOSTICS
+
+
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifdef __APPLE__
+#  include <OpenCL/opencl.h>
+#else
+#  include <CL/cl.h>
+#endif
+
+#include "oclErrorCode.h"
+#include "oclKernelReport.h"
+
+
+//! Severities of compiler diagnostics in build logs
+static constexpr const char* kDiagnosticSeverities[] = {"fatal error", "error", "warning", "note", "remark"};
+
+
+/*!
+ * @brief One compiler diagnostic parsed from a build log
+ */
+struct SourceDiagnostic
+{
+  //! Source file name as the compiler reports it, or empty if not located
+  std::string file;
+  //! Line number, or 0 if not located
+  std::uint64_t line;
+  //! Column number, or 0 if not reported
+  std::uint64_t column;
+  //! Severity such as "error" and "warning"
+  std::string severity;
+  //! Message
+  std::string message;
+};
+
+
+/*!
+ * @brief Build status of one program for one device
+ */
+struct DeviceDiagnostics
+{
+  //! Output file name, or empty if nothing is written
+  std::string output;
+  //! Device name, or empty if the device is not queried, as for cached binaries
+  std::string device;
+  //! Status, which is "succeeded", "failed", "skipped", "cached" or "revalidated"
+  std::string status;
+  //! Build log
+  std::string log;
+};
+
+
+/*!
+ * @brief Build status of one program for all target devices
+ */
+struct BuildDiagnostics
+{
+  //! OpenCL error code of the first failed build, or CL_SUCCESS
+  cl_int errCode;
+  //! Message of the failure which is not a build error, such as a missing file, or empty
+  std::string message;
+  //! Status for each device
+  std::vector<DeviceDiagnostics> devices;
+
+  /*!
+   * @brief Check whether the program failed or not
+   * @return  true if any build or step failed, otherwise false
+   */
+  bool
+  isFailed() const noexcept
+  {
+    return errCode != CL_SUCCESS || !message.empty();
+  }
+
+  /*!
+   * @brief Record binaries which are written from the cache
+   * @param [in] filenames  Output file names
+   */
+  void
+  addCached(const std::vector<std::string>& filenames)
+  {
+    for (const auto& filename : filenames) {
+      devices.emplace_back(DeviceDiagnostics{filename, "", "cached", ""});
+    }
+  }
+};
+
+
+/*!
+ * @brief Check whether a string is a non-empty sequence of decimal digits
+ * @param [in] str  String to check
+ * @return  true if all characters are digits, otherwise false
+ */
+static inline bool
+isDecimalString(const std::string& str) noexcept
+{
+  return !str.empty() && str.find_first_not_of("0123456789") == std::string::npos;
+}
+
+
+/*!
+ * @brief Parse the location of a diagnostic, which precedes its severity
+ *
+ * Both "FILE:LINE:COLUMN" and "FILE:LINE" of clang-based compilers, and
+ * "FILE(LINE)" of EDG-based compilers are recognized.
+ * @param [in]  location    Text before ": SEVERITY: "
+ * @param [out] diagnostic  Diagnostic whose file, line and column are set
+ * @return  true if the location is recognized, otherwise false
+ */
+static inline bool
+parseDiagnosticLocation(const std::string& location, SourceDiagnostic& diagnostic)
+{
+  if (!location.empty() && location.back() == ')') {
+    std::string::size_type pos = location.rfind('(');
+    std::string line = pos == std::string::npos ? "" : location.substr(pos + 1, location.size() - pos - 2);
+    if (!isDecimalString(line)) {
+      return false;
+    }
+    diagnostic.file = location.substr(0, pos);
+    diagnostic.line = std::stoull(line);
+    return true;
+  }
+  std::string::size_type pos = location.rfind(':');
+  if (pos == std::string::npos || !isDecimalString(location.substr(pos + 1))) {
+    return false;
+  }
+  std::uint64_t last = std::stoull(location.substr(pos + 1));
+  std::string::size_type linePos = location.rfind(':', pos - 1);
+  if (pos > 0 && linePos != std::string::npos && isDecimalString(location.substr(linePos + 1, pos - linePos - 1))) {
+    diagnostic.file = location.substr(0, linePos);
+    diagnostic.line = std::stoull(location.substr(linePos + 1, pos - linePos - 1));
+    diagnostic.column = last;
+  } else {
+    diagnostic.file = location.substr(0, pos);
+    diagnostic.line = last;
+  }
+  return true;
+}
+
+
+/*!
+ * @brief Parse compiler diagnostics in a build log
+ *
+ * A diagnostic is a line "LOCATION: SEVERITY: MESSAGE" or "SEVERITY: MESSAGE",
+ * and the other lines, such as source excerpts and carets, are ignored.
+ * @param [in] log  Build log
+ * @return  Diagnostics in the order of the log
+ */
+static inline std::vector<SourceDiagnostic>
+parseBuildLogDiagnostics(const std::string& log)
+{
+  std::vector<SourceDiagnostic> diagnostics;
+  std::string::size_type first = 0;
+  while (first < log.size()) {
+    std::string::size_type last = log.find('\n', first);
+    std::string line = log.substr(first, last == std::string::npos ? std::string::npos : last - first);
+    first = last == std::string::npos ? log.size() : last + 1;
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+
+    // Take the earliest severity, so that a message which mentions another severity is kept whole
+    std::string::size_type pos = std::string::npos;
+    std::string severity;
+    for (const auto& s : kDiagnosticSeverities) {
+      std::string label = s;
+      if (line.compare(0, label.size() + 2, label + ": ") == 0) {
+        pos = 0;
+        severity = label;
+        break;
+      }
+      std::string::size_type p = line.find(": " + label + ": ");
+      if (p != std::string::npos && p < pos) {
+        pos = p;
+        severity = label;
+      }
+    }
+    if (severity.empty()) {
+      continue;
+    }
+    SourceDiagnostic diagnostic{"", 0, 0, severity, ""};
+    if (pos == 0) {
+      diagnostic.message = line.substr(severity.size() + 2);
+    } else if (parseDiagnosticLocation(line.substr(0, pos), diagnostic)) {
+      diagnostic.message = line.substr(pos + severity.size() + 4);
+    } else {
+      continue;
+    }
+    diagnostics.emplace_back(std::move(diagnostic));
+  }
+  return diagnostics;
+}
+
+
+/*!
+ * @brief Collector of build status of all programs, which is written as JSON with --diagnostics=json
+ *
+ * Programs are added from worker threads under a mutex, and the builds of one
+ * program for multiple platforms are merged into one entry.
+ */
+class DiagnosticsWriter
+{
+public:
+  /*!
+   * @brief Construct a disabled writer
+   */
+  DiagnosticsWriter() :
+    mtx_(),
+    isEnabled_(false),
+    entries_()
+  {}
+
+  DiagnosticsWriter(const DiagnosticsWriter&) = delete;
+
+  DiagnosticsWriter&
+  operator=(const DiagnosticsWriter&) = delete;
+
+  /*!
+   * @brief Enable collection
+   */
+  void
+  enable() noexcept
+  {
+    isEnabled_ = true;
+  }
+
+  /*!
+   * @brief Check whether collection is enabled or not
+   * @return  true if enabled, otherwise false
+   */
+  bool
+  isEnabled() const noexcept
+  {
+    return isEnabled_;
+  }
+
+  /*!
+   * @brief Add build status of a program
+   * @param [in] input        Kernel source files of the program
+   * @param [in] diagnostics  Build status
+   */
+  void
+  add(const std::string& input, BuildDiagnostics&& diagnostics)
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = entries_.find(input);
+    if (it == entries_.end()) {
+      entries_.emplace(input, std::move(diagnostics));
+      return;
+    }
+    BuildDiagnostics& entry = it->second;
+    if (entry.errCode == CL_SUCCESS) {
+      entry.errCode = diagnostics.errCode;
+    }
+    if (entry.message.empty()) {
+      entry.message = std::move(diagnostics.message);
+    }
+    for (auto& device : diagnostics.devices) {
+      entry.devices.emplace_back(std::move(device));
+    }
+  }
+
+  /*!
+   * @brief Add a failure of a program which is not a build error
+   * @param [in] input    Kernel source files of the program
+   * @param [in] message  Error message
+   */
+  void
+  addFailure(const std::string& input, const std::string& message)
+  {
+    add(input, BuildDiagnostics{CL_SUCCESS, message, {}});
+  }
+
+  /*!
+   * @brief Write the build status of all programs
+   *
+   * The programs are sorted by input, so that the output does not depend on
+   * the order in which the builds finish.
+   * @param [out] os  Output stream
+   */
+  void
+  write(std::ostream& os) const
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    os << "{\"programs\": [";
+    bool isFirst = true;
+    for (const auto& kv : entries_) {
+      const BuildDiagnostics& entry = kv.second;
+      bool isCached = !entry.devices.empty();
+      for (const auto& device : entry.devices) {
+        isCached = isCached && device.status == "cached";
+      }
+      os << (isFirst ? "" : ",") << "\n  {\"input\": " << quoteJsonString(kv.first)
+         << ", \"status\": \"" << (entry.isFailed() ? "failed" : isCached ? "cached" : "succeeded") << "\"";
+      isFirst = false;
+      if (entry.errCode != CL_SUCCESS) {
+        auto it = kErrorMessageMap.find(entry.errCode);
+        os << ", \"errorCode\": " << entry.errCode
+           << ", \"error\": " << quoteJsonString(it == kErrorMessageMap.end() ? "Unknown error" : it->second);
+      }
+      if (!entry.message.empty()) {
+        os << ", \"message\": " << quoteJsonString(entry.message);
+      }
+      os << ", \"devices\": [";
+      for (decltype(entry.devices)::size_type i = 0; i < entry.devices.size(); i++) {
+        const DeviceDiagnostics& device = entry.devices[i];
+        os << (i == 0 ? "" : ",") << "\n    {";
+        if (!device.output.empty()) {
+          os << "\"output\": " << quoteJsonString(device.output) << ", ";
+        }
+        if (!device.device.empty()) {
+          os << "\"device\": " << quoteJsonString(device.device) << ", ";
+        }
+        os << "\"status\": \"" << device.status << "\", \"diagnostics\": [";
+        std::vector<SourceDiagnostic> diagnostics = parseBuildLogDiagnostics(device.log);
+        for (decltype(diagnostics)::size_type j = 0; j < diagnostics.size(); j++) {
+          const SourceDiagnostic& d = diagnostics[j];
+          os << (j == 0 ? "" : ", ") << "{\"file\": " << quoteJsonString(d.file) << ", \"line\": " << d.line << ", \"column\": " << d.column
+             << ", \"severity\": " << quoteJsonString(d.severity) << ", \"message\": " << quoteJsonString(d.message) << "}";
+        }
+        os << "], \"log\": " << quoteJsonString(device.log) << "}";
+      }
+      os << (entry.devices.empty() ? "]}" : "\n  ]}");
+    }
+    os << "\n]}\n";
+    os.flush();
+  }
+
+private:
+  //! Mutex for the entries
+  mutable std::mutex mtx_;
+  //! Whether collection is enabled or not
+  bool isEnabled_;
+  //! Build status for each input
+  std::map<std::string, BuildDiagnostics> entries_;
+};  // class DiagnosticsWriter
+
+
+/*!
+ * @brief Writer of the build status to stdout when leaving a scope, as well as
+ *        when some builds fail
+ */
+class DiagnosticsFlusher
+{
+public:
+  /*!
+   * @brief Remember the writer to flush
+   * @param [in] writer  Collector of the build status
+   */
+  explicit DiagnosticsFlusher(const DiagnosticsWriter& writer) noexcept :
+    writer_(writer)
+  {}
+
+  DiagnosticsFlusher(const DiagnosticsFlusher&) = delete;
+
+  DiagnosticsFlusher&
+  operator=(const DiagnosticsFlusher&) = delete;
+
+  /*!
+   * @brief Write the build status if enabled
+   */
+  ~DiagnosticsFlusher()
+  {
+    if (!writer_.isEnabled()) {
+      return;
+    }
+    try {
+      writer_.write(std::cout);
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+    }
+  }
+
+private:
+  //! Collector of the build status
+  const DiagnosticsWriter& writer_;
+};  // class DiagnosticsFlusher
+
+
+#endif  // OCL_DIAGNOSTICS
@@ -0,0 +1,595 @@
+#ifndef OCL_EMBED
+#define OCL_EMBED
+
+
+#include <cctype>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <kotlib/macro.h>
+#include "oclFatBinary.h"
+#include "oclFileUtil.h"
+
+
+/*!
+ * @brief Symbol which is defined in an embedded binary
+ *
+ * A fat binary image is embedded so that its binaries are mapped in with the
+ * executable, and parseFatBinary() finds the binary for a device at run time.
+ * Following symbols are defined, where all sizes are 64-bit unsigned integers.
+ *
+ *   SYMBOL         Fat binary image, aligned to the page size
+ *   SYMBOL_size    Size of the image
+ *   SYMBOL_count   Number of binaries
+ *   SYMBOL_<i>     i-th binary in the image, aligned to the page size
+ *   SYMBOL_<i>_size  Size of the i-th binary
+ */
+struct EmbedSymbol
+{
+  //! Symbol name
+  std::string name;
+  //! Offset from the top of the embedded data
+  std::uint64_t offset;
+  //! Size of the object
+  std::uint64_t size;
+};
+
+
+#ifdef _WIN32
+//! Suffix of object files of the host
+static constexpr const char* kEmbedObjectSuffix = ".obj";
+#else
+//! Suffix of object files of the host
+static constexpr const char* kEmbedObjectSuffix = ".o";
+#endif  // _WIN32
+//! Max number of bytes converted to text at once
+static constexpr std::size_t kEmbedChunkSize = 64 * 1024;
+
+
+/*!
+ * @brief Make a C identifier from a file name
+ * @param [in] filename  File name
+ * @return  C identifier which consists of the base name without suffix
+ */
+static inline std::string
+makeEmbedSymbolName(const std::string& filename)
+{
+  std::string::size_type pos = filename.find_last_of("/\\");
+  std::string name = pos == std::string::npos ? filename : filename.substr(pos + 1);
+  name = name.substr(0, name.find('.'));
+  for (auto& c : name) {
+    if (!std::isalnum(static_cast<unsigned char>(c))) {
+      c = '_';
+    }
+  }
+  if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0]))) {
+    name = "_" + name;
+  }
+  return name;
+}
+
+
+/*!
+ * @brief Quote a string as a C string literal
+ * @param [in] str  String to quote
+ * @return  Quoted string
+ */
+static inline std::string
+quoteCString(const std::string& str)
+{
+  std::string quoted = "\"";
+  for (auto c : str) {
+    unsigned char uc = static_cast<unsigned char>(c);
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    } else if (uc < 0x20 || uc >= 0x7f) {
+      // Always use three octal digits so that a following digit is not taken in
+      quoted += '\\';
+      quoted += static_cast<char>('0' + (uc >> 6));
+      quoted += static_cast<char>('0' + ((uc >> 3) & 7));
+      quoted += static_cast<char>('0' + (uc & 7));
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "\"";
+}
+
+
+/*!
+ * @brief Append a little-endian unsigned integer
+ * @param [in,out] bytes  Byte sequence
+ * @param [in]     value  Value to append
+ * @param [in]     nByte  Number of bytes of the value
+ */
+static inline void
+appendEmbedLe(std::string& bytes, std::uint64_t value, int nByte)
+{
+  for (int i = 0; i < nByte; i++) {
+    bytes += static_cast<char>(static_cast<unsigned char>(value >> (i * 8)));
+  }
+}
+
+
+/*!
+ * @brief Layout of a fat binary image which is streamed without building it in memory
+ */
+class EmbedImage
+{
+public:
+  /*!
+   * @brief Compute the layout of the image and the symbols
+   *
+   * A table of the sizes follows the image, aligned to 8 bytes.
+   * @param [in] symbol   Base name of the symbols
+   * @param [in] entries  Binaries for each device, which must outlive this object
+   */
+  EmbedImage(const std::string& symbol, const std::vector<FatBinaryEntry>& entries) :
+    entries_(entries),
+    header_(),
+    offsets_(),
+    imageSize_(0),
+    sizeTable_(),
+    symbols_()
+  {
+    header_ = makeFatBinaryHeader(entries_, offsets_);
+    imageSize_ = entries_.empty() ? header_.size() : offsets_.back() + entries_.back().size;
+    std::uint64_t tableOffset = getSizeTableOffset();
+    symbols_.push_back(EmbedSymbol{symbol, 0, imageSize_});
+    symbols_.push_back(EmbedSymbol{symbol + "_size", tableOffset, 8});
+    symbols_.push_back(EmbedSymbol{symbol + "_count", tableOffset + 8, 8});
+    appendEmbedLe(sizeTable_, imageSize_, 8);
+    appendEmbedLe(sizeTable_, entries_.size(), 8);
+    for (std::remove_reference<decltype(entries)>::type::size_type i = 0; i < entries_.size(); i++) {
+      std::string name = symbol + "_" + std::to_string(i);
+      symbols_.push_back(EmbedSymbol{name, offsets_[i], entries_[i].size});
+      symbols_.push_back(EmbedSymbol{name + "_size", tableOffset + 16 + i * 8, 8});
+      appendEmbedLe(sizeTable_, entries_[i].size, 8);
+    }
+  }
+
+  /*!
+   * @brief Get the size of the fat binary image
+   * @return  Size of the image
+   */
+  std::uint64_t
+  getImageSize() const noexcept
+  {
+    return imageSize_;
+  }
+
+  /*!
+   * @brief Get the offset of the size table
+   * @return  Offset of the size table from the top of the image
+   */
+  std::uint64_t
+  getSizeTableOffset() const noexcept
+  {
+    return (imageSize_ + 7) / 8 * 8;
+  }
+
+  /*!
+   * @brief Get the size of the whole data, which is the image and the size table
+   * @return  Size of the whole data
+   */
+  std::uint64_t
+  getDataSize() const noexcept
+  {
+    return getSizeTableOffset() + sizeTable_.size();
+  }
+
+  /*!
+   * @brief Get the symbols
+   * @return  Symbols in the data
+   */
+  const std::vector<EmbedSymbol>&
+  getSymbols() const noexcept
+  {
+    return symbols_;
+  }
+
+  /*!
+   * @brief Pass the image to the function chunk by chunk
+   *
+   * The payloads are passed as they are, so that memory-mapped binaries are
+   * never copied.
+   * @tparam F  Type of the function, (const char* data, std::size_t size) -> void
+   * @param [in] f  Function which consumes the chunks
+   */
+  template<typename F>
+  void
+  forEachImageChunk(F f) const
+  {
+    f(header_.data(), header_.size());
+    std::uint64_t offset = header_.size();
+    for (decltype(offsets_)::size_type i = 0; i < offsets_.size(); i++) {
+      forEachZeroChunk(offsets_[i] - offset, f);
+      if (entries_[i].size > 0) {
+        f(entries_[i].data, entries_[i].size);
+      }
+      offset = offsets_[i] + entries_[i].size;
+    }
+  }
+
+  /*!
+   * @brief Pass the whole data, that is the image, padding and the size table, to the function
+   * @tparam F  Type of the function, (const char* data, std::size_t size) -> void
+   * @param [in] f  Function which consumes the chunks
+   */
+  template<typename F>
+  void
+  forEachDataChunk(F f) const
+  {
+    forEachImageChunk(f);
+    forEachZeroChunk(getSizeTableOffset() - imageSize_, f);
+    f(sizeTable_.data(), sizeTable_.size());
+  }
+
+private:
+  //! Binaries for each device
+  const std::vector<FatBinaryEntry>& entries_;
+  //! Header of the fat binary
+  std::string header_;
+  //! Offsets of the payloads
+  std::vector<std::uint64_t> offsets_;
+  //! Size of the fat binary image
+  std::uint64_t imageSize_;
+  //! Table of the image size, the number of binaries, and the sizes of the binaries
+  std::string sizeTable_;
+  //! Symbols in the data
+  std::vector<EmbedSymbol> symbols_;
+
+  /*!
+   * @brief Pass zero bytes to the function
+   * @tparam F  Type of the function, (const char* data, std::size_t size) -> void
+   * @param [in] size  Number of zero bytes
+   * @param [in] f     Function which consumes the chunks
+   */
+  template<typename F>
+  static void
+  forEachZeroChunk(std::uint64_t size, F& f)
+  {
+    static const char kZeros[kFatBinaryAlignment] = {};
+    while (size > 0) {
+      std::size_t n = size > sizeof(kZeros) ? sizeof(kZeros) : static_cast<std::size_t>(size);
+      f(kZeros, n);
+      size -= n;
+    }
+  }
+};  // class EmbedImage
+
+
+/*!
+ * @brief Write bytes as the elements of a C array, buffering a bounded amount of text
+ */
+class EmbedHexWriter
+{
+public:
+  /*!
+   * @brief Start writing to the stream
+   * @param [in,out] os  Output stream
+   */
+  explicit EmbedHexWriter(std::ostream& os) :
+    os_(os),
+    buffer_(),
+    column_(0)
+  {
+    buffer_.reserve(kEmbedChunkSize + 128);
+  }
+
+  /*!
+   * @brief Write bytes
+   * @param [in] data  Pointer to the bytes
+   * @param [in] size  Number of bytes
+   */
+  void
+  write(const char* data, std::size_t size)
+  {
+    static const char kDigits[] = "0123456789abcdef";
+    for (std::size_t i = 0; i < size; i++) {
+      unsigned char c = static_cast<unsigned char>(data[i]);
+      buffer_ += column_ == 0 ? "  0x" : " 0x";
+      buffer_ += kDigits[c >> 4];
+      buffer_ += kDigits[c & 0x0f];
+      buffer_ += ',';
+      if (++column_ == kNColumn) {
+        buffer_ += '\n';
+        column_ = 0;
+        if (buffer_.size() >= kEmbedChunkSize) {
+          flush();
+        }
+      }
+    }
+  }
+
+  /*!
+   * @brief Terminate the last line and write out the buffer
+   */
+  void
+  finish()
+  {
+    if (column_ != 0) {
+      buffer_ += '\n';
+      column_ = 0;
+    }
+    flush();
+  }
+
+private:
+  //! Number of bytes per line
+  static constexpr int kNColumn = 16;
+  //! Output stream
+  std::ostream& os_;
+  //! Buffer of text
+  std::string buffer_;
+  //! Number of bytes in the current line
+  int column_;
+
+  /*!
+   * @brief Write out the buffer
+   */
+  void
+  flush()
+  {
+    os_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    buffer_.clear();
+  }
+};  // class EmbedHexWriter
+
+
+/*!
+ * @brief Write a C++ header which defines the fat binary image as a constexpr array
+ *
+ * The header defines the symbols of EmbedSymbol as static constexpr
+ * variables, so include it from only one translation unit.
+ * @param [in] filename  Output file name
+ * @param [in] symbol    Base name of the symbols
+ * @param [in] entries   Binaries for each device
+ */
+static inline void
+writeEmbeddedCArray(const std::string& filename, const std::string& symbol, const std::vector<FatBinaryEntry>& entries)
+{
+  EmbedImage image(symbol, entries);
+  bool isSucceeded = writeStreamAtomically(filename, [&](std::ostream& os) {
+    std::string guard = "OCLC_EMBED_" + symbol;
+    for (auto& c : guard) {
+      c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    }
+    os << "// Generated by oclc. Do not edit.\n"
+       << "#ifndef " << guard << "\n"
+       << "#define " << guard << "\n\n"
+       << "#include <cstdint>\n\n\n"
+       << "//! Fat binary image, which can be parsed with parseFatBinary() of oclFatBinary.h\n"
+       << "alignas(" << kFatBinaryAlignment << ") static constexpr unsigned char " << symbol << "[] = {\n";
+    EmbedHexWriter writer(os);
+    image.forEachImageChunk([&](const char* data, std::size_t size) {
+      writer.write(data, size);
+    });
+    writer.finish();
+    os << "};\n"
+       << "static constexpr std::uint64_t " << symbol << "_size = " << image.getImageSize() << ";\n"
+       << "static constexpr std::uint64_t " << symbol << "_count = " << entries.size() << ";\n";
+    const std::vector<EmbedSymbol>& symbols = image.getSymbols();
+    for (std::remove_reference<decltype(entries)>::type::size_type i = 0; i < entries.size(); i++) {
+      const EmbedSymbol& binSymbol = symbols[3 + i * 2];
+      os << "\n//! " << (entries[i].deviceName.empty() ? "Kernel source"
+          : "Binary for " + quoteCString(entries[i].deviceName) + ", driver " + quoteCString(entries[i].driverVersion))
+         << (entries[i].variant.empty() ? "" : ", variant " + quoteCString(entries[i].variant)) << "\n"
+         << "static constexpr const unsigned char* " << binSymbol.name << " = " << symbol << " + " << binSymbol.offset << ";\n"
+         << "static constexpr std::uint64_t " << binSymbol.name << "_size = " << binSymbol.size << ";\n";
+    }
+    os << "\n\n#endif  // " << guard << "\n";
+  });
+  KOTLIB_THROW_IF(!isSucceeded, std::runtime_error, "Failed to write: " + filename);
+}
+
+
+#if defined(__x86_64__) || defined(_M_X64)
+//! Machine type of ELF (EM_X86_64) and COFF (IMAGE_FILE_MACHINE_AMD64)
+static constexpr std::uint16_t kEmbedElfMachine = 62;
+static constexpr std::uint16_t kEmbedCoffMachine = 0x8664;
+#elif defined(__aarch64__) || defined(_M_ARM64)
+//! Machine type of ELF (EM_AARCH64) and COFF (IMAGE_FILE_MACHINE_ARM64)
+static constexpr std::uint16_t kEmbedElfMachine = 183;
+static constexpr std::uint16_t kEmbedCoffMachine = 0xaa64;
+#else
+//! Machine type is unknown, and objects cannot be written
+static constexpr std::uint16_t kEmbedElfMachine = 0;
+static constexpr std::uint16_t kEmbedCoffMachine = 0;
+#endif
+
+
+/*!
+ * @brief Write a relocatable ELF64 object which defines the fat binary image
+ *
+ * The data is placed in section .rodata.oclc, which the linker merges into
+ * .rodata, and the symbols of EmbedSymbol are global.
+ * No relocation is needed since all symbols are defined by their offsets.
+ * @param [in] os     Output stream
+ * @param [in] image  Layout of the image
+ */
+static inline void
+writeEmbeddedElf(std::ostream& os, const EmbedImage& image)
+{
+  static constexpr std::uint64_t kEhdrSize = 64;
+  static constexpr std::uint64_t kShdrSize = 64;
+  static constexpr std::uint64_t kSymSize = 24;
+  const std::vector<EmbedSymbol>& symbols = image.getSymbols();
+
+  // Null symbol, then global data objects in section 1
+  std::string symtab(kSymSize, '\0');
+  std::string strtab(1, '\0');
+  for (const auto& symbol : symbols) {
+    appendEmbedLe(symtab, strtab.size(), 4);
+    // STB_GLOBAL and STT_OBJECT
+    appendEmbedLe(symtab, 0x11, 1);
+    appendEmbedLe(symtab, 0, 1);
+    appendEmbedLe(symtab, 1, 2);
+    appendEmbedLe(symtab, symbol.offset, 8);
+    appendEmbedLe(symtab, symbol.size, 8);
+    strtab += symbol.name;
+    strtab += '\0';
+  }
+  const std::string shstrtab("\0.rodata.oclc\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack\0", 56);
+
+  std::uint64_t dataOffset = kEhdrSize;
+  std::uint64_t symtabOffset = (dataOffset + image.getDataSize() + 7) / 8 * 8;
+  std::uint64_t strtabOffset = symtabOffset + symtab.size();
+  std::uint64_t shstrtabOffset = strtabOffset + strtab.size();
+  std::uint64_t shdrOffset = (shstrtabOffset + shstrtab.size() + 7) / 8 * 8;
+
+  std::string ehdr("\x7f" "ELF\x02\x01\x01", 7);
+  ehdr.resize(16, '\0');
+  // ET_REL
+  appendEmbedLe(ehdr, 1, 2);
+  appendEmbedLe(ehdr, kEmbedElfMachine, 2);
+  appendEmbedLe(ehdr, 1, 4);
+  appendEmbedLe(ehdr, 0, 8);
+  appendEmbedLe(ehdr, 0, 8);
+  appendEmbedLe(ehdr, shdrOffset, 8);
+  appendEmbedLe(ehdr, 0, 4);
+  appendEmbedLe(ehdr, kEhdrSize, 2);
+  appendEmbedLe(ehdr, 0, 2);
+  appendEmbedLe(ehdr, 0, 2);
+  appendEmbedLe(ehdr, kShdrSize, 2);
+  appendEmbedLe(ehdr, 6, 2);
+  appendEmbedLe(ehdr, 4, 2);
+  os.write(ehdr.data(), static_cast<std::streamsize>(ehdr.size()));
+
+  std::uint64_t offset = dataOffset;
+  image.forEachDataChunk([&](const char* data, std::size_t size) {
+    os.write(data, static_cast<std::streamsize>(size));
+    offset += size;
+  });
+  std::string tail(static_cast<std::string::size_type>(symtabOffset - offset), '\0');
+  tail += symtab;
+  tail += strtab;
+  tail += shstrtab;
+  tail.resize(static_cast<std::string::size_type>(shdrOffset - symtabOffset), '\0');
+
+  // Section headers: name, type, flags, addr, offset, size, link, info, addralign, entsize
+  auto appendShdr = [&tail](std::uint64_t name, std::uint64_t type, std::uint64_t flags, std::uint64_t shOffset, std::uint64_t size,
+      std::uint64_t link, std::uint64_t info, std::uint64_t align, std::uint64_t entsize) {
+    appendEmbedLe(tail, name, 4);
+    appendEmbedLe(tail, type, 4);
+    appendEmbedLe(tail, flags, 8);
+    appendEmbedLe(tail, 0, 8);
+    appendEmbedLe(tail, shOffset, 8);
+    appendEmbedLe(tail, size, 8);
+    appendEmbedLe(tail, link, 4);
+    appendEmbedLe(tail, info, 4);
+    appendEmbedLe(tail, align, 8);
+    appendEmbedLe(tail, entsize, 8);
+  };
+  appendShdr(0, 0, 0, 0, 0, 0, 0, 0, 0);
+  // .rodata.oclc: SHT_PROGBITS, SHF_ALLOC
+  appendShdr(1, 1, 2, dataOffset, image.getDataSize(), 0, 0, kFatBinaryAlignment, 0);
+  // .symtab: SHT_SYMTAB linked to .strtab, whose first global symbol is 1
+  appendShdr(14, 2, 0, symtabOffset, symtab.size(), 3, 1, 8, kSymSize);
+  // .strtab and .shstrtab: SHT_STRTAB
+  appendShdr(22, 3, 0, strtabOffset, strtab.size(), 0, 0, 1, 0);
+  appendShdr(30, 3, 0, shstrtabOffset, shstrtab.size(), 0, 0, 1, 0);
+  // .note.GNU-stack: Empty section which marks the stack as non-executable
+  appendShdr(40, 1, 0, shstrtabOffset, 0, 0, 0, 1, 0);
+  os.write(tail.data(), static_cast<std::streamsize>(tail.size()));
+}
+
+
+/*!
+ * @brief Write a COFF object which defines the fat binary image
+ *
+ * The data is placed in section .rdata, and the symbols of EmbedSymbol are
+ * external.
+ * @param [in] os     Output stream
+ * @param [in] image  Layout of the image
+ */
+static inline void
+writeEmbeddedCoff(std::ostream& os, const EmbedImage& image)
+{
+  static constexpr std::uint64_t kFileHeaderSize = 20;
+  static constexpr std::uint64_t kSectionHeaderSize = 40;
+  const std::vector<EmbedSymbol>& symbols = image.getSymbols();
+  KOTLIB_THROW_IF(image.getDataSize() > 0xffffffffULL, std::runtime_error, "Too large binaries for COFF object");
+
+  std::uint64_t dataOffset = kFileHeaderSize + kSectionHeaderSize;
+  std::uint64_t symbolTableOffset = dataOffset + image.getDataSize();
+  std::string header;
+  appendEmbedLe(header, kEmbedCoffMachine, 2);
+  appendEmbedLe(header, 1, 2);
+  appendEmbedLe(header, 0, 4);
+  appendEmbedLe(header, symbolTableOffset, 4);
+  appendEmbedLe(header, symbols.size(), 4);
+  appendEmbedLe(header, 0, 2);
+  appendEmbedLe(header, 0, 2);
+  header += std::string(".rdata\0\0", 8);
+  appendEmbedLe(header, 0, 4);
+  appendEmbedLe(header, 0, 4);
+  appendEmbedLe(header, image.getDataSize(), 4);
+  appendEmbedLe(header, dataOffset, 4);
+  appendEmbedLe(header, 0, 4);
+  appendEmbedLe(header, 0, 4);
+  appendEmbedLe(header, 0, 2);
+  appendEmbedLe(header, 0, 2);
+  // IMAGE_SCN_CNT_INITIALIZED_DATA, IMAGE_SCN_ALIGN_4096BYTES and IMAGE_SCN_MEM_READ
+  appendEmbedLe(header, 0x40d00040, 4);
+  os.write(header.data(), static_cast<std::streamsize>(header.size()));
+
+  image.forEachDataChunk([&](const char* data, std::size_t size) {
+    os.write(data, static_cast<std::streamsize>(size));
+  });
+
+  // Symbol records, whose names longer than 8 bytes are in the string table
+  std::string symbolTable;
+  std::string stringTable;
+  for (const auto& symbol : symbols) {
+    if (symbol.name.length() <= 8) {
+      symbolTable += symbol.name;
+      symbolTable.resize(symbolTable.size() + 8 - symbol.name.length(), '\0');
+    } else {
+      appendEmbedLe(symbolTable, 0, 4);
+      appendEmbedLe(symbolTable, 4 + stringTable.size(), 4);
+      stringTable += symbol.name;
+      stringTable += '\0';
+    }
+    appendEmbedLe(symbolTable, symbol.offset, 4);
+    appendEmbedLe(symbolTable, 1, 2);
+    appendEmbedLe(symbolTable, 0, 2);
+    // IMAGE_SYM_CLASS_EXTERNAL
+    appendEmbedLe(symbolTable, 2, 1);
+    appendEmbedLe(symbolTable, 0, 1);
+  }
+  appendEmbedLe(symbolTable, 4 + stringTable.size(), 4);
+  symbolTable += stringTable;
+  os.write(symbolTable.data(), static_cast<std::streamsize>(symbolTable.size()));
+}
+
+
+/*!
+ * @brief Write a linkable object of the host, which defines the fat binary image
+ *
+ * ELF is written on Unix-like systems and COFF on Windows.
+ * @param [in] filename  Output file name
+ * @param [in] symbol    Base name of the symbols
+ * @param [in] entries   Binaries for each device
+ */
+static inline void
+writeEmbeddedObject(const std::string& filename, const std::string& symbol, const std::vector<FatBinaryEntry>& entries)
+{
+  KOTLIB_THROW_IF(kEmbedElfMachine == 0, std::runtime_error, "Object file is not supported on this architecture; use --emit=c-array");
+  EmbedImage image(symbol, entries);
+  bool isSucceeded = writeStreamAtomically(filename, [&image](std::ostream& os) {
+#ifdef _WIN32
+    writeEmbeddedCoff(os, image);
+#else
+    writeEmbeddedElf(os, image);
+#endif  // _WIN32
+  });
+  KOTLIB_THROW_IF(!isSucceeded, std::runtime_error, "Failed to write: " + filename);
+}
+
+
+#endif  // OCL_EMBED
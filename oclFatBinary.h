@@ -0,0 +1,304 @@
+#ifndef OCL_FAT_BINARY
+#define OCL_FAT_BINARY
+
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <kotlib/macro.h>
+
+
+/*!
+ * @brief One entry of a fat binary, which is the binary for one device
+ *
+ * The fat binary consists of a header and page-aligned payloads.
+ * All integers are 64-bit little-endian values, and strings are prefixed with
+ * their 64-bit length.
+ *
+ *   magic "OCLCFAT1", alignment, number of entries,
+ *   entries {payload offset, payload size, device name, driver version, build options}...,
+ *   padding, payload, padding, payload, ...
+ *
+ * A fat binary of specialized variants has magic "OCLCFAT2", and each entry
+ * is followed by the variant name, such as "VEC=4,TILE=16", which lists the
+ * macros defined for the variant in addition to the build options.
+ *
+ * Since every payload is aligned to the page size, a payload of a
+ * memory-mapped fat binary can be passed to clCreateProgramWithBinary()
+ * without copying.
+ * An entry whose device name is empty holds the kernel source instead of a
+ * binary, which is used to rebuild the program when a binary is stale.
+ */
+struct FatBinaryEntry
+{
+  //! Device name (CL_DEVICE_NAME)
+  std::string deviceName;
+  //! Driver version (CL_DRIVER_VERSION)
+  std::string driverVersion;
+  //! Build options of the binary, including the macros of the variant
+  std::string options;
+  //! Variant name as comma-separated NAME=VALUE pairs, or empty if not specialized
+  std::string variant;
+  //! Pointer to the binary
+  const char* data;
+  //! Size of the binary
+  std::size_t size;
+};
+
+
+//! Magic number of fat binary ("OCLCFAT1")
+static constexpr std::uint64_t kFatBinaryMagic = 0x31544146434c434fULL;
+//! Magic number of fat binary with variant names ("OCLCFAT2")
+static constexpr std::uint64_t kFatBinaryVariantMagic = 0x32544146434c434fULL;
+//! Alignment of payloads, which is the page size on most systems
+static constexpr std::uint64_t kFatBinaryAlignment = 4096;
+
+
+/*!
+ * @brief Append a 64-bit little-endian unsigned integer
+ * @param [in,out] image  Fat binary image
+ * @param [in]     value  Value to append
+ */
+static inline void
+appendFatBinaryU64(std::string& image, std::uint64_t value)
+{
+  for (int i = 0; i < 8; i++) {
+    image += static_cast<char>(static_cast<unsigned char>(value >> (i * 8)));
+  }
+}
+
+
+/*!
+ * @brief Read a 64-bit little-endian unsigned integer
+ * @param [in]     data    Pointer to the fat binary
+ * @param [in]     size    Size of the fat binary
+ * @param [in,out] offset  Offset to read, which is advanced
+ * @return  Read value
+ */
+static inline std::uint64_t
+readFatBinaryU64(const char* data, std::size_t size, std::size_t& offset)
+{
+  KOTLIB_THROW_IF(size < 8 || offset > size - 8, std::runtime_error, "Truncated fat binary");
+  std::uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value |= static_cast<std::uint64_t>(static_cast<unsigned char>(data[offset++])) << (i * 8);
+  }
+  return value;
+}
+
+
+/*!
+ * @brief Read a length-prefixed string
+ * @param [in]     data    Pointer to the fat binary
+ * @param [in]     size    Size of the fat binary
+ * @param [in,out] offset  Offset to read, which is advanced
+ * @return  Read string
+ */
+static inline std::string
+readFatBinaryString(const char* data, std::size_t size, std::size_t& offset)
+{
+  std::uint64_t length = readFatBinaryU64(data, size, offset);
+  KOTLIB_THROW_IF(length > size - offset, std::runtime_error, "Truncated fat binary");
+  std::string str(data + offset, static_cast<std::size_t>(length));
+  offset += static_cast<std::size_t>(length);
+  return str;
+}
+
+
+/*!
+ * @brief Make build options which define the macros of a variant
+ * @param [in] variant  Variant name as comma-separated NAME=VALUE pairs
+ * @return  Options such as " -DVEC=4 -DTILE=16", or empty for an empty variant
+ */
+static inline std::string
+makeVariantOptions(const std::string& variant)
+{
+  std::string options;
+  std::string::size_type first = 0;
+  while (first < variant.size()) {
+    std::string::size_type last = variant.find(',', first);
+    last = last == std::string::npos ? variant.size() : last;
+    options += " -D" + variant.substr(first, last - first);
+    first = last + 1;
+  }
+  return options;
+}
+
+
+/*!
+ * @brief Make header of fat binary and compute the offsets of the payloads
+ *
+ * The header is followed by zero padding and payloads at the offsets, so the
+ * payloads can be streamed to a file without building the whole image.
+ * The variant names are written only if any entry has one, so that fat
+ * binaries without variants can be read by older loaders.
+ * @param [in]  entries  Binaries for each device
+ * @param [out] offsets  Offsets of the payloads for each device from the top of the image
+ * @return  Header of fat binary
+ */
+static inline std::string
+makeFatBinaryHeader(const std::vector<FatBinaryEntry>& entries, std::vector<std::uint64_t>& offsets)
+{
+  bool isVariant = false;
+  for (const auto& entry : entries) {
+    isVariant = isVariant || !entry.variant.empty();
+  }
+
+  // The header size is needed to place the payloads, so compute it first
+  std::uint64_t headerSize = 24;
+  for (const auto& entry : entries) {
+    headerSize += 16 + 8 + entry.deviceName.length() + 8 + entry.driverVersion.length() + 8 + entry.options.length();
+    headerSize += isVariant ? 8 + entry.variant.length() : 0;
+  }
+
+  std::string header;
+  appendFatBinaryU64(header, isVariant ? kFatBinaryVariantMagic : kFatBinaryMagic);
+  appendFatBinaryU64(header, kFatBinaryAlignment);
+  appendFatBinaryU64(header, entries.size());
+  offsets.clear();
+  std::uint64_t offset = headerSize;
+  for (const auto& entry : entries) {
+    offset = (offset + kFatBinaryAlignment - 1) / kFatBinaryAlignment * kFatBinaryAlignment;
+    offsets.emplace_back(offset);
+    appendFatBinaryU64(header, offset);
+    appendFatBinaryU64(header, entry.size);
+    appendFatBinaryU64(header, entry.deviceName.length());
+    header += entry.deviceName;
+    appendFatBinaryU64(header, entry.driverVersion.length());
+    header += entry.driverVersion;
+    appendFatBinaryU64(header, entry.options.length());
+    header += entry.options;
+    if (isVariant) {
+      appendFatBinaryU64(header, entry.variant.length());
+      header += entry.variant;
+    }
+    offset += entry.size;
+  }
+  return header;
+}
+
+
+/*!
+ * @brief Make fat binary image from binaries for each device
+ * @param [in] entries  Binaries for each device
+ * @return  Fat binary image
+ */
+static inline std::string
+makeFatBinary(const std::vector<FatBinaryEntry>& entries)
+{
+  std::vector<std::uint64_t> offsets;
+  std::string image = makeFatBinaryHeader(entries, offsets);
+  for (decltype(offsets)::size_type i = 0; i < offsets.size(); i++) {
+    image.resize(static_cast<std::string::size_type>(offsets[i]), '\0');
+    image.append(entries[i].data, entries[i].size);
+  }
+  return image;
+}
+
+
+/*!
+ * @brief Check whether specified content is a fat binary or not
+ * @param [in] data  Pointer to the content
+ * @param [in] size  Size of the content
+ * @return  true if the content starts with the magic number of fat binary
+ */
+static inline bool
+isFatBinary(const char* data, std::size_t size)
+{
+  std::size_t offset = 0;
+  if (size < 8) {
+    return false;
+  }
+  std::uint64_t magic = readFatBinaryU64(data, size, offset);
+  return magic == kFatBinaryMagic || magic == kFatBinaryVariantMagic;
+}
+
+
+/*!
+ * @brief Parse the header of fat binary
+ * @param [in] data  Pointer to the fat binary, which must outlive the returned entries
+ * @param [in] size  Size of the fat binary
+ * @return  Entries whose data point to the payloads in the fat binary
+ */
+static inline std::vector<FatBinaryEntry>
+parseFatBinary(const char* data, std::size_t size)
+{
+  std::size_t offset = 0;
+  std::uint64_t magic = readFatBinaryU64(data, size, offset);
+  KOTLIB_THROW_IF(magic != kFatBinaryMagic && magic != kFatBinaryVariantMagic, std::runtime_error, "Not a fat binary");
+  readFatBinaryU64(data, size, offset);
+  std::uint64_t nEntry = readFatBinaryU64(data, size, offset);
+  std::vector<FatBinaryEntry> entries;
+  for (std::uint64_t i = 0; i < nEntry; i++) {
+    std::uint64_t payloadOffset = readFatBinaryU64(data, size, offset);
+    std::uint64_t payloadSize = readFatBinaryU64(data, size, offset);
+    KOTLIB_THROW_IF(payloadOffset > size || payloadSize > size - payloadOffset, std::runtime_error, "Truncated fat binary");
+    FatBinaryEntry entry{"", "", "", "", data + payloadOffset, static_cast<std::size_t>(payloadSize)};
+    entry.deviceName = readFatBinaryString(data, size, offset);
+    entry.driverVersion = readFatBinaryString(data, size, offset);
+    entry.options = readFatBinaryString(data, size, offset);
+    if (magic == kFatBinaryVariantMagic) {
+      entry.variant = readFatBinaryString(data, size, offset);
+    }
+    entries.emplace_back(std::move(entry));
+  }
+  return entries;
+}
+
+
+/*!
+ * @brief Find the entry for specified device
+ *
+ * Only the entries of the specified variant are considered.
+ * An entry whose device name and driver version both match is preferred, and
+ * an entry whose device name only matches is used otherwise.
+ * @param [in] entries        Entries of fat binary
+ * @param [in] deviceName     Device name (CL_DEVICE_NAME)
+ * @param [in] driverVersion  Driver version (CL_DRIVER_VERSION)
+ * @param [in] variant        Variant name, or empty for a fat binary without variants
+ * @return  Pointer to the matched entry, or nullptr if not found
+ */
+static inline const FatBinaryEntry*
+findFatBinaryEntry(
+    const std::vector<FatBinaryEntry>& entries,
+    const std::string& deviceName,
+    const std::string& driverVersion,
+    const std::string& variant = "") noexcept
+{
+  const FatBinaryEntry* found = nullptr;
+  for (const auto& entry : entries) {
+    if (entry.deviceName != deviceName || entry.variant != variant) {
+      continue;
+    }
+    if (entry.driverVersion == driverVersion) {
+      return &entry;
+    }
+    if (found == nullptr) {
+      found = &entry;
+    }
+  }
+  return found;
+}
+
+
+/*!
+ * @brief Find the entry which holds the kernel source
+ * @param [in] entries  Entries of fat binary
+ * @return  Pointer to the source entry, or nullptr if the source is not embedded
+ */
+static inline const FatBinaryEntry*
+findFatBinarySource(const std::vector<FatBinaryEntry>& entries) noexcept
+{
+  for (const auto& entry : entries) {
+    if (entry.deviceName.empty()) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+
+#endif  // OCL_FAT_BINARY
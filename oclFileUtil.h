@@ -0,0 +1,266 @@
+#ifndef OCL_FILE_UTIL
+#define OCL_FILE_UTIL
+
+
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef _WIN32
+#  include <direct.h>
+#  include <process.h>
+#  include <windows.h>
+#else
+#  include <dirent.h>
+#  include <unistd.h>
+#endif  // _WIN32
+
+#include <kotlib/macro.h>
+
+
+/*!
+ * @brief Get the process ID
+ * @return  Process ID
+ */
+static inline long
+getPid() noexcept
+{
+#ifdef _WIN32
+  return static_cast<long>(::_getpid());
+#else
+  return static_cast<long>(::getpid());
+#endif  // _WIN32
+}
+
+
+/*!
+ * @brief Get the current working directory
+ * @return  Absolute path of the current working directory
+ */
+static inline std::string
+getCurrentDirectory()
+{
+  std::vector<char> buf(4096);
+#ifdef _WIN32
+  while (::_getcwd(buf.data(), static_cast<int>(buf.size())) == nullptr) {
+#else
+  while (::getcwd(buf.data(), buf.size()) == nullptr) {
+#endif  // _WIN32
+    KOTLIB_THROW_IF(errno != ERANGE, std::runtime_error, "Failed to get current directory");
+    buf.resize(buf.size() * 2);
+  }
+  return std::string(buf.data());
+}
+
+
+/*!
+ * @brief Check whether a path is absolute or not
+ * @param [in] path  Path to check
+ * @return  true if the path starts from the root or a drive letter, otherwise false
+ */
+static inline bool
+isAbsolutePath(const std::string& path) noexcept
+{
+  return (!path.empty() && (path[0] == '/' || path[0] == '\\'))
+    || (path.length() >= 2 && path[1] == ':' && std::isalpha(static_cast<unsigned char>(path[0])));
+}
+
+
+/*!
+ * @brief Make a temporary file name which is unique among processes and threads
+ * @param [in] path  Path of the file which will be replaced with the temporary file
+ * @return  Temporary file name
+ */
+static inline std::string
+makeTemporaryPath(const std::string& path)
+{
+  static std::atomic<unsigned int> sequence(0);
+  return path + ".tmp." + std::to_string(getPid()) + "." + std::to_string(sequence++);
+}
+
+
+/*!
+ * @brief Atomically replace a file with another one
+ * @param [in] src  File to be renamed
+ * @param [in] dst  Destination file path
+ * @return  true if succeeded, otherwise false
+ */
+static inline bool
+replaceFile(const std::string& src, const std::string& dst) noexcept
+{
+#ifdef _WIN32
+  return ::MoveFileExA(src.c_str(), dst.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  return std::rename(src.c_str(), dst.c_str()) == 0;
+#endif  // _WIN32
+}
+
+
+/*!
+ * @brief Write all bytes to the specified file without user-space buffering
+ * @param [in] path  File path
+ * @param [in] data  Pointer to the bytes
+ * @param [in] size  Number of bytes
+ * @return  true if succeeded, otherwise false
+ */
+static inline bool
+writeWholeFile(const std::string& path, const char* data, std::size_t size) noexcept
+{
+#ifdef _WIN32
+  HANDLE hFile = ::CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (hFile == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  bool isSucceeded = true;
+  while (isSucceeded && size > 0) {
+    DWORD nWritten = 0;
+    DWORD nToWrite = size > 0x40000000 ? 0x40000000 : static_cast<DWORD>(size);
+    isSucceeded = ::WriteFile(hFile, data, nToWrite, &nWritten, nullptr) && nWritten > 0;
+    data += nWritten;
+    size -= nWritten;
+  }
+  return ::CloseHandle(hFile) && isSucceeded;
+#else
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    return false;
+  }
+  bool isSucceeded = true;
+  while (isSucceeded && size > 0) {
+    ssize_t n = ::write(fd, data, size);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    isSucceeded = n > 0;
+    if (isSucceeded) {
+      data += n;
+      size -= static_cast<std::size_t>(n);
+    }
+  }
+  return ::close(fd) == 0 && isSucceeded;
+#endif  // _WIN32
+}
+
+
+/*!
+ * @brief Write all bytes to the specified file atomically
+ *
+ * The bytes are written to a temporary file in the same directory first, and
+ * then the temporary file is renamed, so that other processes never see a
+ * half-written file.
+ * @param [in] path  File path
+ * @param [in] data  Pointer to the bytes
+ * @param [in] size  Number of bytes
+ * @return  true if succeeded, otherwise false
+ */
+static inline bool
+writeFileAtomically(const std::string& path, const char* data, std::size_t size)
+{
+  std::string tmpPath = makeTemporaryPath(path);
+  if (!writeWholeFile(tmpPath, data, size) || !replaceFile(tmpPath, path)) {
+    std::remove(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+
+/*!
+ * @brief Write a file atomically with a function which streams its content
+ *
+ * The content does not have to fit in memory, which is useful for large
+ * generated files.
+ * @param [in] path   File path
+ * @param [in] write  Function which writes the content to the given stream
+ * @return  true if succeeded, otherwise false
+ */
+static inline bool
+writeStreamAtomically(const std::string& path, const std::function<void(std::ostream&)>& write)
+{
+  std::string tmpPath = makeTemporaryPath(path);
+  bool isSucceeded;
+  try {
+    std::ofstream ofs(tmpPath, std::ios::binary);
+    isSucceeded = static_cast<bool>(ofs);
+    if (isSucceeded) {
+      write(ofs);
+      ofs.close();
+      isSucceeded = static_cast<bool>(ofs);
+    }
+  } catch (...) {
+    std::remove(tmpPath.c_str());
+    throw;
+  }
+  if (!isSucceeded || !replaceFile(tmpPath, path)) {
+    std::remove(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+
+/*!
+ * @brief Create the specified directory and its parents
+ * @param [in] path  Directory path
+ */
+static inline void
+makeDirectories(const std::string& path)
+{
+  for (std::string::size_type pos = path.find_first_of("/\\", 1); ; pos = path.find_first_of("/\\", pos + 1)) {
+    std::string dir = path.substr(0, pos);
+#ifdef _WIN32
+    int ret = ::_mkdir(dir.c_str());
+#else
+    int ret = ::mkdir(dir.c_str(), 0755);
+#endif  // _WIN32
+    KOTLIB_THROW_IF(ret != 0 && errno != EEXIST, std::runtime_error, "Failed to create directory: " + dir);
+    if (pos == std::string::npos) {
+      break;
+    }
+  }
+}
+
+
+/*!
+ * @brief List file names in the specified directory
+ * @param [in] path  Directory path
+ * @return  File names in the directory
+ */
+static inline std::vector<std::string>
+listDirectory(const std::string& path)
+{
+  std::vector<std::string> names;
+#ifdef _WIN32
+  WIN32_FIND_DATAA findData;
+  HANDLE hFind = ::FindFirstFileA((path + "/*").c_str(), &findData);
+  if (hFind == INVALID_HANDLE_VALUE) {
+    return names;
+  }
+  do {
+    names.emplace_back(findData.cFileName);
+  } while (::FindNextFileA(hFind, &findData));
+  ::FindClose(hFind);
+#else
+  DIR* dir = ::opendir(path.c_str());
+  if (dir == nullptr) {
+    return names;
+  }
+  for (struct dirent* ent = ::readdir(dir); ent != nullptr; ent = ::readdir(dir)) {
+    names.emplace_back(ent->d_name);
+  }
+  ::closedir(dir);
+#endif  // _WIN32
+  return names;
+}
+
+
+#endif  // OCL_FILE_UTIL
@@ -0,0 +1,224 @@
+#ifndef OCL_FILE_WATCHER
+#define OCL_FILE_WATCHER
+
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __linux__
+#  include <cerrno>
+#  include <poll.h>
+#  include <sys/inotify.h>
+#  include <unistd.h>
+#else
+#  include <chrono>
+#  include <thread>
+#endif  // __linux__
+
+#include <kotlib/macro.h>
+
+
+//! Period to coalesce events which follow the first one
+static constexpr int kFileWatcherCoalesceMilliSeconds = 50;
+//! Interval of polling on systems without inotify
+static constexpr int kFileWatcherPollMilliSeconds = 100;
+
+
+/*!
+ * @brief Watcher which waits for modifications of a set of files
+ *
+ * On Linux, the directories of the files are watched with inotify, so that
+ * files replaced by editors with rename() are also detected.
+ * On other systems, the modification time and the size of the files are
+ * polled.
+ * Events which arrive in a short period are coalesced, since editors and
+ * build tools often write a file several times on save.
+ */
+class FileWatcher
+{
+public:
+  /*!
+   * @brief Start a watcher which watches no file
+   */
+  FileWatcher() :
+#ifdef __linux__
+    fd_(::inotify_init1(IN_CLOEXEC)),
+    wds_(),
+    files_()
+#else
+    stamps_()
+#endif  // __linux__
+  {
+#ifdef __linux__
+    KOTLIB_THROW_IF(fd_ == -1, std::runtime_error, "Failed to initialize inotify");
+#endif  // __linux__
+  }
+
+  FileWatcher(const FileWatcher&) = delete;
+
+  FileWatcher&
+  operator=(const FileWatcher&) = delete;
+
+  /*!
+   * @brief Stop watching
+   */
+  ~FileWatcher()
+  {
+#ifdef __linux__
+    ::close(fd_);
+#endif  // __linux__
+  }
+
+  /*!
+   * @brief Replace the set of watched files
+   * @param [in] filenames  Files to watch, which do not have to exist yet
+   */
+  void
+  watch(const std::vector<std::string>& filenames)
+  {
+#ifdef __linux__
+    // inotify returns the same watch descriptor for every spelling of a directory,
+    // such as "." and "./", so the files are grouped by the watch descriptor
+    files_.clear();
+    std::unordered_map<std::string, int> dirWds;
+    for (const auto& filename : filenames) {
+      std::string::size_type pos = filename.find_last_of("/\\");
+      std::string dir = pos == std::string::npos ? "." : filename.substr(0, pos + 1);
+      std::string name = pos == std::string::npos ? filename : filename.substr(pos + 1);
+      auto it = dirWds.find(dir);
+      if (it == dirWds.end()) {
+        int wd = ::inotify_add_watch(fd_, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        KOTLIB_THROW_IF(wd == -1, std::runtime_error, "Failed to watch directory: " + dir);
+        it = dirWds.emplace(dir, wd).first;
+      }
+      files_[it->second][name].emplace_back(filename);
+    }
+
+    // Remove watches of directories no longer needed
+    for (auto it = wds_.begin(); it != wds_.end();) {
+      if (files_.find(*it) != files_.end()) {
+        ++it;
+        continue;
+      }
+      ::inotify_rm_watch(fd_, *it);
+      it = wds_.erase(it);
+    }
+    for (const auto& wdFiles : files_) {
+      wds_.insert(wdFiles.first);
+    }
+#else
+    stamps_.clear();
+    for (const auto& filename : filenames) {
+      stamps_.emplace(filename, getStamp(filename));
+    }
+#endif  // __linux__
+  }
+
+  /*!
+   * @brief Wait until at least one of the watched files is modified
+   * @return  Modified files, in every spelling specified to watch()
+   */
+  std::vector<std::string>
+  wait()
+  {
+    std::unordered_set<std::string> changedFiles;
+#ifdef __linux__
+    // Block until the first change, then coalesce the events which follow soon
+    for (;;) {
+      struct pollfd pfd = {fd_, POLLIN, 0};
+      int n = ::poll(&pfd, 1, changedFiles.empty() ? -1 : kFileWatcherCoalesceMilliSeconds);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      KOTLIB_THROW_IF(n == -1, std::runtime_error, "Failed to wait for file changes");
+      if (n == 0) {
+        break;
+      }
+      readEvents(changedFiles);
+    }
+#else
+    for (;;) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(kFileWatcherPollMilliSeconds));
+      for (auto& stamp : stamps_) {
+        std::pair<long long, long long> newStamp = getStamp(stamp.first);
+        if (newStamp != stamp.second) {
+          stamp.second = newStamp;
+          changedFiles.insert(stamp.first);
+        }
+      }
+      if (!changedFiles.empty()) {
+        break;
+      }
+    }
+#endif  // __linux__
+    std::vector<std::string> filenames(changedFiles.begin(), changedFiles.end());
+    std::sort(filenames.begin(), filenames.end());
+    return filenames;
+  }
+
+private:
+#ifdef __linux__
+  //! File descriptor of inotify
+  int fd_;
+  //! Watch descriptors of the watched directories
+  std::unordered_set<int> wds_;
+  //! Watched files as specified, for each watch descriptor of the directory and file name
+  std::unordered_map<int, std::unordered_map<std::string, std::vector<std::string> > > files_;
+#else
+  //! Modification time and size of each watched file
+  std::unordered_map<std::string, std::pair<long long, long long> > stamps_;
+#endif  // __linux__
+
+#ifdef __linux__
+  /*!
+   * @brief Read pending inotify events
+   * @param [in,out] changedFiles  Modified files, to which watched files are added
+   */
+  void
+  readEvents(std::unordered_set<std::string>& changedFiles)
+  {
+    alignas(struct inotify_event) char buf[4096];
+    ssize_t size = ::read(fd_, buf, sizeof(buf));
+    if (size == -1 && errno == EINTR) {
+      return;
+    }
+    KOTLIB_THROW_IF(size <= 0, std::runtime_error, "Failed to read inotify events");
+    for (ssize_t offset = 0; offset < size;) {
+      const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(buf + offset);
+      offset += static_cast<ssize_t>(sizeof(struct inotify_event) + event->len);
+      auto dirIt = files_.find(event->wd);
+      if (dirIt == files_.end() || event->len == 0) {
+        continue;
+      }
+      auto fileIt = dirIt->second.find(event->name);
+      if (fileIt != dirIt->second.end()) {
+        changedFiles.insert(fileIt->second.begin(), fileIt->second.end());
+      }
+    }
+  }
+#else
+  /*!
+   * @brief Get the modification time and the size of a file
+   * @param [in] filename  File name
+   * @return  Modification time and size, or -1s if the file does not exist
+   */
+  static std::pair<long long, long long>
+  getStamp(const std::string& filename) noexcept
+  {
+    struct stat st;
+    if (::stat(filename.c_str(), &st) != 0) {
+      return std::make_pair(-1LL, -1LL);
+    }
+    return std::make_pair(static_cast<long long>(st.st_mtime), static_cast<long long>(st.st_size));
+  }
+#endif  // __linux__
+};  // class FileWatcher
+
+
+#endif  // OCL_FILE_WATCHER
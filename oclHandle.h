@@ -0,0 +1,319 @@
+#ifndef OCL_HANDLE
+#define OCL_HANDLE
+
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __APPLE__
+#  include <OpenCL/opencl.h>
+#else
+#  include <CL/cl.h>
+#endif
+
+#include <kotlib/macro.h>
+#include "oclErrorCode.h"
+#include "oclPhaseTimer.h"
+
+
+//! Default max number of platform IDs to get
+static constexpr cl_uint kNDefaultPlatformEntry = 16;
+//! Default max number of device IDs to get
+static constexpr cl_uint kNDefaultDeviceEntry = 16;
+
+
+/*!
+ * @brief Releaser of an OpenCL object, which is specialized for each object type
+ * @tparam T  Object type such as cl_context
+ */
+template<typename T>
+struct HandleReleaser;
+
+template<>
+struct HandleReleaser<cl_context>
+{
+  void
+  operator()(cl_context context) const noexcept
+  {
+    clReleaseContext(context);
+  }
+};
+
+template<>
+struct HandleReleaser<cl_command_queue>
+{
+  void
+  operator()(cl_command_queue cmdQueue) const noexcept
+  {
+    clReleaseCommandQueue(cmdQueue);
+  }
+};
+
+template<>
+struct HandleReleaser<cl_program>
+{
+  void
+  operator()(cl_program program) const noexcept
+  {
+    clReleaseProgram(program);
+  }
+};
+
+template<>
+struct HandleReleaser<cl_kernel>
+{
+  void
+  operator()(cl_kernel kernel) const noexcept
+  {
+    clReleaseKernel(kernel);
+  }
+};
+
+template<>
+struct HandleReleaser<cl_mem>
+{
+  void
+  operator()(cl_mem mem) const noexcept
+  {
+    clReleaseMemObject(mem);
+  }
+};
+
+template<>
+struct HandleReleaser<cl_event>
+{
+  void
+  operator()(cl_event event) const noexcept
+  {
+    clReleaseEvent(event);
+  }
+};
+
+
+/*!
+ * @brief Move-only owner of an OpenCL object, which releases the object on destruction
+ *
+ * The releaser is stateless, so a handle is as large as the object itself and
+ * is constructed from the object alone, such as ContextHandle(clCreateContext(...)).
+ * @tparam T  Object type such as cl_context
+ */
+template<typename T>
+using Handle = std::unique_ptr<typename std::remove_pointer<T>::type, HandleReleaser<T> >;
+
+//! Owner of a context
+using ContextHandle = Handle<cl_context>;
+//! Owner of a command queue
+using CommandQueueHandle = Handle<cl_command_queue>;
+//! Owner of a program
+using ProgramHandle = Handle<cl_program>;
+//! Owner of a kernel
+using KernelHandle = Handle<cl_kernel>;
+//! Owner of a memory object
+using MemHandle = Handle<cl_mem>;
+//! Owner of an event
+using EventHandle = Handle<cl_event>;
+
+
+/*!
+ * @brief Describe an OpenCL error code as "[OpenCL] [CODE] MESSAGE"
+ * @param [in] errCode  Error code
+ * @return  Description of the error code
+ */
+static inline std::string
+getClErrorMessage(cl_int errCode)
+{
+  auto it = kErrorMessageMap.find(errCode);
+  return std::string("[OpenCL] [") + std::to_string(errCode) + "] " + (it == kErrorMessageMap.end() ? "Unknown error" : it->second);
+}
+
+
+/*!
+ * @brief Throw std::runtime_error which describes an OpenCL error code unless it is CL_SUCCESS
+ * @param [in] errCode  Error code
+ */
+static inline void
+checkClError(cl_int errCode)
+{
+  KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, getClErrorMessage(errCode));
+}
+
+
+/*!
+ * @brief Get platform IDs
+ * @param [in] nPlatformEntry  Max number of platform IDs to get
+ * @param [in] timer           Timer to measure "Platform discovery" with, or nullptr
+ * @return  std::vector which contains obtained platform IDs
+ */
+static inline std::vector<cl_platform_id>
+getPlatformIds(cl_uint nPlatformEntry = kNDefaultPlatformEntry, PhaseTimer* timer = nullptr)
+{
+  PhaseTimer::Scope scope = timer != nullptr ? timer->measure("Platform discovery") : PhaseTimer::Scope(nullptr, "");
+  std::vector<cl_platform_id> platformIds(nPlatformEntry);
+  cl_uint nPlatform;
+  checkClError(clGetPlatformIDs(nPlatformEntry, platformIds.data(), &nPlatform));
+  platformIds.resize(nPlatform);
+  return platformIds;
+}
+
+
+/*!
+ * @brief Get device IDs
+ * @param [in] platformId    One platform ID
+ * @param [in] nDeviceEntry  Max number of device IDs to get
+ * @param [in] deviceType    Device type which means CPU, GPU, or both.
+ * @param [in] timer         Timer to measure "Device discovery" with, or nullptr
+ * @return  std::vector which contains obtained device IDs
+ */
+static inline std::vector<cl_device_id>
+getDeviceIds(const cl_platform_id& platformId, cl_uint nDeviceEntry = kNDefaultDeviceEntry, cl_int deviceType = CL_DEVICE_TYPE_DEFAULT, PhaseTimer* timer = nullptr)
+{
+  PhaseTimer::Scope scope = timer != nullptr ? timer->measure("Device discovery") : PhaseTimer::Scope(nullptr, "");
+  std::vector<cl_device_id> deviceIds(nDeviceEntry);
+  cl_uint nDevice;
+  checkClError(clGetDeviceIDs(platformId, static_cast<cl_device_type>(deviceType), nDeviceEntry, deviceIds.data(), &nDevice));
+  deviceIds.resize(nDevice);
+  return deviceIds;
+}
+
+
+/*!
+ * @brief Pool of contexts for each set of devices, and of command queues for
+ *        each device
+ *
+ * A context is created on the first request for its device set and reused by
+ * the later requests on any thread, so that programs for the same devices do
+ * not pay clCreateContext() each.
+ * The pooled objects are released when the pool is cleared or destructed.
+ */
+class ContextPool
+{
+public:
+  /*!
+   * @brief Construct empty pool
+   * @param [in] timer  Timer to measure "Context creation" with, or nullptr
+   */
+  explicit ContextPool(PhaseTimer* timer = nullptr) :
+    timer_(timer),
+    mtx_(),
+    contexts_(),
+    cmdQueues_()
+  {}
+
+  ContextPool(const ContextPool&) = delete;
+
+  ContextPool&
+  operator=(const ContextPool&) = delete;
+
+  /*!
+   * @brief Release the command queues before the contexts
+   */
+  ~ContextPool()
+  {
+    clear();
+  }
+
+  /*!
+   * @brief Get the context which contains the specified devices, creating it on the first call
+   *
+   * Threads which request the same device set wait for one creation, and
+   * requests for other device sets are not blocked.
+   * @param [in] deviceIds  Device IDs which the context contains, in any order
+   * @return  Context, which is owned by this pool
+   */
+  cl_context
+  getContext(const std::vector<cl_device_id>& deviceIds)
+  {
+    std::vector<cl_device_id> key(deviceIds);
+    std::sort(key.begin(), key.end());
+    ContextEntry* entry;
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      std::unique_ptr<ContextEntry>& slot = contexts_[key];
+      if (slot == nullptr) {
+        slot.reset(new ContextEntry());
+      }
+      entry = slot.get();
+    }
+    std::call_once(entry->flag, [this, entry, &deviceIds] {
+      PhaseTimer::Scope scope = timer_ != nullptr ? timer_->measure("Context creation") : PhaseTimer::Scope(nullptr, "");
+      cl_int errCode;
+      ContextHandle context(clCreateContext(nullptr, static_cast<cl_uint>(deviceIds.size()), deviceIds.data(), nullptr, nullptr, &errCode));
+      checkClError(errCode);
+      entry->context = std::move(context);
+    });
+    return entry->context.get();
+  }
+
+  /*!
+   * @brief Get the command queue of the specified device and properties in a context, creating it on the first call
+   *
+   * A command queue is not thread-safe to enqueue commands in order, so a
+   * pooled queue should be used by one thread at a time.
+   * @param [in] context     Context which contains the device
+   * @param [in] deviceId    Device ID
+   * @param [in] properties  Properties of the command queue
+   * @return  Command queue, which is owned by this pool
+   */
+  cl_command_queue
+  getCommandQueue(cl_context context, cl_device_id deviceId, cl_command_queue_properties properties = 0)
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    CommandQueueHandle& cmdQueue = cmdQueues_[std::make_tuple(context, deviceId, properties)];
+    if (cmdQueue == nullptr) {
+      cl_int errCode;
+      cmdQueue.reset(clCreateCommandQueue(context, deviceId, properties, &errCode));
+      checkClError(errCode);
+    }
+    return cmdQueue.get();
+  }
+
+  /*!
+   * @brief Release all pooled command queues and contexts
+   *
+   * No object which this pool returned may be used after this call.
+   */
+  void
+  clear() noexcept
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    cmdQueues_.clear();
+    contexts_.clear();
+  }
+
+private:
+  /*!
+   * @brief Context of one device set, which is created once
+   */
+  struct ContextEntry
+  {
+    //! Flag to create the context once
+    std::once_flag flag;
+    //! Created context
+    ContextHandle context;
+
+    ContextEntry() :
+      flag(),
+      context()
+    {}
+  };
+
+  //! Timer to measure context creation, or nullptr
+  PhaseTimer* timer_;
+  //! Mutex for the pooled objects
+  std::mutex mtx_;
+  //! Contexts for each sorted device set
+  std::map<std::vector<cl_device_id>, std::unique_ptr<ContextEntry> > contexts_;
+  //! Command queues for each context, device and properties
+  std::map<std::tuple<cl_context, cl_device_id, cl_command_queue_properties>, CommandQueueHandle> cmdQueues_;
+};  // class ContextPool
+
+
+#endif  // OCL_HANDLE
@@ -0,0 +1,576 @@
+#ifndef OCL_KERNEL_REPORT
+#define OCL_KERNEL_REPORT
+
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifdef __APPLE__
+#  include <OpenCL/opencl.h>
+#else
+#  include <CL/cl.h>
+#endif
+
+#include <kotlib/macro.h>
+#include "oclBinaryCache.h"
+#include "oclFileUtil.h"
+#include "oclHandle.h"
+
+
+//! Default limit of private memory per work-item in bytes, above which a kernel is flagged
+static constexpr std::uint64_t kDefaultPrivateMemLimit = 1024;
+
+
+/*!
+ * @brief Quote a string as a JSON string literal
+ * @param [in] str  String to quote
+ * @return  Quoted string
+ */
+static inline std::string
+quoteJsonString(const std::string& str)
+{
+  static const char kHexDigits[] = "0123456789abcdef";
+  std::string quoted = "\"";
+  for (auto c : str) {
+    unsigned char uc = static_cast<unsigned char>(c);
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    } else if (c == '\n') {
+      quoted += "\\n";
+    } else if (c == '\t') {
+      quoted += "\\t";
+    } else if (uc < 0x20) {
+      quoted += "\\u00";
+      quoted += kHexDigits[uc >> 4];
+      quoted += kHexDigits[uc & 0x0f];
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "\"";
+}
+
+
+/*!
+ * @brief Unquote a string which is quoted with quoteJsonString()
+ * @param [in] quoted  Quoted string
+ * @return  Original string
+ */
+static inline std::string
+unquoteJsonString(const std::string& quoted)
+{
+  std::string str;
+  for (std::string::size_type i = 1; i + 1 < quoted.size(); i++) {
+    if (quoted[i] != '\\' || i + 2 >= quoted.size()) {
+      str += quoted[i];
+      continue;
+    }
+    char c = quoted[++i];
+    if (c == 'n') {
+      str += '\n';
+    } else if (c == 't') {
+      str += '\t';
+    } else if (c == 'u' && i + 4 < quoted.size()) {
+      str += static_cast<char>(std::stoi(quoted.substr(i + 1, 4), nullptr, 16));
+      i += 4;
+    } else {
+      str += c;
+    }
+  }
+  return str;
+}
+
+
+/*!
+ * @brief Kernel metadata of a program built for one device
+ */
+struct DeviceKernelReport
+{
+  //! Device name
+  std::string deviceName;
+  //! JSON array of the kernels
+  std::string kernels;
+  //! Resource warnings of the kernels
+  std::vector<std::string> warnings;
+
+  /*!
+   * @brief Serialize this report to store it in the binary cache
+   *
+   * The first line is the quoted device name, the second line is the JSON
+   * array, and each of the rest is a warning, none of which contains newlines.
+   * @return  Serialized report
+   */
+  std::string
+  serialize() const
+  {
+    std::string text = quoteJsonString(deviceName) + "\n" + kernels + "\n";
+    for (const auto& warning : warnings) {
+      text += warning + "\n";
+    }
+    return text;
+  }
+
+  /*!
+   * @brief Deserialize a report which is made with serialize()
+   * @param [in]  data    Serialized report
+   * @param [out] report  Report
+   * @return  true if the report is well-formed, otherwise false
+   */
+  static bool
+  parse(const std::vector<char>& data, DeviceKernelReport& report)
+  {
+    std::vector<std::string> lines;
+    std::string::size_type first = 0;
+    std::string text(data.begin(), data.end());
+    for (std::string::size_type last = text.find('\n'); last != std::string::npos; last = text.find('\n', first)) {
+      lines.emplace_back(text.substr(first, last - first));
+      first = last + 1;
+    }
+    if (lines.size() < 2 || first != text.size() || lines[0].size() < 2 || lines[0].front() != '"' || lines[0].back() != '"') {
+      return false;
+    }
+    report.deviceName = unquoteJsonString(lines[0]);
+    report.kernels = lines[1];
+    report.warnings.assign(lines.begin() + 2, lines.end());
+    return true;
+  }
+};
+
+
+/*!
+ * @brief Find the lines of a build log which report register spills
+ *
+ * Compilers report spills in their own formats, such as "8 bytes spill
+ * stores, 8 bytes spill loads" of ptxas and "SpillVGPRs: 4" of AMD, so each
+ * comma-separated clause which mentions "spill" is checked for a non-zero
+ * count.
+ * @param [in] buildLog  Build log
+ * @return  Lines which report non-zero spills, without surrounding blanks
+ */
+static inline std::vector<std::string>
+findSpillLines(const std::string& buildLog)
+{
+  std::vector<std::string> spillLines;
+  std::istringstream iss(buildLog);
+  std::string line;
+  while (std::getline(iss, line)) {
+    std::string lowerLine(line);
+    std::transform(lowerLine.begin(), lowerLine.end(), lowerLine.begin(), [](char c) {
+      return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    });
+    bool isSpilled = false;
+    std::string::size_type first = 0;
+    while (!isSpilled && first <= lowerLine.size()) {
+      std::string::size_type last = std::min(lowerLine.find_first_of(",;", first), lowerLine.size());
+      std::string clause = lowerLine.substr(first, last - first);
+      isSpilled = clause.find("spill") != std::string::npos && clause.find_first_of("123456789") != std::string::npos;
+      first = last + 1;
+    }
+    if (isSpilled) {
+      std::string::size_type begin = line.find_first_not_of(" \t\r");
+      std::string::size_type end = line.find_last_not_of(" \t\r");
+      spillLines.emplace_back(line.substr(begin, end - begin + 1));
+    }
+  }
+  return spillLines;
+}
+
+
+/*!
+ * @brief Create all kernels of a built program and query their metadata and
+ *        resource usage on one device
+ *
+ * Argument names and types are reported only if the implementation keeps
+ * them, which usually requires -cl-kernel-arg-info.
+ * A kernel is flagged when its private memory per work-item exceeds the limit,
+ * which on GPUs means spilled registers or private arrays placed in off-chip
+ * memory, when its local memory exceeds that of the device, or when its
+ * work-group size is limited below the device maximum without
+ * reqd_work_group_size, which means that it runs out of registers.
+ * Register counts are not exposed by OpenCL, so spills which the compiler
+ * reports in the build log are flagged as well.
+ * @param [in] program          Built program
+ * @param [in] deviceId         Device ID
+ * @param [in] buildLog         Build log of the program for the device
+ * @param [in] privateMemLimit  Limit of private memory per work-item in bytes
+ * @return  Report of the kernels
+ */
+static inline DeviceKernelReport
+queryKernelReport(cl_program program, cl_device_id deviceId, const std::string& buildLog, std::uint64_t privateMemLimit)
+{
+  auto checkError = [](cl_int errCode, const char* funcName) {
+    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, std::string(funcName) + "() failed (" + std::to_string(errCode) + ")");
+  };
+  auto getDeviceString = [&](cl_device_info info) {
+    std::size_t size;
+    checkError(clGetDeviceInfo(deviceId, info, 0, nullptr, &size), "clGetDeviceInfo");
+    std::string value(size, '\0');
+    checkError(clGetDeviceInfo(deviceId, info, size, &value[0], nullptr), "clGetDeviceInfo");
+    return std::string(value.c_str());
+  };
+  auto getKernelString = [&](cl_kernel kernel, cl_kernel_info info) {
+    std::size_t size;
+    checkError(clGetKernelInfo(kernel, info, 0, nullptr, &size), "clGetKernelInfo");
+    std::string value(size, '\0');
+    checkError(clGetKernelInfo(kernel, info, size, &value[0], nullptr), "clGetKernelInfo");
+    return std::string(value.c_str());
+  };
+
+  DeviceKernelReport report{getDeviceString(CL_DEVICE_NAME), "", {}};
+  cl_ulong deviceLocalMemSize;
+  checkError(clGetDeviceInfo(deviceId, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(deviceLocalMemSize), &deviceLocalMemSize, nullptr), "clGetDeviceInfo");
+  std::size_t deviceMaxWorkGroupSize;
+  checkError(clGetDeviceInfo(deviceId, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(deviceMaxWorkGroupSize), &deviceMaxWorkGroupSize, nullptr), "clGetDeviceInfo");
+
+  cl_uint nKernel;
+  checkError(clCreateKernelsInProgram(program, 0, nullptr, &nKernel), "clCreateKernelsInProgram");
+  std::vector<cl_kernel> kernelIds(nKernel);
+  checkError(clCreateKernelsInProgram(program, nKernel, kernelIds.data(), nullptr), "clCreateKernelsInProgram");
+  std::vector<KernelHandle> kernelHolders;
+  for (const auto& kernelId : kernelIds) {
+    kernelHolders.emplace_back(kernelId);
+  }
+
+  // Sort the kernels by name, since the order of clCreateKernelsInProgram() is unspecified
+  std::vector<std::pair<std::string, cl_kernel> > kernels;
+  for (const auto& kernelId : kernelIds) {
+    kernels.emplace_back(getKernelString(kernelId, CL_KERNEL_FUNCTION_NAME), kernelId);
+  }
+  std::sort(kernels.begin(), kernels.end(), [](const std::pair<std::string, cl_kernel>& x, const std::pair<std::string, cl_kernel>& y) {
+    return x.first < y.first;
+  });
+
+  static const std::unordered_map<cl_kernel_arg_address_qualifier, const char*> kAddressNameMap{
+    {CL_KERNEL_ARG_ADDRESS_GLOBAL, "global"},
+    {CL_KERNEL_ARG_ADDRESS_LOCAL, "local"},
+    {CL_KERNEL_ARG_ADDRESS_CONSTANT, "constant"},
+    {CL_KERNEL_ARG_ADDRESS_PRIVATE, "private"}
+  };
+  static const std::unordered_map<cl_kernel_arg_access_qualifier, const char*> kAccessNameMap{
+    {CL_KERNEL_ARG_ACCESS_READ_ONLY, "read_only"},
+    {CL_KERNEL_ARG_ACCESS_WRITE_ONLY, "write_only"},
+    {CL_KERNEL_ARG_ACCESS_READ_WRITE, "read_write"},
+    {CL_KERNEL_ARG_ACCESS_NONE, "none"}
+  };
+  std::ostringstream oss;
+  oss << "[";
+  for (decltype(kernels)::size_type i = 0; i < kernels.size(); i++) {
+    const std::string& name = kernels[i].first;
+    cl_kernel kernel = kernels[i].second;
+    cl_uint nArg;
+    checkError(clGetKernelInfo(kernel, CL_KERNEL_NUM_ARGS, sizeof(nArg), &nArg, nullptr), "clGetKernelInfo");
+    std::size_t workGroupSize;
+    checkError(clGetKernelWorkGroupInfo(kernel, deviceId, CL_KERNEL_WORK_GROUP_SIZE, sizeof(workGroupSize), &workGroupSize, nullptr), "clGetKernelWorkGroupInfo");
+    std::size_t compileWorkGroupSize[3];
+    checkError(clGetKernelWorkGroupInfo(kernel, deviceId, CL_KERNEL_COMPILE_WORK_GROUP_SIZE, sizeof(compileWorkGroupSize), compileWorkGroupSize, nullptr), "clGetKernelWorkGroupInfo");
+    std::size_t preferredMultiple;
+    checkError(clGetKernelWorkGroupInfo(kernel, deviceId, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(preferredMultiple), &preferredMultiple, nullptr), "clGetKernelWorkGroupInfo");
+    cl_ulong localMemSize;
+    checkError(clGetKernelWorkGroupInfo(kernel, deviceId, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(localMemSize), &localMemSize, nullptr), "clGetKernelWorkGroupInfo");
+    cl_ulong privateMemSize;
+    checkError(clGetKernelWorkGroupInfo(kernel, deviceId, CL_KERNEL_PRIVATE_MEM_SIZE, sizeof(privateMemSize), &privateMemSize, nullptr), "clGetKernelWorkGroupInfo");
+
+    oss << (i == 0 ? "" : ", ") << "{\"name\": " << quoteJsonString(name)
+        << ", \"num_args\": " << nArg
+        << ", \"args\": ";
+    // Argument information is optional unless the program is built with -cl-kernel-arg-info
+    std::ostringstream argOss;
+    bool isArgInfoAvailable = true;
+    argOss << "[";
+    for (cl_uint j = 0; j < nArg && isArgInfoAvailable; j++) {
+      auto getArgString = [&](cl_kernel_arg_info info, std::string& value) {
+        std::size_t size;
+        if (clGetKernelArgInfo(kernel, j, info, 0, nullptr, &size) != CL_SUCCESS) {
+          return false;
+        }
+        value.assign(size, '\0');
+        if (clGetKernelArgInfo(kernel, j, info, size, &value[0], nullptr) != CL_SUCCESS) {
+          return false;
+        }
+        value = value.c_str();
+        return true;
+      };
+      std::string argName;
+      std::string typeName;
+      cl_kernel_arg_address_qualifier addressQualifier;
+      cl_kernel_arg_access_qualifier accessQualifier;
+      isArgInfoAvailable = getArgString(CL_KERNEL_ARG_NAME, argName)
+        && getArgString(CL_KERNEL_ARG_TYPE_NAME, typeName)
+        && clGetKernelArgInfo(kernel, j, CL_KERNEL_ARG_ADDRESS_QUALIFIER, sizeof(addressQualifier), &addressQualifier, nullptr) == CL_SUCCESS
+        && clGetKernelArgInfo(kernel, j, CL_KERNEL_ARG_ACCESS_QUALIFIER, sizeof(accessQualifier), &accessQualifier, nullptr) == CL_SUCCESS;
+      if (isArgInfoAvailable) {
+        auto addressIt = kAddressNameMap.find(addressQualifier);
+        auto accessIt = kAccessNameMap.find(accessQualifier);
+        argOss << (j == 0 ? "" : ", ") << "{\"name\": " << quoteJsonString(argName)
+               << ", \"type\": " << quoteJsonString(typeName)
+               << ", \"address\": " << quoteJsonString(addressIt == kAddressNameMap.end() ? "unknown" : addressIt->second)
+               << ", \"access\": " << quoteJsonString(accessIt == kAccessNameMap.end() ? "unknown" : accessIt->second) << "}";
+      }
+    }
+    argOss << "]";
+    oss << (isArgInfoAvailable ? argOss.str() : "null")
+        << ", \"work_group_size\": " << workGroupSize
+        << ", \"compile_work_group_size\": [" << compileWorkGroupSize[0] << ", " << compileWorkGroupSize[1] << ", " << compileWorkGroupSize[2] << "]"
+        << ", \"preferred_work_group_size_multiple\": " << preferredMultiple
+        << ", \"local_mem_size\": " << localMemSize
+        << ", \"private_mem_size\": " << privateMemSize << "}";
+
+    if (privateMemSize > privateMemLimit) {
+      report.warnings.emplace_back(name + ": " + std::to_string(privateMemSize) + " bytes of private memory per work-item exceeds "
+          + std::to_string(privateMemLimit) + " bytes, which suggests register spills");
+    }
+    if (localMemSize > deviceLocalMemSize) {
+      report.warnings.emplace_back(name + ": " + std::to_string(localMemSize) + " bytes of local memory exceeds "
+          + std::to_string(deviceLocalMemSize) + " bytes of the device");
+    }
+    if (workGroupSize < deviceMaxWorkGroupSize && compileWorkGroupSize[0] == 0) {
+      report.warnings.emplace_back(name + ": work-group size is limited to " + std::to_string(workGroupSize) + " of "
+          + std::to_string(deviceMaxWorkGroupSize) + ", which suggests high register pressure");
+    }
+  }
+  oss << "]";
+  report.kernels = oss.str();
+
+  for (const auto& spillLine : findSpillLines(buildLog)) {
+    report.warnings.emplace_back("build log reports spills: " + spillLine);
+  }
+  return report;
+}
+
+
+/*!
+ * @brief Collector of kernel reports of the built binaries, which is written
+ *        as one JSON file
+ *
+ * Reports are added on multiple threads under a mutex, and their warnings are
+ * shown to stderr right away.
+ * Binaries written to temporary files, such as those bundled later or tuned,
+ * are reported with the output file name and the variant registered with
+ * setAlias().
+ */
+class KernelReportWriter
+{
+public:
+  /*!
+   * @brief Construct a disabled writer
+   */
+  KernelReportWriter() :
+    mtx_(),
+    filename_(),
+    privateMemLimit_(kDefaultPrivateMemLimit),
+    aliases_(),
+    entries_()
+  {}
+
+  KernelReportWriter(const KernelReportWriter&) = delete;
+
+  KernelReportWriter&
+  operator=(const KernelReportWriter&) = delete;
+
+  /*!
+   * @brief Enable the report
+   * @param [in] filename         Report file name
+   * @param [in] privateMemLimit  Limit of private memory per work-item in bytes
+   */
+  void
+  enable(const std::string& filename, std::uint64_t privateMemLimit) noexcept
+  {
+    filename_ = filename;
+    privateMemLimit_ = privateMemLimit;
+  }
+
+  /*!
+   * @brief Check whether the report is enabled or not
+   * @return  true if the report is enabled, otherwise false
+   */
+  bool
+  isEnabled() const noexcept
+  {
+    return !filename_.empty();
+  }
+
+  /*!
+   * @brief Get the limit of private memory per work-item
+   * @return  Limit in bytes
+   */
+  std::uint64_t
+  getPrivateMemLimit() const noexcept
+  {
+    return privateMemLimit_;
+  }
+
+  /*!
+   * @brief Compute the cache key of the report of a cached binary
+   *
+   * The limit is mixed in, since the warnings depend on it.
+   * @param [in] cacheKey  Cache key of the binary
+   * @return  Cache key of the report
+   */
+  std::string
+  makeCacheKey(const std::string& cacheKey) const
+  {
+    return XxHash64().update("kernel-report").update(cacheKey).update(std::to_string(privateMemLimit_)).hexdigest();
+  }
+
+  /*!
+   * @brief Report a binary written to a temporary file by another name
+   * @param [in] filename  Temporary file name of the binary
+   * @param [in] output    Output file name which is reported
+   * @param [in] variant   Variant name or build options which are reported
+   */
+  void
+  setAlias(const std::string& filename, const std::string& output, const std::string& variant)
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    aliases_[filename] = std::make_pair(output, variant);
+  }
+
+  /*!
+   * @brief Add the report of a binary and show its warnings to stderr
+   * @param [in] filename  File name of the binary
+   * @param [in] report    Report of the kernels in the binary
+   */
+  void
+  add(const std::string& filename, const DeviceKernelReport& report)
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto aliasIt = aliases_.find(filename);
+    Entry entry = aliasIt == aliases_.end() ? Entry{filename, filename, "", report} : Entry{filename, aliasIt->second.first, aliasIt->second.second, report};
+    for (const auto& warning : report.warnings) {
+      std::cerr << "Warning: " << entry.output << (entry.variant.empty() ? "" : " [" + entry.variant + "]")
+                << " (" << report.deviceName << "): " << warning << "\n";
+    }
+    std::cerr.flush();
+    // Replace the report of the same binary, which is rebuilt in watch mode
+    auto it = std::find_if(entries_.begin(), entries_.end(), [&](const Entry& e) {
+      return e.filename == filename;
+    });
+    if (it != entries_.end()) {
+      *it = std::move(entry);
+    } else {
+      entries_.emplace_back(std::move(entry));
+    }
+  }
+
+  /*!
+   * @brief Write all reports to the report file
+   *
+   * The reports are sorted by output file name and variant, so that the file
+   * does not depend on the order in which the builds finish.
+   */
+  void
+  write()
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::vector<const Entry*> entries;
+    for (const auto& entry : entries_) {
+      entries.emplace_back(&entry);
+    }
+    std::stable_sort(entries.begin(), entries.end(), [](const Entry* x, const Entry* y) {
+      return std::tie(x->output, x->variant) < std::tie(y->output, y->variant);
+    });
+    bool isSucceeded = writeStreamAtomically(filename_, [&](std::ostream& os) {
+      os << "{\"binaries\": [";
+      for (decltype(entries)::size_type i = 0; i < entries.size(); i++) {
+        const Entry& entry = *entries[i];
+        os << (i == 0 ? "" : ",") << "\n  {\"output\": " << quoteJsonString(entry.output);
+        if (!entry.variant.empty()) {
+          os << ", \"variant\": " << quoteJsonString(entry.variant);
+        }
+        os << ", \"device\": " << quoteJsonString(entry.report.deviceName)
+           << ", \"kernels\": " << entry.report.kernels
+           << ", \"warnings\": [";
+        for (decltype(entry.report.warnings)::size_type j = 0; j < entry.report.warnings.size(); j++) {
+          os << (j == 0 ? "" : ", ") << quoteJsonString(entry.report.warnings[j]);
+        }
+        os << "]}";
+      }
+      os << "\n]}\n";
+    });
+    KOTLIB_THROW_IF(!isSucceeded, std::runtime_error, "Failed to write: " + filename_);
+  }
+
+private:
+  /*!
+   * @brief Report of one binary
+   */
+  struct Entry
+  {
+    //! File name of the binary
+    std::string filename;
+    //! Output file name which is reported
+    std::string output;
+    //! Variant name or build options which are reported
+    std::string variant;
+    //! Report of the kernels
+    DeviceKernelReport report;
+  };
+
+  //! Mutex for the reports
+  std::mutex mtx_;
+  //! Report file name, which is empty if disabled
+  std::string filename_;
+  //! Limit of private memory per work-item in bytes
+  std::uint64_t privateMemLimit_;
+  //! Pairs of the output file name and the variant for each temporary file name
+  std::unordered_map<std::string, std::pair<std::string, std::string> > aliases_;
+  //! Reports of the binaries in the order of addition
+  std::vector<Entry> entries_;
+};  // class KernelReportWriter
+
+
+/*!
+ * @brief Writer of the kernel report when leaving a scope, as well as when
+ *        some builds fail
+ */
+class KernelReportFlusher
+{
+public:
+  /*!
+   * @brief Remember the writer to flush
+   * @param [in,out] writer  Writer of the kernel report
+   */
+  explicit KernelReportFlusher(KernelReportWriter& writer) noexcept :
+    writer_(writer)
+  {}
+
+  KernelReportFlusher(const KernelReportFlusher&) = delete;
+
+  KernelReportFlusher&
+  operator=(const KernelReportFlusher&) = delete;
+
+  /*!
+   * @brief Write the report if enabled
+   */
+  ~KernelReportFlusher()
+  {
+    if (!writer_.isEnabled()) {
+      return;
+    }
+    try {
+      writer_.write();
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+    }
+  }
+
+private:
+  //! Writer of the kernel report
+  KernelReportWriter& writer_;
+};  // class KernelReportFlusher
+
+
+#endif  // OCL_KERNEL_REPORT
@@ -0,0 +1,305 @@
+#ifndef OCL_PHASE_TIMER
+#define OCL_PHASE_TIMER
+
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _WIN32
+#  include <sys/resource.h>
+#endif  // _WIN32
+
+
+/*!
+ * @brief Accumulator of elapsed time of named phases measured with a monotonic clock
+ *
+ * Phases measured on multiple threads are summed up, so the total time of a
+ * phase may exceed the wall time in parallel modes.
+ * The report also shows the peak resident set size of this process where the
+ * system provides it.
+ * Nothing is measured unless the timer is enabled.
+ */
+class PhaseTimer
+{
+public:
+  //! Clock to measure phases
+  using Clock = std::chrono::steady_clock;
+
+  /*!
+   * @brief RAII object which adds the elapsed time since its construction to the timer
+   */
+  class Scope
+  {
+  public:
+    /*!
+     * @brief Start measuring the specified phase
+     * @param [in] timer  Timer to add the elapsed time to, or nullptr to measure nothing
+     * @param [in] name   Phase name
+     */
+    Scope(PhaseTimer* timer, const char* name) noexcept :
+      timer_(timer),
+      name_(name),
+      start_(timer == nullptr ? Clock::time_point() : Clock::now())
+    {}
+
+    Scope(const Scope&) = delete;
+
+    Scope&
+    operator=(const Scope&) = delete;
+
+    /*!
+     * @brief Move constructor
+     * @param [in,out] that  Scope to move from
+     */
+    Scope(Scope&& that) noexcept :
+      timer_(that.timer_),
+      name_(that.name_),
+      start_(that.start_)
+    {
+      that.timer_ = nullptr;
+    }
+
+    Scope&
+    operator=(Scope&&) = delete;
+
+    /*!
+     * @brief Add the elapsed time to the timer
+     */
+    ~Scope()
+    {
+      if (timer_ != nullptr) {
+        timer_->add(name_, Clock::now() - start_);
+      }
+    }
+
+  private:
+    //! Timer to add the elapsed time to
+    PhaseTimer* timer_;
+    //! Phase name
+    const char* name_;
+    //! Time when the measurement started
+    Clock::time_point start_;
+  };  // class Scope
+
+  /*!
+   * @brief Output format of the report
+   */
+  enum class Format
+  {
+    kTable,
+    kJson
+  };
+
+  /*!
+   * @brief Construct disabled timer
+   */
+  PhaseTimer() :
+    isEnabled_(false),
+    start_(Clock::now()),
+    mtx_(),
+    names_(),
+    phases_()
+  {}
+
+  /*!
+   * @brief Enable measurement
+   */
+  void
+  enable() noexcept
+  {
+    isEnabled_ = true;
+  }
+
+  /*!
+   * @brief Check whether measurement is enabled or not
+   * @return  true if enabled, otherwise false
+   */
+  bool
+  isEnabled() const noexcept
+  {
+    return isEnabled_;
+  }
+
+  /*!
+   * @brief Start measuring the specified phase until the returned object is destructed
+   * @param [in] name  Phase name, which must be a string literal
+   * @return  RAII object of the measurement
+   */
+  Scope
+  measure(const char* name) noexcept
+  {
+    return Scope(isEnabled_ ? this : nullptr, name);
+  }
+
+  /*!
+   * @brief Add elapsed time to the specified phase
+   * @param [in] name     Phase name
+   * @param [in] elapsed  Elapsed time
+   */
+  void
+  add(const std::string& name, Clock::duration elapsed)
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = phases_.find(name);
+    if (it == phases_.end()) {
+      names_.emplace_back(name);
+      it = phases_.emplace(name, Phase{0, Clock::duration::zero()}).first;
+    }
+    it->second.count++;
+    it->second.elapsed += elapsed;
+  }
+
+  /*!
+   * @brief Show the report of all phases in the order of their first measurement
+   * @param [in,out] os      Output stream
+   * @param [in]     format  Output format
+   */
+  void
+  show(std::ostream& os, Format format) const
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    double total = toMilliseconds(Clock::now() - start_);
+    std::uint64_t peakRss = getPeakRssKib();
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize precision = os.precision();
+    if (format == Format::kJson) {
+      os << "{\"phases\": [";
+      for (decltype(names_)::size_type i = 0; i < names_.size(); i++) {
+        const Phase& phase = phases_.at(names_[i]);
+        os << (i == 0 ? "" : ", ")
+           << "{\"name\": \"" << names_[i] << "\", \"count\": " << phase.count
+           << ", \"ms\": " << std::fixed << std::setprecision(3) << toMilliseconds(phase.elapsed) << "}";
+      }
+      os << "], \"total_ms\": " << std::fixed << std::setprecision(3) << total;
+      if (peakRss != 0) {
+        os << ", \"peak_rss_kib\": " << peakRss;
+      }
+      os << "}" << std::endl;
+    } else {
+      os << "================================== Time Report =================================\n"
+         << std::left << std::setw(40) << "Phase" << std::right << std::setw(10) << "Count" << std::setw(16) << "Time [ms]" << "\n";
+      for (const auto& name : names_) {
+        const Phase& phase = phases_.at(name);
+        os << std::left << std::setw(40) << name << std::right << std::setw(10) << phase.count
+           << std::setw(16) << std::fixed << std::setprecision(3) << toMilliseconds(phase.elapsed) << "\n";
+      }
+      os << std::left << std::setw(40) << "Total (wall)" << std::right << std::setw(10) << ""
+         << std::setw(16) << std::fixed << std::setprecision(3) << total << "\n";
+      if (peakRss != 0) {
+        os << std::left << std::setw(40) << "Peak RSS [KiB]" << std::right << std::setw(10) << "" << std::setw(16) << peakRss << "\n";
+      }
+      os << "================================================================================" << std::endl;
+    }
+    os.flags(flags);
+    os.precision(precision);
+  }
+
+private:
+  /*!
+   * @brief Accumulated measurement of one phase
+   */
+  struct Phase
+  {
+    //! Number of measurements
+    std::uintmax_t count;
+    //! Total elapsed time
+    Clock::duration elapsed;
+  };
+
+  //! Whether measurement is enabled or not
+  bool isEnabled_;
+  //! Time when this timer is constructed
+  const Clock::time_point start_;
+  //! Mutex for names_ and phases_
+  mutable std::mutex mtx_;
+  //! Phase names in the order of their first measurement
+  std::vector<std::string> names_;
+  //! Accumulated measurements of each phase
+  std::unordered_map<std::string, Phase> phases_;
+
+  /*!
+   * @brief Convert duration to milliseconds
+   * @param [in] duration  Duration
+   * @return  Milliseconds
+   */
+  static double
+  toMilliseconds(Clock::duration duration) noexcept
+  {
+    return std::chrono::duration<double, std::milli>(duration).count();
+  }
+
+  /*!
+   * @brief Get the peak resident set size of this process
+   * @return  Peak resident set size in KiB, or 0 if unknown
+   */
+  static std::uint64_t
+  getPeakRssKib() noexcept
+  {
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0 || usage.ru_maxrss < 0) {
+      return 0;
+    }
+#  ifdef __APPLE__
+    // macOS reports bytes instead of KiB
+    return static_cast<std::uint64_t>(usage.ru_maxrss) >> 10;
+#  else
+    return static_cast<std::uint64_t>(usage.ru_maxrss);
+#  endif  // __APPLE__
+#endif  // _WIN32
+  }
+};  // class PhaseTimer
+
+
+/*!
+ * @brief RAII object which shows the report of a timer on its destruction if the timer is enabled
+ */
+class PhaseTimerReporter
+{
+public:
+  /*!
+   * @brief Remember where and how to show the report
+   * @param [in]     timer   Timer to report
+   * @param [in,out] os      Output stream
+   * @param [in]     format  Output format
+   */
+  PhaseTimerReporter(const PhaseTimer& timer, std::ostream& os, PhaseTimer::Format format) noexcept :
+    timer_(timer),
+    os_(os),
+    format_(format)
+  {}
+
+  PhaseTimerReporter(const PhaseTimerReporter&) = delete;
+
+  PhaseTimerReporter&
+  operator=(const PhaseTimerReporter&) = delete;
+
+  /*!
+   * @brief Show the report
+   */
+  ~PhaseTimerReporter()
+  {
+    if (timer_.isEnabled()) {
+      timer_.show(os_, format_);
+    }
+  }
+
+private:
+  //! Timer to report
+  const PhaseTimer& timer_;
+  //! Output stream
+  std::ostream& os_;
+  //! Output format
+  const PhaseTimer::Format format_;
+};  // class PhaseTimerReporter
+
+
+#endif  // OCL_PHASE_TIMER
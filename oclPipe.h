@@ -0,0 +1,157 @@
+#ifndef OCL_PIPE
+#define OCL_PIPE
+
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+#ifdef _WIN32
+#  include <fcntl.h>
+#  include <io.h>
+#else
+#  include <cerrno>
+#  include <unistd.h>
+#endif  // _WIN32
+
+#include <kotlib/macro.h>
+#include "oclSocket.h"
+
+
+/*!
+ * @brief Byte channel over a pair of file descriptors such as stdin and stdout
+ *
+ * The file descriptors are not owned, and are switched to binary mode on
+ * Windows so that binaries are not corrupted by newline conversion.
+ */
+class PipeChannel : public ByteChannel<PipeChannel>
+{
+public:
+  /*!
+   * @brief Construct channel which reads from and writes to the specified file descriptors
+   * @param [in] inFd   File descriptor to read from
+   * @param [in] outFd  File descriptor to write to
+   */
+  PipeChannel(int inFd, int outFd) noexcept :
+    ByteChannel<PipeChannel>(),
+    inFd_(inFd),
+    outFd_(outFd),
+    lookahead_(-1)
+  {
+#ifdef _WIN32
+    ::_setmode(inFd_, _O_BINARY);
+    ::_setmode(outFd_, _O_BINARY);
+#endif  // _WIN32
+  }
+
+  /*!
+   * @brief Get channel over standard input and standard output
+   * @return  Channel over file descriptors 0 and 1
+   */
+  static PipeChannel
+  getStandardStreams() noexcept
+  {
+    return PipeChannel(0, 1);
+  }
+
+  /*!
+   * @brief Wait until at least one byte arrives or the input reaches its end
+   * @return  true if more bytes can be received, false at the end of the input
+   */
+  bool
+  hasMore() const
+  {
+    if (lookahead_ == -1) {
+      unsigned char c;
+      if (readSome(&c, 1) == 0) {
+        return false;
+      }
+      lookahead_ = c;
+    }
+    return true;
+  }
+
+  /*!
+   * @brief Write all of the specified bytes
+   * @param [in] data  Pointer to the bytes
+   * @param [in] size  Number of bytes
+   */
+  void
+  sendBytes(const void* data, std::size_t size) const
+  {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+#ifdef _WIN32
+      int n = ::_write(outFd_, p, static_cast<unsigned int>(std::min<std::size_t>(size, kMaxChunkSize)));
+#else
+      ssize_t n = ::write(outFd_, p, size);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+#endif  // _WIN32
+      KOTLIB_THROW_IF(n <= 0, std::runtime_error, "Failed to write to pipe");
+      p += n;
+      size -= static_cast<std::size_t>(n);
+    }
+  }
+
+  /*!
+   * @brief Read exactly the specified number of bytes
+   * @param [out] data  Pointer to the buffer
+   * @param [in]  size  Number of bytes
+   */
+  void
+  recvBytes(void* data, std::size_t size) const
+  {
+    char* p = static_cast<char*>(data);
+    if (size > 0 && lookahead_ != -1) {
+      *p++ = static_cast<char>(lookahead_);
+      lookahead_ = -1;
+      size--;
+    }
+    while (size > 0) {
+      std::size_t n = readSome(p, size);
+      KOTLIB_THROW_IF(n == 0, std::runtime_error, "Unexpected end of pipe");
+      p += n;
+      size -= n;
+    }
+  }
+
+private:
+  //! Max number of bytes of one read or write on Windows
+  static constexpr std::size_t kMaxChunkSize = 1 << 30;
+
+  //! File descriptor to read from
+  int inFd_;
+  //! File descriptor to write to
+  int outFd_;
+  //! Byte which hasMore() has read ahead, or -1
+  mutable int lookahead_;
+
+  /*!
+   * @brief Read at most the specified number of bytes
+   * @param [out] data  Pointer to the buffer
+   * @param [in]  size  Max number of bytes
+   * @return  Number of bytes read, or 0 at the end of the input
+   */
+  std::size_t
+  readSome(void* data, std::size_t size) const
+  {
+    for (;;) {
+#ifdef _WIN32
+      int n = ::_read(inFd_, data, static_cast<unsigned int>(std::min<std::size_t>(size, kMaxChunkSize)));
+#else
+      ssize_t n = ::read(inFd_, data, size);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+#endif  // _WIN32
+      KOTLIB_THROW_IF(n < 0, std::runtime_error, "Failed to read from pipe");
+      return static_cast<std::size_t>(n);
+    }
+  }
+};  // class PipeChannel
+
+
+#endif  // OCL_PIPE
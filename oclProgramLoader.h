@@ -0,0 +1,372 @@
+#ifndef OCL_PROGRAM_LOADER
+#define OCL_PROGRAM_LOADER
+
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifdef __APPLE__
+#  include <OpenCL/opencl.h>
+#else
+#  include <CL/cl.h>
+#endif
+
+#include <kotlib/macro.h>
+#include "oclFatBinary.h"
+#include "oclFileUtil.h"
+#include "oclHandle.h"
+#include "oclSourceFile.h"
+
+
+/*!
+ * @brief Runtime loader of a kernel binary made with oclc for one device
+ *
+ * The binary file, which may be a fat binary, is memory-mapped and passed to
+ * clCreateProgramWithBinary() without copying.
+ * If the fingerprint of the binary, that is the device name and the driver
+ * version, does not match the device, or the driver rejects the binary with
+ * CL_INVALID_BINARY, the program is built from the kernel source instead and
+ * the binary file is refreshed with the new binary, so that only the first
+ * start after a driver update pays for the compilation.
+ * The kernel source is given to the constructor, or embedded in the fat
+ * binary with "oclc --bundle --embed-source".
+ * A fat binary image linked into the executable with "oclc --emit=c-array" or
+ * "oclc --emit=obj" is also accepted, which is rebuilt but never refreshed.
+ * A variant of a fat binary made with "oclc --specialize" is selected by its
+ * name, and is built from the source with the macros of the variant on
+ * fallback.
+ * The program is built only once, and kernels are cached by name.
+ * All member functions are safe to call from multiple threads, but the
+ * returned kernels are shared and clSetKernelArg() on them is not.
+ */
+class ProgramLoader
+{
+public:
+  /*!
+   * @brief Remember the binary and the fallback source, not load them yet
+   * @param [in] context     Context which contains the device
+   * @param [in] deviceId    Device ID
+   * @param [in] binaryPath  Kernel binary file made with oclc
+   * @param [in] source      Kernel source to build on fallback, or empty to use the embedded source
+   * @param [in] options     Build options on fallback, or empty to use the options of the fat binary entry
+   * @param [in] variant     Variant name such as "VEC=4,TILE=16", or empty for a fat binary without variants
+   */
+  ProgramLoader(
+      cl_context context,
+      cl_device_id deviceId,
+      const std::string& binaryPath,
+      const std::string& source = "",
+      const std::string& options = "",
+      const std::string& variant = "") :
+    context_(context),
+    deviceId_(deviceId),
+    binaryPath_(binaryPath),
+    image_(nullptr),
+    imageSize_(0),
+    source_(source),
+    options_(options.empty() ? options : options + makeVariantOptions(variant)),
+    variant_(variant),
+    isRebuilt_(false),
+    mtx_(),
+    program_(),
+    kernels_()
+  {}
+
+  /*!
+   * @brief Remember the embedded fat binary image and the fallback source
+   * @param [in] context    Context which contains the device
+   * @param [in] deviceId   Device ID
+   * @param [in] image      Fat binary image embedded with oclc --emit, which must outlive this loader
+   * @param [in] imageSize  Size of the image
+   * @param [in] source     Kernel source to build on fallback, or empty to use the embedded source
+   * @param [in] options    Build options on fallback, or empty to use the options of the fat binary entry
+   * @param [in] variant    Variant name such as "VEC=4,TILE=16", or empty for a fat binary without variants
+   */
+  ProgramLoader(
+      cl_context context,
+      cl_device_id deviceId,
+      const void* image,
+      std::size_t imageSize,
+      const std::string& source = "",
+      const std::string& options = "",
+      const std::string& variant = "") :
+    context_(context),
+    deviceId_(deviceId),
+    binaryPath_(),
+    image_(static_cast<const char*>(image)),
+    imageSize_(imageSize),
+    source_(source),
+    options_(options.empty() ? options : options + makeVariantOptions(variant)),
+    variant_(variant),
+    isRebuilt_(false),
+    mtx_(),
+    program_(),
+    kernels_()
+  {}
+
+  ProgramLoader(const ProgramLoader&) = delete;
+
+  ProgramLoader&
+  operator=(const ProgramLoader&) = delete;
+
+  /*!
+   * @brief Get the built program, loading and building it on the first call
+   * @return  Built program, which is owned by this loader
+   */
+  cl_program
+  getProgram()
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return getProgramLocked();
+  }
+
+  /*!
+   * @brief Get the kernel of specified name, creating it on the first call
+   * @param [in] name  Kernel name
+   * @return  Kernel, which is owned by this loader
+   */
+  cl_kernel
+  getKernel(const std::string& name)
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = kernels_.find(name);
+    if (it != kernels_.end()) {
+      return it->second.get();
+    }
+    cl_int errCode;
+    KernelHandle kernel(
+        clCreateKernel(getProgramLocked(), name.c_str(), &errCode));
+    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clCreateKernel() failed: " + name + " (" + std::to_string(errCode) + ")");
+    return kernels_.emplace(name, std::move(kernel)).first->second.get();
+  }
+
+  /*!
+   * @brief Check whether the program was built from the source or not
+   * @return  true if the binary was stale and the program was built from the source
+   */
+  bool
+  isRebuilt() const
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return isRebuilt_;
+  }
+
+private:
+  //! Context which contains the device
+  const cl_context context_;
+  //! Device ID
+  const cl_device_id deviceId_;
+  //! Kernel binary file, or empty for the embedded image
+  const std::string binaryPath_;
+  //! Embedded fat binary image, or nullptr to read the binary file
+  const char* const image_;
+  //! Size of the embedded image
+  const std::size_t imageSize_;
+  //! Kernel source to build on fallback
+  std::string source_;
+  //! Build options on fallback
+  std::string options_;
+  //! Variant name of the fat binary entry
+  const std::string variant_;
+  //! Whether the program was built from the source or not
+  bool isRebuilt_;
+  //! Mutex for the program and the kernels
+  mutable std::mutex mtx_;
+  //! Built program
+  ProgramHandle program_;
+  //! Kernels for each name
+  std::unordered_map<std::string, KernelHandle> kernels_;
+
+  /*!
+   * @brief Get the built program while the mutex is locked
+   * @return  Built program
+   */
+  cl_program
+  getProgramLocked()
+  {
+    if (program_ != nullptr) {
+      return program_.get();
+    }
+    std::string deviceName = getDeviceInfoString(CL_DEVICE_NAME);
+    std::string driverVersion = getDeviceInfoString(CL_DRIVER_VERSION);
+
+    // Pick up the binary whose fingerprint matches the device
+    SourceFile binaryFile;
+    if (image_ == nullptr) {
+      try {
+        binaryFile = SourceFile::read(binaryPath_);
+      } catch (const std::runtime_error&) {
+        // Build from the source if there is no binary yet
+      }
+    }
+    const char* fileData = image_ != nullptr ? image_ : binaryFile.data();
+    std::size_t fileSize = image_ != nullptr ? imageSize_ : binaryFile.size();
+    std::vector<FatBinaryEntry> entries;
+    const char* binData = nullptr;
+    std::size_t binSize = 0;
+    bool isStale = false;
+    if (isFatBinary(fileData, fileSize)) {
+      entries = parseFatBinary(fileData, fileSize);
+      const FatBinaryEntry* entry = findFatBinaryEntry(entries, deviceName, driverVersion, variant_);
+      const FatBinaryEntry* sourceEntry = findFatBinarySource(entries);
+      if (entry != nullptr) {
+        binData = entry->data;
+        binSize = entry->size;
+        isStale = entry->driverVersion != driverVersion;
+      }
+      if (source_.empty() && sourceEntry != nullptr) {
+        source_.assign(sourceEntry->data, sourceEntry->size);
+      }
+      if (options_.empty() && (entry != nullptr || sourceEntry != nullptr)) {
+        options_ = entry != nullptr ? entry->options : sourceEntry->options + makeVariantOptions(variant_);
+      }
+    } else if (fileSize > 0) {
+      binData = fileData;
+      binSize = fileSize;
+    }
+    if (options_.empty()) {
+      options_ = makeVariantOptions(variant_);
+    }
+
+    // Try the binary unless it is known to be stale and the source is available
+    if (binData != nullptr && !(isStale && !source_.empty()) && buildFromBinary(binData, binSize)) {
+      return program_.get();
+    }
+
+    // Fall back to the source, and refresh the binary file
+    KOTLIB_THROW_IF(source_.empty(), std::runtime_error, "No valid binary and no source for device: " + deviceName);
+    buildFromSource();
+    isRebuilt_ = true;
+    if (image_ == nullptr) {
+      refreshBinaryFile(entries, deviceName, driverVersion);
+    }
+    return program_.get();
+  }
+
+  /*!
+   * @brief Create program from the binary and build it
+   * @param [in] data  Pointer to the binary
+   * @param [in] size  Size of the binary
+   * @return  true if succeeded, false if the driver rejected the binary
+   */
+  bool
+  buildFromBinary(const char* data, std::size_t size)
+  {
+    const unsigned char* bin = reinterpret_cast<const unsigned char*>(data);
+    cl_int binStatus = CL_SUCCESS;
+    cl_int errCode;
+    program_.reset(clCreateProgramWithBinary(context_, 1, &deviceId_, &size, &bin, &binStatus, &errCode));
+    if (errCode == CL_INVALID_BINARY || binStatus != CL_SUCCESS) {
+      program_.reset();
+      return false;
+    }
+    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clCreateProgramWithBinary() failed (" + std::to_string(errCode) + ")");
+    errCode = clBuildProgram(program_.get(), 1, &deviceId_, nullptr, nullptr, nullptr);
+    if (errCode == CL_INVALID_BINARY || errCode == CL_BUILD_PROGRAM_FAILURE) {
+      program_.reset();
+      return false;
+    }
+    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clBuildProgram() failed (" + std::to_string(errCode) + ")");
+    return true;
+  }
+
+  /*!
+   * @brief Create program from the source and build it
+   */
+  void
+  buildFromSource()
+  {
+    const char* data = source_.data();
+    std::size_t size = source_.size();
+    cl_int errCode;
+    program_.reset(clCreateProgramWithSource(context_, 1, &data, &size, &errCode));
+    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clCreateProgramWithSource() failed (" + std::to_string(errCode) + ")");
+    errCode = clBuildProgram(program_.get(), 1, &deviceId_, options_.c_str(), nullptr, nullptr);
+    if (errCode != CL_SUCCESS) {
+      std::string buildLog = getBuildLog();
+      program_.reset();
+      KOTLIB_THROW_IF(true, std::runtime_error, "clBuildProgram() failed (" + std::to_string(errCode) + ")\n" + buildLog);
+    }
+  }
+
+  /*!
+   * @brief Replace the binary file with the binary of the built program
+   *
+   * Other entries of a fat binary are kept, and the entries for the same
+   * device name and variant are replaced.
+   * The file is replaced atomically, and a failure to write it, such as a
+   * read-only deployment directory, is ignored.
+   * @param [in] entries        Entries of the old fat binary, or empty for a plain binary
+   * @param [in] deviceName     Device name
+   * @param [in] driverVersion  Driver version
+   */
+  void
+  refreshBinaryFile(const std::vector<FatBinaryEntry>& entries, const std::string& deviceName, const std::string& driverVersion) const
+  {
+    std::size_t size;
+    if (clGetProgramInfo(program_.get(), CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, nullptr) != CL_SUCCESS || size == 0) {
+      return;
+    }
+    std::unique_ptr<char[]> bin(new char[size]);
+    char* binPtr = bin.get();
+    if (clGetProgramInfo(program_.get(), CL_PROGRAM_BINARIES, sizeof(binPtr), &binPtr, nullptr) != CL_SUCCESS) {
+      return;
+    }
+    if (entries.empty()) {
+      writeFileAtomically(binaryPath_, bin.get(), size);
+      return;
+    }
+    std::vector<FatBinaryEntry> newEntries;
+    for (const auto& entry : entries) {
+      if (entry.deviceName != deviceName || entry.variant != variant_) {
+        newEntries.push_back(entry);
+      }
+    }
+    newEntries.push_back(FatBinaryEntry{deviceName, driverVersion, options_, variant_, bin.get(), size});
+    std::string image = makeFatBinary(newEntries);
+    writeFileAtomically(binaryPath_, image.data(), image.size());
+  }
+
+  /*!
+   * @brief Get device information as a string
+   * @param [in] paramName  Parameter name of the information
+   * @return  Device information
+   */
+  std::string
+  getDeviceInfoString(cl_device_info paramName) const
+  {
+    std::size_t size;
+    cl_int errCode = clGetDeviceInfo(deviceId_, paramName, 0, nullptr, &size);
+    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clGetDeviceInfo() failed (" + std::to_string(errCode) + ")");
+    std::string info(size, '\0');
+    errCode = clGetDeviceInfo(deviceId_, paramName, info.size(), &info[0], nullptr);
+    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clGetDeviceInfo() failed (" + std::to_string(errCode) + ")");
+    return info.substr(0, info.find('\0'));
+  }
+
+  /*!
+   * @brief Get build log of the program
+   * @return  Build log
+   */
+  std::string
+  getBuildLog() const
+  {
+    std::size_t logSize;
+    if (clGetProgramBuildInfo(program_.get(), deviceId_, CL_PROGRAM_BUILD_LOG, 0, nullptr, &logSize) != CL_SUCCESS || logSize == 0) {
+      return "";
+    }
+    std::string buildLog(logSize, '\0');
+    if (clGetProgramBuildInfo(program_.get(), deviceId_, CL_PROGRAM_BUILD_LOG, logSize, &buildLog[0], nullptr) != CL_SUCCESS) {
+      return "";
+    }
+    return buildLog.substr(0, buildLog.find('\0'));
+  }
+};  // class ProgramLoader
+
+
+#endif  // OCL_PROGRAM_LOADER
@@ -0,0 +1,455 @@
+#ifndef OCL_SOCKET
+#define OCL_SOCKET
+
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#  include <csignal>
+#  include <cerrno>
+#  include <sys/socket.h>
+#  include <sys/types.h>
+#  include <sys/un.h>
+#  include <unistd.h>
+#endif  // _WIN32
+
+#include <kotlib/macro.h>
+#include "oclSourceFile.h"
+
+
+/*!
+ * @brief Encoder of integers and byte sequences over a byte stream
+ *
+ * Integers are transferred as 64-bit little-endian values, and strings and
+ * byte sequences are prefixed with their 64-bit length.
+ * @tparam Derived  Stream class which defines sendBytes() and recvBytes()
+ */
+template<typename Derived>
+class ByteChannel
+{
+public:
+  /*!
+   * @brief Send a 64-bit unsigned integer
+   * @param [in] value  Value to send
+   */
+  void
+  sendU64(std::uint64_t value) const
+  {
+    unsigned char buf[8];
+    for (int i = 0; i < 8; i++) {
+      buf[i] = static_cast<unsigned char>(value >> (i * 8));
+    }
+    static_cast<const Derived*>(this)->sendBytes(buf, sizeof(buf));
+  }
+
+  /*!
+   * @brief Receive a 64-bit unsigned integer
+   * @return  Received value
+   */
+  std::uint64_t
+  recvU64() const
+  {
+    unsigned char buf[8];
+    static_cast<const Derived*>(this)->recvBytes(buf, sizeof(buf));
+    std::uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+      value |= static_cast<std::uint64_t>(buf[i]) << (i * 8);
+    }
+    return value;
+  }
+
+  /*!
+   * @brief Receive a number of elements which follow
+   * @param [in] maxCount  Max acceptable number, which protects from a broken peer
+   * @return  Received number
+   */
+  std::size_t
+  recvCount(std::uint64_t maxCount) const
+  {
+    std::uint64_t count = recvU64();
+    KOTLIB_THROW_IF(count > maxCount, std::runtime_error, "Too many elements: " + std::to_string(count));
+    return static_cast<std::size_t>(count);
+  }
+
+  /*!
+   * @brief Send a length-prefixed byte sequence
+   * @param [in] data  Pointer to the bytes
+   * @param [in] size  Number of bytes
+   */
+  void
+  sendBlob(const void* data, std::size_t size) const
+  {
+    sendU64(size);
+    static_cast<const Derived*>(this)->sendBytes(data, size);
+  }
+
+  /*!
+   * @brief Receive a length-prefixed byte sequence
+   * @tparam Container  std::string or std::vector<char>
+   * @param [in] maxSize  Max acceptable size, which protects from a broken peer
+   * @return  Received bytes
+   */
+  template<typename Container>
+  Container
+  recvBlob(std::uint64_t maxSize = kMaxBlobSize) const
+  {
+    std::uint64_t size = recvU64();
+    KOTLIB_THROW_IF(size > maxSize, std::runtime_error, "Too large message: " + std::to_string(size) + " bytes");
+    Container blob(static_cast<typename Container::size_type>(size), '\0');
+    if (!blob.empty()) {
+      static_cast<const Derived*>(this)->recvBytes(&blob[0], blob.size());
+    }
+    return blob;
+  }
+
+protected:
+  //! Default max size of one byte sequence
+  static constexpr std::uint64_t kMaxBlobSize = static_cast<std::uint64_t>(1) << 32;
+
+  ByteChannel() = default;
+
+  ~ByteChannel() = default;
+};  // class ByteChannel
+
+
+/*!
+ * @brief Move-only RAII wrapper of a Unix domain stream socket
+ *
+ * Unix domain sockets are not supported on Windows, where connect() always
+ * fails and listen() throws.
+ */
+class UnixSocket : public ByteChannel<UnixSocket>
+{
+public:
+  /*!
+   * @brief Construct an invalid socket
+   */
+  UnixSocket() noexcept :
+    ByteChannel<UnixSocket>(),
+    fd_(-1)
+  {}
+
+  UnixSocket(const UnixSocket&) = delete;
+
+  UnixSocket&
+  operator=(const UnixSocket&) = delete;
+
+  /*!
+   * @brief Move constructor
+   * @param [in,out] that  Socket to move from
+   */
+  UnixSocket(UnixSocket&& that) noexcept :
+    ByteChannel<UnixSocket>(),
+    fd_(that.fd_)
+  {
+    that.fd_ = -1;
+  }
+
+  /*!
+   * @brief Move assignment operator
+   * @param [in,out] that  Socket to move from
+   * @return  Reference to this object
+   */
+  UnixSocket&
+  operator=(UnixSocket&& that) noexcept
+  {
+    std::swap(fd_, that.fd_);
+    return *this;
+  }
+
+  /*!
+   * @brief Close the socket
+   */
+  ~UnixSocket()
+  {
+#ifndef _WIN32
+    if (fd_ != -1) {
+      ::close(fd_);
+    }
+#endif  // _WIN32
+  }
+
+  /*!
+   * @brief Connect to the server listening on the specified path
+   * @param [in] path  Socket path
+   * @return  Connected socket, or invalid socket if no server is listening
+   */
+  static UnixSocket
+  connect(const std::string& path) noexcept
+  {
+    UnixSocket sock;
+#ifndef _WIN32
+    struct sockaddr_un addr;
+    if (!makeAddress(path, addr)) {
+      return sock;
+    }
+    sock.fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock.fd_ != -1 && ::connect(sock.fd_, reinterpret_cast<const struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+      sock = UnixSocket();
+    }
+#else
+    static_cast<void>(path);
+#endif  // _WIN32
+    return sock;
+  }
+
+  /*!
+   * @brief Listen on the specified path
+   *
+   * A stale socket file which no server is listening on is removed.
+   * @param [in] path  Socket path
+   * @return  Listening socket
+   */
+  static UnixSocket
+  listen(const std::string& path)
+  {
+    UnixSocket sock;
+#ifndef _WIN32
+    struct sockaddr_un addr;
+    KOTLIB_THROW_IF(!makeAddress(path, addr), std::runtime_error, "Too long socket path: " + path);
+    KOTLIB_THROW_IF(connect(path).isValid(), std::runtime_error, "Server is already running: " + path);
+    ::unlink(path.c_str());
+    // Ignore SIGPIPE so that a client disconnecting early does not kill the server
+    std::signal(SIGPIPE, SIG_IGN);
+    sock.fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    KOTLIB_THROW_IF(sock.fd_ == -1, std::runtime_error, "Failed to create socket");
+    KOTLIB_THROW_IF(::bind(sock.fd_, reinterpret_cast<const struct sockaddr*>(&addr), sizeof(addr)) != 0, std::runtime_error, "Failed to bind: " + path);
+    KOTLIB_THROW_IF(::listen(sock.fd_, SOMAXCONN) != 0, std::runtime_error, "Failed to listen: " + path);
+#else
+    KOTLIB_THROW_IF(true, std::runtime_error, "Unix domain socket is not supported on Windows: " + path);
+#endif  // _WIN32
+    return sock;
+  }
+
+  /*!
+   * @brief Accept one connection
+   * @return  Accepted socket
+   */
+  UnixSocket
+  accept() const
+  {
+    UnixSocket sock;
+#ifndef _WIN32
+    do {
+      sock.fd_ = ::accept(fd_, nullptr, nullptr);
+    } while (sock.fd_ == -1 && errno == EINTR);
+#endif  // _WIN32
+    KOTLIB_THROW_IF(!sock.isValid(), std::runtime_error, "Failed to accept connection");
+    return sock;
+  }
+
+  /*!
+   * @brief Check whether this socket is opened or not
+   * @return  true if this socket is opened, otherwise false
+   */
+  bool
+  isValid() const noexcept
+  {
+    return fd_ != -1;
+  }
+
+  /*!
+   * @brief Send all of the specified bytes
+   * @param [in] data  Pointer to the bytes
+   * @param [in] size  Number of bytes
+   */
+  void
+  sendBytes(const void* data, std::size_t size) const
+  {
+#ifndef _WIN32
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+      ssize_t n = ::send(fd_, p, size, 0);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      KOTLIB_THROW_IF(n <= 0, std::runtime_error, "Failed to send to socket");
+      p += n;
+      size -= static_cast<std::size_t>(n);
+    }
+#else
+    static_cast<void>(data);
+    static_cast<void>(size);
+#endif  // _WIN32
+  }
+
+  /*!
+   * @brief Receive exactly the specified number of bytes
+   * @param [out] data  Pointer to the buffer
+   * @param [in]  size  Number of bytes
+   */
+  void
+  recvBytes(void* data, std::size_t size) const
+  {
+#ifndef _WIN32
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+      ssize_t n = ::recv(fd_, p, size, 0);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      KOTLIB_THROW_IF(n <= 0, std::runtime_error, "Failed to receive from socket");
+      p += n;
+      size -= static_cast<std::size_t>(n);
+    }
+#else
+    static_cast<void>(data);
+    static_cast<void>(size);
+#endif  // _WIN32
+  }
+
+private:
+  //! File descriptor of the socket
+  int fd_;
+
+#ifndef _WIN32
+  /*!
+   * @brief Make socket address of the specified path
+   * @param [in]  path  Socket path
+   * @param [out] addr  Socket address
+   * @return  true if the path fits in the address, otherwise false
+   */
+  static bool
+  makeAddress(const std::string& path, struct sockaddr_un& addr) noexcept
+  {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.length() >= sizeof(addr.sun_path)) {
+      return false;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.length());
+    return true;
+  }
+#endif  // _WIN32
+};  // class UnixSocket
+
+
+/*!
+ * @brief Compile request from oclc client to oclc server
+ */
+struct CompileRequest
+{
+  //! Platform index
+  std::uint64_t platformIndex;
+  //! Device type to enumerate devices of the platform
+  std::uint64_t deviceType;
+  //! Index of the first target device
+  std::uint64_t deviceIndex;
+  //! Whether to check syntax only, not generate binary
+  bool isSyntaxOnly;
+  //! Compile options
+  std::string options;
+  //! Working directory of the client, against which relative paths are resolved
+  std::string workingDirectory;
+  //! Kernel source codes
+  std::vector<SourceFile> sources;
+
+  /*!
+   * @brief Send this request
+   * @param [in] sock  Connected socket
+   */
+  void
+  send(const UnixSocket& sock) const
+  {
+    sock.sendU64(kMagic);
+    sock.sendU64(platformIndex);
+    sock.sendU64(deviceType);
+    sock.sendU64(deviceIndex);
+    sock.sendU64(isSyntaxOnly ? 1 : 0);
+    sock.sendBlob(options.data(), options.length());
+    sock.sendBlob(workingDirectory.data(), workingDirectory.length());
+    sock.sendU64(sources.size());
+    for (const auto& source : sources) {
+      sock.sendBlob(source.data(), source.size());
+    }
+  }
+
+  /*!
+   * @brief Receive a request
+   * @param [in] sock  Connected socket
+   * @return  Received request
+   */
+  static CompileRequest
+  recv(const UnixSocket& sock)
+  {
+    KOTLIB_THROW_IF(sock.recvU64() != kMagic, std::runtime_error, "Invalid compile request");
+    CompileRequest request{0, 0, 0, false, "", "", {}};
+    request.platformIndex = sock.recvU64();
+    request.deviceType = sock.recvU64();
+    request.deviceIndex = sock.recvU64();
+    request.isSyntaxOnly = sock.recvU64() != 0;
+    request.options = sock.recvBlob<std::string>();
+    request.workingDirectory = sock.recvBlob<std::string>();
+    request.sources.resize(sock.recvCount(kMaxSources));
+    for (auto& source : request.sources) {
+      source = SourceFile(sock.recvBlob<std::string>());
+    }
+    return request;
+  }
+
+  //! Magic number which identifies the protocol and its version ("OCLCREQ2")
+  static constexpr std::uint64_t kMagic = 0x32514552434c434fULL;
+  //! Max number of kernel sources in one request
+  static constexpr std::uint64_t kMaxSources = 1 << 16;
+};  // struct CompileRequest
+
+
+/*!
+ * @brief Compile response from oclc server to oclc client
+ */
+struct CompileResponse
+{
+  //! true if the compilation succeeded, otherwise false
+  bool isSucceeded;
+  //! Error message including the build log on failure
+  std::string message;
+  //! Compiled binaries for each target device
+  std::vector<std::vector<char> > binaries;
+
+  //! Max number of binaries in one response, which is the number of target devices
+  static constexpr std::uint64_t kMaxBinaries = 1 << 16;
+
+  /*!
+   * @brief Send this response
+   * @tparam Channel  UnixSocket, or PipeChannel in stream mode
+   * @param [in] sock  Connected socket or pipe
+   */
+  template<typename Channel>
+  void
+  send(const ByteChannel<Channel>& sock) const
+  {
+    sock.sendU64(isSucceeded ? 1 : 0);
+    sock.sendBlob(message.data(), message.length());
+    sock.sendU64(binaries.size());
+    for (const auto& binary : binaries) {
+      sock.sendBlob(binary.data(), binary.size());
+    }
+  }
+
+  /*!
+   * @brief Receive a response
+   * @tparam Channel  UnixSocket, or PipeChannel in stream mode
+   * @param [in] sock  Connected socket or pipe
+   * @return  Received response
+   */
+  template<typename Channel>
+  static CompileResponse
+  recv(const ByteChannel<Channel>& sock)
+  {
+    CompileResponse response{false, "", {}};
+    response.isSucceeded = sock.recvU64() != 0;
+    response.message = sock.template recvBlob<std::string>();
+    response.binaries.resize(sock.recvCount(kMaxBinaries));
+    for (auto& binary : response.binaries) {
+      binary = sock.template recvBlob<std::vector<char> >();
+    }
+    return response;
+  }
+};  // struct CompileResponse
+
+
+#endif  // OCL_SOCKET
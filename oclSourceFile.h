@@ -0,0 +1,282 @@
+#ifndef OCL_SOURCE_FILE
+#define OCL_SOURCE_FILE
+
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <cerrno>
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif  // _WIN32
+
+#include <kotlib/macro.h>
+
+
+//! File name which means standard input or standard output
+static constexpr const char* kStdioFileName = "-";
+
+
+/*!
+ * @brief Move-only read-only content of a kernel source file
+ *
+ * A regular file is memory-mapped, so that its content can be passed to
+ * clCreateProgramWithSource() without copying.
+ * Other files such as pipes are read into an owned buffer with bulk reads.
+ * The file name "-" means standard input, which is read once into a buffer
+ * shared by all sources of it.
+ * The content is not NUL-terminated; always use it with size().
+ */
+class SourceFile
+{
+public:
+  /*!
+   * @brief Construct empty source
+   */
+  SourceFile() noexcept :
+    buffer_(),
+    shared_(),
+    mapped_(nullptr),
+    mappedSize_(0)
+  {}
+
+  /*!
+   * @brief Construct source which owns the specified content
+   * @param [in] content  Source content
+   */
+  explicit SourceFile(std::string&& content) noexcept :
+    buffer_(std::move(content)),
+    shared_(),
+    mapped_(nullptr),
+    mappedSize_(0)
+  {}
+
+  SourceFile(const SourceFile&) = delete;
+
+  SourceFile&
+  operator=(const SourceFile&) = delete;
+
+  /*!
+   * @brief Move constructor
+   * @param [in,out] that  Source to move from
+   */
+  SourceFile(SourceFile&& that) noexcept :
+    buffer_(std::move(that.buffer_)),
+    shared_(std::move(that.shared_)),
+    mapped_(that.mapped_),
+    mappedSize_(that.mappedSize_)
+  {
+    that.mapped_ = nullptr;
+    that.mappedSize_ = 0;
+  }
+
+  /*!
+   * @brief Move assignment operator
+   * @param [in,out] that  Source to move from
+   * @return  Reference to this object
+   */
+  SourceFile&
+  operator=(SourceFile&& that) noexcept
+  {
+    std::swap(buffer_, that.buffer_);
+    std::swap(shared_, that.shared_);
+    std::swap(mapped_, that.mapped_);
+    std::swap(mappedSize_, that.mappedSize_);
+    return *this;
+  }
+
+  /*!
+   * @brief Unmap the file
+   */
+  ~SourceFile()
+  {
+    unmap();
+  }
+
+  /*!
+   * @brief Open and map, or read the specified file
+   * @param [in] filename  File name to read, or "-" for standard input
+   * @return  Content of the file
+   */
+  static SourceFile
+  read(const std::string& filename)
+  {
+    if (filename == kStdioFileName) {
+      return readStandardInput();
+    }
+    SourceFile source;
+#ifdef _WIN32
+    HANDLE hFile = ::CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    KOTLIB_THROW_IF(hFile == INVALID_HANDLE_VALUE, std::runtime_error, "Failed to read file: " + filename);
+    LARGE_INTEGER fileSize;
+    if (::GetFileType(hFile) == FILE_TYPE_DISK && ::GetFileSizeEx(hFile, &fileSize) && fileSize.QuadPart > 0) {
+      HANDLE hMapping = ::CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      if (hMapping != nullptr) {
+        source.mapped_ = ::MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+        source.mappedSize_ = static_cast<std::size_t>(fileSize.QuadPart);
+        ::CloseHandle(hMapping);
+      }
+    }
+    if (source.mapped_ == nullptr) {
+      source.mappedSize_ = 0;
+      source.readAll(hFile);
+    }
+    ::CloseHandle(hFile);
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    KOTLIB_THROW_IF(fd == -1, std::runtime_error, "Failed to read file: " + filename);
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void* p = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        source.mapped_ = p;
+        source.mappedSize_ = static_cast<std::size_t>(st.st_size);
+      }
+    }
+    if (source.mapped_ == nullptr) {
+      bool isSucceeded = source.readAll(fd);
+      ::close(fd);
+      KOTLIB_THROW_IF(!isSucceeded, std::runtime_error, "Failed to read file: " + filename);
+      return source;
+    }
+    ::close(fd);
+#endif  // _WIN32
+    return source;
+  }
+
+  /*!
+   * @brief Read standard input
+   *
+   * Standard input is read only on the first call, so that the sources which
+   * are read more than once, such as for hashing and for building, are the same.
+   * Every call shares the buffer of the first call instead of copying it.
+   * @return  Content of standard input
+   */
+  static SourceFile
+  readStandardInput()
+  {
+    static const std::shared_ptr<const std::string> content = [] {
+      SourceFile source;
+#ifdef _WIN32
+      source.readAll(::GetStdHandle(STD_INPUT_HANDLE));
+#else
+      KOTLIB_THROW_IF(!source.readAll(STDIN_FILENO), std::runtime_error, "Failed to read standard input");
+#endif  // _WIN32
+      return std::make_shared<const std::string>(std::move(source.buffer_));
+    }();
+    SourceFile source;
+    source.shared_ = content;
+    return source;
+  }
+
+  /*!
+   * @brief Get pointer to the content
+   * @return  Pointer to the content
+   */
+  const char*
+  data() const noexcept
+  {
+    return mapped_ != nullptr ? static_cast<const char*>(mapped_)
+      : shared_ != nullptr ? shared_->data()
+      : buffer_.data();
+  }
+
+  /*!
+   * @brief Get size of the content
+   * @return  Size of the content in bytes
+   */
+  std::size_t
+  size() const noexcept
+  {
+    return mapped_ != nullptr ? mappedSize_
+      : shared_ != nullptr ? shared_->size()
+      : buffer_.size();
+  }
+
+private:
+  //! Size of one bulk read for non-regular files
+  static constexpr std::size_t kReadChunkSize = 1 << 20;
+
+  //! Owned content, which is used if the file is neither mapped nor shared
+  std::string buffer_;
+  //! Content shared with other sources, such as of standard input
+  std::shared_ptr<const std::string> shared_;
+  //! Mapped content
+  void* mapped_;
+  //! Size of the mapped content
+  std::size_t mappedSize_;
+
+  /*!
+   * @brief Unmap the mapped content
+   */
+  void
+  unmap() noexcept
+  {
+    if (mapped_ == nullptr) {
+      return;
+    }
+#ifdef _WIN32
+    ::UnmapViewOfFile(mapped_);
+#else
+    ::munmap(mapped_, mappedSize_);
+#endif  // _WIN32
+    mapped_ = nullptr;
+    mappedSize_ = 0;
+  }
+
+#ifdef _WIN32
+  /*!
+   * @brief Read all content of the specified file handle into the buffer
+   * @param [in] hFile  File handle
+   */
+  void
+  readAll(HANDLE hFile)
+  {
+    std::string::size_type size = 0;
+    for (DWORD nRead = 0; ; size += nRead) {
+      buffer_.resize(size + kReadChunkSize);
+      if (!::ReadFile(hFile, &buffer_[size], static_cast<DWORD>(kReadChunkSize), &nRead, nullptr) || nRead == 0) {
+        break;
+      }
+    }
+    buffer_.resize(size);
+  }
+#else
+  /*!
+   * @brief Read all content of the specified file descriptor into the buffer
+   * @param [in] fd  File descriptor
+   * @return  true if succeeded, otherwise false
+   */
+  bool
+  readAll(int fd)
+  {
+    std::string::size_type size = 0;
+    for (;;) {
+      if (buffer_.size() - size < kReadChunkSize) {
+        buffer_.resize(std::max(buffer_.size() * 2, size + kReadChunkSize));
+      }
+      ssize_t n = ::read(fd, &buffer_[size], buffer_.size() - size);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        buffer_.resize(size);
+        return n == 0;
+      }
+      size += static_cast<std::string::size_type>(n);
+    }
+  }
+#endif  // _WIN32
+};  // class SourceFile
+
+
+#endif  // OCL_SOURCE_FILE
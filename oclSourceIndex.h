@@ -0,0 +1,372 @@
+#ifndef OCL_SOURCE_INDEX
+#define OCL_SOURCE_INDEX
+
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <kotlib/macro.h>
+#include "oclBinaryCache.h"
+#include "oclSourceFile.h"
+
+
+/*!
+ * @brief Index of kernel source files, their content hashes and the headers
+ *        which they include
+ *
+ * Each file is read once, hashed, and scanned for #include directives, and
+ * the results are memoized, so that the cache keys, the dependency files and
+ * watch mode share one pass over the source tree without starting the OpenCL
+ * compiler.
+ * Files are scanned on worker threads level by level of the include graph;
+ * the given files are scanned in parallel first, then the headers which they
+ * include, and so on.
+ *
+ * A quoted header is searched in the directory of the including file first,
+ * and then in the include directories.
+ * Headers which are not found, such as those of the OpenCL implementation,
+ * are ignored.
+ * Conditional compilation is not evaluated, so headers in disabled blocks are
+ * also indexed.
+ */
+class SourceIndex
+{
+public:
+  /*!
+   * @brief Construct empty index
+   * @param [in] includeDirs  Include directories
+   */
+  explicit SourceIndex(const std::vector<std::string>& includeDirs) :
+    includeDirs_(includeDirs),
+    entries_()
+  {}
+
+  /*!
+   * @brief Scan specified files and the headers which they include
+   *
+   * Files which are already indexed are not scanned again, but the headers
+   * which they include are followed to find the files which are not indexed.
+   * @param [in] filenames  Kernel source files
+   * @param [in] nJob       Number of worker threads
+   */
+  void
+  scan(const std::vector<std::string>& filenames, std::size_t nJob)
+  {
+    std::unordered_set<std::string> visited;
+    std::vector<std::string> frontier = findUnscanned(filenames, visited);
+    while (!frontier.empty()) {
+      std::vector<Entry> scanned(frontier.size(), Entry{false, "", {}});
+      std::atomic<std::size_t> nextIndex(0);
+      auto worker = [&] {
+        for (std::size_t i = nextIndex++; i < frontier.size(); i = nextIndex++) {
+          scanned[i] = scanFile(frontier[i]);
+        }
+      };
+      std::vector<std::thread> threads;
+      for (std::size_t i = 1; i < std::min(nJob, frontier.size()); i++) {
+        threads.emplace_back(worker);
+      }
+      worker();
+      for (auto& thread : threads) {
+        thread.join();
+      }
+
+      std::vector<std::string> includes;
+      for (decltype(frontier)::size_type i = 0; i < frontier.size(); i++) {
+        includes.insert(includes.end(), scanned[i].includes.begin(), scanned[i].includes.end());
+        entries_.emplace(frontier[i], std::move(scanned[i]));
+      }
+      frontier = findUnscanned(includes, visited);
+    }
+  }
+
+  /*!
+   * @brief Forget specified files, so that they are scanned again by scan()
+   * @param [in] filenames  Files which are modified
+   */
+  void
+  invalidate(const std::vector<std::string>& filenames)
+  {
+    for (const auto& filename : filenames) {
+      entries_.erase(filename);
+    }
+  }
+
+  /*!
+   * @brief Get specified files and the headers which they include
+   *
+   * The files must be scanned with scan() beforehand.
+   * @param [in] filenames  Kernel source files
+   * @return  Kernel source files followed by the included headers
+   */
+  std::vector<std::string>
+  getDependencies(const std::vector<std::string>& filenames) const
+  {
+    std::vector<std::string> dependencies(filenames);
+    std::unordered_set<std::string> visited(filenames.begin(), filenames.end());
+    for (decltype(dependencies)::size_type i = 0; i < dependencies.size(); i++) {
+      auto it = entries_.find(dependencies[i]);
+      if (it == entries_.end()) {
+        continue;
+      }
+      for (const auto& include : it->second.includes) {
+        if (visited.insert(include).second) {
+          dependencies.emplace_back(include);
+        }
+      }
+    }
+    return dependencies;
+  }
+
+  /*!
+   * @brief Get the digest of specified files and all headers which they include
+   *
+   * The files must be scanned with scan() beforehand.
+   * @param [in] filenames  Kernel source files
+   * @return  Hex string which changes whenever any of the files or the headers changes
+   */
+  std::string
+  getDigest(const std::vector<std::string>& filenames) const
+  {
+    XxHash64 hasher;
+    std::vector<std::string> dependencies = getDependencies(filenames);
+    for (decltype(dependencies)::size_type i = 0; i < dependencies.size(); i++) {
+      auto it = entries_.find(dependencies[i]);
+      bool isFound = it != entries_.end() && it->second.isFound;
+      KOTLIB_THROW_IF(!isFound && i < filenames.size(), std::runtime_error, "Failed to read file: " + dependencies[i]);
+      hasher.update(dependencies[i]).update(isFound ? it->second.digest : "");
+    }
+    return hasher.hexdigest();
+  }
+
+  /*!
+   * @brief Get the digest of kernel sources in memory and all headers which they include
+   *
+   * The headers are scanned as needed, so that sources received from a client
+   * are keyed by their headers as well as the files which are scanned.
+   * Quoted headers of the sources are searched in the specified directory
+   * first, since the sources have no file names.
+   * @param [in] sources  Kernel source codes
+   * @param [in] dir      Directory of quoted headers with a trailing separator, or empty for the current directory
+   * @param [in] nJob     Number of worker threads which scan the headers
+   * @return  Hex string which changes whenever any of the sources or the headers changes
+   */
+  std::string
+  getContentDigest(const std::vector<SourceFile>& sources, const std::string& dir, std::size_t nJob)
+  {
+    XxHash64 hasher;
+    std::vector<std::string> includes;
+    for (const auto& source : sources) {
+      Entry entry = scanContent(source.data(), source.size(), dir);
+      hasher.update(entry.digest);
+      includes.insert(includes.end(), entry.includes.begin(), entry.includes.end());
+    }
+    scan(includes, nJob);
+    for (const auto& dependency : getDependencies(includes)) {
+      auto it = entries_.find(dependency);
+      hasher.update(dependency).update(it != entries_.end() && it->second.isFound ? it->second.digest : "");
+    }
+    return hasher.hexdigest();
+  }
+
+private:
+  /*!
+   * @brief Scanned result of one file
+   */
+  struct Entry
+  {
+    //! Whether the file is read or not
+    bool isFound;
+    //! Hex string of the content hash
+    std::string digest;
+    //! Resolved paths of the included headers
+    std::vector<std::string> includes;
+  };
+
+  //! Include directories
+  const std::vector<std::string> includeDirs_;
+  //! Scanned results for each file name
+  std::unordered_map<std::string, Entry> entries_;
+
+  /*!
+   * @brief Find files which are not indexed, following the includes of indexed files
+   * @param [in]     filenames  Files to start from
+   * @param [in,out] visited    Files which are already visited
+   * @return  Files which are not indexed yet
+   */
+  std::vector<std::string>
+  findUnscanned(const std::vector<std::string>& filenames, std::unordered_set<std::string>& visited) const
+  {
+    std::vector<std::string> unscanned;
+    std::vector<std::string> stack(filenames.rbegin(), filenames.rend());
+    while (!stack.empty()) {
+      std::string filename = std::move(stack.back());
+      stack.pop_back();
+      if (!visited.insert(filename).second) {
+        continue;
+      }
+      auto it = entries_.find(filename);
+      if (it == entries_.end()) {
+        unscanned.emplace_back(filename);
+      } else {
+        stack.insert(stack.end(), it->second.includes.rbegin(), it->second.includes.rend());
+      }
+    }
+    return unscanned;
+  }
+
+  /*!
+   * @brief Read, hash and scan one file
+   *
+   * This function is called on worker threads, so it does not touch entries_.
+   * @param [in] filename  File name
+   * @return  Scanned result, whose isFound is false if the file cannot be read
+   */
+  Entry
+  scanFile(const std::string& filename) const
+  {
+    SourceFile source;
+    try {
+      source = SourceFile::read(filename);
+    } catch (const std::exception&) {
+      return Entry{false, "", {}};
+    }
+    std::string::size_type pos = filename.find_last_of("/\\");
+    return scanContent(source.data(), source.size(), pos == std::string::npos ? "" : filename.substr(0, pos + 1));
+  }
+
+  /*!
+   * @brief Hash and scan the content of one file
+   * @param [in] data  Pointer to the content
+   * @param [in] size  Size of the content
+   * @param [in] dir   Directory of the file with a trailing separator, or empty for the current directory
+   * @return  Scanned result
+   */
+  Entry
+  scanContent(const char* data, std::size_t size, const std::string& dir) const
+  {
+    Entry entry{true, XxHash64().update(data, size).hexdigest(), {}};
+    const char* end = data + size;
+    for (const char* line = data; line < end;) {
+      const char* eol = static_cast<const char*>(std::memchr(line, '\n', static_cast<std::size_t>(end - line)));
+      if (eol == nullptr) {
+        eol = end;
+      }
+      std::string include = resolveInclude(line, eol, dir);
+      if (!include.empty()) {
+        entry.includes.emplace_back(std::move(include));
+      }
+      line = eol + 1;
+    }
+    return entry;
+  }
+
+  /*!
+   * @brief Resolve the header of an #include directive
+   * @param [in] first  Pointer to the beginning of the line
+   * @param [in] last   Pointer to the end of the line
+   * @param [in] dir    Directory of the including file, with a trailing separator
+   * @return  Path of the header, or empty if the line is not an #include directive or the header is not found
+   */
+  std::string
+  resolveInclude(const char* first, const char* last, const std::string& dir) const
+  {
+    auto skipBlank = [last](const char* p) {
+      while (p < last && (*p == ' ' || *p == '\t')) {
+        p++;
+      }
+      return p;
+    };
+    const char* p = skipBlank(first);
+    if (p == last || *p != '#') {
+      return "";
+    }
+    p = skipBlank(p + 1);
+    if (last - p < 7 || std::memcmp(p, "include", 7) != 0) {
+      return "";
+    }
+    p = skipBlank(p + 7);
+    if (p == last || (*p != '"' && *p != '<')) {
+      return "";
+    }
+    bool isQuoted = *p == '"';
+    const char* q = std::find(p + 1, last, isQuoted ? '"' : '>');
+    if (q == last) {
+      return "";
+    }
+    std::string name(p + 1, q);
+
+    if (isQuoted && isRegularFile(dir + name)) {
+      return normalizePath(dir + name);
+    }
+    for (const auto& includeDir : includeDirs_) {
+      std::string candidate = includeDir + "/" + name;
+      if (isRegularFile(candidate)) {
+        return normalizePath(candidate);
+      }
+    }
+    return "";
+  }
+
+  /*!
+   * @brief Remove "." and "dir/.." from a path of an existing file
+   *
+   * A header which is reached through different relative paths, such as
+   * "a/../inc/x.h" and "inc/x.h", is indexed and watched as one file.
+   * The path is kept as it is if the simplified one does not name a file, as
+   * happens when a directory is a symbolic link.
+   * @param [in] path  Path of an existing file
+   * @return  Simplified path
+   */
+  static std::string
+  normalizePath(const std::string& path)
+  {
+    std::vector<std::string> segments;
+    std::string::size_type first = 0;
+    for (;;) {
+      std::string::size_type last = path.find_first_of("/\\", first);
+      std::string segment = path.substr(first, last == std::string::npos ? std::string::npos : last - first);
+      if (segment == ".." && !segments.empty() && segments.back() != ".." && !segments.back().empty()) {
+        segments.pop_back();
+      } else if (segment != "." && (!segment.empty() || segments.empty())) {
+        segments.emplace_back(segment);
+      }
+      if (last == std::string::npos) {
+        break;
+      }
+      first = last + 1;
+    }
+
+    std::string normalized;
+    for (decltype(segments)::size_type i = 0; i < segments.size(); i++) {
+      normalized += (i == 0 ? "" : "/") + segments[i];
+    }
+    return normalized != path && isRegularFile(normalized) ? normalized : path;
+  }
+
+  /*!
+   * @brief Check whether specified path is an existing regular file or not
+   * @param [in] path  Path to check
+   * @return  true if the path is a regular file, otherwise false
+   */
+  static bool
+  isRegularFile(const std::string& path) noexcept
+  {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG;
+  }
+};  // class SourceIndex
+
+
+#endif  // OCL_SOURCE_INDEX
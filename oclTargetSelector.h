@@ -0,0 +1,263 @@
+#ifndef OCL_TARGET_SELECTOR
+#define OCL_TARGET_SELECTOR
+
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __APPLE__
+#  include <OpenCL/opencl.h>
+#else
+#  include <CL/cl.h>
+#endif
+
+#include <kotlib/macro.h>
+#include "oclDeviceInventory.h"
+
+
+//! Keys of conditions of target selectors
+static constexpr const char* kTargetSelectorKeys[] = {"platform", "vendor", "name", "version", "driver", "type"};
+
+
+/*!
+ * @brief Target devices of one platform
+ */
+struct TargetGroup
+{
+  //! Platform index
+  std::size_t platformIndex;
+  //! Indices of the devices in the order of clGetDeviceIDs() with CL_DEVICE_TYPE_ALL
+  std::vector<std::size_t> deviceIndices;
+};
+
+
+/*!
+ * @brief Selector of target devices by their names, vendors and types
+ *
+ * A selector is a comma-separated list of conditions "KEY=PATTERN", all of
+ * which a device must satisfy, such as "vendor=NVIDIA,name=*A100*".
+ * The keys are platform (platform name), vendor (device or platform vendor),
+ * name (device name), version (device version), driver (driver version) and
+ * type (cpu, gpu, accelerator or custom).
+ * Patterns are matched case-insensitively, where '*' matches any string and
+ * '?' matches any character.
+ * A pattern without wildcards matches a value which contains it, so that
+ * "vendor=NVIDIA" matches "NVIDIA Corporation".
+ */
+class TargetSelector
+{
+public:
+  /*!
+   * @brief Parse one selector
+   * @param [in] text  Comma-separated conditions
+   * @return  Selector
+   */
+  static TargetSelector
+  parse(const std::string& text)
+  {
+    TargetSelector selector(text);
+    std::string::size_type first = 0;
+    for (;;) {
+      std::string::size_type last = text.find(',', first);
+      std::string condition = text.substr(first, last == std::string::npos ? std::string::npos : last - first);
+      std::string::size_type pos = condition.find('=');
+      KOTLIB_THROW_IF(pos == std::string::npos || pos == 0, std::invalid_argument, "Invalid target condition: " + condition);
+      std::string key = condition.substr(0, pos);
+      KOTLIB_THROW_IF(std::find(std::begin(kTargetSelectorKeys), std::end(kTargetSelectorKeys), key) == std::end(kTargetSelectorKeys), std::invalid_argument, "Invalid target key: " + key);
+      selector.conditions_.emplace_back(key, condition.substr(pos + 1));
+      if (last == std::string::npos) {
+        break;
+      }
+      first = last + 1;
+    }
+    return selector;
+  }
+
+  /*!
+   * @brief Parse semicolon-separated selectors
+   * @param [in] text  Selectors such as "vendor=NVIDIA,name=*A100*;vendor=AMD"
+   * @return  Selectors
+   */
+  static std::vector<TargetSelector>
+  parseList(const std::string& text)
+  {
+    std::vector<TargetSelector> selectors;
+    std::string::size_type first = 0;
+    for (;;) {
+      std::string::size_type last = text.find(';', first);
+      std::string selector = text.substr(first, last == std::string::npos ? std::string::npos : last - first);
+      if (!selector.empty()) {
+        selectors.emplace_back(parse(selector));
+      }
+      if (last == std::string::npos) {
+        break;
+      }
+      first = last + 1;
+    }
+    return selectors;
+  }
+
+  /*!
+   * @brief Select the devices which any of the selectors matches
+   * @param [in] inventory  Device inventory
+   * @param [in] selectors  Selectors
+   * @return  Target devices for each platform in the order of the inventory,
+   *          or empty if any of the selectors matches no device
+   */
+  static std::vector<TargetGroup>
+  select(const DeviceInventory& inventory, const std::vector<TargetSelector>& selectors)
+  {
+    std::vector<TargetGroup> groups;
+    std::vector<bool> isUsed(selectors.size(), false);
+    const std::vector<PlatformRecord>& platforms = inventory.getPlatforms();
+    for (decltype(platforms.size()) i = 0; i < platforms.size(); i++) {
+      TargetGroup group{i, {}};
+      for (decltype(platforms[i].devices.size()) j = 0; j < platforms[i].devices.size(); j++) {
+        bool isMatched = false;
+        for (decltype(selectors.size()) k = 0; k < selectors.size(); k++) {
+          if (selectors[k].matches(platforms[i], platforms[i].devices[j])) {
+            isMatched = true;
+            isUsed[k] = true;
+          }
+        }
+        if (isMatched) {
+          group.deviceIndices.emplace_back(j);
+        }
+      }
+      if (!group.deviceIndices.empty()) {
+        groups.emplace_back(std::move(group));
+      }
+    }
+    if (std::find(isUsed.begin(), isUsed.end(), false) != isUsed.end()) {
+      groups.clear();
+    }
+    return groups;
+  }
+
+  /*!
+   * @brief Check whether a device satisfies all conditions of this selector
+   * @param [in] platform  Platform of the device
+   * @param [in] device    Device
+   * @return  true if the device is selected, otherwise false
+   */
+  bool
+  matches(const PlatformRecord& platform, const DeviceRecord& device) const
+  {
+    for (const auto& condition : conditions_) {
+      const std::string& key = condition.first;
+      const std::string& pattern = condition.second;
+      bool isMatched = key == "platform" ? matchPattern(pattern, platform.name)
+        : key == "vendor" ? matchPattern(pattern, device.vendor) || matchPattern(pattern, platform.vendor)
+        : key == "name" ? matchPattern(pattern, device.name)
+        : key == "version" ? matchPattern(pattern, device.version)
+        : key == "driver" ? matchPattern(pattern, device.driverVersion)
+        : matchPattern(pattern, getTypeName(device.type));
+      if (!isMatched) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /*!
+   * @brief Get the selector as specified
+   * @return  Text of the selector
+   */
+  const std::string&
+  getText() const noexcept
+  {
+    return text_;
+  }
+
+private:
+  //! Text of the selector
+  std::string text_;
+  //! Pairs of the key and the pattern of each condition
+  std::vector<std::pair<std::string, std::string> > conditions_;
+
+  /*!
+   * @brief Construct selector without conditions
+   * @param [in] text  Text of the selector
+   */
+  explicit TargetSelector(const std::string& text) :
+    text_(text),
+    conditions_()
+  {}
+
+  /*!
+   * @brief Get the name of the device type for the type condition
+   * @param [in] type  Device type bits (CL_DEVICE_TYPE)
+   * @return  Device type name
+   */
+  static std::string
+  getTypeName(std::uint64_t type)
+  {
+    return (type & CL_DEVICE_TYPE_GPU) != 0 ? "gpu"
+      : (type & CL_DEVICE_TYPE_CPU) != 0 ? "cpu"
+      : (type & CL_DEVICE_TYPE_ACCELERATOR) != 0 ? "accelerator"
+      : "custom";
+  }
+
+  /*!
+   * @brief Match a value with a pattern case-insensitively
+   * @param [in] pattern  Pattern which may contain '*' and '?'
+   * @param [in] value    Value to match
+   * @return  true if matched, otherwise false
+   */
+  static bool
+  matchPattern(const std::string& pattern, const std::string& value)
+  {
+    if (pattern.find_first_of("*?") == std::string::npos) {
+      return matchGlob("*" + pattern + "*", value);
+    }
+    return matchGlob(pattern, value);
+  }
+
+  /*!
+   * @brief Match a whole value with a glob pattern case-insensitively
+   *
+   * The last '*' is backtracked, which takes linear time for each '*'.
+   * @param [in] pattern  Pattern which may contain '*' and '?'
+   * @param [in] value    Value to match
+   * @return  true if matched, otherwise false
+   */
+  static bool
+  matchGlob(const std::string& pattern, const std::string& value) noexcept
+  {
+    auto toLower = [](char c) {
+      return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    };
+    std::string::size_type p = 0;
+    std::string::size_type v = 0;
+    std::string::size_type starP = std::string::npos;
+    std::string::size_type starV = 0;
+    while (v < value.size()) {
+      if (p < pattern.size() && pattern[p] == '*') {
+        starP = p++;
+        starV = v;
+      } else if (p < pattern.size() && (pattern[p] == '?' || toLower(pattern[p]) == toLower(value[v]))) {
+        p++;
+        v++;
+      } else if (starP != std::string::npos) {
+        p = starP + 1;
+        v = ++starV;
+      } else {
+        return false;
+      }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+      p++;
+    }
+    return p == pattern.size();
+  }
+};  // class TargetSelector
+
+
+#endif  // OCL_TARGET_SELECTOR
@@ -1,9 +1,28 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <numeric>
 #include <random>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#  include <arm_neon.h>
+#endif
 
 #ifdef __APPLE__
 #  include <OpenCL/opencl.h>
@@ -13,10 +32,56 @@
 
 #include <kotlib/macro.h>
 #include <kotlib/OptionParser.hpp>
+#include "../oclHandle.h"
+#include "../oclProgramLoader.h"
+
+
+static const std::unordered_map<std::string, cl_int> kDeviceTypeMap{
+  {"all", CL_DEVICE_TYPE_ALL},
+  {"default", CL_DEVICE_TYPE_DEFAULT},
+  {"cpu", CL_DEVICE_TYPE_CPU},
+  {"gpu", CL_DEVICE_TYPE_GPU}
+};
+//! Number of elements which a verification thread checks at a time
+static constexpr std::size_t kVerifyBlockSize = 4096;
+
+
+/*!
+ * @brief Reference implementation of a kernel for result verification
+ *
+ * It computes the expected values of elements [first, first + n) of the first
+ * buffer argument from the other buffer arguments, all of which are float
+ * arrays of the same size.
+ * @param [in]  inputs    Buffer arguments except the first one
+ * @param [in]  first     Index of the first element
+ * @param [in]  n         Number of elements
+ * @param [out] expected  Expected values of the n elements
+ */
+using ReferenceFunction = void (*)(const std::vector<const float*>& inputs, std::size_t first, std::size_t n, float* expected);
+
+
+/*!
+ * @brief Kernel whose results are verified
+ */
+struct ReferenceKernel
+{
+  //! Number of the buffer arguments except the first one
+  std::size_t nInput;
+  //! Reference implementation
+  ReferenceFunction compute;
+};
 
 
-static constexpr cl_uint kNDefaultPlatformEntry = 16;
-static constexpr cl_uint kNDefaultDeviceEntry = 16;
+//! Reference implementations of the kernels whose results are verified, which are looked up by kernel name
+static const std::unordered_map<std::string, ReferenceKernel> kReferenceKernelMap{
+  {"vecAdd", {2, [](const std::vector<const float*>& inputs, std::size_t first, std::size_t n, float* expected) {
+    const float* x = inputs[0] + first;
+    const float* y = inputs[1] + first;
+    for (std::size_t i = 0; i < n; i++) {
+      expected[i] = x[i] + y[i];
+    }
+  }}}
+};
 
 
 /*!
@@ -71,43 +136,6 @@ struct AlignedDeleter
 };
 
 
-/*!
- * @brief Get platform IDs
- * @param [in] nPlatformEntry  Max number of platform IDs to get
- * @return  std::vector which contains obtained platform IDs
- */
-static inline std::vector<cl_platform_id>
-getPlatformIds(cl_uint nPlatformEntry = kNDefaultPlatformEntry)
-{
-  std::vector<cl_platform_id> platformIds(nPlatformEntry);
-  cl_uint nPlatform;
-  cl_int errCode = clGetPlatformIDs(nPlatformEntry, platformIds.data(), &nPlatform);
-  KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clGetPlatformIDs() failed");
-  platformIds.resize(nPlatform);
-  return platformIds;
-}
-
-
-/*!
- * @brief Get device IDs
- * @param [in] platformId    One platform ID
- * @param [in] nDeviceEntry  Max number of device IDs to get
- * @param [in] deviceType    Device type which means CPU, GPU, or both.
- * @return  std::vector which contains obtained device IDs
- */
-static inline std::vector<cl_device_id>
-getDeviceIds(const cl_platform_id& platformId, cl_uint nDeviceEntry = kNDefaultDeviceEntry, cl_int deviceType = CL_DEVICE_TYPE_DEFAULT)
-{
-  std::vector<cl_device_id> deviceIds(nDeviceEntry);
-  cl_uint nDevice;
-  cl_int errCode = clGetDeviceIDs(platformId, deviceType, nDeviceEntry, deviceIds.data(), &nDevice);
-  KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clGetDeviceIDs() failed");
-  deviceIds.resize(nDevice);
-  return deviceIds;
-}
-
-
-
 /*!
  * @brief Implementation of setting arguments to kernel function
  * @param [in] kernel  Kernel object of OpenCL
@@ -156,8 +184,579 @@ setKernelArgs(const cl_kernel& kernel, const Args&... args) noexcept
 
 
 
+/*!
+ * @brief Parse comma-separated sizes
+ * @param [in] str  Comma-separated sizes such as "1024,1024"
+ * @return  Parsed sizes
+ */
+static inline std::vector<std::size_t>
+parseSizes(const std::string& str)
+{
+  std::vector<std::size_t> sizes;
+  std::istringstream iss(str);
+  for (std::string field; std::getline(iss, field, ',');) {
+    KOTLIB_THROW_IF(field.empty() || field.find_first_not_of("0123456789") != std::string::npos, std::invalid_argument, "Invalid size: " + str);
+    sizes.emplace_back(static_cast<std::size_t>(std::stoull(field)));
+  }
+  return sizes;
+}
+
+
+/*!
+ * @brief Get elapsed time of the command associated with specified event
+ * @param [in] event  Event of the command enqueued to a profiling queue
+ * @return  Elapsed time in nanoseconds from the start to the end of the command
+ */
+static inline cl_ulong
+getElapsedTime(cl_event event)
+{
+  cl_ulong start;
+  cl_ulong end;
+  cl_int errCode = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, nullptr);
+  KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clGetEventProfilingInfo() failed");
+  errCode = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr);
+  KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clGetEventProfilingInfo() failed");
+  return end - start;
+}
+
+
+/*!
+ * @brief Get percentile of sorted samples with nearest-rank method
+ * @param [in] sortedSamples  Samples sorted in ascending order
+ * @param [in] ratio          Ratio of the percentile in [0, 1]
+ * @return  Percentile of the samples
+ */
+static inline cl_ulong
+getPercentile(const std::vector<cl_ulong>& sortedSamples, double ratio) noexcept
+{
+  std::size_t rank = static_cast<std::size_t>(std::ceil(ratio * static_cast<double>(sortedSamples.size())));
+  return sortedSamples[rank == 0 ? 0 : rank - 1];
+}
+
+
+/*!
+ * @brief Map a float to an integer which is ordered in the same way, so that
+ *        the difference of two mapped floats is their distance in ULPs
+ * @param [in] x  Float value
+ * @return  Ordered integer, where -0.0 and +0.0 are both 0
+ */
+static inline std::int32_t
+toOrderedInt(float x) noexcept
+{
+  std::int32_t i;
+  std::memcpy(&i, &x, sizeof(i));
+  return i < 0 ? std::numeric_limits<std::int32_t>::min() - i : i;
+}
+
+
+/*!
+ * @brief Get the distance of two floats in ULPs
+ * @param [in] x  Float value
+ * @param [in] y  Float value
+ * @return  Number of representable floats between the two values
+ */
+static inline std::uint32_t
+getUlpDistance(float x, float y) noexcept
+{
+  std::int32_t ix = toOrderedInt(x);
+  std::int32_t iy = toOrderedInt(y);
+  return ix > iy ? static_cast<std::uint32_t>(ix) - static_cast<std::uint32_t>(iy) : static_cast<std::uint32_t>(iy) - static_cast<std::uint32_t>(ix);
+}
+
+
+/*!
+ * @brief Accuracy of results over the checked elements
+ */
+struct VerifyResult
+{
+  //! Max distance in ULPs
+  std::uint32_t maxUlp;
+  //! Max relative error
+  float maxRelError;
+  //! Index of the first element out of the tolerance, or the number of elements if none
+  std::size_t failedIndex;
+};
+
+
+/*!
+ * @brief Compare results with the expected values in SIMD lanes
+ *
+ * AVX2 or NEON (AArch64) is used where the compiler targets it, and the rest
+ * of the elements are compared one by one.
+ * @param [in]     actual    Results
+ * @param [in]     expected  Expected values
+ * @param [in]     n         Number of elements
+ * @param [in]     maxUlp    Tolerance in ULPs
+ * @param [in,out] result    Accuracy, which is updated with these elements
+ * @return  Index of the first element out of the tolerance, or n if none
+ */
+static inline std::size_t
+compareResults(const float* actual, const float* expected, std::size_t n, std::uint32_t maxUlp, VerifyResult& result) noexcept
+{
+  std::size_t i = 0;
+  std::size_t failedIndex = n;
+#if defined(__AVX2__)
+  const __m256i vIntMin = _mm256_set1_epi32(std::numeric_limits<std::int32_t>::min());
+  const __m256i vTolerance = _mm256_set1_epi32(static_cast<std::int32_t>(maxUlp));
+  const __m256 vAbsMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  __m256i vMaxUlp = _mm256_setzero_si256();
+  __m256 vMaxRelError = _mm256_setzero_ps();
+  auto toOrdered = [&](__m256i v) {
+    return _mm256_blendv_epi8(v, _mm256_sub_epi32(vIntMin, v), _mm256_srai_epi32(v, 31));
+  };
+  for (; i + 8 <= n; i += 8) {
+    __m256 va = _mm256_loadu_ps(actual + i);
+    __m256 ve = _mm256_loadu_ps(expected + i);
+    __m256i oa = toOrdered(_mm256_castps_si256(va));
+    __m256i oe = toOrdered(_mm256_castps_si256(ve));
+    __m256i vUlp = _mm256_sub_epi32(_mm256_max_epi32(oa, oe), _mm256_min_epi32(oa, oe));
+    vMaxUlp = _mm256_max_epu32(vMaxUlp, vUlp);
+    vMaxRelError = _mm256_max_ps(_mm256_div_ps(_mm256_and_ps(_mm256_sub_ps(va, ve), vAbsMask), _mm256_and_ps(ve, vAbsMask)), vMaxRelError);
+    // ulp > tolerance if max(ulp, tolerance) != tolerance
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_max_epu32(vUlp, vTolerance), vTolerance)) != -1) {
+      break;
+    }
+  }
+  alignas(32) std::uint32_t ulps[8];
+  alignas(32) float relErrors[8];
+  _mm256_store_si256(reinterpret_cast<__m256i*>(ulps), vMaxUlp);
+  _mm256_store_ps(relErrors, vMaxRelError);
+  for (int k = 0; k < 8; k++) {
+    result.maxUlp = std::max(result.maxUlp, ulps[k]);
+    result.maxRelError = std::max(relErrors[k], result.maxRelError);
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const int32x4_t vIntMin = vdupq_n_s32(std::numeric_limits<std::int32_t>::min());
+  const uint32x4_t vTolerance = vdupq_n_u32(maxUlp);
+  uint32x4_t vMaxUlp = vdupq_n_u32(0);
+  float32x4_t vMaxRelError = vdupq_n_f32(0.0f);
+  auto toOrdered = [&](int32x4_t v) {
+    return vbslq_s32(vcltzq_s32(v), vsubq_s32(vIntMin, v), v);
+  };
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t va = vld1q_f32(actual + i);
+    float32x4_t ve = vld1q_f32(expected + i);
+    int32x4_t oa = toOrdered(vreinterpretq_s32_f32(va));
+    int32x4_t oe = toOrdered(vreinterpretq_s32_f32(ve));
+    uint32x4_t vUlp = vsubq_u32(vreinterpretq_u32_s32(vmaxq_s32(oa, oe)), vreinterpretq_u32_s32(vminq_s32(oa, oe)));
+    vMaxUlp = vmaxq_u32(vMaxUlp, vUlp);
+    // vmaxnmq_f32() ignores NaN of 0 / 0
+    vMaxRelError = vmaxnmq_f32(vMaxRelError, vdivq_f32(vabdq_f32(va, ve), vabsq_f32(ve)));
+    if (vmaxvq_u32(vcgtq_u32(vUlp, vTolerance)) != 0) {
+      break;
+    }
+  }
+  result.maxUlp = std::max(result.maxUlp, vmaxvq_u32(vMaxUlp));
+  result.maxRelError = std::max(vmaxnmvq_f32(vMaxRelError), result.maxRelError);
+#endif  // defined(__AVX2__)
+  // Compare the rest, and find the failed element in the lanes of the last vector
+  for (; i < n; i++) {
+    std::uint32_t ulp = getUlpDistance(actual[i], expected[i]);
+    float relError = std::abs(actual[i] - expected[i]) / std::abs(expected[i]);
+    result.maxUlp = std::max(result.maxUlp, ulp);
+    if (relError > result.maxRelError) {
+      result.maxRelError = relError;
+    }
+    if (ulp > maxUlp) {
+      failedIndex = i;
+      break;
+    }
+  }
+  return failedIndex;
+}
+
+
+/*!
+ * @brief Verify the first buffer argument with the reference implementation
+ *        on multiple threads
+ *
+ * Each thread computes the expected values of one block at a time and
+ * compares them with the results, and all threads stop at the first block
+ * which has an element out of the tolerance.
+ * @param [in] reference  Reference implementation
+ * @param [in] buffers    Host buffers of the buffer arguments, whose first one holds the results
+ * @param [in] n          Number of elements of each buffer
+ * @param [in] maxUlp     Tolerance in ULPs
+ * @param [in] nThread    Number of threads
+ * @return  Accuracy over the checked elements
+ */
+static inline VerifyResult
+verifyResults(ReferenceFunction reference, const std::vector<const float*>& buffers, std::size_t n, std::uint32_t maxUlp, std::size_t nThread)
+{
+  std::vector<const float*> inputs(buffers.begin() + 1, buffers.end());
+  std::atomic<std::size_t> nextBlock(0);
+  std::atomic<std::size_t> failedIndex(n);
+  std::vector<VerifyResult> results(nThread, VerifyResult{0, 0.0f, n});
+  auto worker = [&](std::size_t t) {
+    std::vector<float> expected(kVerifyBlockSize);
+    for (std::size_t first = nextBlock++ * kVerifyBlockSize; first < n && failedIndex.load() == n; first = nextBlock++ * kVerifyBlockSize) {
+      std::size_t nElement = std::min(kVerifyBlockSize, n - first);
+      reference(inputs, first, nElement, expected.data());
+      std::size_t index = compareResults(buffers[0] + first, expected.data(), nElement, maxUlp, results[t]);
+      if (index != nElement) {
+        // Keep the smallest index among the blocks which failed at the same time
+        std::size_t failed = failedIndex.load();
+        while (first + index < failed && !failedIndex.compare_exchange_weak(failed, first + index)) {
+        }
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (std::size_t t = 1; t < nThread; t++) {
+    threads.emplace_back(worker, t);
+  }
+  worker(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  VerifyResult result{0, 0.0f, failedIndex.load()};
+  for (const auto& threadResult : results) {
+    result.maxUlp = std::max(result.maxUlp, threadResult.maxUlp);
+    result.maxRelError = std::max(threadResult.maxRelError, result.maxRelError);
+  }
+  return result;
+}
+
+
+/*!
+ * @brief Verify results, and show the accuracy
+ * @param [in] kernelName  Kernel name, whose reference implementation is used
+ * @param [in] hostPtrs    Host buffers of the buffer arguments, whose first one holds the results
+ * @param [in] n           Number of elements of each buffer
+ * @param [in] maxUlp      Tolerance in ULPs
+ * @return  true if all elements are within the tolerance, otherwise false
+ */
+static inline bool
+verifyAndReport(const std::string& kernelName, const std::vector<char*>& hostPtrs, std::size_t n, std::uint32_t maxUlp)
+{
+  std::vector<const float*> buffers;
+  for (const auto& hostPtr : hostPtrs) {
+    buffers.emplace_back(reinterpret_cast<const float*>(hostPtr));
+  }
+  ReferenceFunction reference = kReferenceKernelMap.at(kernelName).compute;
+  VerifyResult result = verifyResults(reference, buffers, n, maxUlp, std::max(std::thread::hardware_concurrency(), 1U));
+  std::ios::fmtflags flags = std::cout.flags();
+  std::streamsize precision = std::cout.precision();
+  if (result.failedIndex != n) {
+    std::vector<float> expected(1);
+    std::vector<const float*> inputs(buffers.begin() + 1, buffers.end());
+    reference(inputs, result.failedIndex, 1, expected.data());
+    std::cerr << "Result verification failed at element " << result.failedIndex << ": expected " << std::setprecision(9) << expected[0]
+              << ", got " << buffers[0][result.failedIndex] << " (" << getUlpDistance(buffers[0][result.failedIndex], expected[0]) << " ulp)" << std::endl;
+  } else {
+    std::cout << "Test PASSED" << std::endl;
+  }
+  std::cout << "Max error: " << result.maxUlp << " ulp, relative " << std::scientific << std::setprecision(3) << result.maxRelError
+            << (result.failedIndex != n ? " (checked elements only)" : "") << std::endl;
+  std::cout.flags(flags);
+  std::cout.precision(precision);
+  return result.failedIndex == n;
+}
+
+
+/*!
+ * @brief Choose local work sizes which suit the kernel and the device
+ *
+ * The size required by reqd_work_group_size is used if any.
+ * Otherwise the first dimension gets the largest multiple of the preferred
+ * work-group size multiple which divides the global work size and does not
+ * exceed the max work-group size of the kernel, and the other dimensions get 1.
+ * @param [in] kernel       Kernel object
+ * @param [in] deviceId     Device ID
+ * @param [in] globalSizes  Global work sizes
+ * @return  Local work sizes, or empty to leave them to the implementation
+ */
+static inline std::vector<std::size_t>
+getLocalSizes(cl_kernel kernel, cl_device_id deviceId, const std::vector<std::size_t>& globalSizes)
+{
+  std::size_t compileSizes[3];
+  cl_int errCode = clGetKernelWorkGroupInfo(kernel, deviceId, CL_KERNEL_COMPILE_WORK_GROUP_SIZE, sizeof(compileSizes), compileSizes, nullptr);
+  KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clGetKernelWorkGroupInfo() failed");
+  if (compileSizes[0] != 0) {
+    return std::vector<std::size_t>(compileSizes, compileSizes + globalSizes.size());
+  }
+  std::size_t maxSize;
+  errCode = clGetKernelWorkGroupInfo(kernel, deviceId, CL_KERNEL_WORK_GROUP_SIZE, sizeof(maxSize), &maxSize, nullptr);
+  KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clGetKernelWorkGroupInfo() failed");
+  std::size_t multiple;
+  errCode = clGetKernelWorkGroupInfo(kernel, deviceId, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple), &multiple, nullptr);
+  KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clGetKernelWorkGroupInfo() failed");
+  for (std::size_t size = maxSize / std::max(multiple, static_cast<std::size_t>(1)) * multiple; size >= multiple && size > 0; size -= multiple) {
+    if (globalSizes[0] % size == 0) {
+      std::vector<std::size_t> localSizes(globalSizes.size(), 1);
+      localSizes[0] = size;
+      return localSizes;
+    }
+  }
+  return {};
+}
+
+
+/*!
+ * @brief Run one pass of a 1-D NDRange streamed in chunks through two sets of
+ *        device buffers
+ *
+ * The inputs of chunk k are written on one queue while chunk k - 1 runs on
+ * another and chunk k - 2 is read back on a third, and each command waits
+ * only for the events it depends on, so that transfers overlap with kernels
+ * as in host code which streams data larger than the device memory.
+ * A slot of device buffers is reused by chunk k + 2 after the results of
+ * chunk k are read.
+ * @param [in] queues       Queues for writes, kernels and reads
+ * @param [in] kernel       Kernel object, whose arguments are the buffers
+ * @param [in] slotBuffers  Two sets of chunk-sized device buffers
+ * @param [in] hostPtrs     Pinned host buffers
+ * @param [in] itemSizes    Bytes of each buffer per work-item
+ * @param [in] isOutputs    Whether each buffer is read back, or written otherwise
+ * @param [in] globalSize   Total number of work-items
+ * @param [in] chunkSize    Number of work-items of each chunk
+ * @param [in] localSize    Local work size, or 0 to choose for each chunk
+ * @param [in] deviceId     Device ID
+ * @return  Elapsed time in nanoseconds from the start of the first command to the end of the last one
+ */
+static inline cl_ulong
+runStreamedPass(
+    const std::vector<cl_command_queue>& queues,
+    cl_kernel kernel,
+    const std::vector<std::vector<cl_mem> >& slotBuffers,
+    const std::vector<char*>& hostPtrs,
+    const std::vector<std::size_t>& itemSizes,
+    const std::vector<bool>& isOutputs,
+    std::size_t globalSize,
+    std::size_t chunkSize,
+    std::size_t localSize,
+    cl_device_id deviceId)
+{
+  std::vector<EventHandle> events;
+  std::vector<cl_event> lastEvents(slotBuffers.size(), nullptr);
+  auto holdEvent = [&](cl_event event) {
+    events.emplace_back(event);
+    return event;
+  };
+  for (std::size_t offset = 0, k = 0; offset < globalSize; offset += chunkSize, k++) {
+    std::size_t nItem = std::min(chunkSize, globalSize - offset);
+    std::size_t slot = k % slotBuffers.size();
+    cl_event waitEvent = lastEvents[slot];
+    cl_int errCode;
+    for (std::remove_reference<decltype(itemSizes)>::type::size_type i = 0; i < itemSizes.size(); i++) {
+      if (isOutputs[i]) {
+        continue;
+      }
+      cl_event event;
+      errCode = clEnqueueWriteBuffer(queues[0], slotBuffers[slot][i], CL_FALSE, 0, nItem * itemSizes[i], hostPtrs[i] + offset * itemSizes[i],
+          waitEvent == nullptr ? 0 : 1, waitEvent == nullptr ? nullptr : &waitEvent, &event);
+      KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clEnqueueWriteBuffer() failed");
+      // The write queue is in order, so the kernel has only to wait for the last write
+      waitEvent = holdEvent(event);
+    }
+
+    for (std::remove_reference<decltype(itemSizes)>::type::size_type i = 0; i < itemSizes.size(); i++) {
+      cl_mem buffer = slotBuffers[slot][i];
+      errCode = clSetKernelArg(kernel, static_cast<cl_uint>(i), sizeof(buffer), &buffer);
+      KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clSetKernelArg() failed");
+    }
+    std::vector<std::size_t> localSizes = localSize == 0 ? getLocalSizes(kernel, deviceId, {nItem}) : std::vector<std::size_t>{localSize};
+    cl_event event;
+    errCode = clEnqueueNDRangeKernel(queues[1], kernel, 1, nullptr, &nItem, localSizes.empty() ? nullptr : localSizes.data(),
+        waitEvent == nullptr ? 0 : 1, waitEvent == nullptr ? nullptr : &waitEvent, &event);
+    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clEnqueueNDRangeKernel() failed");
+    cl_event kernelEvent = holdEvent(event);
+    lastEvents[slot] = kernelEvent;
+
+    for (std::remove_reference<decltype(itemSizes)>::type::size_type i = 0; i < itemSizes.size(); i++) {
+      if (!isOutputs[i]) {
+        continue;
+      }
+      errCode = clEnqueueReadBuffer(queues[2], slotBuffers[slot][i], CL_FALSE, 0, nItem * itemSizes[i], hostPtrs[i] + offset * itemSizes[i], 1, &kernelEvent, &event);
+      KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clEnqueueReadBuffer() failed");
+      lastEvents[slot] = holdEvent(event);
+    }
+    // Submit the commands right away, since the queues depend on each other
+    for (const auto& queue : queues) {
+      clFlush(queue);
+    }
+  }
+  for (const auto& queue : queues) {
+    cl_int errCode = clFinish(queue);
+    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clFinish() failed");
+  }
+
+  cl_ulong first = std::numeric_limits<cl_ulong>::max();
+  cl_ulong last = 0;
+  for (const auto& event : events) {
+    cl_ulong start;
+    cl_ulong end;
+    cl_int errCode = clGetEventProfilingInfo(event.get(), CL_PROFILING_COMMAND_START, sizeof(start), &start, nullptr);
+    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clGetEventProfilingInfo() failed");
+    errCode = clGetEventProfilingInfo(event.get(), CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr);
+    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clGetEventProfilingInfo() failed");
+    first = std::min(first, start);
+    last = std::max(last, end);
+  }
+  return last - first;
+}
+
+
+/*!
+ * @brief Get the binary file for one of multiple devices
+ * @param [in] path   Binary file name, such as "kernel.bin.0" for platform 0 written with oclc --all
+ * @param [in] index  Device index
+ * @return  "<path>.<index>" if it exists, otherwise the path itself, such as a fat binary
+ */
+static inline std::string
+getDeviceBinaryPath(const std::string& path, std::size_t index)
+{
+  std::string devicePath = path + "." + std::to_string(index);
+  return std::ifstream(devicePath).is_open() ? devicePath : path;
+}
+
+
+/*!
+ * @brief Timings of a 1-D NDRange split across devices
+ */
+struct SplitTimings
+{
+  //! Sorted elapsed times of the iterations in nanoseconds
+  std::vector<cl_ulong> elapsedTimes;
+  //! Sorted kernel times in nanoseconds for each device
+  std::vector<std::vector<cl_ulong> > kernelTimes;
+  //! Number of work-items for each device
+  std::vector<std::size_t> nItems;
+};
+
+
+/*!
+ * @brief Launch a 1-D NDRange split across devices, and time the launches
+ *
+ * Each device gets a contiguous part of the NDRange, whose size is a multiple
+ * of the local work size, with its own part of every buffer.
+ * The local work size of each part is chosen for its device if not specified.
+ * All devices are launched at once in each iteration, and the iteration is
+ * timed on the host until all of them finish, since the profiling clocks of
+ * different devices are not comparable.
+ * @param [in] contextPool  Pool which owns the context and keeps the command queues for the later calls
+ * @param [in] context      Context which contains all devices
+ * @param [in] deviceIds    Devices to split the NDRange across
+ * @param [in] kernels      Kernel object for each device
+ * @param [in] hostPtrs     Pinned host buffers
+ * @param [in] itemSizes    Bytes of each buffer per work-item
+ * @param [in] globalSize   Total number of work-items
+ * @param [in] localSize    Local work size, or 0 to choose for each device
+ * @param [in] nWarmup      Number of warmup iterations
+ * @param [in] nIteration   Number of timed iterations
+ * @param [in] isReadBack   Read the first buffer of each part back to the host
+ * @return  Timings of the iterations and each device
+ */
+static inline SplitTimings
+runSplitLaunches(
+    ContextPool& contextPool,
+    cl_context context,
+    const std::vector<cl_device_id>& deviceIds,
+    const std::vector<cl_kernel>& kernels,
+    const std::vector<char*>& hostPtrs,
+    const std::vector<std::size_t>& itemSizes,
+    std::size_t globalSize,
+    std::size_t localSize,
+    std::size_t nWarmup,
+    std::size_t nIteration,
+    bool isReadBack)
+{
+  // Split the NDRange in units of the local work size for the whole NDRange
+  std::vector<std::size_t> unitSizes = localSize == 0 ? getLocalSizes(kernels[0], deviceIds[0], {globalSize}) : std::vector<std::size_t>{localSize};
+  std::size_t unit = unitSizes.empty() ? 1 : unitSizes[0];
+  std::size_t nUnit = globalSize / unit;
+  SplitTimings timings{{}, std::vector<std::vector<cl_ulong> >(deviceIds.size()), {}};
+  std::vector<std::size_t>& nItems = timings.nItems;
+  std::vector<std::size_t> offsets;
+  for (std::remove_reference<decltype(deviceIds)>::type::size_type j = 0; j < deviceIds.size(); j++) {
+    offsets.emplace_back(nUnit * j / deviceIds.size() * unit);
+    nItems.emplace_back(nUnit * (j + 1) / deviceIds.size() * unit - offsets.back());
+    KOTLIB_THROW_IF(nItems.back() == 0, std::invalid_argument, "Global work size is too small to split across " + std::to_string(deviceIds.size()) + " devices");
+  }
+
+  // Use an out-of-order queue where supported, since the commands are chained with events
+  cl_int errCode;
+  std::vector<cl_command_queue> cmdQueues;
+  std::vector<MemHandle> deviceBuffers;
+  std::vector<EventHandle> writeEventHolders;
+  std::vector<std::vector<cl_event> > writeEvents(deviceIds.size());
+  std::vector<std::vector<std::size_t> > localSizes;
+  for (std::remove_reference<decltype(deviceIds)>::type::size_type j = 0; j < deviceIds.size(); j++) {
+    cl_command_queue_properties queueProperties;
+    errCode = clGetDeviceInfo(deviceIds[j], CL_DEVICE_QUEUE_PROPERTIES, sizeof(queueProperties), &queueProperties, nullptr);
+    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clGetDeviceInfo() failed");
+    cmdQueues.emplace_back(
+        contextPool.getCommandQueue(context, deviceIds[j], CL_QUEUE_PROFILING_ENABLE | (queueProperties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)));
+    for (std::remove_reference<decltype(itemSizes)>::type::size_type i = 0; i < itemSizes.size(); i++) {
+      deviceBuffers.emplace_back(clCreateBuffer(context, CL_MEM_READ_WRITE, std::max(itemSizes[i] * nItems[j], sizeof(float)), nullptr, &errCode));
+      KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clCreateBuffer() failed");
+      cl_event event;
+      errCode = clEnqueueWriteBuffer(cmdQueues[j], deviceBuffers.back().get(), CL_FALSE, 0, itemSizes[i] * nItems[j], hostPtrs[i] + offsets[j] * itemSizes[i], 0, nullptr, &event);
+      KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clEnqueueWriteBuffer() failed");
+      writeEventHolders.emplace_back(event);
+      writeEvents[j].emplace_back(event);
+    }
+    localSizes.emplace_back(localSize == 0 ? getLocalSizes(kernels[j], deviceIds[j], {nItems[j]}) : std::vector<std::size_t>{localSize});
+    clFlush(cmdQueues[j]);
+  }
+
+  for (std::size_t k = 0; k < nWarmup + nIteration; k++) {
+    std::vector<EventHandle> eventHolders;
+    std::vector<cl_event> events;
+    auto start = std::chrono::steady_clock::now();
+    for (std::remove_reference<decltype(deviceIds)>::type::size_type j = 0; j < deviceIds.size(); j++) {
+      // Kernel objects keep their arguments, so each device has its own kernel
+      for (std::remove_reference<decltype(itemSizes)>::type::size_type i = 0; i < itemSizes.size(); i++) {
+        cl_mem deviceBuffer = deviceBuffers[j * itemSizes.size() + i].get();
+        errCode = clSetKernelArg(kernels[j], static_cast<cl_uint>(i), sizeof(deviceBuffer), &deviceBuffer);
+        KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clSetKernelArg() failed");
+      }
+      cl_event event;
+      errCode = clEnqueueNDRangeKernel(cmdQueues[j], kernels[j], 1, nullptr, &nItems[j], localSizes[j].empty() ? nullptr : localSizes[j].data(),
+          k == 0 ? static_cast<cl_uint>(writeEvents[j].size()) : 0, k == 0 && !writeEvents[j].empty() ? writeEvents[j].data() : nullptr, &event);
+      KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clEnqueueNDRangeKernel() failed");
+      eventHolders.emplace_back(event);
+      events.emplace_back(event);
+      clFlush(cmdQueues[j]);
+    }
+    errCode = clWaitForEvents(static_cast<cl_uint>(events.size()), events.data());
+    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clWaitForEvents() failed");
+    auto end = std::chrono::steady_clock::now();
+    if (k < nWarmup) {
+      continue;
+    }
+    timings.elapsedTimes.emplace_back(static_cast<cl_ulong>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+    for (decltype(events)::size_type j = 0; j < events.size(); j++) {
+      timings.kernelTimes[j].emplace_back(getElapsedTime(events[j]));
+    }
+  }
+
+  for (std::remove_reference<decltype(deviceIds)>::type::size_type j = 0; j < deviceIds.size(); j++) {
+    if (isReadBack) {
+      // A blocking read does not wait for the preceding commands in an out-of-order queue
+      errCode = clFinish(cmdQueues[j]);
+      KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clFinish() failed");
+      errCode = clEnqueueReadBuffer(cmdQueues[j], deviceBuffers[j * itemSizes.size()].get(), CL_TRUE, 0, itemSizes[0] * nItems[j], hostPtrs[0] + offsets[j] * itemSizes[0], 0, nullptr, nullptr);
+      KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clEnqueueReadBuffer() failed");
+    }
+    std::sort(timings.kernelTimes[j].begin(), timings.kernelTimes[j].end());
+  }
+  std::sort(timings.elapsedTimes.begin(), timings.elapsedTimes.end());
+  return timings;
+}
+
+
 /*!
  * @brief The entry point of this program
+ *
+ * Every buffer is filled with random floats in pinned host memory and passed
+ * to the kernel in the specified order.
+ * With --chunk, the NDRange is streamed in chunks whose transfers overlap with
+ * the kernels, and each pass including the transfers is timed.
+ * The results of the kernels which have reference implementations, such as
+ * the default kernel, "vecAdd", which computes z = x + y for buffers
+ * (z, x, y), are verified on multiple threads within the tolerance in ULPs.
  * @param [in] argc  Number of command-line arguments
  * @param [in] argv  Command-line arguments
  * @return Exit-status
@@ -168,94 +767,304 @@ main(int argc, char* argv[])
   static constexpr int ALIGN = 4096;
   static constexpr std::size_t N = 65536;
 
-  if (argc < 2) {
+  kot::OptionParser op(argv[0]);
+  op.setOption("kernel", 'k', kot::OptionParser::REQUIRED_ARGUMENT, "vecAdd", "Specify kernel name", "KERNEL_NAME");
+  op.setOption("global", 'g', kot::OptionParser::REQUIRED_ARGUMENT, std::to_string(N), "Specify comma-separated global work sizes", "SIZES");
+  op.setOption("local", 'l', kot::OptionParser::REQUIRED_ARGUMENT, "",
+      "Specify comma-separated local work sizes\n"
+      "      Chosen from the preferred work-group size multiple of the kernel if omitted", "SIZES");
+  op.setOption("buffer", 'b', kot::OptionParser::REQUIRED_ARGUMENT, std::to_string(N * sizeof(float)) + "," + std::to_string(N * sizeof(float)) + "," + std::to_string(N * sizeof(float)),
+      "Specify comma-separated sizes of buffer arguments in bytes", "SIZES");
+  op.setOption("platform", 'p', kot::OptionParser::REQUIRED_ARGUMENT, 0, "Specify platform index", "PLATFORM_INDEX");
+  op.setOption("device-type", 't', kot::OptionParser::REQUIRED_ARGUMENT, "default",
+      "Specify device type\n"
+      "      all: CPU and GPU\n"
+      "      cpu: CPU only\n"
+      "      gpu: GPU only", "DEVICE_TYPE");
+  op.setOption("device", 'd', kot::OptionParser::REQUIRED_ARGUMENT, 0, "Specify device index", "DEVICE_INDEX");
+  op.setOption("chunk", 'c', kot::OptionParser::REQUIRED_ARGUMENT, 0,
+      "Stream 1-D NDRange in chunks of N work-items through two sets of device buffers,\n"
+      "      overlapping writes, kernels and reads; each pass is timed as a whole\n"
+      "      0: Write buffers once and time kernels only", "N");
+  op.setOption("outputs", 'o', kot::OptionParser::REQUIRED_ARGUMENT, "0",
+      "Specify comma-separated indices of output buffers, which are read back in streaming mode\n"
+      "      The other buffers are written as inputs", "INDICES");
+  op.setOption("multi-device", 'M', kot::OptionParser::NO_ARGUMENT, false,
+      "Split 1-D NDRange across all devices of the platform with one queue for each device,\n"
+      "      and report per-device and aggregate throughput and scaling efficiency against device 0 alone\n"
+      "      Binary <FILE_NAME>.<DEVICE_INDEX> written with oclc --all or -t is used for each device if it exists");
+  op.setOption("variant", 'V', kot::OptionParser::REQUIRED_ARGUMENT, "", "Specify variant of fat binary made with oclc --specialize", "VARIANT");
+  op.setOption("max-ulp", 'u', kot::OptionParser::REQUIRED_ARGUMENT, 4, "Specify tolerance of result verification in ULPs", "N");
+  op.setOption("warmup", 'w', kot::OptionParser::REQUIRED_ARGUMENT, 3, "Specify number of warmup iterations", "N");
+  op.setOption("iteration", 'n', kot::OptionParser::REQUIRED_ARGUMENT, 10, "Specify number of timed iterations", "N");
+  op.setOption("help", 'h', kot::OptionParser::NO_ARGUMENT, false, "Show help and exit this program");
+  op.parse(argc, argv);
+
+  if (op.get<bool>("help")) {
+    op.showUsage();
+    return EXIT_SUCCESS;
+  }
+  std::vector<std::string> args = op.getArguments();
+  if (args.size() != 1) {
     std::cerr << "Please specify only one kernel binary file" << std::endl;
     return EXIT_FAILURE;
   }
 
-  std::unique_ptr<float[], AlignedDeleter> hostX(alignedMalloc<float*>(N * sizeof(float), ALIGN));
-  std::unique_ptr<float[], AlignedDeleter> hostY(alignedMalloc<float*>(N * sizeof(float), ALIGN));
-  std::unique_ptr<float[], AlignedDeleter> hostZ(alignedMalloc<float*>(N * sizeof(float), ALIGN));
+  try {
+    std::string kernelName = op.get("kernel");
+    std::vector<std::size_t> globalSizes = parseSizes(op.get("global"));
+    std::vector<std::size_t> localSizes = parseSizes(op.get("local"));
+    std::vector<std::size_t> bufferSizes = parseSizes(op.get("buffer"));
+    std::size_t nWarmup = op.get<std::size_t>("warmup");
+    std::size_t nIteration = op.get<std::size_t>("iteration");
+    KOTLIB_THROW_IF(globalSizes.empty() || globalSizes.size() > 3, std::invalid_argument, "Global work sizes must have 1 to 3 dimensions");
+    KOTLIB_THROW_IF(!localSizes.empty() && localSizes.size() != globalSizes.size(), std::invalid_argument, "Local work sizes must have the same dimensions as global work sizes");
+    KOTLIB_THROW_IF(nIteration == 0, std::invalid_argument, "Number of timed iterations must be positive");
+    auto referenceKernel = kReferenceKernelMap.find(kernelName);
+    bool isVerified = referenceKernel != kReferenceKernelMap.end();
+    KOTLIB_THROW_IF(isVerified && (bufferSizes.size() != referenceKernel->second.nInput + 1
+          || std::any_of(bufferSizes.begin(), bufferSizes.end(), [&](std::size_t size) { return size != bufferSizes[0]; })),
+        std::invalid_argument, kernelName + " requires " + std::to_string(referenceKernel->second.nInput + 1) + " buffers of the same size");
+    std::uint32_t maxUlp = static_cast<std::uint32_t>(std::min(op.get<std::size_t>("max-ulp"), static_cast<std::size_t>(std::numeric_limits<std::uint32_t>::max())));
+    std::size_t chunkSize = op.get<std::size_t>("chunk");
+    bool isMultiDevice = op.get<bool>("multi-device");
+    KOTLIB_THROW_IF(isMultiDevice && chunkSize != 0, std::invalid_argument, "Streaming cannot be used with multiple devices");
+    std::vector<std::size_t> itemSizes;
+    std::vector<bool> isOutputs(bufferSizes.size(), false);
+    if (chunkSize != 0 || isMultiDevice) {
+      // Each chunk or part of the NDRange gets its part of every buffer
+      KOTLIB_THROW_IF(globalSizes.size() != 1, std::invalid_argument, "Streaming and multiple devices require 1-D global work size");
+      for (const auto& bufferSize : bufferSizes) {
+        KOTLIB_THROW_IF(globalSizes[0] == 0 || bufferSize % globalSizes[0] != 0, std::invalid_argument, "Buffer sizes must be multiples of global work size");
+        itemSizes.emplace_back(bufferSize / globalSizes[0]);
+      }
+    }
+    if (chunkSize != 0) {
+      KOTLIB_THROW_IF(!localSizes.empty() && (chunkSize % localSizes[0] != 0 || globalSizes[0] % localSizes[0] != 0),
+          std::invalid_argument, "Chunk size and global work size must be multiples of local work size");
+      chunkSize = std::min(chunkSize, globalSizes[0]);
+      for (const auto& index : parseSizes(op.get("outputs"))) {
+        KOTLIB_THROW_IF(index >= bufferSizes.size(), std::out_of_range, "Invalid output buffer index: " + std::to_string(index));
+        isOutputs[index] = true;
+      }
+    }
 
-  std::mt19937 mt((std::random_device())());
-  for (std::size_t i = 0; i < N; i++) {
-    hostX[i] = static_cast<float>(mt());
-    hostY[i] = static_cast<float>(mt());
-  }
-  std::fill_n(hostZ.get(), N, 0.0f);
+    // Fill host buffers with random floats
+    std::mt19937 mt((std::random_device())());
+    std::vector<std::unique_ptr<float[], AlignedDeleter> > hostBuffers;
+    for (const auto& bufferSize : bufferSizes) {
+      hostBuffers.emplace_back(alignedMalloc<float*>(std::max(bufferSize, sizeof(float)), ALIGN));
+      if (hostBuffers.back() == nullptr) {
+        throw std::bad_alloc();
+      }
+      for (std::size_t i = 0; i < bufferSize / sizeof(float); i++) {
+        hostBuffers.back()[i] = static_cast<float>(mt());
+      }
+    }
 
-  try {
-    std::vector<cl_platform_id> platformIds = getPlatformIds(1);
-    std::vector<cl_device_id> deviceIds = getDeviceIds(platformIds[0], 1, CL_DEVICE_TYPE_DEFAULT);
+    std::vector<cl_platform_id> platformIds = getPlatformIds();
+    std::size_t pi = op.get<std::size_t>("platform");
+    KOTLIB_THROW_IF(pi >= platformIds.size(), std::out_of_range, "Invalid platform index: " + std::to_string(pi));
+    std::vector<cl_device_id> deviceIds = getDeviceIds(platformIds[pi], kNDefaultDeviceEntry, kDeviceTypeMap.at(op.get("device-type")));
+    std::size_t di = op.get<std::size_t>("device");
+    KOTLIB_THROW_IF(di >= deviceIds.size(), std::out_of_range, "Invalid device index: " + std::to_string(di));
+    // The context contains all devices in multi-device mode, and only the specified device otherwise
+    if (!isMultiDevice) {
+      deviceIds = {deviceIds[di]};
+    }
 
     cl_int errCode;
-    std::unique_ptr<std::remove_pointer<cl_context>::type, decltype(&clReleaseContext)> context(
-        clCreateContext(nullptr, 1, &deviceIds[0], nullptr, nullptr, &errCode), clReleaseContext);
-    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clCreateContext() failed");
-    std::unique_ptr<std::remove_pointer<cl_command_queue>::type, decltype(&clReleaseCommandQueue)> cmdQueue(
-        clCreateCommandQueue(context.get(), deviceIds[0], 0, &errCode), clReleaseCommandQueue);
-    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clCreateCommandQueue() failed");
-
-    std::unique_ptr<std::remove_pointer<cl_mem>::type, decltype(&clReleaseMemObject)> deviceX(
-        clCreateBuffer(context.get(), CL_MEM_READ_WRITE, N * sizeof(float), nullptr, &errCode), clReleaseMemObject);
-    std::unique_ptr<std::remove_pointer<cl_mem>::type, decltype(&clReleaseMemObject)> deviceY(
-        clCreateBuffer(context.get(), CL_MEM_READ_WRITE, N * sizeof(float), nullptr, &errCode), clReleaseMemObject);
-    std::unique_ptr<std::remove_pointer<cl_mem>::type, decltype(&clReleaseMemObject)> deviceZ(
-        clCreateBuffer(context.get(), CL_MEM_READ_WRITE, N * sizeof(float), nullptr, &errCode), clReleaseMemObject);
-
-    errCode = clEnqueueWriteBuffer(cmdQueue.get(), deviceX.get(), CL_TRUE, 0, N * sizeof(float), hostX.get(), 0, nullptr, nullptr);
-    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clEnqueueWriteBuffer() failed");
-    errCode = clEnqueueWriteBuffer(cmdQueue.get(), deviceY.get(), CL_TRUE, 0, N * sizeof(float), hostY.get(), 0, nullptr, nullptr);
-    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clEnqueueWriteBuffer() failed");
-    errCode = clEnqueueWriteBuffer(cmdQueue.get(), deviceZ.get(), CL_TRUE, 0, N * sizeof(float), hostZ.get(), 0, nullptr, nullptr);
-    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clEnqueueWriteBuffer() failed");
-
-    // Read kernel binary
-    std::ifstream ifs(argv[1], std::ios::binary);
-    if (!ifs.is_open()) {
-      std::cerr << "Failed to kernel binary: " << argv[1] << std::endl;
-      std::exit(EXIT_FAILURE);
+    ContextPool contextPool;
+    cl_context context = contextPool.getContext(deviceIds);
+    // Writes, kernels and reads are enqueued to their own queues in streaming mode
+    std::vector<CommandQueueHandle> cmdQueueHolders;
+    std::vector<cl_command_queue> cmdQueues;
+    for (int i = 0; i < (chunkSize == 0 ? 1 : 3); i++) {
+      cmdQueueHolders.emplace_back(clCreateCommandQueue(context, deviceIds[0], CL_QUEUE_PROFILING_ENABLE, &errCode));
+      KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clCreateCommandQueue() failed");
+      cmdQueues.emplace_back(cmdQueueHolders.back().get());
     }
-    std::string kernelBin((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    cl_command_queue cmdQueue = cmdQueues[chunkSize == 0 ? 0 : 1];
 
-    const unsigned char* kbin = reinterpret_cast<const unsigned char*>(kernelBin.c_str());
-    std::size_t kbinSize = kernelBin.size();
-    cl_int binStatus;
-    std::unique_ptr<std::remove_pointer<cl_program>::type, decltype(&clReleaseProgram)> program(
-        clCreateProgramWithBinary(context.get(), 1, &deviceIds[0], &kbinSize, &kbin, &binStatus, &errCode), clReleaseProgram);
-    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clCreateProgramWithBinary() failed");
+    // Pin the page-aligned host buffers, from and to which all transfers are done
+    std::vector<MemHandle> hostMems;
+    std::vector<char*> hostPtrs;
+    for (decltype(bufferSizes)::size_type i = 0; i < bufferSizes.size(); i++) {
+      std::size_t size = std::max(bufferSizes[i], sizeof(float));
+      hostMems.emplace_back(clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, size, hostBuffers[i].get(), &errCode));
+      KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clCreateBuffer() failed");
+      hostPtrs.emplace_back(static_cast<char*>(clEnqueueMapBuffer(cmdQueue, hostMems[i].get(), CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, 0, nullptr, nullptr, &errCode)));
+      KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clEnqueueMapBuffer() failed");
+    }
 
-    // errCode = clBuildProgram(program.get(), 1, &deviceIds[0], nullptr, nullptr, nullptr);
+    auto unmapHostBuffers = [&] {
+      for (decltype(hostMems)::size_type i = 0; i < hostMems.size(); i++) {
+        errCode = clEnqueueUnmapMemObject(cmdQueue, hostMems[i].get(), hostPtrs[i], 0, nullptr, nullptr);
+        KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clEnqueueUnmapMemObject() failed");
+      }
+      errCode = clFinish(cmdQueue);
+      KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clFinish() failed");
+    };
 
-    std::unique_ptr<std::remove_pointer<cl_kernel>::type, decltype(&clReleaseKernel)> kernel(
-        clCreateKernel(program.get(), "vecAdd", &errCode), clReleaseKernel);
-    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clCreateKernel() failed");
+    if (isMultiDevice) {
+      std::vector<std::unique_ptr<ProgramLoader> > loaders;
+      std::vector<cl_kernel> kernels;
+      std::vector<std::string> deviceNames;
+      for (decltype(deviceIds)::size_type j = 0; j < deviceIds.size(); j++) {
+        std::string path = getDeviceBinaryPath(args[0], j);
+        loaders.emplace_back(new ProgramLoader(context, deviceIds[j], path, "", "", op.get("variant")));
+        kernels.emplace_back(loaders.back()->getKernel(kernelName));
+        if (loaders.back()->isRebuilt()) {
+          std::cerr << "Kernel binary was stale and rebuilt from the source: " << path << std::endl;
+        }
+        std::size_t size;
+        errCode = clGetDeviceInfo(deviceIds[j], CL_DEVICE_NAME, 0, nullptr, &size);
+        KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clGetDeviceInfo() failed");
+        std::string name(size, '\0');
+        errCode = clGetDeviceInfo(deviceIds[j], CL_DEVICE_NAME, size, &name[0], nullptr);
+        KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clGetDeviceInfo() failed");
+        deviceNames.emplace_back(name.c_str());
+      }
+      std::size_t localSize = localSizes.empty() ? 0 : localSizes[0];
 
-    errCode = setKernelArgs(kernel.get(), deviceZ.get(), deviceX.get(), deviceY.get());
-    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "setKernelArgs() failed");
-    errCode = clEnqueueTask(cmdQueue.get(), kernel.get(), 0, nullptr, nullptr);
-    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clEnqueueTask() failed");
+      // Run the whole NDRange on device 0 alone as the baseline of scaling efficiency
+      std::vector<cl_ulong> baselineTimes;
+      if (deviceIds.size() > 1) {
+        baselineTimes = runSplitLaunches(contextPool, context, {deviceIds[0]}, {kernels[0]}, hostPtrs, itemSizes, globalSizes[0], localSize, nWarmup, nIteration, false).elapsedTimes;
+      }
+      SplitTimings timings = runSplitLaunches(contextPool, context, deviceIds, kernels, hostPtrs, itemSizes, globalSizes[0], localSize, nWarmup, nIteration, isVerified);
 
-    errCode = clFlush(cmdQueue.get());
-    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clFlush() failed");
-    errCode = clFinish(cmdQueue.get());
-    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clFinish() failed");
+      if (isVerified && !verifyAndReport(kernelName, hostPtrs, bufferSizes[0] / sizeof(float), maxUlp)) {
+        return EXIT_FAILURE;
+      }
+      unmapHostBuffers();
 
-    errCode = clEnqueueReadBuffer(cmdQueue.get(), deviceZ.get(), CL_TRUE, 0, N * sizeof(float), hostZ.get(), 0, nullptr, nullptr);
-    KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clEnqueueReadBuffer() failed");
-  } catch (const std::exception& e) {
-    std::cerr << e.what() << std::endl;
-    return EXIT_FAILURE;
-  }
+      // Throughput assumes that every buffer is accessed once per launch, split in proportion to the work-items
+      std::size_t itemSize = std::accumulate(itemSizes.begin(), itemSizes.end(), static_cast<std::size_t>(0));
+      auto getThroughput = [itemSize](std::size_t nItem, cl_ulong time) {
+        return time == 0 ? 0.0 : static_cast<double>(itemSize * nItem) / static_cast<double>(time);
+      };
+      cl_ulong median = getPercentile(timings.elapsedTimes, 0.5);
+      std::cout << "Kernel: " << kernelName << "\n"
+                << "Iterations: " << nIteration << " (warmup: " << nWarmup << ")\n"
+                << std::fixed << std::setprecision(3);
+      for (decltype(deviceIds)::size_type j = 0; j < deviceIds.size(); j++) {
+        cl_ulong kernelMedian = getPercentile(timings.kernelTimes[j], 0.5);
+        std::cout << "Device " << j << " (" << deviceNames[j] << "): " << timings.nItems[j] << " work-items, median "
+                  << static_cast<double>(kernelMedian) / 1.0e3 << " us, " << getThroughput(timings.nItems[j], kernelMedian) << " GB/s\n";
+      }
+      std::cout << "Aggregate: median " << static_cast<double>(median) / 1.0e3 << " us, "
+                << getThroughput(globalSizes[0], median) << " GB/s on " << deviceIds.size() << " devices\n";
+      if (!baselineTimes.empty()) {
+        cl_ulong baselineMedian = getPercentile(baselineTimes, 0.5);
+        std::cout << "Device 0 alone: median " << static_cast<double>(baselineMedian) / 1.0e3 << " us, "
+                  << getThroughput(globalSizes[0], baselineMedian) << " GB/s\n"
+                  << "Scaling efficiency: " << std::setprecision(1)
+                  << (median == 0 ? 0.0 : 100.0 * static_cast<double>(baselineMedian) / (static_cast<double>(median) * static_cast<double>(deviceIds.size()))) << " %\n";
+      }
+      std::cout.flush();
+      return EXIT_SUCCESS;
+    }
 
-  for (std::size_t i = 0; i < N; i++) {
-    if (std::abs(hostX[i] + hostY[i] - hostZ[i]) > 1.0e-5) {
-      std::cerr << "Result verification failed at element " << i << "!" << std::endl;
+    // Load kernel binary, which is rebuilt from the embedded source if it is stale
+    ProgramLoader loader(context, deviceIds[0], args[0], "", "", op.get("variant"));
+    cl_kernel kernel = loader.getKernel(kernelName);
+    if (loader.isRebuilt()) {
+      std::cerr << "Kernel binary was stale and rebuilt from the source: " << args[0] << std::endl;
+    }
+    if (localSizes.empty() && chunkSize == 0) {
+      localSizes = getLocalSizes(kernel, deviceIds[0], globalSizes);
+    }
+
+    std::vector<cl_ulong> elapsedTimes;
+    elapsedTimes.reserve(nIteration);
+    if (chunkSize == 0) {
+      // Write all buffers without blocking, and let the first launch wait for them
+      std::vector<MemHandle> deviceBuffers;
+      std::vector<EventHandle> writeEventHolders;
+      std::vector<cl_event> writeEvents;
+      for (decltype(bufferSizes)::size_type i = 0; i < bufferSizes.size(); i++) {
+        deviceBuffers.emplace_back(
+            clCreateBuffer(context, CL_MEM_READ_WRITE, std::max(bufferSizes[i], sizeof(float)), nullptr, &errCode));
+        KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clCreateBuffer() failed");
+        cl_event event;
+        errCode = clEnqueueWriteBuffer(cmdQueue, deviceBuffers[i].get(), CL_FALSE, 0, bufferSizes[i], hostPtrs[i], 0, nullptr, &event);
+        KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clEnqueueWriteBuffer() failed");
+        writeEventHolders.emplace_back(event);
+        writeEvents.emplace_back(event);
+
+        cl_mem deviceBuffer = deviceBuffers[i].get();
+        errCode = clSetKernelArg(kernel, static_cast<cl_uint>(i), sizeof(deviceBuffer), &deviceBuffer);
+        KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clSetKernelArg() failed");
+      }
+
+      // Run warmup and timed iterations
+      for (std::size_t i = 0; i < nWarmup + nIteration; i++) {
+        cl_event event;
+        errCode = clEnqueueNDRangeKernel(
+            cmdQueue,
+            kernel,
+            static_cast<cl_uint>(globalSizes.size()),
+            nullptr,
+            globalSizes.data(),
+            localSizes.empty() ? nullptr : localSizes.data(),
+            i == 0 ? static_cast<cl_uint>(writeEvents.size()) : 0,
+            i == 0 && !writeEvents.empty() ? writeEvents.data() : nullptr,
+            &event);
+        KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clEnqueueNDRangeKernel() failed");
+        EventHandle eventHolder(event);
+        errCode = clWaitForEvents(1, &event);
+        KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clWaitForEvents() failed");
+        if (i >= nWarmup) {
+          elapsedTimes.emplace_back(getElapsedTime(event));
+        }
+      }
+      if (isVerified) {
+        errCode = clEnqueueReadBuffer(cmdQueue, deviceBuffers[0].get(), CL_TRUE, 0, bufferSizes[0], hostPtrs[0], 0, nullptr, nullptr);
+        KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clEnqueueReadBuffer() failed");
+      }
+    } else {
+      // Stream the NDRange through two slots of chunk-sized device buffers
+      std::vector<std::vector<MemHandle> > slotBufferHolders(2);
+      std::vector<std::vector<cl_mem> > slotBuffers(2);
+      for (decltype(slotBuffers)::size_type slot = 0; slot < slotBuffers.size(); slot++) {
+        for (const auto& itemSize : itemSizes) {
+          slotBufferHolders[slot].emplace_back(
+              clCreateBuffer(context, CL_MEM_READ_WRITE, std::max(itemSize * chunkSize, sizeof(float)), nullptr, &errCode));
+          KOTLIB_THROW_IF(errCode != CL_SUCCESS, std::runtime_error, "clCreateBuffer() failed");
+          slotBuffers[slot].emplace_back(slotBufferHolders[slot].back().get());
+        }
+      }
+      for (std::size_t i = 0; i < nWarmup + nIteration; i++) {
+        cl_ulong elapsedTime = runStreamedPass(cmdQueues, kernel, slotBuffers, hostPtrs, itemSizes, isOutputs, globalSizes[0], chunkSize,
+            localSizes.empty() ? 0 : localSizes[0], deviceIds[0]);
+        if (i >= nWarmup) {
+          elapsedTimes.emplace_back(elapsedTime);
+        }
+      }
+    }
+
+    if (isVerified && !verifyAndReport(kernelName, hostPtrs, bufferSizes[0] / sizeof(float), maxUlp)) {
       return EXIT_FAILURE;
     }
+    unmapHostBuffers();
+
+    // Effective bandwidth assumes that every buffer is accessed once per launch, or transferred once per pass in streaming mode
+    std::sort(elapsedTimes.begin(), elapsedTimes.end());
+    std::size_t totalBufferSize = std::accumulate(bufferSizes.begin(), bufferSizes.end(), static_cast<std::size_t>(0));
+    cl_ulong median = getPercentile(elapsedTimes, 0.5);
+    cl_ulong p99 = getPercentile(elapsedTimes, 0.99);
+    std::cout << "Kernel: " << kernelName << "\n"
+              << "Iterations: " << nIteration << " (warmup: " << nWarmup << ")\n"
+              << (chunkSize == 0 ? "" : "Streaming: " + std::to_string((globalSizes[0] + chunkSize - 1) / chunkSize) + " chunks of " + std::to_string(chunkSize) + " work-items, timed with transfers\n")
+              << std::fixed << std::setprecision(3)
+              << "Median: " << static_cast<double>(median) / 1.0e3 << " us\n"
+              << "P99: " << static_cast<double>(p99) / 1.0e3 << " us\n"
+              << "Bandwidth: " << (median == 0 ? 0.0 : static_cast<double>(totalBufferSize) / static_cast<double>(median)) << " GB/s" << std::endl;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
   }
-  std::cout << "Test PASSED" << std::endl;
 
   return EXIT_SUCCESS;
 }
-